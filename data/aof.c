@@ -721,19 +721,100 @@ int rioWriteBulkObject(rio *r, robj *obj) {
     }
 }
 
+/* Return the bits of 'v' in reverse order. */
+static uint64_t aofReverseBits64(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+/* Emit the commands needed to rebuild a string encoded as a sparse bitmap:
+ * a SETBIT creating a string of the right length, followed by BITFIELD
+ * commands setting the non zero 64 bit words. This way the value is never
+ * materialized, neither here nor while loading the AOF.
+ * The function returns 0 on error, 1 on success. */
+int rewriteSparseBitmapObject(rio *r, robj *key, robj *o) {
+    sparseBitmap *sb = o->ptr;
+    uint64_t w[1024];
+    uint32_t j, containers = roaringContainers(sb->bits);
+    char buf[32];
+
+    if (sb->len == 0) {
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        return rioWriteBulkString(r,"",0) != 0;
+    } else {
+        char cmd[]="*4\r\n$6\r\nSETBIT\r\n";
+        if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        if (rioWriteBulkLongLong(r,(long long)sb->len*8-1) == 0) return 0;
+        if (rioWriteBulkLongLong(r,0) == 0) return 0;
+    }
+
+    for (j = 0; j < containers; j++) {
+        long long first = roaringContainerWords(sb->bits,j,w) >> 6;
+        long long count = 0, items = 0;
+        int i;
+
+        for (i = 0; i < 1024; i++) if (w[i]) items++;
+        for (i = 0; i < 1024; i++) {
+            size_t byte = (size_t)(first+i)*8;
+            uint64_t value;
+            int bits;
+
+            if (w[i] == 0) continue;
+            if (count == 0) {
+                int cmd_items = (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD) ?
+                    REDIS_AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*4) == 0) return 0;
+                if (rioWriteBulkString(r,"BITFIELD",8) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+
+            /* In strings the first bit is the most significant of the
+             * field, in the bitmap the least significant of the word. The
+             * last word may be partial, and is set as a shorter unsigned
+             * field so that the string doesn't grow. */
+            value = aofReverseBits64(w[i]);
+            bits = (sb->len-byte >= 8) ? 64 : (int)(sb->len-byte)*8;
+            if (rioWriteBulkString(r,"SET",3) == 0) return 0;
+            if (bits == 64) {
+                if (rioWriteBulkString(r,"i64",3) == 0) return 0;
+                snprintf(buf,sizeof(buf),"#%lld",first+i);
+                if (rioWriteBulkString(r,buf,strlen(buf)) == 0) return 0;
+                if (rioWriteBulkLongLong(r,(long long)value) == 0) return 0;
+            } else {
+                snprintf(buf,sizeof(buf),"u%d",bits);
+                if (rioWriteBulkString(r,buf,strlen(buf)) == 0) return 0;
+                if (rioWriteBulkLongLong(r,(first+i)*64) == 0) return 0;
+                if (rioWriteBulkLongLong(r,(long long)(value >> (64-bits)))
+                    == 0) return 0;
+            }
+            if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object.
  * The function returns 0 on error, 1 on success. */
 int rewriteListObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = listTypeLength(o);
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *zl = o->ptr;
-        unsigned char *p = ziplistIndex(zl,0);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        unsigned char *p = lpFirst(lp);
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
 
-        while(ziplistGet(p,&vstr,&vlen,&vlong)) {
+        while(lpGetValue(p,&vstr,&vlen,&vlong)) {
             if (count == 0) {
                 int cmd_items = (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD) ?
                     REDIS_AOF_REWRITE_ITEMS_PER_CMD : items;
@@ -747,19 +828,15 @@ int rewriteListObject(rio *r, robj *key, robj *o) {
             } else {
                 if (rioWriteBulkLongLong(r,vlong) == 0) return 0;
             }
-            p = ziplistNext(zl,p);
+            p = lpNext(lp,p);
             if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list *list = o->ptr;
-        listNode *ln;
-        listIter li;
-
-        listRewind(list,&li);
-        while((ln = listNext(&li))) {
-            robj *eleobj = listNodeValue(ln);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter *li = quicklistGetIterator(o->ptr,AL_START_HEAD);
+        quicklistEntry entry;
 
+        while(quicklistNext(li,&entry)) {
             if (count == 0) {
                 int cmd_items = (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD) ?
                     REDIS_AOF_REWRITE_ITEMS_PER_CMD : items;
@@ -768,10 +845,16 @@ int rewriteListObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkString(r,"RPUSH",5) == 0) return 0;
                 if (rioWriteBulkObject(r,key) == 0) return 0;
             }
-            if (rioWriteBulkObject(r,eleobj) == 0) return 0;
+            if (entry.value) {
+                if (rioWriteBulkString(r,(char*)entry.value,entry.sz) == 0)
+                    return 0;
+            } else {
+                if (rioWriteBulkLongLong(r,entry.longval) == 0) return 0;
+            }
             if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+        quicklistReleaseIterator(li);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -800,6 +883,24 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == REDIS_ENCODING_ROARING) {
+        roaringIterator ri;
+        int64_t llval;
+
+        roaringInitIterator(o->ptr,&ri);
+        while(roaringNext(&ri,&llval)) {
+            if (count == 0) {
+                int cmd_items = (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD) ?
+                    REDIS_AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkLongLong(r,llval) == 0) return 0;
+            if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
     } else if (o->encoding == REDIS_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -830,7 +931,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -838,13 +939,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpFirst(zl);
         redisAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            redisAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            redisAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -888,6 +989,26 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             items--;
         }
         dictReleaseIterator(di);
+    } else if (o->encoding == REDIS_ENCODING_BTREE) {
+        zbtIter it;
+        sds ele;
+
+        for (zbtFirst(o->ptr,&it); zbtIterValid(&it); zbtNext(&it)) {
+            ele = zbtIterEle(&it);
+
+            if (count == 0) {
+                int cmd_items = (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD) ?
+                    REDIS_AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items*2) == 0) return 0;
+                if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (rioWriteBulkDouble(r,zbtIterScore(&it)) == 0) return 0;
+            if (rioWriteBulkString(r,ele,sdslen(ele)) == 0) return 0;
+            if (++count == REDIS_AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
     } else {
         redisPanic("Unknown sorted zset encoding");
     }
@@ -901,12 +1022,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (hi->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr) {
             return rioWriteBulkString(r, (char*)vstr, vlen);
         } else {
@@ -1005,13 +1126,17 @@ int rewriteAppendOnlyFile(char *filename) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = getExpireFromEntry(db,de);
 
             /* If this key is already expired skip it */
             if (expiretime != -1 && expiretime < now) continue;
 
             /* Save the key and associated value */
-            if (o->type == REDIS_STRING) {
+            if (o->type == REDIS_STRING &&
+                o->encoding == REDIS_ENCODING_SPARSE)
+            {
+                if (rewriteSparseBitmapObject(&aof,&key,o) == 0) goto werr;
+            } else if (o->type == REDIS_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
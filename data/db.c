@@ -34,32 +34,60 @@
 
 void SlotToKeyAdd(robj *key);
 void SlotToKeyDel(robj *key);
+static int expireIfNeededWhen(redisDb *db, robj *key, mstime_t when);
 
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
+/* Return the value stored at the main dictionary entry 'de', updating its
+ * access time. */
+static robj *lookupKeyFromEntry(dictEntry *de) {
+    robj *val = dictGetVal(de);
+
+    /* Update the access time (or the access frequency counter when an
+     * LFU policy is selected) for the ageing algorithm.
+     * Don't do it if we have a saving child, as this will trigger
+     * a copy on write madness. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+        if (REDIS_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+            updateLFU(val);
+        } else {
+            val->lru = server.lruclock;
+        }
+    }
+    return val;
+}
+
 robj *lookupKey(redisDb *db, robj *key) {
     dictEntry *de = dictFind(db->dict,key->ptr);
-    if (de) {
-        robj *val = dictGetVal(de);
 
-        /* Update the access time for the ageing algorithm.
-         * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            val->lru = server.lruclock;
-        return val;
-    } else {
-        return NULL;
+    return de ? lookupKeyFromEntry(de) : NULL;
+}
+
+/* Lookup a key expiring it first if needed. When expires are stored inline
+ * the expire time is read from the same entry holding the value, so the
+ * key is looked up a single time. */
+static robj *lookupKeyExpireIfNeeded(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    if (!server.keyspace_inline_expires) {
+        expireIfNeeded(db,key);
+        return lookupKey(db,key);
     }
+
+    if ((de = dictFind(db->dict,key->ptr)) == NULL) return NULL;
+    /* On masters an expired key is deleted, so 'de' is no longer valid,
+     * while slaves still serve it, see expireIfNeeded(). */
+    if (expireIfNeededWhen(db,key,getExpireFromEntry(db,de)) &&
+        server.masterhost == NULL) return NULL;
+    return lookupKeyFromEntry(de);
 }
 
 robj *lookupKeyRead(redisDb *db, robj *key) {
     robj *val;
 
-    expireIfNeeded(db,key);
-    val = lookupKey(db,key);
+    val = lookupKeyExpireIfNeeded(db,key);
     if (val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -68,8 +96,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key);
+    return lookupKeyExpireIfNeeded(db,key);
 }
 
 robj *lookupKeyReadOrReply(redisClient *c, robj *key, robj *reply) {
@@ -93,19 +120,29 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     int retval = dictAdd(db->dict, copy, val);
 
     redisAssertWithInfo(NULL,key,retval == REDIS_OK);
-    if (val->type == REDIS_LIST) signalListAsReady(db, key);
+    if (val->type == REDIS_LIST || val->type == REDIS_ZSET)
+        signalKeyAsReady(db, key);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
+ * The old value is released in background if lazyfree-lazy-server-del
+ * is enabled.
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
     struct dictEntry *de = dictFind(db->dict,key->ptr);
 
     redisAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->dict, key->ptr, val);
+    if (server.lazyfree_lazy_server_del) {
+        robj *old = dictGetVal(de);
+
+        dictSetVal(db->dict,de,val);
+        freeObjAsync(old);
+    } else {
+        dictReplace(db->dict, key->ptr, val);
+    }
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -145,7 +182,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (getExpireFromEntry(db,de) != -1) {
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -156,10 +193,10 @@ robj *dbRandomKey(redisDb *db) {
 }
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
-int dbDelete(redisDb *db, robj *key) {
+int dbSyncDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (db->expires_index->length > 0) dbDeleteExpire(db,key->ptr);
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         return 1;
     } else {
@@ -167,6 +204,13 @@ int dbDelete(redisDb *db, robj *key) {
     }
 }
 
+/* This is a wrapper whose behavior depends on the Redis lazy free
+ * configuration. Deletes the key synchronously or asynchronously. */
+int dbDelete(redisDb *db, robj *key) {
+    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db,key) :
+                                             dbSyncDelete(db,key);
+}
+
 /* Prepare the string object stored at 'key' to be modified destructively
  * to implement commands like SETBIT or APPEND.
  *
@@ -213,6 +257,7 @@ long long emptyDb(void(callback)(void*)) {
         removed += dictSize(server.db[j].dict);
         dictEmpty(server.db[j].dict,callback);
         dictEmpty(server.db[j].expires,callback);
+        expireIndexEmpty(&server.db[j]);
     }
     return removed;
 }
@@ -245,17 +290,58 @@ void signalFlushedDb(int dbid) {
  * Type agnostic commands operating on the key space
  *----------------------------------------------------------------------------*/
 
+/* Return the set of flags to use for the FLUSHDB and FLUSHALL commands.
+ * The only optional argument is ASYNC, that makes the old key space to be
+ * released in a background thread.
+ *
+ * On success REDIS_OK is returned and 'async' is set, otherwise an error is
+ * sent to the client and REDIS_ERR is returned. */
+static int getFlushCommandFlags(redisClient *c, int *async) {
+    if (c->argc > 2) {
+        addReply(c,shared.syntaxerr);
+        return REDIS_ERR;
+    }
+    *async = 0;
+    if (c->argc == 2) {
+        if (!strcasecmp(c->argv[1]->ptr,"async")) {
+            *async = 1;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/* FLUSHDB [ASYNC] */
 void flushdbCommand(redisClient *c) {
+    int async;
+
+    if (getFlushCommandFlags(c,&async) == REDIS_ERR) return;
     server.dirty += dictSize(c->db->dict);
     signalFlushedDb(c->db->id);
-    dictEmpty(c->db->dict,NULL);
-    dictEmpty(c->db->expires,NULL);
+    if (async) {
+        emptyDbAsync(c->db);
+    } else {
+        dictEmpty(c->db->dict,NULL);
+        dictEmpty(c->db->expires,NULL);
+        expireIndexEmpty(c->db);
+    }
     addReply(c,shared.ok);
 }
 
+/* FLUSHALL [ASYNC] */
 void flushallCommand(redisClient *c) {
+    int async, j;
+
+    if (getFlushCommandFlags(c,&async) == REDIS_ERR) return;
     signalFlushedDb(-1);
-    server.dirty += emptyDb(NULL);
+    if (async) {
+        for (j = 0; j < server.dbnum; j++)
+            server.dirty += emptyDbAsync(&server.db[j]);
+    } else {
+        server.dirty += emptyDb(NULL);
+    }
     addReply(c,shared.ok);
     if (server.rdb_child_pid != -1) {
         kill(server.rdb_child_pid,SIGUSR1);
@@ -271,12 +357,19 @@ void flushallCommand(redisClient *c) {
     server.dirty++;
 }
 
-void delCommand(redisClient *c) {
+/* This command implements DEL and UNLINK. UNLINK removes the keys from the
+ * key space in constant time, and releases the values in a background
+ * thread when they are big enough. */
+void delGenericCommand(redisClient *c, int lazy) {
     int deleted = 0, j;
 
     for (j = 1; j < c->argc; j++) {
+        int removed;
+
         expireIfNeeded(c->db,c->argv[j]);
-        if (dbDelete(c->db,c->argv[j])) {
+        removed = lazy ? dbAsyncDelete(c->db,c->argv[j]) :
+                         dbSyncDelete(c->db,c->argv[j]);
+        if (removed) {
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,
                 "del",c->argv[j],c->db->id);
@@ -287,6 +380,14 @@ void delCommand(redisClient *c) {
     addReplyLongLong(c,deleted);
 }
 
+void delCommand(redisClient *c) {
+    delGenericCommand(c,0);
+}
+
+void unlinkCommand(redisClient *c) {
+    delGenericCommand(c,1);
+}
+
 void existsCommand(redisClient *c) {
     expireIfNeeded(c->db,c->argv[1]);
     if (dbExists(c->db,c->argv[1])) {
@@ -349,6 +450,11 @@ void keysCommand(redisClient *c) {
     setDeferredMultiBulkLength(c,replylen,numkeys);
 }
 
+/* Like scanCallback() but for the integers returned by roaringScan(). */
+void scanRoaringCallback(void *privdata, int64_t value) {
+    listAddNodeTail((list*)privdata,createStringObjectFromLongLong(value));
+}
+
 /* This callback is used by scanGenericCommand in order to collect elements
  * returned by the dictionary iterator into a list. */
 void scanCallback(void *privdata, const dictEntry *de) {
@@ -368,6 +474,10 @@ void scanCallback(void *privdata, const dictEntry *de) {
         incrRefCount(key);
         val = dictGetVal(de);
         incrRefCount(val);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_BTREE) {
+        sds sdskey = dictGetKey(de);
+        key = createStringObject(sdskey, sdslen(sdskey));
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else if (o->type == REDIS_ZSET) {
         key = dictGetKey(de);
         incrRefCount(key);
@@ -464,7 +574,9 @@ void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor) {
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
-     * cursor to zero to signal the end of the iteration. */
+     * cursor to zero to signal the end of the iteration. Roaring bitmaps are
+     * the exception, as they can be big: they have their own cursor, see
+     * roaringScan(). */
 
     /* Handle the case of a hash table. */
     ht = NULL;
@@ -479,6 +591,10 @@ void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = o->ptr;
+        ht = zbt->dict;
+        count *= 2; /* We return key / value for this type. */
     }
 
     if (ht) {
@@ -499,6 +615,8 @@ void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
+    } else if (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_ROARING) {
+        cursor = roaringScan(o->ptr,cursor,count,scanRoaringCallback,keys);
     } else if (o->type == REDIS_SET) {
         int pos = 0;
         int64_t ll;
@@ -507,17 +625,19 @@ void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor) {
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
     } else if (o->type == REDIS_HASH || o->type == REDIS_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *lp = (o->type == REDIS_HASH) ? hashTypeListpack(o) :
+                                                      o->ptr;
+        unsigned char *p = lpFirst(lp);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            lpGetValue(p,&vstr,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(lp,p);
         }
         cursor = 0;
     } else {
@@ -748,11 +868,137 @@ void moveCommand(redisClient *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* Every database keeps, in addition to the expires dictionary, an index of
+ * the volatile keys ordered by expire time, so that the active expire cycle
+ * can reclaim exactly the keys that are already expired, starting from the
+ * oldest ones, instead of sampling random keys.
+ *
+ * The index is a skiplist, the same used by sorted sets, where the score is
+ * the unix time in milliseconds of the expire (that is represented without
+ * loss of precision by a double) and the element is a string object whose
+ * ptr is the sds of the key in the main dictionary, exactly like the expires
+ * dictionary does, so no copy of the key name is kept. Keys with the same
+ * expire time are ordered lexicographically.
+ *
+ * Since the sds is owned by the main dictionary, the ptr of the objects must
+ * be cleared before they are released by the skiplist, otherwise the key
+ * would be freed twice. Every key is removed from the index before it is
+ * removed from the main dictionary (see dbSyncDelete()).
+ *
+ * The index must be updated every time the expires dictionary is, so the
+ * expires dictionary should only be modified via the functions below. */
+
+/* Add 'key' expiring at 'when' into the expire index. 'key' must be the sds
+ * of the key in the main dictionary. */
+static void expireIndexAdd(redisDb *db, sds key, long long when) {
+    zslInsert(db->expires_index,(double)when,createObject(REDIS_STRING,key));
+}
+
+/* Remove 'key' expiring at 'when' from the expire index. This is just like
+ * zslDelete() but the key referenced by the node is not freed. */
+static void expireIndexDel(redisDb *db, sds key, long long when) {
+    zskiplist *zsl = db->expires_index;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    double score = (double)when;
+    int i;
+
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                sdscmp(x->level[i].forward->obj->ptr,key) < 0)))
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+    x = x->level[0].forward;
+    redisAssert(x && score == x->score && sdscmp(x->obj->ptr,key) == 0);
+    zslDeleteNode(zsl,x,update);
+    x->obj->ptr = NULL;
+    zslFreeNode(x);
+}
+
+/* Replace the expire index of the DB with an empty one, and return the old
+ * index after clearing the references to the keys of the main dictionary,
+ * so that it can be released with zslFree() even after the keys are gone. */
+zskiplist *expireIndexDetach(redisDb *db) {
+    zskiplist *zsl = db->expires_index;
+    zskiplistNode *x;
+
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward)
+        x->obj->ptr = NULL;
+    db->expires_index = zslCreate();
+    return zsl;
+}
+
+/* Remove all the entries from the expire index of the DB. */
+void expireIndexEmpty(redisDb *db) {
+    if (db->expires_index->length == 0) return;
+    zslFree(expireIndexDetach(db));
+}
+
+/* Return the number of keys of the DB with an expire time less or equal
+ * to 'now', that is, keys already logically expired that are still using
+ * memory. This is computed in O(log(N)) using the spans of the skiplist. */
+unsigned long expireIndexDueCount(redisDb *db, long long now) {
+    zskiplistNode *x = db->expires_index->header;
+    unsigned long due = 0;
+    int i;
+
+    for (i = db->expires_index->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               x->level[i].forward->score <= (double)now)
+        {
+            due += x->level[i].span;
+            x = x->level[i].forward;
+        }
+    }
+    return due;
+}
+
+/* Get and set the expire time stored inline in the metadata of the main
+ * dictionary entry 'de'. The metadata is an array of bytes, so memcpy() is
+ * used to access it without breaking the strict aliasing rules. */
+static long long dbGetInlineExpire(dictEntry *de) {
+    long long when;
+
+    memcpy(&when,dictMetadata(de),sizeof(when));
+    return when;
+}
+
+static void dbSetInlineExpire(dictEntry *de, long long when) {
+    memcpy(dictMetadata(de),&when,sizeof(when));
+}
+
+/* Remove the expire of 'key' from the expires dictionary (or from the main
+ * dictionary entry when expires are stored inline) and from the expire
+ * index. Unlike removeExpire() the key is not required to exist.
+ * Returns 1 if the key had an associated expire, otherwise 0. */
+int dbDeleteExpire(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (server.keyspace_inline_expires) {
+        long long when;
+
+        de = dictFind(db->dict,key);
+        if (de == NULL || (when = dbGetInlineExpire(de)) <= 0) return 0;
+        expireIndexDel(db,dictGetKey(de),when);
+        dbSetInlineExpire(de,0);
+        return 1;
+    }
+
+    de = dictFind(db->expires,key);
+    if (de == NULL) return 0;
+    expireIndexDel(db,dictGetKey(de),dictGetSignedIntegerVal(de));
+    dictDelete(db->expires,key);
+    return 1;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     redisAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    return dbDeleteExpire(db,key->ptr);
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
@@ -761,8 +1007,29 @@ void setExpire(redisDb *db, robj *key, long long when) {
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     redisAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
+
+    if (server.keyspace_inline_expires) {
+        long long old = dbGetInlineExpire(kde);
+
+        /* Non positive values mean "no expire" inline, but such a time
+         * is in the past anyway, so storing 1 is equivalent. */
+        if (when <= 0) when = 1;
+        if (old > 0) expireIndexDel(db,dictGetKey(kde),old);
+        dbSetInlineExpire(kde,when);
+        expireIndexAdd(db,dictGetKey(kde),when);
+        return;
+    }
+
+    de = dictFind(db->expires,key->ptr);
+    if (de) {
+        /* Updating the expire of an already volatile key: move the key
+         * to the new position in the index. */
+        expireIndexDel(db,dictGetKey(de),dictGetSignedIntegerVal(de));
+    } else {
+        de = dictAddRaw(db->expires,dictGetKey(kde));
+    }
     dictSetSignedIntegerVal(de,when);
+    expireIndexAdd(db,dictGetKey(de),when);
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -771,8 +1038,14 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (db->expires_index->length == 0) return -1;
+
+    if (server.keyspace_inline_expires) {
+        if ((de = dictFind(db->dict,key->ptr)) == NULL) return -1;
+        return getExpireFromEntry(db,de);
+    }
+
+    if ((de = dictFind(db->expires,key->ptr)) == NULL) return -1;
 
     /* The entry was found in the expire dict, this means it should also
      * be present in the main dict (safety check). */
@@ -780,6 +1053,21 @@ long long getExpire(redisDb *db, robj *key) {
     return dictGetSignedIntegerVal(de);
 }
 
+/* Like getExpire() but the key is specified by its entry 'de' in the main
+ * dictionary of the DB. When expires are stored inline no lookup is needed,
+ * so this is the function to use while iterating the key space. */
+long long getExpireFromEntry(redisDb *db, dictEntry *de) {
+    dictEntry *ede;
+
+    if (server.keyspace_inline_expires) {
+        long long when = dbGetInlineExpire(de);
+        return when > 0 ? when : -1;
+    }
+    if (dictSize(db->expires) == 0 ||
+       (ede = dictFind(db->expires,dictGetKey(de))) == NULL) return -1;
+    return dictGetSignedIntegerVal(ede);
+}
+
 /* Propagate expires into slaves and the AOF file.
  * When a key expires in the master, a DEL operation for this key is sent
  * to all the slaves and the AOF file if enabled.
@@ -805,7 +1093,12 @@ void propagateExpire(redisDb *db, robj *key) {
 }
 
 int expireIfNeeded(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+    return expireIfNeededWhen(db,key,getExpire(db,key));
+}
+
+/* Implements expireIfNeeded() when the expire time 'when' of the key was
+ * already fetched by the caller, or is -1 if the key is not volatile. */
+static int expireIfNeededWhen(redisDb *db, robj *key, mstime_t when) {
     mstime_t now;
 
     if (when < 0) return 0; /* No expire for this key */
@@ -837,7 +1130,8 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key);
     notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
         "expired",key,db->id);
-    return dbDelete(db,key);
+    return server.lazyfree_lazy_expire ? dbAsyncDelete(db,key) :
+                                         dbSyncDelete(db,key);
 }
 
 /*-----------------------------------------------------------------------------
@@ -1014,6 +1308,25 @@ int *renameGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys,
     }
 }
 
+/* SINTERCARD and ZINTERCARD take the number of keys as first argument. */
+int *intercardGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags) {
+    int i, num, *keys;
+    REDIS_NOTUSED(cmd);
+    REDIS_NOTUSED(flags);
+
+    num = atoi(argv[1]->ptr);
+    /* Sanity check. Don't return any key if the command is going to
+     * reply with syntax error. */
+    if (num < 1 || num > (argc-2)) {
+        *numkeys = 0;
+        return NULL;
+    }
+    keys = zmalloc(sizeof(int)*num);
+    for (i = 0; i < num; i++) keys[i] = 2+i;
+    *numkeys = num;
+    return keys;
+}
+
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags) {
     int i, num, *keys;
     REDIS_NOTUSED(cmd);
@@ -40,6 +40,41 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 
+/* The object types below are not known to any other Redis implementation.
+ * Other implementations assign the types after 13 to different encodings,
+ * so the new types start at 100. Because of this they are never misread by
+ * another server. Such a server refuses the file anyway, because of the
+ * version, see REDIS_RDB_VERSION in redis.h. */
+#define rdbIsExtObjectType(t) ((t) >= REDIS_RDB_TYPE_LIST_QUICKLIST && \
+                               (t) <= REDIS_RDB_TYPE_STRING_SPARSE)
+
+/* Lists encoded as quicklists are serialized as the number of nodes followed
+ * by the ziplist of every node, saved as a single string. */
+#ifndef REDIS_RDB_TYPE_LIST_QUICKLIST
+#define REDIS_RDB_TYPE_LIST_QUICKLIST 100
+#endif
+
+/* Small hashes, sorted sets and lists are encoded as listpacks, saved as a
+ * single string. Values saved as ziplists by older versions are converted
+ * to listpacks at load time. */
+#ifndef REDIS_RDB_TYPE_HASH_LISTPACK
+#define REDIS_RDB_TYPE_HASH_LISTPACK 101
+#define REDIS_RDB_TYPE_ZSET_LISTPACK 102
+#define REDIS_RDB_TYPE_LIST_LISTPACK 103
+#endif
+
+/* Sets encoded as roaring bitmaps are saved as a single string holding the
+ * serialized bitmap, see roaringSerialize(). */
+#ifndef REDIS_RDB_TYPE_SET_ROARING
+#define REDIS_RDB_TYPE_SET_ROARING 104
+#endif
+
+/* Strings encoded as sparse bitmaps are saved as the length of the string
+ * followed by the serialized bitmap of the offsets of the bits set. */
+#ifndef REDIS_RDB_TYPE_STRING_SPARSE
+#define REDIS_RDB_TYPE_STRING_SPARSE 105
+#endif
+
 static int rdbWriteRaw(rio *rdb, void *p, size_t len) {
     if (rdb && rioWrite(rdb,p,len) == 0)
         return -1;
@@ -209,41 +244,47 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
-    size_t comprlen, outlen;
+/* Save already LZF compressed data as an LZF encoded string, so that it
+ * is loaded back decompressed by rdbLoadStringObject(). */
+int rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                   size_t original_len) {
     unsigned char byte;
     int n, nwritten = 0;
-    void *out;
 
-    /* We require at least four bytes compression for this to be worth it */
-    if (len <= 4) return 0;
-    outlen = len-4;
-    if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
-    if (comprlen == 0) {
-        zfree(out);
-        return 0;
-    }
     /* Data compressed! Let's save it on disk */
     byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
-    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
+    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) return -1;
     nwritten += n;
 
-    if ((n = rdbSaveLen(rdb,comprlen)) == -1) goto writeerr;
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) return -1;
     nwritten += n;
 
-    if ((n = rdbSaveLen(rdb,len)) == -1) goto writeerr;
+    if ((n = rdbSaveLen(rdb,original_len)) == -1) return -1;
     nwritten += n;
 
-    if ((n = rdbWriteRaw(rdb,out,comprlen)) == -1) goto writeerr;
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) return -1;
     nwritten += n;
 
-    zfree(out);
     return nwritten;
+}
 
-writeerr:
+int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    int nwritten;
+    void *out;
+
+    /* We require at least four bytes compression for this to be worth it */
+    if (len <= 4) return 0;
+    outlen = len-4;
+    if ((out = zmalloc(outlen+1)) == NULL) return 0;
+    comprlen = lzf_compress(s, len, out, outlen);
+    if (comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    nwritten = rdbSaveLzfBlob(rdb,out,comprlen,len);
     zfree(out);
-    return -1;
+    return nwritten;
 }
 
 robj *rdbLoadLzfStringObject(rio *rdb) {
@@ -430,31 +471,37 @@ int rdbLoadDoubleValue(rio *rdb, double *val) {
 int rdbSaveObjectType(rio *rdb, robj *o) {
     switch (o->type) {
     case REDIS_STRING:
+        if (o->encoding == REDIS_ENCODING_SPARSE)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_STRING_SPARSE);
         return rdbSaveType(rdb,REDIS_RDB_TYPE_STRING);
     case REDIS_LIST:
-        if (o->encoding == REDIS_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST_ZIPLIST);
-        else if (o->encoding == REDIS_ENCODING_LINKEDLIST)
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST);
+        if (o->encoding == REDIS_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST_LISTPACK);
+        else if (o->encoding == REDIS_ENCODING_QUICKLIST)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST_QUICKLIST);
         else
             redisPanic("Unknown list encoding");
     case REDIS_SET:
         if (o->encoding == REDIS_ENCODING_INTSET)
             return rdbSaveType(rdb,REDIS_RDB_TYPE_SET_INTSET);
+        else if (o->encoding == REDIS_ENCODING_ROARING)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_SET_ROARING);
         else if (o->encoding == REDIS_ENCODING_HT)
             return rdbSaveType(rdb,REDIS_RDB_TYPE_SET);
         else
             redisPanic("Unknown set encoding");
     case REDIS_ZSET:
-        if (o->encoding == REDIS_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == REDIS_ENCODING_SKIPLIST)
+        if (o->encoding == REDIS_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == REDIS_ENCODING_SKIPLIST ||
+                 o->encoding == REDIS_ENCODING_BTREE)
             return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET);
         else
             redisPanic("Unknown sorted set encoding");
     case REDIS_HASH:
-        if (o->encoding == REDIS_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == REDIS_ENCODING_LISTPACK ||
+            o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == REDIS_ENCODING_HT)
             return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH);
         else
@@ -470,7 +517,7 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
 int rdbLoadObjectType(rio *rdb) {
     int type;
     if ((type = rdbLoadType(rdb)) == -1) return -1;
-    if (!rdbIsObjectType(type)) return -1;
+    if (!rdbIsObjectType(type) && !rdbIsExtObjectType(type)) return -1;
     return type;
 }
 
@@ -478,30 +525,50 @@ int rdbLoadObjectType(rio *rdb) {
 int rdbSaveObject(rio *rdb, robj *o) {
     int n, nwritten = 0;
 
-    if (o->type == REDIS_STRING) {
+    if (o->type == REDIS_STRING && o->encoding == REDIS_ENCODING_SPARSE) {
+        sparseBitmap *sb = o->ptr;
+        size_t l;
+        unsigned char *buf;
+
+        if ((n = rdbSaveLen(rdb,sb->len)) == -1) return -1;
+        nwritten += n;
+        buf = roaringSerialize(sb->bits,&l);
+        n = rdbSaveRawString(rdb,buf,l);
+        zfree(buf);
+        if (n == -1) return -1;
+        nwritten += n;
+    } else if (o->type == REDIS_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
     } else if (o->type == REDIS_LIST) {
         /* Save a list value */
-        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
-        } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-            list *list = o->ptr;
-            listIter li;
-            listNode *ln;
+        } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+            quicklist *ql = o->ptr;
+            quicklistNode *node = ql->head;
 
-            if ((n = rdbSaveLen(rdb,listLength(list))) == -1) return -1;
+            if ((n = rdbSaveLen(rdb,ql->len)) == -1) return -1;
             nwritten += n;
 
-            listRewind(list,&li);
-            while((ln = listNext(&li))) {
-                robj *eleobj = listNodeValue(ln);
-                if ((n = rdbSaveStringObject(rdb,eleobj)) == -1) return -1;
+            while(node) {
+                if (quicklistNodeIsCompressed(node)) {
+                    /* Save compressed nodes as they are, no need to
+                     * decompress and compress them again. */
+                    void *data;
+                    size_t compress_len = quicklistGetLzf(node,&data);
+                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1)
+                        return -1;
+                } else {
+                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1)
+                        return -1;
+                }
                 nwritten += n;
+                node = node->next;
             }
         } else {
             redisPanic("Unknown list encoding");
@@ -527,13 +594,21 @@ int rdbSaveObject(rio *rdb, robj *o) {
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
+        } else if (o->encoding == REDIS_ENCODING_ROARING) {
+            size_t l;
+            unsigned char *buf = roaringSerialize(o->ptr,&l);
+
+            n = rdbSaveRawString(rdb,buf,l);
+            zfree(buf);
+            if (n == -1) return -1;
+            nwritten += n;
         } else {
             redisPanic("Unknown set encoding");
         }
     } else if (o->type == REDIS_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -555,15 +630,37 @@ int rdbSaveObject(rio *rdb, robj *o) {
                 nwritten += n;
             }
             dictReleaseIterator(di);
+        } else if (o->encoding == REDIS_ENCODING_BTREE) {
+            /* Same format of the skiplist encoding. */
+            zbtree *zbt = o->ptr;
+            dictIterator *di = dictGetIterator(zbt->dict);
+            dictEntry *de;
+
+            if ((n = rdbSaveLen(rdb,dictSize(zbt->dict))) == -1) return -1;
+            nwritten += n;
+
+            while((de = dictNext(di)) != NULL) {
+                sds ele = dictGetKey(de);
+
+                if ((n = rdbSaveRawString(rdb,(unsigned char*)ele,sdslen(ele))) == -1) return -1;
+                nwritten += n;
+                if ((n = rdbSaveDoubleValue(rdb,dictGetDoubleVal(de))) == -1) return -1;
+                nwritten += n;
+            }
+            dictReleaseIterator(di);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
     } else if (o->type == REDIS_HASH) {
         /* Save a hash value */
-        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == REDIS_ENCODING_LISTPACK ||
+            o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+        {
+            /* The field index is not saved, it is rebuilt on load. */
+            unsigned char *lp = hashTypeListpack(o);
+            size_t l = lpBytes(lp);
 
-            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            if ((n = rdbSaveRawString(rdb,lp,l)) == -1) return -1;
             nwritten += n;
 
         } else if (o->encoding == REDIS_ENCODING_HT) {
@@ -665,7 +762,7 @@ int rdbSaveRio(rio *rdb, int *error) {
             long long expire;
 
             initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
+            expire = getExpireFromEntry(db,de);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1) goto werr;
         }
         dictReleaseIterator(di);
@@ -830,40 +927,74 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
 
-        /* Use a real list when there are too many entries */
+        /* Use a quicklist when there are too many entries */
         if (len > server.list_max_ziplist_entries) {
-            o = createListObject();
+            o = createQuicklistObject();
         } else {
-            o = createZiplistObject();
+            o = createListpackObject();
         }
 
         /* Load every single element of the list */
         while(len--) {
             if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
 
-            /* If we are using a ziplist and the value is too big, convert
-             * the object to a real list. */
-            if (o->encoding == REDIS_ENCODING_ZIPLIST &&
+            /* If we are using a listpack and the value is too big, convert
+             * the object to a quicklist. */
+            if (o->encoding == REDIS_ENCODING_LISTPACK &&
                 ele->encoding == REDIS_ENCODING_RAW &&
                 sdslen(ele->ptr) > server.list_max_ziplist_value)
-                    listTypeConvert(o,REDIS_ENCODING_LINKEDLIST);
+                    listTypeConvert(o,REDIS_ENCODING_QUICKLIST);
 
-            if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-                dec = getDecodedObject(ele);
-                o->ptr = ziplistPush(o->ptr,dec->ptr,sdslen(dec->ptr),REDIS_TAIL);
-                decrRefCount(dec);
-                decrRefCount(ele);
+            dec = getDecodedObject(ele);
+            if (o->encoding == REDIS_ENCODING_LISTPACK) {
+                o->ptr = lpAppend(o->ptr,dec->ptr,sdslen(dec->ptr));
             } else {
-                ele = tryObjectEncoding(ele);
-                listAddNodeTail(o->ptr,ele);
+                quicklistPushTail(o->ptr,dec->ptr,sdslen(dec->ptr));
             }
+            decrRefCount(dec);
+            decrRefCount(ele);
+        }
+    } else if (rdbtype == REDIS_RDB_TYPE_LIST_QUICKLIST) {
+        /* Read the ziplist of every quicklist node */
+        if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+        o = createQuicklistObject();
+
+        while(len--) {
+            robj *aux = rdbLoadStringObject(rdb);
+            unsigned char *zl;
+            size_t zlsize;
+
+            if (aux == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            zlsize = sdslen(aux->ptr);
+            zl = zmalloc(zlsize);
+            memcpy(zl,aux->ptr,zlsize);
+            decrRefCount(aux);
+
+            /* Quicklist nodes are never empty: empty ziplists are just
+             * skipped, while corrupted ones fail the load. */
+            if (!ziplistValidateHeader(zl,zlsize)) {
+                zfree(zl);
+                decrRefCount(o);
+                return NULL;
+            }
+            if (ziplistLen(zl) == 0) {
+                zfree(zl);
+                continue;
+            }
+            quicklistAppendZiplist(o->ptr,zl);
         }
     } else if (rdbtype == REDIS_RDB_TYPE_SET) {
         /* Read list/set value */
         if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
 
-        /* Use a regular set when there are too many entries. */
-        if (len > server.set_max_intset_entries) {
+        /* Use a roaring bitmap or a regular set when there are too many
+         * entries. */
+        if (len > server.set_max_intset_entries && server.set_roaring) {
+            o = createRoaringSetObject();
+        } else if (len > server.set_max_intset_entries) {
             o = createSetObject();
             /* It's faster to expand the dict to the right size asap in order
              * to avoid rehashing */
@@ -879,6 +1010,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
             ele = tryObjectEncoding(ele);
 
+            if (o->encoding == REDIS_ENCODING_ROARING) {
+                /* setTypeAdd() takes care of converting the bitmap into
+                 * a hash table if the element is not an integer. */
+                setTypeAdd(o,ele);
+                decrRefCount(ele);
+                continue;
+            }
+
             if (o->encoding == REDIS_ENCODING_INTSET) {
                 /* Fetch integer value from element */
                 if (isObjectRepresentableAsLongLong(ele,&llval) == REDIS_OK) {
@@ -904,6 +1043,26 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         zset *zs;
 
         if ((zsetlen = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+        if (server.zset_btree) {
+            zbtree *zbt;
+
+            o = createZsetBtreeObject();
+            zbt = o->ptr;
+            while(zsetlen--) {
+                robj *ele;
+                double score;
+
+                if ((ele = rdbLoadStringObject(rdb)) == NULL) return NULL;
+                if (rdbLoadDoubleValue(rdb,&score) == -1) return NULL;
+                if (sdslen(ele->ptr) > maxelelen) maxelelen = sdslen(ele->ptr);
+
+                /* Duplicated members are not allowed by the tree. */
+                if (zbtFind(zbt,ele->ptr,NULL)) return NULL;
+                zbtInsert(zbt,score,sdsdup(ele->ptr));
+                decrRefCount(ele);
+            }
+            goto zsetloaded;
+        }
         o = createZsetObject();
         zs = o->ptr;
 
@@ -927,10 +1086,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             incrRefCount(ele); /* added to skiplist */
         }
 
+zsetloaded:
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,REDIS_ENCODING_ZIPLIST);
+                zsetConvert(o,REDIS_ENCODING_LISTPACK);
     } else if (rdbtype == REDIS_RDB_TYPE_HASH) {
         size_t len;
         int ret;
@@ -944,8 +1104,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, REDIS_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == REDIS_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == REDIS_ENCODING_LISTPACK && len > 0) {
             robj *field, *value;
 
             len--;
@@ -957,9 +1117,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if (value == NULL) return NULL;
             redisAssert(field->encoding == REDIS_ENCODING_RAW);
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, field->ptr, sdslen(field->ptr), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, value->ptr, sdslen(value->ptr), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, field->ptr, sdslen(field->ptr));
+            o->ptr = lpAppend(o->ptr, value->ptr, sdslen(value->ptr));
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field->ptr) > server.hash_max_ziplist_value ||
                 sdslen(value->ptr) > server.hash_max_ziplist_value)
@@ -994,12 +1154,51 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         /* All pairs should be read by now */
         redisAssert(len == 0);
+        hashTypeTryIndex(o);
+
+    } else if (rdbtype == REDIS_RDB_TYPE_SET_ROARING) {
+        robj *aux = rdbLoadStringObject(rdb);
+        roaring *r;
+
+        if (aux == NULL) return NULL;
+        r = roaringDeserialize(aux->ptr,sdslen(aux->ptr));
+        decrRefCount(aux);
+        if (r == NULL) return NULL; /* Corrupted bitmap. */
+        o = createObject(REDIS_SET,r);
+        o->encoding = REDIS_ENCODING_ROARING;
+        if (!server.set_roaring) setTypeConvert(o,REDIS_ENCODING_HT);
+    } else if (rdbtype == REDIS_RDB_TYPE_STRING_SPARSE) {
+        robj *aux;
+        roaring *r;
+        sparseBitmap *sb;
+        int64_t first;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+        if (len > 512*1024*1024) return NULL; /* Longer than any string. */
+        if ((aux = rdbLoadStringObject(rdb)) == NULL) return NULL;
+        r = roaringDeserialize(aux->ptr,sdslen(aux->ptr));
+        decrRefCount(aux);
+        if (r == NULL) return NULL; /* Corrupted bitmap. */
 
+        /* All the bits set must be inside the string. */
+        if ((roaringNextValue(r,INT64_MIN,&first) && first < 0) ||
+            roaringNextValue(r,(int64_t)len*8,&first))
+        {
+            roaringFree(r);
+            return NULL;
+        }
+        o = createSparseBitmapObject(len);
+        sb = o->ptr;
+        roaringFree(sb->bits);
+        sb->bits = r;
     } else if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == REDIS_RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == REDIS_RDB_TYPE_SET_INTSET   ||
                rdbtype == REDIS_RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == REDIS_RDB_TYPE_HASH_LISTPACK ||
+               rdbtype == REDIS_RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == REDIS_RDB_TYPE_LIST_LISTPACK)
     {
         robj *aux = rdbLoadStringObject(rdb);
 
@@ -1009,6 +1208,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         memcpy(o->ptr,aux->ptr,sdslen(aux->ptr));
         decrRefCount(aux);
 
+        /* Ziplists saved by older versions are converted to listpacks, the
+         * encoding used for small aggregate values. */
+        if (rdbtype == REDIS_RDB_TYPE_LIST_ZIPLIST ||
+            rdbtype == REDIS_RDB_TYPE_ZSET_ZIPLIST ||
+            rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST)
+        {
+            unsigned char *lp = lpFromZiplist(o->ptr);
+            zfree(o->ptr);
+            o->ptr = lp;
+        }
+
         /* Fix the object encoding, and make sure to convert the encoded
          * data type into the base type if accordingly to the current
          * configuration there are too many elements in the encoded data
@@ -1017,10 +1227,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
          * converted. */
         switch(rdbtype) {
             case REDIS_RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1029,45 +1239,54 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = REDIS_HASH;
-                    o->encoding = REDIS_ENCODING_ZIPLIST;
+                    o->encoding = REDIS_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
                     {
                         hashTypeConvert(o, REDIS_ENCODING_HT);
+                    } else {
+                        hashTypeTryIndex(o);
                     }
                 }
                 break;
             case REDIS_RDB_TYPE_LIST_ZIPLIST:
+            case REDIS_RDB_TYPE_LIST_LISTPACK:
                 o->type = REDIS_LIST;
-                o->encoding = REDIS_ENCODING_ZIPLIST;
-                if (ziplistLen(o->ptr) > server.list_max_ziplist_entries)
-                    listTypeConvert(o,REDIS_ENCODING_LINKEDLIST);
+                o->encoding = REDIS_ENCODING_LISTPACK;
+                if (lpLength(o->ptr) > server.list_max_ziplist_entries)
+                    listTypeConvert(o,REDIS_ENCODING_QUICKLIST);
                 break;
             case REDIS_RDB_TYPE_SET_INTSET:
                 o->type = REDIS_SET;
                 o->encoding = REDIS_ENCODING_INTSET;
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(o,REDIS_ENCODING_HT);
+                    setTypeConvert(o,server.set_roaring ?
+                        REDIS_ENCODING_ROARING : REDIS_ENCODING_HT);
                 break;
             case REDIS_RDB_TYPE_ZSET_ZIPLIST:
+            case REDIS_RDB_TYPE_ZSET_LISTPACK:
                 o->type = REDIS_ZSET;
-                o->encoding = REDIS_ENCODING_ZIPLIST;
+                o->encoding = REDIS_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,REDIS_ENCODING_SKIPLIST);
+                    zsetConvert(o,server.zset_btree ?
+                        REDIS_ENCODING_BTREE : REDIS_ENCODING_SKIPLIST);
                 break;
             case REDIS_RDB_TYPE_HASH_ZIPLIST:
+            case REDIS_RDB_TYPE_HASH_LISTPACK:
                 o->type = REDIS_HASH;
-                o->encoding = REDIS_ENCODING_ZIPLIST;
+                o->encoding = REDIS_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, REDIS_ENCODING_HT);
+                else
+                    hashTypeTryIndex(o);
                 break;
             default:
                 redisPanic("Unknown encoding");
@@ -1148,7 +1367,7 @@ int rdbLoad(char *filename) {
         return REDIS_ERR;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > REDIS_RDB_VERSION) {
+    if (!rdbIsSupportedVersion(rdbver)) {
         fclose(fp);
         redisLog(REDIS_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
@@ -1195,6 +1414,13 @@ int rdbLoad(char *filename) {
         if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
         /* Read value */
         if ((val = rdbLoadObject(type,&rdb)) == NULL) goto eoferr;
+        /* Lists whose nodes were all empty are not added: empty keys can't
+         * exist in the DB. */
+        if (val->type == REDIS_LIST && listTypeLength(val) == 0) {
+            decrRefCount(key);
+            decrRefCount(val);
+            continue;
+        }
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
          * received from the master. In the latter case, the master is
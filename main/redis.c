@@ -126,6 +126,7 @@ struct redisCommand redisCommandTable[] = {
     {"append",appendCommand,3,"wm",0,NULL,1,1,1,0,0},
     {"strlen",strlenCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
+    {"unlink",unlinkCommand,-2,"wF",0,NULL,1,-1,1,0,0},
     {"exists",existsCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"setbit",setbitCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"getbit",getbitCommand,3,"rF",0,NULL,1,1,1,0,0},
@@ -140,8 +141,8 @@ struct redisCommand redisCommandTable[] = {
     {"rpushx",rpushxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"lpushx",lpushxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"linsert",linsertCommand,5,"wm",0,NULL,1,1,1,0,0},
-    {"rpop",rpopCommand,2,"wF",0,NULL,1,1,1,0,0},
-    {"lpop",lpopCommand,2,"wF",0,NULL,1,1,1,0,0},
+    {"rpop",rpopCommand,-2,"wF",0,NULL,1,1,1,0,0},
+    {"lpop",lpopCommand,-2,"wF",0,NULL,1,1,1,0,0},
     {"brpop",brpopCommand,-3,"ws",0,NULL,1,1,1,0,0},
     {"brpoplpush",brpoplpushCommand,4,"wms",0,NULL,1,2,1,0,0},
     {"blpop",blpopCommand,-3,"ws",0,NULL,1,-2,1,0,0},
@@ -157,10 +158,11 @@ struct redisCommand redisCommandTable[] = {
     {"smove",smoveCommand,4,"wF",0,NULL,1,2,1,0,0},
     {"sismember",sismemberCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"scard",scardCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"spop",spopCommand,2,"wRsF",0,NULL,1,1,1,0,0},
+    {"spop",spopCommand,-2,"wRsF",0,NULL,1,1,1,0,0},
     {"srandmember",srandmemberCommand,-2,"rR",0,NULL,1,1,1,0,0},
     {"sinter",sinterCommand,-2,"rS",0,NULL,1,-1,1,0,0},
     {"sinterstore",sinterstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
+    {"sintercard",sinterCardCommand,-3,"r",0,intercardGetKeys,0,0,0,0,0},
     {"sunion",sunionCommand,-2,"rS",0,NULL,1,-1,1,0,0},
     {"sunionstore",sunionstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
     {"sdiff",sdiffCommand,-2,"rS",0,NULL,1,-1,1,0,0},
@@ -175,6 +177,7 @@ struct redisCommand redisCommandTable[] = {
     {"zremrangebylex",zremrangebylexCommand,4,"w",0,NULL,1,1,1,0,0},
     {"zunionstore",zunionstoreCommand,-4,"wm",0,zunionInterGetKeys,0,0,0,0,0},
     {"zinterstore",zinterstoreCommand,-4,"wm",0,zunionInterGetKeys,0,0,0,0,0},
+    {"zintercard",zinterCardCommand,-3,"r",0,intercardGetKeys,0,0,0,0,0},
     {"zrange",zrangeCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zrangebyscore",zrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zrevrangebyscore",zrevrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
@@ -188,6 +191,10 @@ struct redisCommand redisCommandTable[] = {
     {"zrank",zrankCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"zrevrank",zrevrankCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"zscan",zscanCommand,-3,"rR",0,NULL,1,1,1,0,0},
+    {"zpopmin",zpopminCommand,-2,"wF",0,NULL,1,1,1,0,0},
+    {"zpopmax",zpopmaxCommand,-2,"wF",0,NULL,1,1,1,0,0},
+    {"bzpopmin",bzpopminCommand,-3,"ws",0,NULL,1,-2,1,0,0},
+    {"bzpopmax",bzpopmaxCommand,-3,"ws",0,NULL,1,-2,1,0,0},
     {"hset",hsetCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hsetnx",hsetnxCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hget",hgetCommand,3,"rF",0,NULL,1,1,1,0,0},
@@ -235,8 +242,8 @@ struct redisCommand redisCommandTable[] = {
     {"sync",syncCommand,1,"ars",0,NULL,0,0,0,0,0},
     {"psync",syncCommand,3,"ars",0,NULL,0,0,0,0,0},
     {"replconf",replconfCommand,-1,"arslt",0,NULL,0,0,0,0,0},
-    {"flushdb",flushdbCommand,1,"w",0,NULL,0,0,0,0,0},
-    {"flushall",flushallCommand,1,"w",0,NULL,0,0,0,0,0},
+    {"flushdb",flushdbCommand,-1,"w",0,NULL,0,0,0,0,0},
+    {"flushall",flushallCommand,-1,"w",0,NULL,0,0,0,0,0},
     {"sort",sortCommand,-2,"wm",0,NULL,1,1,1,0,0},
     {"info",infoCommand,-1,"rlt",0,NULL,0,0,0,0,0},
     {"monitor",monitorCommand,1,"ars",0,NULL,0,0,0,0,0},
@@ -268,6 +275,7 @@ struct redisCommand redisCommandTable[] = {
     {"bitop",bitopCommand,-4,"wm",0,NULL,2,-1,1,0,0},
     {"bitcount",bitcountCommand,-2,"r",0,NULL,1,1,1,0,0},
     {"bitpos",bitposCommand,-3,"r",0,NULL,1,1,1,0,0},
+    {"bitfield",bitfieldCommand,-2,"wm",0,NULL,1,1,1,0,0},
     {"command",commandCommand,0,"rlt",0,NULL,0,0,0,0,0},
     {"pfselftest",pfselftestCommand,1,"r",0,NULL,0,0,0,0,0},
     {"pfadd",pfaddCommand,-2,"wmF",0,NULL,1,1,1,0,0},
@@ -508,7 +516,8 @@ dictType setDictType = {
     NULL,                      /* val dup */
     dictEncObjKeyCompare,      /* key compare */
     dictRedisObjectDestructor, /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL                       /* entry metadata bytes */
 };
 
 /* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
@@ -518,9 +527,17 @@ dictType zsetDictType = {
     NULL,                      /* val dup */
     dictEncObjKeyCompare,      /* key compare */
     dictRedisObjectDestructor, /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL                       /* entry metadata bytes */
 };
 
+/* Db->dict entries carry the expire time of the key when expires are stored
+ * inline, see dbGetInlineExpire() in db.c. */
+size_t dbDictEntryMetadataBytes(dict *d) {
+    DICT_NOTUSED(d);
+    return server.keyspace_inline_expires ? sizeof(long long) : 0;
+}
+
 /* Db->dict, keys are sds strings, vals are Redis objects. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
@@ -528,7 +545,8 @@ dictType dbDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictRedisObjectDestructor,  /* val destructor */
+    dbDictEntryMetadataBytes    /* entry metadata bytes */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -538,7 +556,8 @@ dictType shaScriptObjectDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictRedisObjectDestructor,  /* val destructor */
+    NULL                        /* entry metadata bytes */
 };
 
 /* Db->expires */
@@ -548,7 +567,8 @@ dictType keyptrDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL                       /* entry metadata bytes */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -558,7 +578,8 @@ dictType commandTableDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCaseCompare,     /* key compare */
     dictSdsDestructor,         /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL                       /* entry metadata bytes */
 };
 
 /* Hash type hash table (note that small hashes are represented with ziplists) */
@@ -568,7 +589,8 @@ dictType hashDictType = {
     NULL,                       /* val dup */
     dictEncObjKeyCompare,       /* key compare */
     dictRedisObjectDestructor,  /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictRedisObjectDestructor,  /* val destructor */
+    NULL                        /* entry metadata bytes */
 };
 
 /* Keylist hash table type has unencoded redis objects as keys and
@@ -580,7 +602,8 @@ dictType keylistDictType = {
     NULL,                       /* val dup */
     dictObjKeyCompare,          /* key compare */
     dictRedisObjectDestructor,  /* key destructor */
-    dictListDestructor          /* val destructor */
+    dictListDestructor,         /* val destructor */
+    NULL                        /* entry metadata bytes */
 };
 
 /* Replication cached script dict (server.repl_scriptcache_dict).
@@ -592,7 +615,8 @@ dictType replScriptCacheDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* entry metadata bytes */
 };
 
 int htNeedsResize(dict *dict) {
@@ -650,8 +674,8 @@ void updateDictResizePolicy(void) {
 /* ======================= Cron: called every 100 ms ======================== */
 
 /* Helper function for the activeExpireCycle() function.
- * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+ * This function will try to expire the key that is stored in the node
+ * 'ln' of the expire index of a Redis database.
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -660,14 +684,17 @@ void updateDictResizePolicy(void) {
  *
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
-int activeExpireCycleTryExpire(redisDb *db, struct dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+int activeExpireCycleTryExpire(redisDb *db, zskiplistNode *ln, long long now) {
+    long long t = (long long)ln->score;
     if (now > t) {
-        sds key = dictGetKey(de);
+        sds key = ln->obj->ptr;
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj);
-        dbDelete(db,keyobj);
+        if (server.lazyfree_lazy_expire)
+            dbAsyncDelete(db,keyobj);
+        else
+            dbSyncDelete(db,keyobj);
         notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
             "expired",keyobj,db->id);
         decrRefCount(keyobj);
@@ -678,10 +705,10 @@ int activeExpireCycleTryExpire(redisDb *db, struct dictEntry *de, long long now)
     }
 }
 
-/* Try to expire a few timed out keys. The algorithm used is adaptive and
- * will use few CPU cycles if there are few expiring keys, otherwise
- * it will get more aggressive to avoid that too much memory is used by
- * keys that can be removed from the keyspace.
+/* Expire the keys that are already timed out. Every DB keeps an index of
+ * the volatile keys ordered by expire time (see the Expires API in db.c),
+ * so the function just reclaims keys from the head of the index as long as
+ * they are expired, without wasting time sampling keys that are not.
  *
  * No more than REDIS_DBCRON_DBS_PER_CALL databases are tested at every
  * iteration.
@@ -742,64 +769,41 @@ void activeExpireCycle(int type) {
         timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
 
     for (j = 0; j < dbs_per_call; j++) {
-        int expired;
         redisDb *db = server.db+(current_db % server.dbnum);
+        zskiplist *zsl = db->expires_index;
+        zskiplistNode *ln;
+        long long now = mstime();
 
         /* Increment the DB now so we are sure if we run out of time
          * in the current DB we'll restart from the next. This allows to
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
-        do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
+        /* If there is nothing to expire try next DB ASAP. */
+        if (zsl->length == 0) {
+            db->avg_ttl = 0;
+            continue;
+        }
 
-            /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
-                db->avg_ttl = 0;
-                break;
-            }
-            slots = dictSlots(db->expires);
-            now = mstime();
-
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
-
-            if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
-                num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
-
-            while (num--) {
-                dictEntry *de;
-                long long ttl;
-
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
-                if (ttl < 0) ttl = 0;
-                ttl_sum += ttl;
-                ttl_samples++;
-            }
+        /* Update the TTL stats for this database: the TTL of the key in
+         * the middle of the index is used as an estimate of the average,
+         * smoothed with the previous value. */
+        ln = zslGetElementByRank(zsl,(zsl->length+1)/2);
+        if (ln) {
+            long long ttl = (long long)ln->score - now;
 
-            /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
+            if (ttl < 0) ttl = 0;
+            if (db->avg_ttl == 0) db->avg_ttl = ttl;
+            db->avg_ttl = (db->avg_ttl+ttl)/2;
+        }
 
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                /* Smooth the value averaging with the previous one. */
-                db->avg_ttl = (db->avg_ttl+avg_ttl)/2;
-            }
+        /* The main collection cycle. Reclaim keys from the head of the
+         * index, that is, from the ones expiring first, until the first
+         * key that is not yet expired is found. */
+        while ((ln = zsl->header->level[0].forward) != NULL &&
+               (long long)ln->score < now)
+        {
+            activeExpireCycleTryExpire(db,ln,now);
 
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
@@ -809,12 +813,12 @@ void activeExpireCycle(int type) {
                 long long elapsed = ustime()-start;
 
                 latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
-                if (elapsed > timelimit) timelimit_exit = 1;
+                if (elapsed > timelimit) {
+                    timelimit_exit = 1;
+                    return;
+                }
             }
-            if (timelimit_exit) return;
-            /* We don't repeat the cycle if there are less than 25% of keys
-             * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+        }
     }
 }
 
@@ -933,7 +937,7 @@ void clientsCron(void) {
  * incrementally in Redis databases, such as active key expiring, resizing,
  * rehashing. */
 void databasesCron(void) {
-    /* Expire keys by random sampling. Not required for slaves
+    /* Expire keys that are already timed out. Not required for slaves
      * as master will synthesize DELs for us. */
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
@@ -1059,7 +1063,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
             size = dictSlots(server.db[j].dict);
             used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = server.db[j].expires_index->length;
             if (used || vkeys) {
                 redisLog(REDIS_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
@@ -1174,6 +1178,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * to detect transfer failures. */
     run_with_period(1000) replicationCron();
 
+    /* Tune the compact encodings limits if adaptive encoding is enabled. */
+    run_with_period(1000) adaptiveEncodingCron();
+
     /* Run the sentinel timer if we are in sentinel mode. */
     run_with_period(100) {
         if (server.sentinel_mode) sentinelTimer();
@@ -1288,6 +1295,8 @@ void createSharedObjects(void) {
     shared.rpop = createStringObject("RPOP",4);
     shared.lpop = createStringObject("LPOP",4);
     shared.lpush = createStringObject("LPUSH",5);
+    shared.zpopmin = createStringObject("ZPOPMIN",7);
+    shared.zpopmax = createStringObject("ZPOPMAX",7);
     for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
         shared.integers[j] = createObject(REDIS_STRING,(void*)(long)j);
         shared.integers[j]->encoding = REDIS_ENCODING_INT;
@@ -1365,14 +1374,33 @@ void initServerConfig(void) {
     server.maxmemory = REDIS_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = REDIS_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = REDIS_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_eviction_time_limit = REDIS_DEFAULT_MAXMEMORY_EVICTION_TIME_LIMIT;
+    server.maxmemory_overshoot_tolerance = REDIS_DEFAULT_MAXMEMORY_OVERSHOOT_TOLERANCE;
+    server.lfu_log_factor = REDIS_DEFAULT_LFU_LOG_FACTOR;
+    server.lfu_decay_time = REDIS_DEFAULT_LFU_DECAY_TIME;
+    server.lazyfree_lazy_eviction = REDIS_DEFAULT_LAZYFREE_LAZY_EVICTION;
+    server.lazyfree_lazy_expire = REDIS_DEFAULT_LAZYFREE_LAZY_EXPIRE;
+    server.lazyfree_lazy_server_del = REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.keyspace_inline_expires = REDIS_DEFAULT_KEYSPACE_INLINE_EXPIRES;
     server.hash_max_ziplist_entries = REDIS_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = REDIS_HASH_MAX_ZIPLIST_VALUE;
+    server.hash_listpack_index_entries = REDIS_HASH_LISTPACK_INDEX_ENTRIES;
     server.list_max_ziplist_entries = REDIS_LIST_MAX_ZIPLIST_ENTRIES;
     server.list_max_ziplist_value = REDIS_LIST_MAX_ZIPLIST_VALUE;
+    server.list_max_ziplist_size = REDIS_LIST_MAX_ZIPLIST_SIZE;
+    server.list_compress_depth = REDIS_LIST_COMPRESS_DEPTH;
     server.set_max_intset_entries = REDIS_SET_MAX_INTSET_ENTRIES;
+    server.set_roaring = REDIS_DEFAULT_SET_ROARING;
     server.zset_max_ziplist_entries = REDIS_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = REDIS_ZSET_MAX_ZIPLIST_VALUE;
+    server.zset_btree = REDIS_DEFAULT_ZSET_BTREE;
+    server.encoding_adaptive = REDIS_DEFAULT_ENCODING_ADAPTIVE;
+    server.encoding_adaptive_min_entries =
+        REDIS_DEFAULT_ENCODING_ADAPTIVE_MIN_ENTRIES;
+    server.encoding_adaptive_max_entries =
+        REDIS_DEFAULT_ENCODING_ADAPTIVE_MAX_ENTRIES;
     server.hll_sparse_max_bytes = REDIS_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.bitmap_sparse_threshold = REDIS_DEFAULT_BITMAP_SPARSE_THRESHOLD;
     server.shutdown_asap = 0;
     server.repl_ping_slave_period = REDIS_REPL_PING_SLAVE_PERIOD;
     server.repl_timeout = REDIS_REPL_TIMEOUT;
@@ -1439,6 +1467,8 @@ void initServerConfig(void) {
     server.lpushCommand = lookupCommandByCString("lpush");
     server.lpopCommand = lookupCommandByCString("lpop");
     server.rpopCommand = lookupCommandByCString("rpop");
+    server.zpopminCommand = lookupCommandByCString("zpopmin");
+    server.zpopmaxCommand = lookupCommandByCString("zpopmax");
 
     /* Slow log */
     server.slowlog_log_slower_than = REDIS_SLOWLOG_LOG_SLOWER_THAN;
@@ -1628,6 +1658,7 @@ void resetServerStats(void) {
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
     server.stat_evictedkeys = 0;
+    server.stat_eviction_overshoot_peak = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_fork_time = 0;
@@ -1700,12 +1731,17 @@ void initServer(void) {
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].expires_index = zslCreate();
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&setDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
     }
+    server.eviction_pool = evictionPoolAlloc();
+    server.eviction_pending = 0;
+    server.eviction_pending_since = 0;
+    server.eviction_timer_id = -1;
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
@@ -1777,6 +1813,7 @@ void initServer(void) {
     scriptingInit();
     slowlogInit();
     latencyMonitorInit();
+    adaptiveEncodingInit();
     bioInit();
 }
 
@@ -1933,6 +1970,8 @@ void forceCommandPropagation(redisClient *c, int flags) {
 void call(redisClient *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->flags;
+    adaptiveSample sample;
+    int sampled;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
@@ -1947,9 +1986,11 @@ void call(redisClient *c, int flags) {
     c->flags &= ~(REDIS_FORCE_AOF|REDIS_FORCE_REPL);
     redisOpArrayInit(&server.also_propagate);
     dirty = server.dirty;
+    sampled = adaptiveEncodingSampleBegin(c,&sample);
     start = ustime();
     c->cmd->proc(c);
     duration = ustime()-start;
+    if (sampled) adaptiveEncodingSampleEnd(&sample,duration);
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
 
@@ -2169,7 +2210,7 @@ int processCommand(redisClient *c) {
     } else {
         call(c,REDIS_CALL_FULL);
         if (listLength(server.ready_keys))
-            handleClientsBlockedOnLists();
+            handleClientsBlockedOnKeys();
     }
     return REDIS_OK;
 }
@@ -2560,7 +2601,9 @@ sds genRedisInfoString(char *section) {
             "used_memory_peak_human:%s\r\n"
             "used_memory_lua:%lld\r\n"
             "mem_fragmentation_ratio:%.2f\r\n"
-            "mem_allocator:%s\r\n",
+            "mem_allocator:%s\r\n"
+            "lazyfree_pending_objects:%llu\r\n"
+            "lazyfree_pending_memory:%zu\r\n",
             zmalloc_used,
             hmem,
             server.resident_set_size,
@@ -2568,7 +2611,9 @@ sds genRedisInfoString(char *section) {
             peak_hmem,
             ((long long)lua_gc(server.lua,LUA_GCCOUNT,0))*1024LL,
             zmalloc_get_fragmentation_ratio(server.resident_set_size),
-            ZMALLOC_LIB
+            ZMALLOC_LIB,
+            lazyfreeGetPendingObjectsCount(),
+            zmalloc_pending_free_memory()
             );
     }
 
@@ -2660,6 +2705,13 @@ sds genRedisInfoString(char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        unsigned long long expired_backlog = 0;
+        long long now = mstime();
+
+        /* Keys already expired but not yet reclaimed. */
+        for (j = 0; j < server.dbnum; j++)
+            expired_backlog += expireIndexDueCount(server.db+j,now);
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -2675,7 +2727,12 @@ sds genRedisInfoString(char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_backlog_keys:%llu\r\n"
             "evicted_keys:%lld\r\n"
+            "eviction_in_progress:%d\r\n"
+            "eviction_lag_msec:%lld\r\n"
+            "eviction_overshoot_bytes:%zu\r\n"
+            "eviction_overshoot_peak_bytes:%zu\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
@@ -2693,7 +2750,12 @@ sds genRedisInfoString(char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            expired_backlog,
             server.stat_evictedkeys,
+            server.eviction_pending,
+            getEvictionLag(),
+            getEvictionOvershoot(),
+            server.stat_eviction_overshoot_peak,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
@@ -2834,6 +2896,13 @@ sds genRedisInfoString(char *section) {
         (float)c_ru.ru_utime.tv_sec+(float)c_ru.ru_utime.tv_usec/1000000);
     }
 
+    /* Encoding */
+    if (allsections || defsections || !strcasecmp(section,"encoding")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info,"# Encoding\r\n");
+        info = genAdaptiveEncodingInfoString(info);
+    }
+
     /* cmdtime */
     if (allsections || !strcasecmp(section,"commandstats")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -2858,7 +2927,7 @@ sds genRedisInfoString(char *section) {
             long long keys, vkeys;
 
             keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = server.db[j].expires_index->length;
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
@@ -2894,30 +2963,351 @@ void monitorCommand(redisClient *c) {
 
 /* ============================ Maxmemory directive  ======================== */
 
-/* This function gets called when 'maxmemory' is set on the config file to limit
- * the max memory used by the server, before processing a command.
+/* ----------------------------------------------------------------------------
+ * LFU (Least Frequently Used) implementation.
  *
- * The goal of the function is to free enough memory to keep Redis under the
- * configured memory limit.
+ * When an LFU maxmemory policy is configured the object 'lru' field stores
+ * a 16 bit "last decrement time" in minutes and an 8 bit logarithmic access
+ * counter (see the REDIS_LFU_* defines in redis.h). The counter is
+ * incremented with a probability that gets lower as the counter grows, so
+ * that 8 bits are enough to distinguish keys accessed a few times from keys
+ * accessed millions of times, and it is decremented as time passes so that
+ * keys that are no longer accessed can be evicted.
+ * --------------------------------------------------------------------------*/
+
+/* Return the current time in minutes, just taking the least significant
+ * 16 bits. The returned time is suitable to be stored as LDT (last decrement
+ * time) for the LFU implementation. */
+unsigned long LFUGetTimeInMinutes(void) {
+    return (server.unixtime/60) & 65535;
+}
+
+/* Given an object last decrement time, compute the minimum number of minutes
+ * that elapsed since the last decrement. Handle overflow (ldt greater than
+ * the current 16 bits minutes time) considering the time as wrapping
+ * exactly once. */
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Logarithmically increment a counter. The greater the current counter value
+ * the less likely it is that it gets really incremented. Saturate it at
+ * 255. */
+unsigned char LFULogIncr(unsigned char counter) {
+    double r, baseval, p;
+
+    if (counter == 255) return 255;
+    r = (double)rand()/RAND_MAX;
+    baseval = counter - REDIS_LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0/(baseval*server.lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* If the object decrement time is reached, decrement the LFU counter but
+ * do not update the LFU fields of the object: we update the access time
+ * and counter in an explicit way when the object is really accessed.
+ * The counter is decremented by one for every 'lfu-decay-time' minutes
+ * elapsed since the last decrement. Return the object frequency counter.
  *
- * The function starts calculating how many bytes should be freed to keep
- * Redis under the limit, and enters a loop selecting the best keys to
- * evict accordingly to the configured policy.
+ * This function is used in order to scan the dataset for the best object
+ * to fit: as we check for the candidate, we incrementally decrement the
+ * counter of the scanned objects if needed. */
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long num_periods = server.lfu_decay_time ?
+                                LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+
+    if (num_periods)
+        counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+/* Update the LFU fields of an object that is being accessed: first decay
+ * the counter accordingly to the time elapsed, then increment it
+ * logarithmically and refresh the decrement time. */
+void updateLFU(robj *o) {
+    unsigned long counter = LFUDecrAndReturn(o);
+
+    counter = LFULogIncr(counter);
+    o->lru = (LFUGetTimeInMinutes()<<8) | counter;
+}
+
+
+/* ----------------------------------------------------------------------------
+ * Eviction candidates selection.
  *
- * If all the bytes needed to return back under the limit were freed the
- * function returns REDIS_OK, otherwise REDIS_ERR is returned, and the caller
- * should block the execution of commands that will result in more memory
- * used by the server.
- */
-int freeMemoryIfNeeded(void) {
-    size_t mem_used, mem_tofree, mem_freed;
-    int slaves = listLength(server.slaves);
-    mstime_t latency;
+ * Eviction candidates are sampled across all the databases at once: every
+ * sample picks a database with a probability proportional to the number of
+ * keys it can evict (all the keys or just the volatile ones, depending on
+ * the policy), so that the key space is sampled uniformly whatever the
+ * distribution of keys among DBs is.
+ *
+ * Sampled keys are inserted in a global eviction pool, sorted by idle time
+ * (or inverted frequency counter, or inverted TTL), so that the key that is
+ * evicted is the best candidate found in the whole key space, and good
+ * candidates found in previous calls are remembered.
+ * --------------------------------------------------------------------------*/
+
+/* Return true if the policy only evicts keys with an expire set. */
+static int evictionIsVolatile(void) {
+    return !(server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
+             server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LFU ||
+             server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM);
+}
+
+/* Return the number of eviction candidates in 'db'. */
+static unsigned long evictionDbSize(redisDb *db) {
+    return evictionIsVolatile() ? db->expires_index->length :
+                                  dictSize(db->dict);
+}
+
+/* Return a random eviction candidate of 'db', that must not be empty, as
+ * an entry of the main dictionary. When expires are stored inline there is
+ * no dictionary of volatile keys to sample from, so a random element of
+ * the expire index is picked instead. */
+static dictEntry *evictionRandomEntry(redisDb *db) {
+    dictEntry *de;
+
+    if (!evictionIsVolatile()) return dictGetRandomKey(db->dict);
+    if (server.keyspace_inline_expires) {
+        zskiplist *zsl = db->expires_index;
+        zskiplistNode *ln;
+
+        ln = zslGetElementByRank(zsl,1+(random() % zsl->length));
+        return dictFind(db->dict,ln->obj->ptr);
+    }
+    de = dictGetRandomKey(db->expires);
+    return dictFind(db->dict,dictGetKey(de));
+}
+
+/* Return the main dictionary entry of 'key' if it is still an eviction
+ * candidate of 'db', otherwise NULL. */
+static dictEntry *evictionFindCandidate(redisDb *db, sds key) {
+    dictEntry *de = dictFind(db->dict,key);
+
+    if (de && evictionIsVolatile() && getExpireFromEntry(db,de) == -1)
+        return NULL;
+    return de;
+}
+
+/* Return the number of keys that can be evicted across all the DBs. */
+static unsigned long long evictionCandidatesCount(void) {
+    unsigned long long total = 0;
+    int j;
+
+    for (j = 0; j < server.dbnum; j++)
+        total += evictionDbSize(server.db+j);
+    return total;
+}
+
+/* Select a DB with a probability proportional to the number of evictable
+ * keys it contains. 'total' is the value returned by
+ * evictionCandidatesCount(), and must be greater than zero. Returns NULL
+ * if all the DBs are empty. */
+static redisDb *evictionSelectDb(unsigned long long total) {
+    unsigned long long r;
+    int j;
+
+    r = (((unsigned long long)random() << 31) ^ random()) % total;
+    for (j = 0; j < server.dbnum; j++) {
+        unsigned long long size = evictionDbSize(server.db+j);
+
+        if (r < size) return server.db+j;
+        r -= size;
+    }
+    /* Not reached unless 'total' is stale: return the last non empty DB. */
+    for (j = server.dbnum-1; j >= 0; j--)
+        if (evictionDbSize(server.db+j)) return server.db+j;
+    return NULL;
+}
+
+/* Create a new eviction pool. */
+struct evictionPoolEntry *evictionPoolAlloc(void) {
+    struct evictionPoolEntry *ep;
+    int j;
+
+    ep = zmalloc(sizeof(*ep)*REDIS_EVICTION_POOL_SIZE);
+    for (j = 0; j < REDIS_EVICTION_POOL_SIZE; j++) {
+        ep[j].idle = 0;
+        ep[j].key = NULL;
+        ep[j].dbid = 0;
+    }
+    return ep;
+}
+
+/* This is an helper function for freeMemoryIfNeeded(), it is used in order
+ * to populate the evictionPool with a few entries every time we want to
+ * expire a key. Keys with idle time smaller than one of the current
+ * keys are added. Keys are always added if there are free entries.
+ *
+ * We insert keys on place in ascending order, so keys with the smaller
+ * idle time are on the left, and keys with the higher idle time on the
+ * right. For the LFU and TTL policies the "idle" value is inverted so that
+ * a higher value is always a better candidate. */
+static void evictionPoolPopulate(struct evictionPoolEntry *pool,
+                                 unsigned long long total)
+{
+    int j, k;
+
+    for (j = 0; j < server.maxmemory_samples; j++) {
+        unsigned long long idle;
+        redisDb *db = evictionSelectDb(total);
+        dictEntry *de;
+        sds key;
+        robj *o;
+
+        if (db == NULL) break; /* No candidates left. */
+        de = evictionRandomEntry(db);
+        key = dictGetKey(de);
+
+        if (server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_TTL) {
+            /* Expire sooner (minor expire unix timestamp) is better
+             * candidate for deletion. */
+            idle = ULLONG_MAX - getExpireFromEntry(db,de);
+        } else {
+            o = dictGetVal(de);
+            if (REDIS_MAXMEMORY_IS_LFU(server.maxmemory_policy))
+                idle = 255-LFUDecrAndReturn(o);
+            else
+                idle = estimateObjectIdleTime(o);
+        }
+
+        /* Insert the element inside the pool.
+         * First, find the first empty bucket or the first populated
+         * bucket that has an idle time smaller than our idle time. */
+        k = 0;
+        while (k < REDIS_EVICTION_POOL_SIZE &&
+               pool[k].key &&
+               pool[k].idle < idle) k++;
+        if (k == 0 && pool[REDIS_EVICTION_POOL_SIZE-1].key != NULL) {
+            /* Can't insert if the element is < the worst element we have
+             * and there are no empty buckets. */
+            continue;
+        } else if (k < REDIS_EVICTION_POOL_SIZE && pool[k].key == NULL) {
+            /* Inserting into empty position. No setup needed before insert. */
+        } else {
+            /* Inserting in the middle. Now k points to the first element
+             * greater than the element to insert.  */
+            if (pool[REDIS_EVICTION_POOL_SIZE-1].key == NULL) {
+                /* Free space on the right? Insert at k shifting
+                 * all the elements from k to end to the right. */
+                memmove(pool+k+1,pool+k,
+                    sizeof(pool[0])*(REDIS_EVICTION_POOL_SIZE-k-1));
+            } else {
+                /* No free space on right? Insert at k-1 */
+                k--;
+                /* Shift all elements on the left of k (included) to the
+                 * left, so we discard the element with smaller idle time. */
+                sdsfree(pool[0].key);
+                memmove(pool,pool+1,sizeof(pool[0])*k);
+            }
+        }
+        pool[k].key = sdsdup(key);
+        pool[k].idle = idle;
+        pool[k].dbid = db->id;
+    }
+}
+
+/* Remove from the pool the entry with the highest idle time that still
+ * exists in its DB, and return the key as stored in the DB (so the returned
+ * sds is owned by the key space). The DB is returned by reference.
+ * Entries referring to keys that no longer exist are discarded.
+ * NULL is returned if the pool contains no valid entry. */
+static sds evictionPoolPopBest(struct evictionPoolEntry *pool, redisDb **dbp) {
+    int k;
+
+    for (k = REDIS_EVICTION_POOL_SIZE-1; k >= 0; k--) {
+        redisDb *db;
+        dictEntry *de;
+
+        if (pool[k].key == NULL) continue;
+        db = server.db+pool[k].dbid;
+        de = evictionFindCandidate(db,pool[k].key);
+
+        /* Remove the entry from the pool. Since we scan from the right
+         * there are no populated buckets after 'k'. */
+        sdsfree(pool[k].key);
+        pool[k].key = NULL;
+        pool[k].idle = 0;
+
+        if (de) {
+            *dbp = db;
+            return dictGetKey(de);
+        }
+    }
+    return NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Background eviction.
+ *
+ * When 'maxmemory-eviction-time-limit' is set, freeMemoryIfNeeded() stops
+ * evicting once it used the configured amount of microseconds, and the
+ * rest of the work is performed incrementally by the following time event,
+ * that runs until the memory usage is back under the limit. Meanwhile write
+ * commands are admitted only if the memory usage does not exceed maxmemory
+ * by more than 'maxmemory-overshoot-tolerance' percent.
+ * --------------------------------------------------------------------------*/
+
+int evictionTimeProc(struct aeEventLoop *eventLoop, long long id,
+                     void *clientData)
+{
+    REDIS_NOTUSED(eventLoop);
+    REDIS_NOTUSED(id);
+    REDIS_NOTUSED(clientData);
+
+    /* Every call performs at most a time limited chunk of work, so other
+     * events are served between calls. */
+    if (server.maxmemory) freeMemoryIfNeeded();
+    if (server.maxmemory && server.eviction_pending) return 0;
+
+    server.eviction_pending = 0;
+    server.eviction_timer_id = -1;
+    return AE_NOMORE;
+}
+
+/* Flag the eviction as incomplete and make sure the time event that
+ * continues it is registered. */
+static void startBackgroundEviction(void) {
+    if (!server.eviction_pending) {
+        server.eviction_pending = 1;
+        server.eviction_pending_since = mstime();
+    }
+    if (server.eviction_timer_id == -1) {
+        server.eviction_timer_id = aeCreateTimeEvent(server.el,0,
+            evictionTimeProc,NULL,NULL);
+        if (server.eviction_timer_id == AE_ERR)
+            server.eviction_timer_id = -1; /* Retry at next call. */
+    }
+}
+
+/* Return the number of milliseconds a background eviction has been lagging
+ * behind, that is, for how long the memory usage is over maxmemory
+ * without the eviction being able to catch up, or zero. */
+long long getEvictionLag(void) {
+    if (!server.eviction_pending) return 0;
+    return mstime() - server.eviction_pending_since;
+}
+
+/* Return the amount of memory that counts against the maxmemory limit:
+ * the size of slaves output buffers and AOF buffers is not counted, as
+ * evicting keys would grow these buffers instead of shrinking them.
+ * Memory that the lazy free thread is going to release is not counted
+ * as well. */
+size_t getMaxmemoryUsedMemory(void) {
+    size_t mem_used = zmalloc_used_memory();
+    size_t pending = zmalloc_pending_free_memory();
+
+    mem_used = (pending > mem_used) ? 0 : mem_used - pending;
 
     /* Remove the size of slaves output buffers and AOF buffer from the
      * count of used memory. */
-    mem_used = zmalloc_used_memory();
-    if (slaves) {
+    if (listLength(server.slaves)) {
         listIter li;
         listNode *ln;
 
@@ -2935,9 +3325,50 @@ int freeMemoryIfNeeded(void) {
         mem_used -= sdslen(server.aof_buf);
         mem_used -= aofRewriteBufferSize();
     }
+    return mem_used;
+}
+
+/* Return how many bytes the memory usage is currently over maxmemory. */
+size_t getEvictionOvershoot(void) {
+    size_t mem_used;
+
+    if (!server.maxmemory) return 0;
+    mem_used = getMaxmemoryUsedMemory();
+    return (mem_used > server.maxmemory) ? mem_used - server.maxmemory : 0;
+}
+
+/* This function gets called when 'maxmemory' is set on the config file to limit
+ * the max memory used by the server, before processing a command.
+ *
+ * The goal of the function is to free enough memory to keep Redis under the
+ * configured memory limit.
+ *
+ * The function starts calculating how many bytes should be freed to keep
+ * Redis under the limit, and enters a loop selecting the best keys to
+ * evict accordingly to the configured policy.
+ *
+ * If all the bytes needed to return back under the limit were freed the
+ * function returns REDIS_OK, otherwise REDIS_ERR is returned, and the caller
+ * should block the execution of commands that will result in more memory
+ * used by the server.
+ *
+ * When an eviction time limit is configured the function returns as soon
+ * as the limit is reached, leaving the remaining work to the background
+ * eviction time event. In this case REDIS_OK is returned if the memory
+ * still to free is within the configured overshoot tolerance.
+ */
+int freeMemoryIfNeeded(void) {
+    size_t mem_used, mem_tofree, mem_freed, mem_tolerance;
+    int slaves = listLength(server.slaves);
+    long long start = ustime(), keys_freed = 0;
+    mstime_t latency;
 
     /* Check if we are over the memory limit. */
-    if (mem_used <= server.maxmemory) return REDIS_OK;
+    mem_used = getMaxmemoryUsedMemory();
+    if (mem_used <= server.maxmemory) {
+        server.eviction_pending = 0;
+        return REDIS_OK;
+    }
 
     if (server.maxmemory_policy == REDIS_MAXMEMORY_NO_EVICTION)
         return REDIS_ERR; /* We need to free memory, but policy forbids. */
@@ -2945,118 +3376,105 @@ int freeMemoryIfNeeded(void) {
     /* Compute how much memory we need to free. */
     mem_tofree = mem_used - server.maxmemory;
     mem_freed = 0;
+    mem_tolerance = (size_t)
+        ((double)server.maxmemory*server.maxmemory_overshoot_tolerance/100);
+    if (mem_tofree > server.stat_eviction_overshoot_peak)
+        server.stat_eviction_overshoot_peak = mem_tofree;
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
-        int j, k, keys_freed = 0;
+        unsigned long long total;
+        sds bestkey = NULL;
+        redisDb *db = NULL;
+        struct dictEntry *de;
 
-        for (j = 0; j < server.dbnum; j++) {
-            long bestval = 0; /* just to prevent warning */
-            sds bestkey = NULL;
-            struct dictEntry *de;
-            redisDb *db = server.db+j;
-            dict *dict;
-
-            if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM)
-            {
-                dict = server.db[j].dict;
-            } else {
-                dict = server.db[j].expires;
-            }
-            if (dictSize(dict) == 0) continue;
+        /* Candidates are selected globally across all the databases, so
+         * a small DB is not drained as fast as a big one, and the best
+         * candidate of the whole key space is evicted. */
+        while (bestkey == NULL) {
+            if ((total = evictionCandidatesCount()) == 0) break;
 
             /* volatile-random and allkeys-random policy */
             if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM ||
                 server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_RANDOM)
             {
-                de = dictGetRandomKey(dict);
+                if ((db = evictionSelectDb(total)) == NULL) break;
+                de = evictionRandomEntry(db);
                 bestkey = dictGetKey(de);
             }
 
-            /* volatile-lru and allkeys-lru policy */
-            else if (server.maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
-            {
-                for (k = 0; k < server.maxmemory_samples; k++) {
-                    sds thiskey;
-                    long thisval;
-                    robj *o;
-
-                    de = dictGetRandomKey(dict);
-                    thiskey = dictGetKey(de);
-                    /* When policy is volatile-lru we need an additional lookup
-                     * to locate the real key, as dict is set to db->expires. */
-                    if (server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
-                        de = dictFind(db->dict, thiskey);
-                    o = dictGetVal(de);
-                    thisval = estimateObjectIdleTime(o);
-
-                    /* Higher idle time is better candidate for deletion */
-                    if (bestkey == NULL || thisval > bestval) {
-                        bestkey = thiskey;
-                        bestval = thisval;
-                    }
-                }
-            }
-
-            /* volatile-ttl */
-            else if (server.maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_TTL) {
-                for (k = 0; k < server.maxmemory_samples; k++) {
-                    sds thiskey;
-                    long thisval;
-
-                    de = dictGetRandomKey(dict);
-                    thiskey = dictGetKey(de);
-                    thisval = (long) dictGetVal(de);
-
-                    /* Expire sooner (minor expire unix timestamp) is better
-                     * candidate for deletion */
-                    if (bestkey == NULL || thisval < bestval) {
-                        bestkey = thiskey;
-                        bestval = thisval;
-                    }
-                }
+            /* volatile-lru, allkeys-lru, volatile-lfu, allkeys-lfu and
+             * volatile-ttl: fill the pool and take its best entry that
+             * still exists. */
+            else {
+                evictionPoolPopulate(server.eviction_pool,total);
+                bestkey = evictionPoolPopBest(server.eviction_pool,&db);
             }
+        }
 
-            /* Finally remove the selected key. */
-            if (bestkey) {
-                long long delta;
-
-                robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-                propagateExpire(db,keyobj);
-                /* We compute the amount of memory freed by dbDelete() alone.
-                 * It is possible that actually the memory needed to propagate
-                 * the DEL in AOF and replication link is greater than the one
-                 * we are freeing removing the key, but we can't account for
-                 * that otherwise we would never exit the loop.
-                 *
-                 * AOF and Output buffer memory will be freed eventually so
-                 * we only care about memory used by the key space. */
-                delta = (long long) zmalloc_used_memory();
-                dbDelete(db,keyobj);
-                delta -= (long long) zmalloc_used_memory();
-                mem_freed += delta;
-                server.stat_evictedkeys++;
-                notifyKeyspaceEvent(REDIS_NOTIFY_EVICTED, "evicted",
-                    keyobj, db->id);
-                decrRefCount(keyobj);
-                keys_freed++;
-
-                /* When the memory to free starts to be big enough, we may
-                 * start spending so much time here that is impossible to
-                 * deliver data to the slaves fast enough, so we force the
-                 * transmission here inside the loop. */
-                if (slaves) flushSlavesOutputBuffers();
+        /* Finally remove the selected key. */
+        if (bestkey) {
+            long long delta;
+
+            robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
+            propagateExpire(db,keyobj);
+            /* We compute the amount of memory freed by dbDelete() alone.
+             * It is possible that actually the memory needed to propagate
+             * the DEL in AOF and replication link is greater than the one
+             * we are freeing removing the key, but we can't account for
+             * that otherwise we would never exit the loop.
+             *
+             * AOF and Output buffer memory will be freed eventually so
+             * we only care about memory used by the key space.
+             *
+             * When the value is released by the lazy free thread, the
+             * memory it will release is accounted as pending free memory
+             * that we subtract from the used memory. */
+            delta = (long long) (zmalloc_used_memory() -
+                                 zmalloc_pending_free_memory());
+            if (server.lazyfree_lazy_eviction)
+                dbAsyncDelete(db,keyobj);
+            else
+                dbSyncDelete(db,keyobj);
+            delta -= (long long) (zmalloc_used_memory() -
+                                  zmalloc_pending_free_memory());
+            mem_freed += delta;
+            server.stat_evictedkeys++;
+            notifyKeyspaceEvent(REDIS_NOTIFY_EVICTED, "evicted",
+                keyobj, db->id);
+            decrRefCount(keyobj);
+
+            /* When the memory to free starts to be big enough, we may
+             * start spending so much time here that is impossible to
+             * deliver data to the slaves fast enough, so we force the
+             * transmission here inside the loop. */
+            if (slaves) flushSlavesOutputBuffers();
+
+            /* Stop if we are out of time, checking the clock once every
+             * 16 evicted keys. The background eviction will continue the
+             * work, and the command is admitted only if the memory still
+             * to free is within the tolerance. */
+            keys_freed++;
+            if (server.maxmemory_eviction_time_limit &&
+                (keys_freed & 15) == 0 &&
+                ustime()-start > server.maxmemory_eviction_time_limit &&
+                mem_freed < mem_tofree)
+            {
+                latencyEndMonitor(latency);
+                latencyAddSampleIfNeeded("eviction-cycle",latency);
+                startBackgroundEviction();
+                return (mem_tofree - mem_freed <= mem_tolerance) ?
+                       REDIS_OK : REDIS_ERR;
             }
-        }
-        if (!keys_freed) {
+        } else {
             latencyEndMonitor(latency);
             latencyAddSampleIfNeeded("eviction-cycle",latency);
+            server.eviction_pending = 0;
             return REDIS_ERR; /* nothing to free... */
         }
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
+    server.eviction_pending = 0;
     return REDIS_OK;
 }
 
@@ -3129,7 +3547,9 @@ void usage(void) {
     fprintf(stderr,"       ./redis-server - (read config from stdin)\n");
     fprintf(stderr,"       ./redis-server -v or --version\n");
     fprintf(stderr,"       ./redis-server -h or --help\n");
-    fprintf(stderr,"       ./redis-server --test-memory <megabytes>\n\n");
+    fprintf(stderr,"       ./redis-server --test-memory <megabytes>\n");
+    fprintf(stderr,"       ./redis-server --test-zset [members]\n");
+    fprintf(stderr,"       ./redis-server --test-hash\n\n");
     fprintf(stderr,"Examples:\n");
     fprintf(stderr,"       ./redis-server (run the server with default conf)\n");
     fprintf(stderr,"       ./redis-server /etc/redis/6379.conf\n");
@@ -3317,6 +3737,9 @@ int main(int argc, char **argv) {
             }
         }
 
+        if (strcmp(argv[1], "--test-zset") == 0) exit(zsetTest(argc,argv));
+        if (strcmp(argv[1], "--test-hash") == 0) exit(hashTest(argc,argv));
+
         /* First argument is the config file name? */
         if (argv[j][0] != '-' || argv[j][1] != '-')
             configfile = argv[j++];
@@ -449,6 +449,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
     int index;
     dictEntry *entry;
     dictht *ht;
+    size_t metasize;
 
     //如果正在进行rehash模式，进行一次单步rehash
     if (dictIsRehashing(d)) _dictRehashStep(d);
@@ -460,7 +461,9 @@ dictEntry *dictAddRaw(dict *d, void *key)
 
     /* Allocate the memory and store the new entry */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    metasize = dictMetadataSize(d);
+    entry = zmalloc(sizeof(*entry)+metasize);
+    if (metasize) memset(dictMetadata(entry),0,metasize);
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -1362,7 +1365,8 @@ dictType dictTypeHeapStringCopyKey = {
     NULL,                          /* val dup */
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
-    NULL                           /* val destructor */
+    NULL,                          /* val destructor */
+    NULL                           /* entry metadata bytes */
 };
 
 /* This is like StringCopy but does not auto-duplicate the key.
@@ -1373,7 +1377,8 @@ dictType dictTypeHeapStrings = {
     NULL,                          /* val dup */
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
-    NULL                           /* val destructor */
+    NULL,                          /* val destructor */
+    NULL                           /* entry metadata bytes */
 };
 
 /* This is like StringCopy but also automatically handle dynamic
@@ -1385,5 +1390,6 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringCopyHTKeyCompare,   /* key compare */
     _dictStringDestructor,         /* key destructor */
     _dictStringDestructor,         /* val destructor */
+    NULL                           /* entry metadata bytes */
 };
 #endif
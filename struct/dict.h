@@ -41,6 +41,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef __DICT_H
 #define __DICT_H
@@ -61,8 +62,13 @@ typedef struct dictEntry {
         double d;       //double双精度浮点数
     } v;
     struct dictEntry *next;//指向dictEntry的指针
+    /* Optional extra space allocated with the entry when the dict type
+     * requests it, see dictType.entryMetadataBytes. */
+    void *metadata[];
 } dictEntry;
 
+struct dict;
+
 //字典类型
 //封装了一些字典操作的函数
 typedef struct dictType {
@@ -72,6 +78,10 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);  //key值比较方法
     void (*keyDestructor)(void *privdata, void *key);       //key的析构函数
     void (*valDestructor)(void *privdata, void *obj);       //val的析构函数
+    /* Bytes of metadata to allocate at the end of every entry, or NULL
+     * if entries carry no metadata. The value must not change while the
+     * dictionary contains entries. */
+    size_t (*entryMetadataBytes)(struct dict *d);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -184,6 +194,9 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
 //返回dictEntry的key值
 #define dictGetKey(he) ((he)->key)
+#define dictMetadata(he) ((void*)(he)->metadata)
+#define dictMetadataSize(d) ((d)->type->entryMetadataBytes ? \
+                             (d)->type->entryMetadataBytes(d) : 0)
 //返回dictEntry的v联合体中的val值
 #define dictGetVal(he) ((he)->v.val)
 //返回回dictEntry的v联合体中的有符号整型值
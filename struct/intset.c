@@ -266,6 +266,28 @@ int64_t intsetRandom(intset *is) {
     return _intsetGet(is,rand()%intrev32ifbe(is->length));
 }
 
+/* Remove 'count' random elements from the intset, storing them into the
+ * 'popped' array, that must have room for 'count' elements. The set is
+ * scanned a single time using selection sampling (Knuth's algorithm S), so
+ * that every subset has the same probability to be chosen, while the
+ * elements that are not popped are compacted in place. */
+intset *intsetPopRandom(intset *is, uint32_t count, int64_t *popped) {
+    uint32_t len = intrev32ifbe(is->length), i, kept = 0, taken = 0;
+    int64_t value;
+
+    if (count > len) count = len;
+    for (i = 0; i < len; i++) {
+        value = _intsetGet(is,i);
+        if ((uint32_t)(rand() % (len-i)) < count-taken)
+            popped[taken++] = value;
+        else
+            _intsetSet(is,kept++,value);
+    }
+    is = intsetResize(is,kept);
+    is->length = intrev32ifbe(kept);
+    return is;
+}
+
 /* Sets the value to the value at the given position. When this position is
  * out of range the function returns 0, when in range it returns 1. */
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
@@ -286,6 +308,436 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* -----------------------------------------------------------------------------
+ * Set operations on sorted intset contents
+ * -------------------------------------------------------------------------- */
+
+/* Intersection, union and difference of two intsets are computed merging
+ * their sorted contents, instead of looking up every element of one set
+ * into the other.
+ *
+ * When one set is much smaller than the other (more than INTSET_GALLOP_RATIO
+ * times) the elements of the small set are located into the big one with
+ * an exponential search starting at the last position found ("galloping"),
+ * so that the cost is O(N*log(M/N)) instead of O(N+M).
+ *
+ * Otherwise both arrays are scanned in blocks of a few elements, comparing
+ * every element of a block of the first array with all the elements of a
+ * block of the second one. With SSE2 (or AVX2 for 32 bit encodings) all the
+ * comparisons of a block are performed with a few vector instructions,
+ * without any branch depending on the data. */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define INTSET_GALLOP_RATIO 32
+
+#define INTSET_OP_INTER 0
+#define INTSET_OP_UNION 1
+#define INTSET_OP_DIFF 2
+
+/* Block compare functions: return a bitmap where the bit N is set if the
+ * element N of the block 'a' is equal to some element of the block 'b'.
+ * INTSET_BLOCK_<type> is the number of elements per block. */
+#if defined(__AVX2__)
+#define INTSET_BLOCK_int32_t 8
+static inline unsigned int intsetBlockMatch_int32_t(const int32_t *a, const int32_t *b) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+    __m256i rot = _mm256_setr_epi32(1,2,3,4,5,6,7,0);
+    __m256i eq = _mm256_cmpeq_epi32(va,vb);
+    int j;
+
+    for (j = 1; j < 8; j++) {
+        vb = _mm256_permutevar8x32_epi32(vb,rot);
+        eq = _mm256_or_si256(eq,_mm256_cmpeq_epi32(va,vb));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+#elif defined(__SSE2__)
+#define INTSET_BLOCK_int32_t 4
+static inline unsigned int intsetBlockMatch_int32_t(const int32_t *a, const int32_t *b) {
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    __m128i eq;
+
+    eq = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi32(va,vb),
+            _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1)))),
+        _mm_or_si128(
+            _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(1,0,3,2))),
+            _mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(2,1,0,3)))));
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+#endif
+
+#if defined(__SSE2__)
+#define INTSET_BLOCK_int16_t 8
+/* Rotate the eight 16 bit lanes of 'v' by 'n' positions. */
+#define intsetRotate16(v,n) \
+    _mm_or_si128(_mm_srli_si128(v,(n)*2),_mm_slli_si128(v,16-(n)*2))
+static inline unsigned int intsetBlockMatch_int16_t(const int16_t *a, const int16_t *b) {
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    __m128i eq;
+
+    eq = _mm_or_si128(
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(va,vb),
+                         _mm_cmpeq_epi16(va,intsetRotate16(vb,1))),
+            _mm_or_si128(_mm_cmpeq_epi16(va,intsetRotate16(vb,2)),
+                         _mm_cmpeq_epi16(va,intsetRotate16(vb,3)))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(va,intsetRotate16(vb,4)),
+                         _mm_cmpeq_epi16(va,intsetRotate16(vb,5))),
+            _mm_or_si128(_mm_cmpeq_epi16(va,intsetRotate16(vb,6)),
+                         _mm_cmpeq_epi16(va,intsetRotate16(vb,7)))));
+    /* Pack the 16 bit masks into bytes to get one bit per element. */
+    return _mm_movemask_epi8(_mm_packs_epi16(eq,_mm_setzero_si128()));
+}
+#else
+#define INTSET_BLOCK_int16_t 2
+#define INTSET_BLOCK_int32_t 2
+#endif
+
+/* 64 bit elements and builds without SSE2 use 2x2 blocks. */
+#define INTSET_BLOCK_int64_t 2
+#define INTSET_SCALAR_MATCH(T) \
+static inline unsigned int intsetBlockMatchScalar_##T(const T *a, const T *b) { \
+    return ((a[0] == b[0]) | (a[0] == b[1])) | \
+           (((a[1] == b[0]) | (a[1] == b[1])) << 1); \
+}
+INTSET_SCALAR_MATCH(int64_t)
+#define intsetBlockMatch_int64_t intsetBlockMatchScalar_int64_t
+#if !defined(__SSE2__)
+INTSET_SCALAR_MATCH(int16_t)
+INTSET_SCALAR_MATCH(int32_t)
+#define intsetBlockMatch_int16_t intsetBlockMatchScalar_int16_t
+#define intsetBlockMatch_int32_t intsetBlockMatchScalar_int32_t
+#endif
+
+/* Index of the lowest bit set in a non zero block bitmap. */
+#if defined(__GNUC__)
+#define intsetLowestBit(m) __builtin_ctz(m)
+#else
+static inline int intsetLowestBit(unsigned int m) {
+    int j = 0;
+    while (!(m & 1)) { m >>= 1; j++; }
+    return j;
+}
+#endif
+
+/* The kernels below are the same for every encoding, so they are defined
+ * by the following macro for int16_t, int32_t and int64_t arrays. All of
+ * them write the result into 'out', that must have enough room, and return
+ * the number of elements written. */
+#define INTSET_SETOPS(T) \
+\
+/* Return the index of the first element of b[j..lb-1] that is not smaller \
+ * than 'v', or 'lb' if there is no such element. */ \
+static size_t intsetGallop_##T(const T *b, size_t lb, size_t j, T v) { \
+    size_t lo = j, hi, step = 1; \
+\
+    if (j >= lb || b[j] >= v) return j; \
+    while (j+step < lb && b[j+step] < v) { \
+        lo = j+step; \
+        step <<= 1; \
+    } \
+    hi = (j+step < lb) ? j+step : lb; \
+    /* Now b[lo] < v and the result is in the range lo+1 .. hi. */ \
+    while (lo+1 < hi) { \
+        size_t mid = lo+(hi-lo)/2; \
+        if (b[mid] < v) lo = mid; else hi = mid; \
+    } \
+    return hi; \
+} \
+\
+static size_t intsetInter_##T(const T *a, size_t la, const T *b, size_t lb, T *out) { \
+    const size_t bs = INTSET_BLOCK_##T; \
+    size_t i = 0, j = 0, k = 0; \
+\
+    /* The intersection is symmetric: always make 'a' the smallest. */ \
+    if (la > lb) { \
+        const T *t = a; a = b; b = t; \
+        i = la; la = lb; lb = i; i = 0; \
+    } \
+    if (la*INTSET_GALLOP_RATIO < lb) { \
+        for (i = 0; i < la && j < lb; i++) { \
+            j = intsetGallop_##T(b,lb,j,a[i]); \
+            if (j < lb && b[j] == a[i]) out[k++] = b[j++]; \
+        } \
+        return k; \
+    } \
+    while (i+bs <= la && j+bs <= lb) { \
+        unsigned int m = intsetBlockMatch_##T(a+i,b+j); \
+        T amax = a[i+bs-1], bmax = b[j+bs-1]; \
+\
+        while (m) { \
+            out[k++] = a[i+intsetLowestBit(m)]; \
+            m &= m-1; \
+        } \
+        if (amax <= bmax) i += bs; \
+        if (bmax <= amax) j += bs; \
+    } \
+    while (i < la && j < lb) { \
+        if (a[i] < b[j]) { \
+            i++; \
+        } else if (a[i] > b[j]) { \
+            j++; \
+        } else { \
+            out[k++] = a[i]; \
+            i++; j++; \
+        } \
+    } \
+    return k; \
+} \
+\
+static size_t intsetUnion_##T(const T *a, size_t la, const T *b, size_t lb, T *out) { \
+    size_t i = 0, j = 0, k = 0; \
+\
+    /* Like the intersection the union is symmetric. */ \
+    if (la > lb) { \
+        const T *t = a; a = b; b = t; \
+        i = la; la = lb; lb = i; i = 0; \
+    } \
+    if (la*INTSET_GALLOP_RATIO < lb) { \
+        /* Copy the runs of the big set between elements of the small \
+         * one with a single memcpy(). */ \
+        for (i = 0; i < la; i++) { \
+            size_t p = intsetGallop_##T(b,lb,j,a[i]); \
+\
+            memcpy(out+k,b+j,(p-j)*sizeof(T)); \
+            k += p-j; \
+            j = p; \
+            out[k++] = a[i]; \
+            if (j < lb && b[j] == a[i]) j++; \
+        } \
+    } else { \
+        while (i < la && j < lb) { \
+            if (a[i] < b[j]) { \
+                out[k++] = a[i++]; \
+            } else if (a[i] > b[j]) { \
+                out[k++] = b[j++]; \
+            } else { \
+                out[k++] = a[i]; \
+                i++; j++; \
+            } \
+        } \
+        memcpy(out+k,a+i,(la-i)*sizeof(T)); \
+        k += la-i; \
+    } \
+    memcpy(out+k,b+j,(lb-j)*sizeof(T)); \
+    return k+lb-j; \
+} \
+\
+static size_t intsetDiff_##T(const T *a, size_t la, const T *b, size_t lb, T *out) { \
+    const size_t bs = INTSET_BLOCK_##T; \
+    size_t i = 0, j = 0, k = 0, base; \
+    unsigned int seen = 0; \
+\
+    if (la*INTSET_GALLOP_RATIO < lb) { \
+        for (i = 0; i < la; i++) { \
+            j = intsetGallop_##T(b,lb,j,a[i]); \
+            if (j == lb || b[j] != a[i]) out[k++] = a[i]; \
+        } \
+        return k; \
+    } else if (lb*INTSET_GALLOP_RATIO < la) { \
+        /* Copy the runs of 'a' between elements of 'b'. */ \
+        for (j = 0; j < lb && i < la; j++) { \
+            size_t p = intsetGallop_##T(a,la,i,b[j]); \
+\
+            memcpy(out+k,a+i,(p-i)*sizeof(T)); \
+            k += p-i; \
+            i = (p < la && a[p] == b[j]) ? p+1 : p; \
+        } \
+        memcpy(out+k,a+i,(la-i)*sizeof(T)); \
+        return k+la-i; \
+    } \
+\
+    /* An element of the current block of 'a' may match an element of any \
+     * of the blocks of 'b' we scan before moving to the next block of 'a', \
+     * so the matches are accumulated into 'seen'. */ \
+    while (i+bs <= la && j+bs <= lb) { \
+        T amax = a[i+bs-1], bmax = b[j+bs-1]; \
+\
+        seen |= intsetBlockMatch_##T(a+i,b+j); \
+        if (amax <= bmax) { \
+            for (base = 0; base < bs; base++) \
+                if (!(seen & (1u<<base))) out[k++] = a[i+base]; \
+            seen = 0; \
+            i += bs; \
+        } \
+        if (bmax <= amax) j += bs; \
+    } \
+    base = i; \
+    while (i < la) { \
+        if (i-base < bs && (seen & (1u<<(i-base)))) { \
+            i++; /* Already found in a previous block of 'b'. */ \
+        } else if (j == lb || a[i] < b[j]) { \
+            out[k++] = a[i++]; \
+        } else if (a[i] > b[j]) { \
+            j++; \
+        } else { \
+            i++; j++; \
+        } \
+    } \
+    return k; \
+}
+
+INTSET_SETOPS(int16_t)
+INTSET_SETOPS(int32_t)
+INTSET_SETOPS(int64_t)
+
+/* Return the contents of 'is' as a native array of elements of the
+ * specified encoding, that must be at least as large as the encoding of the
+ * intset. When a conversion is needed the array is allocated and the
+ * caller should free it: in such case '*tofree' is set to the array,
+ * otherwise to NULL. */
+static void *intsetNativeContents(intset *is, uint8_t enc, void **tofree) {
+    uint32_t j, len = intrev32ifbe(is->length);
+    void *a;
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    if (intrev32ifbe(is->encoding) == enc) {
+        *tofree = NULL;
+        return is->contents;
+    }
+#endif
+    a = *tofree = zmalloc(len*enc);
+    for (j = 0; j < len; j++) {
+        int64_t v = _intsetGet(is,j);
+
+        if (enc == INTSET_ENC_INT64)
+            ((int64_t*)a)[j] = v;
+        else if (enc == INTSET_ENC_INT32)
+            ((int32_t*)a)[j] = v;
+        else
+            ((int16_t*)a)[j] = v;
+    }
+    return a;
+}
+
+/* Create a new intset with the result of the operation 'op' between 'a'
+ * and 'b'. The input intsets are not modified. */
+static intset *intsetOperation(intset *a, intset *b, int op) {
+    uint8_t enc = intrev32ifbe(a->encoding);
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t len, cap;
+    void *va, *vb, *fa, *fb;
+    intset *is;
+
+    /* Elements are compared using the largest of the two encodings. */
+    if (intrev32ifbe(b->encoding) > enc) enc = intrev32ifbe(b->encoding);
+    va = intsetNativeContents(a,enc,&fa);
+    vb = intsetNativeContents(b,enc,&fb);
+
+    if (op == INTSET_OP_INTER)
+        cap = la < lb ? la : lb;
+    else if (op == INTSET_OP_UNION)
+        cap = la+lb;
+    else
+        cap = la;
+    is = zmalloc(sizeof(intset)+cap*enc);
+    is->encoding = intrev32ifbe(enc);
+
+    if (enc == INTSET_ENC_INT64) {
+        int64_t *out = (int64_t*)is->contents;
+        if (op == INTSET_OP_INTER) len = intsetInter_int64_t(va,la,vb,lb,out);
+        else if (op == INTSET_OP_UNION) len = intsetUnion_int64_t(va,la,vb,lb,out);
+        else len = intsetDiff_int64_t(va,la,vb,lb,out);
+    } else if (enc == INTSET_ENC_INT32) {
+        int32_t *out = (int32_t*)is->contents;
+        if (op == INTSET_OP_INTER) len = intsetInter_int32_t(va,la,vb,lb,out);
+        else if (op == INTSET_OP_UNION) len = intsetUnion_int32_t(va,la,vb,lb,out);
+        else len = intsetDiff_int32_t(va,la,vb,lb,out);
+    } else {
+        int16_t *out = (int16_t*)is->contents;
+        if (op == INTSET_OP_INTER) len = intsetInter_int16_t(va,la,vb,lb,out);
+        else if (op == INTSET_OP_UNION) len = intsetUnion_int16_t(va,la,vb,lb,out);
+        else len = intsetDiff_int16_t(va,la,vb,lb,out);
+    }
+    if (fa) zfree(fa);
+    if (fb) zfree(fb);
+
+#if (BYTE_ORDER == BIG_ENDIAN)
+    {
+        uint32_t j;
+
+        /* The kernels work on native integers, convert them back. */
+        for (j = 0; j < len; j++) {
+            if (enc == INTSET_ENC_INT64)
+                memrev64(((int64_t*)is->contents)+j);
+            else if (enc == INTSET_ENC_INT32)
+                memrev32(((int32_t*)is->contents)+j);
+            else
+                memrev16(((int16_t*)is->contents)+j);
+        }
+    }
+#endif
+    is->length = intrev32ifbe(len);
+    if (len != cap) is = intsetResize(is,len);
+    return is;
+}
+
+/* Return a new intset with the elements both in 'a' and 'b'. */
+intset *intsetIntersect(intset *a, intset *b) {
+    return intsetOperation(a,b,INTSET_OP_INTER);
+}
+
+/* Return a new intset with the elements either in 'a' or in 'b'. */
+intset *intsetUnion(intset *a, intset *b) {
+    return intsetOperation(a,b,INTSET_OP_UNION);
+}
+
+/* Return a new intset with the elements of 'a' that are not in 'b'. */
+intset *intsetDifference(intset *a, intset *b) {
+    return intsetOperation(a,b,INTSET_OP_DIFF);
+}
+
+static int intsetCompareValues(const void *a, const void *b) {
+    int64_t va = *(const int64_t*)a, vb = *(const int64_t*)b;
+    return (va > vb) - (va < vb);
+}
+
+/* Add 'count' values at once, storing into '*added' how many of them were
+ * not already in the set. The values are sorted and deduplicated in place,
+ * then merged with the set in a single pass, instead of moving the tail of
+ * the set for every value as intsetAdd() does. */
+intset *intsetAddMany(intset *is, int64_t *values, uint32_t count, uint32_t *added) {
+    intset *batch, *merged;
+    uint8_t enc = INTSET_ENC_INT16, valenc;
+    uint32_t i, j = 0;
+
+    if (count == 0) {
+        *added = 0;
+        return is;
+    }
+    qsort(values,count,sizeof(int64_t),intsetCompareValues);
+    for (i = 0; i < count; i++) {
+        if (i && values[i] == values[j-1]) continue;
+        values[j++] = values[i];
+        valenc = _intsetValueEncoding(values[i]);
+        if (valenc > enc) enc = valenc;
+    }
+
+    batch = intsetNew();
+    batch->encoding = intrev32ifbe(enc);
+    batch = intsetResize(batch,j);
+    for (i = 0; i < j; i++) _intsetSet(batch,i,values[i]);
+    batch->length = intrev32ifbe(j);
+
+    merged = intsetUnion(is,batch);
+    *added = intrev32ifbe(merged->length)-intrev32ifbe(is->length);
+    zfree(batch);
+    zfree(is);
+    return merged;
+}
+
 #ifdef INTSET_TEST_MAIN
 #include <sys/time.h>
 
@@ -484,5 +936,140 @@ int main(int argc, char **argv) {
         checkConsistency(is);
         ok();
     }
+
+    printf("Intersection, union and difference: "); {
+        int bits[] = {15, 30, 40};
+        int sizes[] = {0, 1, 7, 100, 1000, 5000};
+        int x, y, z, w;
+
+        for (i = 0; i < 200; i++) {
+            intset *a, *b, *r[3];
+            int64_t v;
+            uint32_t j;
+
+            x = rand()%3; y = rand()%3;
+            z = rand()%6; w = rand()%6;
+            a = createSet(bits[x],sizes[z]);
+            b = createSet(bits[y],sizes[w]);
+            /* Make sure there are common elements. */
+            for (j = 0; j < intrev32ifbe(a->length); j += 2)
+                b = intsetAdd(b,_intsetGet(a,j),NULL);
+            r[0] = intsetIntersect(a,b);
+            r[1] = intsetUnion(a,b);
+            r[2] = intsetDifference(a,b);
+            for (j = 0; j < 3; j++)
+                if (intrev32ifbe(r[j]->length)) checkConsistency(r[j]);
+            for (j = 0; j < intrev32ifbe(a->length); j++) {
+                v = _intsetGet(a,j);
+                assert(intsetFind(r[0],v) == intsetFind(b,v));
+                assert(intsetFind(r[1],v));
+                assert(intsetFind(r[2],v) == !intsetFind(b,v));
+            }
+            for (j = 0; j < intrev32ifbe(b->length); j++) {
+                v = _intsetGet(b,j);
+                assert(intsetFind(r[0],v) == intsetFind(a,v));
+                assert(intsetFind(r[1],v));
+                assert(!intsetFind(r[2],v));
+            }
+            for (j = 0; j < intrev32ifbe(r[0]->length); j++)
+                assert(intsetFind(a,_intsetGet(r[0],j)));
+            for (j = 0; j < intrev32ifbe(r[1]->length); j++) {
+                v = _intsetGet(r[1],j);
+                assert(intsetFind(a,v) || intsetFind(b,v));
+            }
+            for (j = 0; j < intrev32ifbe(r[2]->length); j++)
+                assert(intsetFind(a,_intsetGet(r[2],j)));
+            zfree(a); zfree(b);
+            for (j = 0; j < 3; j++) zfree(r[j]);
+        }
+        ok();
+    }
+
+    printf("Bulk adding: "); {
+        int64_t small[] = {5, -3, 5, 7, -3, 5};
+        int64_t values[2000];
+        uint32_t added, j;
+
+        is = intsetNew();
+        is = intsetAdd(is,7,NULL);
+        is = intsetAddMany(is,small,0,&added);
+        assert(added == 0 && intrev32ifbe(is->length) == 1);
+        is = intsetAddMany(is,small,6,&added);
+        assert(added == 2 && intrev32ifbe(is->length) == 3);
+        assert(intrev32ifbe(is->encoding) == INTSET_ENC_INT16);
+        assert(intsetFind(is,-3) && intsetFind(is,5) && intsetFind(is,7));
+        zfree(is);
+
+        /* Same set as adding the values one by one, upgrades included. */
+        for (i = 0; i < 200; i++) {
+            intset *ref = createSet(rand()%2 ? 15 : 31,rand()%1000);
+            uint32_t count = rand()%2000, inserts = 0;
+
+            is = intsetNew();
+            for (j = 0; j < intrev32ifbe(ref->length); j++)
+                is = intsetAdd(is,_intsetGet(ref,j),NULL);
+            for (j = 0; j < count; j++) {
+                switch(rand()%4) {
+                case 0: values[j] = rand()%0x7fff; break;
+                case 1: values[j] = -(rand()%0x7fffffff); break;
+                case 2: values[j] = ((int64_t)rand()<<32)|rand(); break;
+                default: values[j] = j ? values[rand()%j] : 0; break;
+                }
+                ref = intsetAdd(ref,values[j],&success);
+                if (success) inserts++;
+            }
+            is = intsetAddMany(is,values,count,&added);
+            assert(added == inserts);
+            assert(is->encoding == ref->encoding && is->length == ref->length);
+            assert(memcmp(is->contents,ref->contents,
+                intrev32ifbe(is->length)*intrev32ifbe(is->encoding)) == 0);
+            if (intrev32ifbe(is->length)) checkConsistency(is);
+            zfree(is);
+            zfree(ref);
+        }
+        ok();
+    }
+
+    printf("Benchmark set operations:\n"); {
+        long sizes[] = {100, 1000, 10000, 100000};
+        int runs, k, s;
+
+        for (s = 0; s < 4; s++) {
+            long size = sizes[s];
+            intset *a = createSet(31,size), *b = createSet(31,size), *r;
+            long long start, find_usec, merge_usec;
+            uint32_t j;
+
+            /* Half of the elements of 'a' are also in 'b'. */
+            for (j = 0; j < intrev32ifbe(a->length); j += 2)
+                b = intsetAdd(b,_intsetGet(a,j),NULL);
+            runs = 10000000/size;
+
+            start = usec();
+            for (k = 0; k < runs; k++) {
+                r = intsetNew();
+                for (j = 0; j < intrev32ifbe(a->length); j++) {
+                    int64_t v = _intsetGet(a,j);
+                    if (intsetFind(b,v)) r = intsetAdd(r,v,NULL);
+                }
+                zfree(r);
+            }
+            find_usec = usec()-start;
+
+            start = usec();
+            for (k = 0; k < runs; k++) zfree(intsetIntersect(a,b));
+            merge_usec = usec()-start;
+            printf("  %6ld elements: intersect %.2f usec (lookups %.2f usec)",
+                size, (double)merge_usec/runs, (double)find_usec/runs);
+
+            start = usec();
+            for (k = 0; k < runs; k++) zfree(intsetUnion(a,b));
+            printf(", union %.2f usec", (double)(usec()-start)/runs);
+            start = usec();
+            for (k = 0; k < runs; k++) zfree(intsetDifference(a,b));
+            printf(", diff %.2f usec\n", (double)(usec()-start)/runs);
+            zfree(a); zfree(b);
+        }
+    }
 }
 #endif
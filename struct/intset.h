@@ -42,13 +42,18 @@ typedef struct intset {
 intset *intsetNew(void);
 // 添加数据
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
+intset *intsetAddMany(intset *is, int64_t *values, uint32_t count, uint32_t *added);
 // 删除数据
 intset *intsetRemove(intset *is, int64_t value, int *success);
 // 查找某个值
 uint8_t intsetFind(intset *is, int64_t value);
 int64_t intsetRandom(intset *is);
+intset *intsetPopRandom(intset *is, uint32_t count, int64_t *popped);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
 uint32_t intsetLen(intset *is);
 size_t intsetBlobLen(intset *is);
+intset *intsetIntersect(intset *a, intset *b);
+intset *intsetUnion(intset *a, intset *b);
+intset *intsetDifference(intset *a, intset *b);
 
 #endif // __INTSET_H
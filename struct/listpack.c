@@ -0,0 +1,1108 @@
+/* listpack.c - A compact list of strings and integers
+ *
+ * The listpack is a replacement for the ziplist: a single allocation holding
+ * a sequence of string or integer elements, able to be traversed in both
+ * directions. The ziplist achieves backward traversal storing in every entry
+ * the length of the *previous* entry: since the number of bytes used by that
+ * field depends on the previous entry length, growing an entry over the 254
+ * bytes boundary may require the next entry to grow as well, and so forth,
+ * turning a single insertion into a cascade of reallocations and moves
+ * (see __ziplistCascadeUpdate), O(N^2) in the worst case.
+ *
+ * The listpack stores instead at the end of every entry the length of the
+ * entry itself, so modifying an entry never affects its neighbours.
+ *
+ * LISTPACK OVERALL LAYOUT:
+ *
+ * <tot-bytes> <num-elements> <entry> <entry> ... <entry> <end-byte>
+ *
+ * <tot-bytes> is a 32 bit unsigned integer holding the total size of the
+ * listpack in bytes, header and end byte included.
+ *
+ * <num-elements> is a 16 bit unsigned integer holding the number of entries.
+ * When the listpack holds 65535 or more entries the field is set to 65535,
+ * meaning the number of entries is unknown, and a full scan is needed to
+ * compute it.
+ *
+ * <end-byte> is a single byte equal to 255 (LP_EOF).
+ *
+ * Both the header fields are stored in little endian byte order.
+ *
+ * LISTPACK ENTRIES:
+ *
+ * <encoding-type><element-data><element-tot-len>
+ *
+ * The encoding type is one of the following, the first byte being enough
+ * to know how many bytes the encoding and the data use:
+ *
+ * |0xxxxxxx| 7 bit unsigned integer, 0 to 127.
+ * |10xxxxxx| string of length up to 63 bytes follows.
+ * |110xxxxx|yyyyyyyy| 13 bit signed integer.
+ * |1110xxxx|yyyyyyyy| string of length up to 4095 bytes follows.
+ * |11110001| 16 bit signed integer follows (2 bytes).
+ * |11110010| 24 bit signed integer follows (3 bytes).
+ * |11110011| 32 bit signed integer follows (4 bytes).
+ * |11110100| 64 bit signed integer follows (8 bytes).
+ * |11110000| 32 bit string length follows (4 bytes), then the string.
+ * |11111111| end of listpack.
+ *
+ * Multi byte integers and lengths are stored in little endian byte order.
+ *
+ * <element-tot-len> is the number of bytes used by the encoding type and the
+ * element data, encoded as a variable length integer meant to be parsed from
+ * right to left: every byte holds 7 bits of the length, the most significant
+ * bit of a byte is set if there are more bytes to its left. So from a
+ * pointer to the first byte of an entry we can jump to the next one, and
+ * from a pointer to the first byte of an entry we can go to the previous
+ * entry reading its <element-tot-len> backward.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "zmalloc.h"
+#include "util.h"
+#include "listpack.h"
+#include "ziplist.h"
+#include "redisassert.h"
+
+#define LP_HDR_SIZE 6       /* 32 bit total len + 16 bit number of elements. */
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_IS_7BIT_UINT(byte) (((byte)&LP_ENCODING_7BIT_UINT_MASK)==LP_ENCODING_7BIT_UINT)
+
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xC0
+#define LP_ENCODING_IS_6BIT_STR(byte) (((byte)&LP_ENCODING_6BIT_STR_MASK)==LP_ENCODING_6BIT_STR)
+
+#define LP_ENCODING_13BIT_INT 0xC0
+#define LP_ENCODING_13BIT_INT_MASK 0xE0
+#define LP_ENCODING_IS_13BIT_INT(byte) (((byte)&LP_ENCODING_13BIT_INT_MASK)==LP_ENCODING_13BIT_INT)
+
+#define LP_ENCODING_12BIT_STR 0xE0
+#define LP_ENCODING_12BIT_STR_MASK 0xF0
+#define LP_ENCODING_IS_12BIT_STR(byte) (((byte)&LP_ENCODING_12BIT_STR_MASK)==LP_ENCODING_12BIT_STR)
+
+#define LP_ENCODING_16BIT_INT 0xF1
+#define LP_ENCODING_24BIT_INT 0xF2
+#define LP_ENCODING_32BIT_INT 0xF3
+#define LP_ENCODING_64BIT_INT 0xF4
+#define LP_ENCODING_32BIT_STR 0xF0
+
+#define LP_EOF 0xFF
+
+#define LP_ENCODING_6BIT_STR_LEN(p) ((p)[0] & 0x3F)
+#define LP_ENCODING_12BIT_STR_LEN(p) ((((p)[0] & 0xF) << 8) | (p)[1])
+#define LP_ENCODING_32BIT_STR_LEN(p) (((uint32_t)(p)[1]<<0) | \
+                                      ((uint32_t)(p)[2]<<8) | \
+                                      ((uint32_t)(p)[3]<<16) | \
+                                      ((uint32_t)(p)[4]<<24))
+
+#define lpGetTotalBytes(p)           (((uint32_t)(p)[0]<<0) | \
+                                      ((uint32_t)(p)[1]<<8) | \
+                                      ((uint32_t)(p)[2]<<16) | \
+                                      ((uint32_t)(p)[3]<<24))
+
+#define lpGetNumElements(p)          (((uint32_t)(p)[4]<<0) | \
+                                      ((uint32_t)(p)[5]<<8))
+#define lpSetTotalBytes(p,v) do { \
+    (p)[0] = (v)&0xff; \
+    (p)[1] = ((v)>>8)&0xff; \
+    (p)[2] = ((v)>>16)&0xff; \
+    (p)[3] = ((v)>>24)&0xff; \
+} while(0)
+
+#define lpSetNumElements(p,v) do { \
+    (p)[4] = (v)&0xff; \
+    (p)[5] = ((v)>>8)&0xff; \
+} while(0)
+
+/* Set the number of elements, or mark it as unknown if it does not fit
+ * the 16 bits header field. */
+#define lpUpdateNumElements(p,v) \
+    lpSetNumElements(p, (v) < LP_HDR_NUMELE_UNKNOWN ? (v) : LP_HDR_NUMELE_UNKNOWN)
+
+/* Create a new, empty listpack.
+ * On success the new listpack is returned. */
+unsigned char *lpNew(void) {
+    unsigned char *lp = zmalloc(LP_HDR_SIZE+1);
+    lpSetTotalBytes(lp,LP_HDR_SIZE+1);
+    lpSetNumElements(lp,0);
+    lp[LP_HDR_SIZE] = LP_EOF;
+    return lp;
+}
+
+/* Free the specified listpack. */
+void lpFree(unsigned char *lp) {
+    zfree(lp);
+}
+
+/* Given an element 'ele' of size 'size', determine if the element can be
+ * represented inside the listpack encoded as integer, and returns
+ * LP_ENCODING_INT if so. Otherwise returns LP_ENCODING_STRING if no integer
+ * encoding is possible.
+ *
+ * If the LP_ENCODING_INT is returned, the function stores the integer encoded
+ * representation of the element in the 'intenc' buffer.
+ *
+ * Regardless of the returned encoding, 'enclen' is populated by reference to
+ * the number of bytes that the string or integer encoded element will require
+ * in order to be represented. */
+static int lpEncodeGetType(unsigned char *ele, uint32_t size,
+                           unsigned char *intenc, uint64_t *enclen) {
+    long long v;
+
+    if (size <= 20 && string2ll((char*)ele,size,&v)) {
+        if (v >= 0 && v <= 127) {
+            /* Single byte 0-127 integer. */
+            intenc[0] = v;
+            *enclen = 1;
+        } else if (v >= -4096 && v <= 4095) {
+            /* 13 bit integer. */
+            if (v < 0) v = ((int64_t)1<<13)+v;
+            intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+            intenc[1] = v&0xff;
+            *enclen = 2;
+        } else if (v >= -32768 && v <= 32767) {
+            /* 16 bit integer. */
+            if (v < 0) v = ((int64_t)1<<16)+v;
+            intenc[0] = LP_ENCODING_16BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = v>>8;
+            *enclen = 3;
+        } else if (v >= -8388608 && v <= 8388607) {
+            /* 24 bit integer. */
+            if (v < 0) v = ((int64_t)1<<24)+v;
+            intenc[0] = LP_ENCODING_24BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = (v>>8)&0xff;
+            intenc[3] = v>>16;
+            *enclen = 4;
+        } else if (v >= -2147483648LL && v <= 2147483647LL) {
+            /* 32 bit integer. */
+            if (v < 0) v = ((int64_t)1<<32)+v;
+            intenc[0] = LP_ENCODING_32BIT_INT;
+            intenc[1] = v&0xff;
+            intenc[2] = (v>>8)&0xff;
+            intenc[3] = (v>>16)&0xff;
+            intenc[4] = v>>24;
+            *enclen = 5;
+        } else {
+            /* 64 bit integer. */
+            uint64_t uv = v;
+            intenc[0] = LP_ENCODING_64BIT_INT;
+            intenc[1] = uv&0xff;
+            intenc[2] = (uv>>8)&0xff;
+            intenc[3] = (uv>>16)&0xff;
+            intenc[4] = (uv>>24)&0xff;
+            intenc[5] = (uv>>32)&0xff;
+            intenc[6] = (uv>>40)&0xff;
+            intenc[7] = (uv>>48)&0xff;
+            intenc[8] = uv>>56;
+            *enclen = 9;
+        }
+        return LP_ENCODING_INT;
+    } else {
+        if (size < 64) *enclen = 1+size;
+        else if (size < 4096) *enclen = 2+size;
+        else *enclen = 5+(uint64_t)size;
+        return LP_ENCODING_STRING;
+    }
+}
+
+/* Store a reverse-encoded variable length field, representing the length
+ * of the previous element of size 'l', in the target buffer 'buf'.
+ * The function returns the number of bytes used to encode it, from
+ * 1 to 5. If 'buf' is NULL the function just returns the number of bytes
+ * needed in order to encode the backlen. */
+static unsigned long lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+    if (l <= 127) {
+        if (buf) buf[0] = l;
+        return 1;
+    } else if (l < 16383) {
+        if (buf) {
+            buf[0] = l>>7;
+            buf[1] = (l&127)|128;
+        }
+        return 2;
+    } else if (l < 2097151) {
+        if (buf) {
+            buf[0] = l>>14;
+            buf[1] = ((l>>7)&127)|128;
+            buf[2] = (l&127)|128;
+        }
+        return 3;
+    } else if (l < 268435455) {
+        if (buf) {
+            buf[0] = l>>21;
+            buf[1] = ((l>>14)&127)|128;
+            buf[2] = ((l>>7)&127)|128;
+            buf[3] = (l&127)|128;
+        }
+        return 4;
+    } else {
+        if (buf) {
+            buf[0] = l>>28;
+            buf[1] = ((l>>21)&127)|128;
+            buf[2] = ((l>>14)&127)|128;
+            buf[3] = ((l>>7)&127)|128;
+            buf[4] = (l&127)|128;
+        }
+        return 5;
+    }
+}
+
+/* Decode the backlen and returns it. If the encoding looks invalid (more than
+ * 5 bytes are used), UINT64_MAX is returned to report the problem. 'p'
+ * points to the last byte of the backlen field. */
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    uint64_t shift = 0;
+    do {
+        val |= (uint64_t)(p[0] & 127) << shift;
+        if (!(p[0] & 128)) break;
+        shift += 7;
+        p--;
+        if (shift > 28) return UINT64_MAX;
+    } while(1);
+    return val;
+}
+
+/* Encode the string element pointed by 's' of size 'len' in the target
+ * buffer 'buf'. The function should be called with 'buf' having always
+ * enough space for encoding the string. This is done by calling
+ * lpEncodeGetType() before calling this function. */
+static void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {
+    if (len < 64) {
+        buf[0] = len | LP_ENCODING_6BIT_STR;
+        memcpy(buf+1,s,len);
+    } else if (len < 4096) {
+        buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
+        buf[1] = len & 0xff;
+        memcpy(buf+2,s,len);
+    } else {
+        buf[0] = LP_ENCODING_32BIT_STR;
+        buf[1] = len & 0xff;
+        buf[2] = (len >> 8) & 0xff;
+        buf[3] = (len >> 16) & 0xff;
+        buf[4] = (len >> 24) & 0xff;
+        memcpy(buf+5,s,len);
+    }
+}
+
+/* Return the encoded length of the listpack element pointed by 'p'.
+ * This includes the encoding byte, length bytes, and the element data itself,
+ * but not the backlen field. */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return 1;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return 1+LP_ENCODING_6BIT_STR_LEN(p);
+    if (LP_ENCODING_IS_13BIT_INT(p[0])) return 2;
+    if (LP_ENCODING_IS_12BIT_STR(p[0])) return 2+LP_ENCODING_12BIT_STR_LEN(p);
+    if (p[0] == LP_ENCODING_16BIT_INT) return 3;
+    if (p[0] == LP_ENCODING_24BIT_INT) return 4;
+    if (p[0] == LP_ENCODING_32BIT_INT) return 5;
+    if (p[0] == LP_ENCODING_64BIT_INT) return 9;
+    if (p[0] == LP_ENCODING_32BIT_STR) return 5+LP_ENCODING_32BIT_STR_LEN(p);
+    if (p[0] == LP_EOF) return 1;
+    return 0;
+}
+
+/* Skip the current entry returning the next. It is invalid to call this
+ * function if the current element is the EOF element at the end of the
+ * listpack, however, while this function is used to implement lpNext(),
+ * it does not return NULL when the EOF element is encountered. */
+static unsigned char *lpSkip(unsigned char *p) {
+    unsigned long entrylen = lpCurrentEncodedSize(p);
+    entrylen += lpEncodeBacklen(NULL,entrylen);
+    p += entrylen;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpNext() will return
+ * the pointer to the next element (the one on the right), or NULL if 'p'
+ * already pointed to the last element of the listpack. */
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+    ((void) lp);
+    p = lpSkip(p);
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* If 'p' points to an element of the listpack, calling lpPrev() will return
+ * the pointer to the previous element (the one on the left), or NULL if 'p'
+ * already pointed to the first element of the listpack. 'p' may also point
+ * to the EOF byte, in which case the last element is returned. */
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+    uint64_t prevlen;
+
+    if (p-lp == LP_HDR_SIZE) return NULL;
+    p--; /* Seek the first backlen byte of the last element. */
+    prevlen = lpDecodeBacklen(p);
+    prevlen += lpEncodeBacklen(NULL,prevlen);
+    return p-prevlen+1; /* Seek the first byte of the previous entry. */
+}
+
+/* Return a pointer to the first element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpFirst(unsigned char *lp) {
+    unsigned char *p = lp + LP_HDR_SIZE; /* Skip the header. */
+    if (p[0] == LP_EOF) return NULL;
+    return p;
+}
+
+/* Return a pointer to the last element of the listpack, or NULL if the
+ * listpack has no elements. */
+unsigned char *lpLast(unsigned char *lp) {
+    unsigned char *p = lp+lpGetTotalBytes(lp)-1; /* Seek EOF element. */
+    return lpPrev(lp,p); /* Will return NULL if EOF is the only element. */
+}
+
+/* Return the number of elements inside the listpack. This function attempts
+ * to use the cached value when within range, otherwise a full scan is
+ * needed. As a side effect of calling this function, the listpack header
+ * could be modified, because if the count is found to be already within
+ * the 'numele' header field range, the new value is set. */
+unsigned long lpLength(unsigned char *lp) {
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned long count = 0;
+    unsigned char *p;
+
+    if (numele != LP_HDR_NUMELE_UNKNOWN) return numele;
+
+    /* Too many elements inside the listpack. We need to scan in order
+     * to get the total number. */
+    p = lpFirst(lp);
+    while(p) {
+        count++;
+        p = lpNext(lp,p);
+    }
+
+    /* If the count is again within range of the header numele field,
+     * set it. */
+    if (count < LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,count);
+    return count;
+}
+
+/* Return the listpack element pointed by 'p'.
+ *
+ * The function changes behavior depending on the passed 'intbuf' value.
+ * Specifically, if 'intbuf' is NULL:
+ *
+ * If the element is internally encoded as an integer, the function returns
+ * NULL and populates the integer value by reference in 'count'. Otherwise if
+ * the element is encoded as a string a pointer to the string (pointing inside
+ * the listpack itself) is returned, and 'count' is set to the length of the
+ * string.
+ *
+ * If instead 'intbuf' points to a buffer passed by the caller, that must be
+ * at least LP_INTBUF_SIZE bytes, the function always returns the element as
+ * it was a string (returning the pointer to the string and setting the
+ * 'count' argument to the string length by reference). However if the element
+ * is encoded as an integer, the 'intbuf' buffer is used in order to store
+ * the string representation. */
+unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
+    int64_t val;
+    uint64_t uval, negstart, negmax;
+
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+        negstart = UINT64_MAX; /* 7 bit ints are always positive. */
+        negmax = 0;
+        uval = p[0] & 0x7f;
+    } else if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+        *count = LP_ENCODING_6BIT_STR_LEN(p);
+        return p+1;
+    } else if (LP_ENCODING_IS_13BIT_INT(p[0])) {
+        uval = ((p[0]&0x1f)<<8) | p[1];
+        negstart = (uint64_t)1<<12;
+        negmax = 8191;
+    } else if (p[0] == LP_ENCODING_16BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8;
+        negstart = (uint64_t)1<<15;
+        negmax = UINT16_MAX;
+    } else if (p[0] == LP_ENCODING_24BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16;
+        negstart = (uint64_t)1<<23;
+        negmax = UINT32_MAX>>8;
+    } else if (p[0] == LP_ENCODING_32BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24;
+        negstart = (uint64_t)1<<31;
+        negmax = UINT32_MAX;
+    } else if (p[0] == LP_ENCODING_64BIT_INT) {
+        uval = (uint64_t)p[1] |
+               (uint64_t)p[2]<<8 |
+               (uint64_t)p[3]<<16 |
+               (uint64_t)p[4]<<24 |
+               (uint64_t)p[5]<<32 |
+               (uint64_t)p[6]<<40 |
+               (uint64_t)p[7]<<48 |
+               (uint64_t)p[8]<<56;
+        negstart = (uint64_t)1<<63;
+        negmax = UINT64_MAX;
+    } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+        *count = LP_ENCODING_12BIT_STR_LEN(p);
+        return p+2;
+    } else if (p[0] == LP_ENCODING_32BIT_STR) {
+        *count = LP_ENCODING_32BIT_STR_LEN(p);
+        return p+5;
+    } else {
+        assert(NULL); /* Invalid encoding. */
+        return NULL; /* avoid warning */
+    }
+
+    /* We reach this code path only for integer encodings.
+     * Convert the unsigned value to the signed one using two's complement
+     * rule. */
+    if (uval >= negstart) {
+        /* This three steps conversion should avoid undefined behaviors
+         * in the unsigned -> signed conversion. */
+        uval = negmax-uval;
+        val = uval;
+        val = -val-1;
+    } else {
+        val = uval;
+    }
+
+    /* Return the string representation of the integer or the value itself
+     * depending on intbuf being NULL or not. */
+    if (intbuf) {
+        *count = ll2string((char*)intbuf,LP_INTBUF_SIZE,(long long)val);
+        return intbuf;
+    } else {
+        *count = val;
+        return NULL;
+    }
+}
+
+/* Get the value of the element pointed by 'p' with the same semantics of
+ * ziplistGet(): a string element is returned by reference in 'sval' and
+ * 'slen', while for an integer element 'sval' is set to NULL and the value
+ * is stored in 'lval'. Returns 0 if 'p' is NULL or points to the end of the
+ * listpack, otherwise 1. */
+int lpGetValue(unsigned char *p, unsigned char **sval, unsigned int *slen,
+               long long *lval) {
+    unsigned char *vstr;
+    int64_t count;
+
+    if (p == NULL || p[0] == LP_EOF) return 0;
+    vstr = lpGet(p,&count,NULL);
+    if (vstr) {
+        *sval = vstr;
+        *slen = count;
+    } else {
+        *sval = NULL;
+        *lval = count;
+    }
+    return 1;
+}
+
+/* Insert, delete or replace the specified element 'ele' of length 'len' at
+ * the specified position 'p', with 'p' being a listpack element pointer
+ * obtained with lpFirst(), lpLast(), lpNext(), lpPrev() or lpSeek().
+ *
+ * The element is inserted before, after, or replaces the element pointed
+ * by 'p' depending on the 'where' argument, that can be LP_BEFORE, LP_AFTER
+ * or LP_REPLACE. 'p' may also point to the EOF byte, with LP_BEFORE, in
+ * order to append an element.
+ *
+ * If 'ele' is set to NULL, the function removes the element pointed by 'p'
+ * instead of inserting one.
+ *
+ * Returns the (possibly reallocated) listpack, or NULL if the resulting
+ * listpack would be bigger than what the 32 bit total size can represent.
+ *
+ * When 'newp' is not NULL it is set to the address of the element just added,
+ * so that it will be possible to continue an interation with lpNext() and
+ * lpPrev(). For deletion operations ('ele' set to NULL) 'newp' is set to the
+ * next element, on the right of the deleted one, or to NULL if the deleted
+ * element was the last one. */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size, unsigned char *p, int where, unsigned char **newp) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+    uint64_t enclen; /* The length of the encoded element. */
+    uint64_t old_listpack_bytes, new_listpack_bytes;
+    unsigned long backlen_size, poff;
+    uint32_t replaced_len = 0;
+    unsigned char *dst;
+    int enctype = 0;
+
+    /* An element pointer set to NULL means deletion, which is conceptually
+     * replacing the element with a zero-length element. So whatever we
+     * get passed as 'where', set it to LP_REPLACE. */
+    if (ele == NULL) where = LP_REPLACE;
+
+    /* If we need to insert after the current element, we just jump to the
+     * next element (that could be the EOF one) and handle the case of
+     * inserting before. So the function will actually deal with just two
+     * cases: LP_BEFORE and LP_REPLACE. */
+    if (where == LP_AFTER) {
+        p = lpSkip(p);
+        where = LP_BEFORE;
+    }
+
+    /* Store the offset of the element 'p', so that we can obtain its
+     * address again after a reallocation. */
+    poff = p-lp;
+
+    /* Calling lpEncodeGetType() results into the encoded version of the
+     * element to be stored into 'intenc' in case it is representable as
+     * an integer: in that case, the function returns LP_ENCODING_INT.
+     * Otherwise if LP_ENCODING_STRING is returned, we'll have to call
+     * lpEncodeString() to actually write the encoded string on place later.
+     *
+     * Whatever the returned encoding is, 'enclen' is populated with the
+     * length of the encoded element. */
+    if (ele) {
+        enctype = lpEncodeGetType(ele,size,intenc,&enclen);
+    } else {
+        enclen = 0;
+    }
+
+    /* We need to also encode the backward-parsable length of the element
+     * and append it to the end: this allows to traverse the listpack from
+     * the end to the start. */
+    backlen_size = ele ? lpEncodeBacklen(backlen,enclen) : 0;
+    old_listpack_bytes = lpGetTotalBytes(lp);
+    if (where == LP_REPLACE) {
+        replaced_len = lpCurrentEncodedSize(p);
+        replaced_len += lpEncodeBacklen(NULL,replaced_len);
+    }
+
+    new_listpack_bytes = old_listpack_bytes + enclen + backlen_size
+                         - replaced_len;
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+
+    /* We now need to reallocate in order to make space or shrink the
+     * allocation (in case 'when' value is LP_REPLACE and the new element is
+     * smaller). However we do that before memmoving the memory to
+     * make room for the new element if the final allocation will get
+     * larger, or we do it after if the final allocation will get smaller. */
+    dst = lp + poff; /* May be updated after reallocation. */
+
+    /* Realloc before: we need more room. */
+    if (new_listpack_bytes > old_listpack_bytes) {
+        lp = zrealloc(lp,new_listpack_bytes);
+        dst = lp + poff;
+    }
+
+    /* Setup the listpack relocating the elements to make the exact room
+     * we need to store the new one. */
+    if (where == LP_BEFORE) {
+        memmove(dst+enclen+backlen_size,dst,old_listpack_bytes-poff);
+    } else { /* LP_REPLACE. */
+        long lendiff = (long)(enclen+backlen_size)-(long)replaced_len;
+        memmove(dst+replaced_len+lendiff,
+                dst+replaced_len,
+                old_listpack_bytes-poff-replaced_len);
+    }
+
+    /* Realloc after: we need to free space. */
+    if (new_listpack_bytes < old_listpack_bytes) {
+        lp = zrealloc(lp,new_listpack_bytes);
+        dst = lp + poff;
+    }
+
+    /* Store the entry. */
+    if (newp) {
+        *newp = dst;
+        /* In case of deletion, set 'newp' to NULL if the next element is
+         * the EOF element. */
+        if (!ele && dst[0] == LP_EOF) *newp = NULL;
+    }
+    if (ele) {
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst,intenc,enclen);
+        } else {
+            lpEncodeString(dst,ele,size);
+        }
+        dst += enclen;
+        memcpy(dst,backlen,backlen_size);
+        dst += backlen_size;
+    }
+
+    /* Update header. */
+    if (where != LP_REPLACE || ele == NULL) {
+        uint32_t num_elements = lpGetNumElements(lp);
+        if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+            if (ele)
+                lpSetNumElements(lp,num_elements+1);
+            else
+                lpSetNumElements(lp,num_elements-1);
+        }
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
+/* Append the specified element 'ele' of length 'size' at the end of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    uint64_t listpack_bytes = lpGetTotalBytes(lp);
+    unsigned char *eofptr = lp + listpack_bytes - 1;
+    return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
+}
+
+/* Prepend the specified element 'ele' of length 'size' at the start of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (!p) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Remove the element pointed by 'p', and return the resulting listpack.
+ * If 'newp' is not NULL, the next element pointer (to the right of the
+ * deleted one) is returned by reference, or NULL if the deleted element
+ * was the last one. */
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
+}
+
+/* Replace the element pointed by '*p' with 's' of length 'slen'. On return
+ * '*p' points to the new element. */
+unsigned char *lpReplace(unsigned char *lp, unsigned char **p, unsigned char *s, uint32_t slen) {
+    return lpInsert(lp,s,slen,*p,LP_REPLACE,p);
+}
+
+/* Delete 'num' consecutive elements starting at 'index'. A negative index
+ * counts from the end of the listpack, like in lpSeek(). Unlike deleting the
+ * elements one after the other, the tail of the listpack is moved only
+ * once. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *p, *eptr;
+    unsigned long numele, deleted = 0;
+    size_t bytes, newbytes;
+
+    if (num == 0) return lp; /* Nothing to delete, return ASAP. */
+    if ((p = lpSeek(lp,index)) == NULL) return lp;
+
+    numele = lpLength(lp);
+    if (index < 0) index = (long)numele + index;
+
+    /* Deleting up to the end of the listpack: just move the EOF marker. */
+    if ((unsigned long)index + num >= numele) {
+        p[0] = LP_EOF;
+        newbytes = p - lp + 1;
+        lpSetTotalBytes(lp,newbytes);
+        lpUpdateNumElements(lp,(unsigned long)index);
+        return zrealloc(lp,newbytes);
+    }
+
+    eptr = p;
+    while (deleted < num) {
+        eptr = lpSkip(eptr);
+        deleted++;
+    }
+
+    /* Move the tail, end byte included, to the first deleted element. */
+    bytes = lpGetTotalBytes(lp);
+    memmove(p,eptr,bytes-(eptr-lp));
+    newbytes = bytes-(eptr-p);
+    lpSetTotalBytes(lp,newbytes);
+    lpUpdateNumElements(lp,numele-num);
+    return zrealloc(lp,newbytes);
+}
+
+/* Return the total number of bytes the listpack is composed of. */
+size_t lpBytes(unsigned char *lp) {
+    return lpGetTotalBytes(lp);
+}
+
+/* Seek the specified element and returns the pointer to the seeked element.
+ * Positive indexes specify the zero-based element to seek from the head to
+ * the tail, negative indexes specify elements starting from the tail, where
+ * -1 means the last element, -2 the penultimate and so forth. If the index
+ * is out of range, NULL is returned. */
+unsigned char *lpSeek(unsigned char *lp, long index) {
+    int forward = 1; /* Seek forward by default. */
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned char *ele;
+
+    /* We want to seek from left to right or the other way around
+     * depending on the listpack length and the element position.
+     * However if the listpack length cannot be obtained in constant time,
+     * we always seek from left to right. */
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        if (index < 0) index = (long)numele+index;
+        if (index < 0) return NULL; /* Index still < 0 means out of range. */
+        if (index >= (long)numele) return NULL; /* Out of range the other side. */
+        /* We want to scan right-to-left if the element we are looking for
+         * is past the half of the listpack. */
+        if (index > (long)numele/2) {
+            forward = 0;
+            /* Right to left scanning always expects a negative index. Convert
+             * our index to negative form. */
+            index -= numele;
+        }
+    } else {
+        /* If the listpack length is unspecified, for negative indexes we
+         * want to always scan right-to-left. */
+        if (index < 0) forward = 0;
+    }
+
+    /* Forward and backward scanning is trivially based on lpNext()/lpPrev(). */
+    if (forward) {
+        ele = lpFirst(lp);
+        while (index > 0 && ele) {
+            ele = lpNext(lp,ele);
+            index--;
+        }
+    } else {
+        ele = lpLast(lp);
+        while (index < -1 && ele) {
+            ele = lpPrev(lp,ele);
+            index++;
+        }
+    }
+    return ele;
+}
+
+/* Compare the element pointed by 'p' with the string 's' of length 'slen',
+ * with the same semantics of ziplistCompare(): returns 1 if equal. */
+int lpCompare(unsigned char *p, unsigned char *s, unsigned int slen) {
+    unsigned char *value;
+    int64_t count;
+    long long sval;
+
+    if (p[0] == LP_EOF) return 0;
+    value = lpGet(p,&count,NULL);
+    if (value) {
+        return count == (int64_t)slen && memcmp(value,s,slen) == 0;
+    } else {
+        /* Integer element: compare as integers, 's' must be an integer
+         * in canonical form as well to be equal. */
+        if (slen > 20 || !string2ll((char*)s,slen,&sval)) return 0;
+        return count == sval;
+    }
+}
+
+/* Find the element equal to 's' of length 'slen' starting at 'p' and
+ * comparing only one element every 'skip'+1 elements (for instance, pass
+ * 1 to only look at the fields of a field/value listpack). Returns the
+ * element pointer, or NULL if not found. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, unsigned int slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    int sval_valid = -1; /* Integer conversion of 's' not attempted yet. */
+    long long sval = 0;
+
+    while (p) {
+        if (skipcnt == 0) {
+            unsigned char *value;
+            int64_t count;
+
+            value = lpGet(p,&count,NULL);
+            if (value) {
+                if (count == (int64_t)slen && memcmp(value,s,slen) == 0)
+                    return p;
+            } else {
+                /* Convert 's' to an integer only once, the first time we
+                 * need to compare it with an integer element. */
+                if (sval_valid == -1)
+                    sval_valid = slen <= 20 &&
+                                 string2ll((char*)s,slen,&sval);
+                if (sval_valid && count == sval) return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpNext(lp,p);
+    }
+    return NULL;
+}
+
+/* Create a listpack with the same elements of the ziplist 'zl', used to
+ * convert the ziplist encoded values found in old RDB files. The ziplist
+ * is not freed. */
+unsigned char *lpFromZiplist(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[LP_INTBUF_SIZE];
+
+    while (ziplistGet(p,&vstr,&vlen,&vlong)) {
+        if (!vstr) {
+            vlen = ll2string(buf,sizeof(buf),vlong);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    return lp;
+}
+
+#ifdef LISTPACK_TEST_MAIN
+#include <sys/time.h>
+#include <time.h>
+#include "adlist.h"
+#include "sds.h"
+
+/* The tests below are the ziplist.c stress tests ported to the listpack,
+ * plus a benchmark of the cascade update scenario comparing the two. */
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static void stress(int pos, int num, int maxsize, int dnum) {
+    int i,j,k;
+    unsigned char *lp;
+    char posstr[2][5] = { "HEAD", "TAIL" };
+    long long start;
+    for (i = 0; i < maxsize; i+=dnum) {
+        lp = lpNew();
+        for (j = 0; j < i; j++) {
+            lp = lpAppend(lp,(unsigned char*)"quux",4);
+        }
+
+        /* Do num times a push+pop from pos */
+        start = usec();
+        for (k = 0; k < num; k++) {
+            if (pos == 0)
+                lp = lpPrepend(lp,(unsigned char*)"quux",4);
+            else
+                lp = lpAppend(lp,(unsigned char*)"quux",4);
+            lp = lpDeleteRange(lp,0,1);
+        }
+        printf("List size: %8d, bytes: %8d, %dx push+pop (%s): %6lld usec\n",
+            i,(int)lpBytes(lp),num,posstr[pos],usec()-start);
+        lpFree(lp);
+    }
+}
+
+static int randstring(char *target, unsigned int min, unsigned int max) {
+    int p = 0;
+    int len = min+rand()%(max-min+1);
+    int minval, maxval;
+    switch(rand() % 3) {
+    case 0:
+        minval = 0;
+        maxval = 255;
+    break;
+    case 1:
+        minval = 48;
+        maxval = 122;
+    break;
+    case 2:
+        minval = 48;
+        maxval = 52;
+    break;
+    default:
+        assert(NULL);
+    }
+
+    while(p < len)
+        target[p++] = minval+rand()%(maxval-minval+1);
+    return len;
+}
+
+/* Insert at the head of a ziplist and of a listpack made of entries of 250
+ * bytes an entry of 253 bytes: in the ziplist every entry needs to grow its
+ * previous entry length field from 1 to 5 bytes, one after the other. */
+static void cascade(int entries, int num) {
+    unsigned char *zl, *lp;
+    unsigned char small[250], big[253];
+    long long start, zltime, lptime;
+    int j, k;
+
+    memset(small,'a',sizeof(small));
+    memset(big,'b',sizeof(big));
+    zltime = lptime = 0;
+    for (k = 0; k < num; k++) {
+        zl = ziplistNew();
+        lp = lpNew();
+        for (j = 0; j < entries; j++) {
+            zl = ziplistPush(zl,small,sizeof(small),ZIPLIST_TAIL);
+            lp = lpAppend(lp,small,sizeof(small));
+        }
+        start = usec();
+        zl = ziplistPush(zl,big,sizeof(big),ZIPLIST_HEAD);
+        zltime += usec()-start;
+        start = usec();
+        lp = lpPrepend(lp,big,sizeof(big));
+        lptime += usec()-start;
+        zfree(zl);
+        lpFree(lp);
+    }
+    printf("Cascade insert, %5d entries, %dx: ziplist %8lld usec, "
+           "listpack %8lld usec\n", entries, num, zltime, lptime);
+}
+
+int main(int argc, char **argv) {
+    unsigned char *lp, *p;
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    (void)argc; (void)argv;
+    srand(time(NULL));
+
+    printf("Basic operations:\n");
+    {
+        lp = lpNew();
+        lp = lpAppend(lp,(unsigned char*)"foo",3);
+        lp = lpAppend(lp,(unsigned char*)"quux",4);
+        lp = lpPrepend(lp,(unsigned char*)"hello",5);
+        lp = lpAppend(lp,(unsigned char*)"1024",4);
+        assert(lpLength(lp) == 4);
+
+        p = lpSeek(lp,0);
+        assert(lpGetValue(p,&vstr,&vlen,&vlong) && vlen == 5 &&
+               memcmp(vstr,"hello",5) == 0);
+        p = lpSeek(lp,-1);
+        assert(lpGetValue(p,&vstr,&vlen,&vlong) && vstr == NULL &&
+               vlong == 1024);
+        assert(lpCompare(p,(unsigned char*)"1024",4));
+        assert(lpSeek(lp,4) == NULL && lpSeek(lp,-5) == NULL);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"1024",4,0) == p);
+        assert(lpFind(lp,lpFirst(lp),(unsigned char*)"foo",3,1) == NULL);
+
+        /* Delete "foo" and "quux", then iterate from both ends. */
+        lp = lpDeleteRange(lp,1,2);
+        assert(lpLength(lp) == 2);
+        p = lpFirst(lp);
+        assert(lpCompare(p,(unsigned char*)"hello",5));
+        p = lpNext(lp,p);
+        assert(lpCompare(p,(unsigned char*)"1024",4));
+        assert(lpNext(lp,p) == NULL);
+        assert(lpPrev(lp,p) == lpFirst(lp));
+        lp = lpDelete(lp,p,&p);
+        assert(p == NULL && lpLength(lp) == 1);
+        lpFree(lp);
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Stress with random payloads of different encoding:\n");
+    {
+        int i,j,len,where;
+        char buf[1024];
+        int buflen;
+        list *ref;
+        listNode *refnode;
+
+        for (i = 0; i < 20000; i++) {
+            lp = lpNew();
+            ref = listCreate();
+            listSetFreeMethod(ref,(void (*)(void*))sdsfree);
+            len = rand() % 256;
+
+            /* Create lists */
+            for (j = 0; j < len; j++) {
+                where = rand() & 1;
+                if (rand() % 2) {
+                    buflen = randstring(buf,1,sizeof(buf)-1);
+                } else {
+                    switch(rand() % 3) {
+                    case 0:
+                        buflen = sprintf(buf,"%lld",(0LL + rand()) >> 20);
+                        break;
+                    case 1:
+                        buflen = sprintf(buf,"%lld",(0LL + rand()));
+                        break;
+                    case 2:
+                        buflen = sprintf(buf,"%lld",(0LL + rand()) << 20);
+                        break;
+                    default:
+                        assert(NULL);
+                    }
+                }
+
+                /* Add to listpack and to the reference list */
+                if (where == 0) {
+                    lp = lpPrepend(lp,(unsigned char*)buf,buflen);
+                    listAddNodeHead(ref,sdsnewlen(buf, buflen));
+                } else {
+                    lp = lpAppend(lp,(unsigned char*)buf,buflen);
+                    listAddNodeTail(ref,sdsnewlen(buf, buflen));
+                }
+            }
+
+            assert(listLength(ref) == lpLength(lp));
+            for (j = 0; j < len; j++) {
+                /* Naive way to get elements, but similar to the stresser
+                 * executed from the Tcl test suite. */
+                p = lpSeek(lp,j);
+                refnode = listIndex(ref,j);
+
+                assert(lpGetValue(p,&vstr,&vlen,&vlong));
+                if (vstr == NULL) {
+                    buflen = sprintf(buf,"%lld",vlong);
+                } else {
+                    buflen = vlen;
+                    memcpy(buf,vstr,buflen);
+                    buf[buflen] = '\0';
+                }
+                assert(memcmp(buf,listNodeValue(refnode),buflen) == 0);
+                assert(lpPrev(lp,lpNext(lp,p) ? lpNext(lp,p) :
+                              lp+lpBytes(lp)-1) == p);
+            }
+            lpFree(lp);
+            listRelease(ref);
+        }
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Stress with variable listpack size:\n");
+    {
+        stress(0,100000,16384,256);
+        stress(1,100000,16384,256);
+    }
+
+    printf("Cascade update, ziplist vs listpack:\n");
+    {
+        cascade(100,1000);
+        cascade(1000,100);
+        cascade(10000,10);
+    }
+
+    return 0;
+}
+#endif
@@ -0,0 +1,1487 @@
+/* quicklist.c - A doubly linked list of ziplists
+ *
+ * A quicklist is a linked list of ziplists: every node of the list holds a
+ * ziplist with a bounded number of entries (or bounded size in bytes), so
+ * that big lists retain most of the memory efficiency of ziplists, while
+ * pushing and popping at both ends is O(1) like in a linked list, since only
+ * a small ziplist is reallocated at every operation.
+ *
+ * Every node also records the number of entries of its ziplist, so that
+ * seeking a given index (LINDEX, LRANGE, LSET, ...) only needs to walk the
+ * nodes, not the single entries, and can start from the nearest end.
+ *
+ * Optionally the nodes more than 'compress' nodes away from both the ends of
+ * the list are kept compressed with LZF: lists used as queues or logs only
+ * access the nodes at the ends, so the interior nodes are only decompressed
+ * when an element in the middle of the list is accessed, and compressed
+ * again as soon as the access is finished.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "quicklist.h"
+#include "zmalloc.h"
+#include "ziplist.h"
+#include "util.h"
+#include "lzf.h"
+#include "redisassert.h"
+
+/* Optimization levels for size-based filling: a negative fill factor -N
+ * limits every node to optimization_level[N-1] bytes. */
+static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
+
+/* Maximum size in bytes of any multi-element ziplist.
+ * Larger values will live in their own isolated ziplists. */
+#define SIZE_SAFETY_LIMIT 8192
+
+/* Maximum positive fill factor, bounded by the 16 bits node count. */
+#define FILL_MAX ((1 << 15)-1)
+
+/* Minimum ziplist size in bytes for attempting merges. */
+#define MIN_ZIPLIST_BYTES 11
+
+/* Maximum compression depth, bounded by the 16 bits 'compress' field. */
+#define COMPRESS_MAX ((1 << 16)-1)
+
+/* Minimum ziplist size in bytes for attempting compression. */
+#define MIN_COMPRESS_BYTES 48
+
+/* Minimum size reduction in bytes to store compressed quicklistNode data.
+ * This also prevents us from storing compression if the compression
+ * resulted in a larger size than the original data. */
+#define MIN_COMPRESS_IMPROVE 8
+
+#define quicklistNodeUpdateSz(node)                                            \
+    do {                                                                       \
+        (node)->sz = ziplistBlobLen((node)->zl);                               \
+    } while (0)
+
+static void initEntry(quicklistEntry *entry) {
+    entry->quicklist = NULL;
+    entry->node = NULL;
+    entry->zi = NULL;
+    entry->value = NULL;
+    entry->sz = 0;
+    entry->longval = -123456789;
+    entry->offset = 123456789;
+}
+
+/* Create a new quicklist.
+ * Free with quicklistRelease(). */
+quicklist *quicklistCreate(void) {
+    struct quicklist *quicklist;
+
+    quicklist = zmalloc(sizeof(*quicklist));
+    quicklist->head = quicklist->tail = NULL;
+    quicklist->len = 0;
+    quicklist->count = 0;
+    quicklist->compress = 0;
+    quicklist->fill = -2;
+    return quicklist;
+}
+
+void quicklistSetCompressDepth(quicklist *quicklist, int compress) {
+    if (compress > COMPRESS_MAX) {
+        compress = COMPRESS_MAX;
+    } else if (compress < 0) {
+        compress = 0;
+    }
+    quicklist->compress = compress;
+}
+
+void quicklistSetFill(quicklist *quicklist, int fill) {
+    if (fill > FILL_MAX) {
+        fill = FILL_MAX;
+    } else if (fill < -5) {
+        fill = -5;
+    } else if (fill == 0) {
+        fill = 1;
+    }
+    quicklist->fill = fill;
+}
+
+void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
+    quicklistSetFill(quicklist, fill);
+    quicklistSetCompressDepth(quicklist, depth);
+}
+
+/* Create a new quicklist with some default parameters. */
+quicklist *quicklistNew(int fill, int compress) {
+    quicklist *quicklist = quicklistCreate();
+    quicklistSetOptions(quicklist, fill, compress);
+    return quicklist;
+}
+
+static quicklistNode *quicklistCreateNode(void) {
+    quicklistNode *node;
+    node = zmalloc(sizeof(*node));
+    node->zl = NULL;
+    node->count = 0;
+    node->sz = 0;
+    node->next = node->prev = NULL;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    node->recompress = 0;
+    node->extra = 0;
+    return node;
+}
+
+/* Return cached quicklist count */
+unsigned long quicklistCount(const quicklist *ql) { return ql->count; }
+
+/* Free entire quicklist. */
+void quicklistRelease(quicklist *quicklist) {
+    unsigned long len;
+    quicklistNode *current, *next;
+
+    current = quicklist->head;
+    len = quicklist->len;
+    while (len--) {
+        next = current->next;
+
+        zfree(current->zl);
+        quicklist->count -= current->count;
+
+        zfree(current);
+
+        quicklist->len--;
+        current = next;
+    }
+    zfree(quicklist);
+}
+
+/* Compress the ziplist in 'node' and update encoding details.
+ * Returns 1 if ziplist compressed successfully.
+ * Returns 0 if compression failed or if ziplist too small to compress. */
+static int __quicklistCompressNode(quicklistNode *node) {
+    quicklistLZF *lzf;
+
+    /* Don't bother compressing small values */
+    if (node->sz < MIN_COMPRESS_BYTES)
+        return 0;
+
+    lzf = zmalloc(sizeof(*lzf) + node->sz);
+
+    /* Cancel if compression fails or doesn't compress small enough */
+    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
+                                 node->sz)) == 0) ||
+        lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        /* lzf_compress aborts/rejects compression if value not compressable. */
+        zfree(lzf);
+        return 0;
+    }
+    lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
+    zfree(node->zl);
+    node->zl = (unsigned char *)lzf;
+    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->recompress = 0;
+    return 1;
+}
+
+/* Compress only uncompressed nodes. */
+#define quicklistCompressNode(_node)                                           \
+    do {                                                                       \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW) {     \
+            __quicklistCompressNode((_node));                                  \
+        }                                                                      \
+    } while (0)
+
+/* Uncompress the ziplist in 'node' and update encoding details.
+ * Returns 1 on successful decode, 0 on failure to decode. */
+static int __quicklistDecompressNode(quicklistNode *node) {
+    void *decompressed = zmalloc(node->sz);
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+
+    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+        /* Someone requested decompress, but we can't decompress.  Not good. */
+        zfree(decompressed);
+        return 0;
+    }
+    zfree(lzf);
+    node->zl = decompressed;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    return 1;
+}
+
+/* Decompress only compressed nodes. */
+#define quicklistDecompressNode(_node)                                         \
+    do {                                                                       \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+            __quicklistDecompressNode((_node));                                \
+        }                                                                      \
+    } while (0)
+
+/* Force node to not be immediately re-compresable */
+#define quicklistDecompressNodeForUse(_node)                                   \
+    do {                                                                       \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+            __quicklistDecompressNode((_node));                                \
+            (_node)->recompress = 1;                                           \
+        }                                                                      \
+    } while (0)
+
+/* Extract the raw LZF data from this quicklistNode.
+ * Pointer to LZF data is assigned to '*data'.
+ * Return value is the length of compressed LZF data. */
+size_t quicklistGetLzf(const quicklistNode *node, void **data) {
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    *data = lzf->compressed;
+    return lzf->sz;
+}
+
+#define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
+
+/* Force 'quicklist' to meet compression guidelines set by compress depth.
+ * The only way to guarantee interior nodes get compressed is to iterate
+ * to our "interior" compress depth then compress the next node we find.
+ * If compress depth is larger than the entire list, we return immediately. */
+static void __quicklistCompress(const quicklist *quicklist,
+                                quicklistNode *node) {
+    quicklistNode *forward, *reverse;
+    int depth = 0;
+    int in_depth = 0;
+
+    /* If length is less than our compress depth (from both sides),
+     * we can't compress anything. Nodes are deleted one at a time, so
+     * when the list gets this short every node was already decompressed
+     * by the loop below while the list was shrinking. */
+    if (!quicklistAllowsCompression(quicklist) ||
+        quicklist->len < (unsigned int)(quicklist->compress * 2))
+        return;
+
+    /* Iterate until we reach compress depth for both sides of the list.
+     * Note: because we do length checks at the *top* of this function,
+     *       we can skip explicit null checks below. Everything exists. */
+    forward = quicklist->head;
+    reverse = quicklist->tail;
+    while (depth++ < quicklist->compress) {
+        quicklistDecompressNode(forward);
+        quicklistDecompressNode(reverse);
+
+        /* Nodes within the depth must stay uncompressed even if they were
+         * decompressed for use while being in the middle of the list. */
+        forward->recompress = 0;
+        reverse->recompress = 0;
+
+        if (forward == node || reverse == node)
+            in_depth = 1;
+
+        forward = forward->next;
+        reverse = reverse->prev;
+    }
+
+    /* A list of exactly 'compress * 2' nodes has no interior nodes. */
+    if (quicklist->len == (unsigned int)(quicklist->compress * 2))
+        return;
+
+    if (!in_depth)
+        quicklistCompressNode(node);
+
+    /* At this point, forward and reverse are one node beyond depth */
+    quicklistCompressNode(forward);
+    quicklistCompressNode(reverse);
+}
+
+#define quicklistCompress(_ql, _node)                                          \
+    do {                                                                       \
+        if ((_node)->recompress)                                               \
+            quicklistCompressNode((_node));                                    \
+        else                                                                   \
+            __quicklistCompress((_ql), (_node));                               \
+    } while (0)
+
+/* If we previously used quicklistDecompressNodeForUse(), just recompress. */
+#define quicklistRecompressOnly(_ql, _node)                                    \
+    do {                                                                       \
+        if ((_node)->recompress)                                               \
+            quicklistCompressNode((_node));                                    \
+    } while (0)
+
+/* Insert 'new_node' after 'old_node' if 'after' is 1.
+ * Insert 'new_node' before 'old_node' if 'after' is 0. */
+static void __quicklistInsertNode(quicklist *quicklist, quicklistNode *old_node,
+                                  quicklistNode *new_node, int after) {
+    if (after) {
+        new_node->prev = old_node;
+        if (old_node) {
+            new_node->next = old_node->next;
+            if (old_node->next)
+                old_node->next->prev = new_node;
+            old_node->next = new_node;
+        }
+        if (quicklist->tail == old_node)
+            quicklist->tail = new_node;
+    } else {
+        new_node->next = old_node;
+        if (old_node) {
+            new_node->prev = old_node->prev;
+            if (old_node->prev)
+                old_node->prev->next = new_node;
+            old_node->prev = new_node;
+        }
+        if (quicklist->head == old_node)
+            quicklist->head = new_node;
+    }
+    /* If this insert creates the only element so far, initialize head/tail. */
+    if (quicklist->len == 0) {
+        quicklist->head = quicklist->tail = new_node;
+    }
+
+    quicklist->len++;
+
+    if (old_node)
+        quicklistCompress(quicklist, old_node);
+}
+
+/* Wrappers for node inserting around existing node. */
+static void _quicklistInsertNodeBefore(quicklist *quicklist,
+                                       quicklistNode *old_node,
+                                       quicklistNode *new_node) {
+    __quicklistInsertNode(quicklist, old_node, new_node, 0);
+}
+
+static void _quicklistInsertNodeAfter(quicklist *quicklist,
+                                      quicklistNode *old_node,
+                                      quicklistNode *new_node) {
+    __quicklistInsertNode(quicklist, old_node, new_node, 1);
+}
+
+static int _quicklistNodeSizeMeetsOptimizationRequirement(const size_t sz,
+                                                          const int fill) {
+    size_t offset;
+
+    if (fill >= 0)
+        return 0;
+
+    offset = (-fill) - 1;
+    if (offset < (sizeof(optimization_level) / sizeof(*optimization_level))) {
+        if (sz <= optimization_level[offset]) {
+            return 1;
+        } else {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+}
+
+#define sizeMeetsSafetyLimit(sz) ((sz) <= SIZE_SAFETY_LIMIT)
+
+/* Return true if an entry of 'sz' bytes can be added to 'node' without
+ * exceeding the limits of the 'fill' factor. */
+static int _quicklistNodeAllowInsert(const quicklistNode *node, const int fill,
+                                     const size_t sz) {
+    int ziplist_overhead;
+    size_t new_sz;
+
+    if (!node)
+        return 0;
+
+    /* size of previous offset */
+    if (sz < 254)
+        ziplist_overhead = 1;
+    else
+        ziplist_overhead = 5;
+
+    /* size of forward offset */
+    if (sz < 64)
+        ziplist_overhead += 1;
+    else if (sz < 16384)
+        ziplist_overhead += 2;
+    else
+        ziplist_overhead += 5;
+
+    /* new_sz overestimates if 'sz' encodes to an integer type */
+    new_sz = node->sz + sz + ziplist_overhead;
+    if (_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill))
+        return 1;
+    else if (!sizeMeetsSafetyLimit(new_sz))
+        return 0;
+    else if ((int)node->count < fill)
+        return 1;
+    else
+        return 0;
+}
+
+/* Return true if nodes 'a' and 'b' can be merged in a single node. */
+static int _quicklistNodeAllowMerge(const quicklistNode *a,
+                                    const quicklistNode *b, const int fill) {
+    size_t merge_sz;
+
+    if (!a || !b)
+        return 0;
+
+    /* approximate merged ziplist size (- 11 to remove one ziplist
+     * header/trailer) */
+    merge_sz = a->sz + b->sz - MIN_ZIPLIST_BYTES;
+    if (_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill))
+        return 1;
+    else if (!sizeMeetsSafetyLimit(merge_sz))
+        return 0;
+    else if ((int)(a->count + b->count) <= fill)
+        return 1;
+    else
+        return 0;
+}
+
+/* Add new entry to head node of quicklist.
+ *
+ * Returns 0 if used existing head.
+ * Returns 1 if new head created. */
+int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
+    quicklistNode *orig_head = quicklist->head;
+
+    if (_quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz)) {
+        quicklist->head->zl =
+            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklistNodeUpdateSz(quicklist->head);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+
+        quicklistNodeUpdateSz(node);
+        _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
+    }
+    quicklist->count++;
+    quicklist->head->count++;
+    return (orig_head != quicklist->head);
+}
+
+/* Add new entry to tail node of quicklist.
+ *
+ * Returns 0 if used existing tail.
+ * Returns 1 if new tail created. */
+int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
+    quicklistNode *orig_tail = quicklist->tail;
+
+    if (_quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz)) {
+        quicklist->tail->zl =
+            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklistNodeUpdateSz(quicklist->tail);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+
+        quicklistNodeUpdateSz(node);
+        _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
+    }
+    quicklist->count++;
+    quicklist->tail->count++;
+    return (orig_tail != quicklist->tail);
+}
+
+/* Wrapper to allow argument-based switching between HEAD/TAIL pop */
+void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
+                   int where) {
+    if (where == QUICKLIST_HEAD) {
+        quicklistPushHead(quicklist, value, sz);
+    } else if (where == QUICKLIST_TAIL) {
+        quicklistPushTail(quicklist, value, sz);
+    }
+}
+
+/* Create new node consisting of a pre-formed ziplist.
+ * Used for loading RDBs where entire ziplists have been stored
+ * to be retrieved later. The ziplist is owned by the quicklist
+ * from now on. */
+void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+    quicklistNode *node = quicklistCreateNode();
+
+    node->zl = zl;
+    node->count = ziplistLen(node->zl);
+    node->sz = ziplistBlobLen(zl);
+
+    _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
+    quicklist->count += node->count;
+}
+
+/* Append all values of ziplist 'zl' individually into 'quicklist'.
+ *
+ * This allows us to restore old RDB ziplists into new quicklists
+ * with smaller ziplist sizes than the saved RDB ziplist.
+ *
+ * Returns 'quicklist' argument. Frees passed-in ziplist 'zl' */
+static quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
+                                                   unsigned char *zl) {
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    char longstr[32] = {0};
+
+    unsigned char *p = ziplistIndex(zl, 0);
+    while (ziplistGet(p, &value, &sz, &longval)) {
+        if (!value) {
+            /* Write the longval as a string so we can re-add it */
+            sz = ll2string(longstr, sizeof(longstr), longval);
+            value = (unsigned char *)longstr;
+        }
+        quicklistPushTail(quicklist, value, sz);
+        p = ziplistNext(zl, p);
+    }
+    zfree(zl);
+    return quicklist;
+}
+
+/* Create new (potentially multi-node) quicklist from a single existing
+ * ziplist.
+ *
+ * Returns new quicklist. Frees passed-in ziplist 'zl'. */
+quicklist *quicklistCreateFromZiplist(int fill, int compress,
+                                      unsigned char *zl) {
+    return quicklistAppendValuesFromZiplist(quicklistNew(fill, compress), zl);
+}
+
+static void __quicklistDelNode(quicklist *quicklist, quicklistNode *node) {
+    if (node->next)
+        node->next->prev = node->prev;
+    if (node->prev)
+        node->prev->next = node->next;
+
+    if (node == quicklist->tail) {
+        quicklist->tail = node->prev;
+    }
+
+    if (node == quicklist->head) {
+        quicklist->head = node->next;
+    }
+
+    quicklist->count -= node->count;
+
+    zfree(node->zl);
+    zfree(node);
+    quicklist->len--;
+
+    /* If we deleted a node within our compress depth, we now have compressed
+     * nodes needing to be decompressed. */
+    __quicklistCompress(quicklist, NULL);
+}
+
+#define quicklistDeleteIfEmpty(ql, n)                                          \
+    do {                                                                       \
+        if ((n)->count == 0) {                                                 \
+            __quicklistDelNode((ql), (n));                                     \
+            (n) = NULL;                                                        \
+        }                                                                      \
+    } while (0)
+
+/* Delete one entry from list given the node for the entry and a pointer
+ * to the entry in the node.
+ *
+ * Note: quicklistDelIndex() *requires* uncompressed nodes because you
+ *       already had to get *p from an uncompressed node somewhere.
+ *
+ * Returns 1 if the entire node was deleted, 0 if node still exists.
+ * Also updates in/out param 'p' with the next offset in the ziplist. */
+static int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
+                             unsigned char **p) {
+    int gone = 0;
+
+    node->zl = ziplistDelete(node->zl, p);
+    node->count--;
+    if (node->count == 0) {
+        gone = 1;
+        __quicklistDelNode(quicklist, node);
+    } else {
+        quicklistNodeUpdateSz(node);
+    }
+    quicklist->count--;
+    /* If we deleted the node, the original node is no longer valid */
+    return gone ? 1 : 0;
+}
+
+/* Delete one element represented by 'entry'
+ *
+ * 'entry' stores enough metadata to delete the proper position in
+ * the correct ziplist in the correct quicklist node. */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    quicklistNode *prev = entry->node->prev;
+    quicklistNode *next = entry->node->next;
+    int deleted_node = quicklistDelIndex((quicklist *)entry->quicklist,
+                                         entry->node, &entry->zi);
+
+    /* after delete, the zi is now invalid for any future usage. */
+    iter->zi = NULL;
+
+    /* If current node is deleted, we must update iterator node and offset. */
+    if (deleted_node) {
+        if (iter->direction == AL_START_HEAD) {
+            iter->current = next;
+            iter->offset = 0;
+        } else if (iter->direction == AL_START_TAIL) {
+            iter->current = prev;
+            iter->offset = -1;
+        }
+    }
+    /* else if (!deleted_node), no changes needed: iterators moving towards
+     * the tail use positive offsets and iterators moving towards the head
+     * use negative offsets (see quicklistGetIteratorAtIdx()), so after the
+     * deletion the same offset already refers to the next element:
+     *  - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
+     *  - [1, 2, 3] => delete offset -2 => [1, 3]: next element still offset -2
+     * If we deleted the last element in the iteration direction, the next
+     * call into quicklistNext() will jump to the next node. */
+}
+
+/* Replace quicklist entry at offset 'index' by 'data' with length 'sz'.
+ *
+ * Returns 1 if replace happened.
+ * Returns 0 if replace failed and no changes happened. */
+int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
+                            int sz) {
+    quicklistEntry entry;
+
+    if (quicklistIndex(quicklist, index, &entry)) {
+        /* quicklistIndex provides an uncompressed node */
+        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
+        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+        quicklistNodeUpdateSz(entry.node);
+        quicklistCompress(quicklist, entry.node);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Move all the entries of node 'nokeep' into its neighbour 'keep', at the
+ * head of 'keep' if 'nokeep' precedes it, at the tail otherwise, and delete
+ * 'nokeep' from the quicklist. Returns 'keep'.
+ *
+ * The node we merge into is always preserved, so that callers holding a
+ * reference to it (like an iterator that was used to insert an element)
+ * never see it freed under their feet. */
+static quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+                                             quicklistNode *keep,
+                                             quicklistNode *nokeep) {
+    int before = (nokeep == keep->prev);
+    unsigned char *p;
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    char longstr[32];
+
+    quicklistDecompressNode(keep);
+    quicklistDecompressNode(nokeep);
+    p = ziplistIndex(nokeep->zl, before ? -1 : 0);
+    while (ziplistGet(p, &value, &sz, &longval)) {
+        if (!value) {
+            sz = ll2string(longstr, sizeof(longstr), longval);
+            value = (unsigned char *)longstr;
+        }
+        keep->zl = ziplistPush(keep->zl, value, sz,
+                               before ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        p = before ? ziplistPrev(nokeep->zl, p) : ziplistNext(nokeep->zl, p);
+    }
+    keep->count = ziplistLen(keep->zl);
+    quicklistNodeUpdateSz(keep);
+
+    /* The entries of 'nokeep' are now accounted in 'keep'. */
+    nokeep->count = 0;
+    __quicklistDelNode(quicklist, nokeep);
+    quicklistCompress(quicklist, keep);
+    return keep;
+}
+
+/* Attempt to merge ziplists of the nodes around 'center', in order to
+ * avoid leaving many small nodes after a node split:
+ *   - (center->prev, center)
+ *   - (center, center->next)
+ * 'center' itself is never freed. */
+static void _quicklistMergeNodes(quicklist *quicklist, quicklistNode *center) {
+    int fill = quicklist->fill;
+
+    if (_quicklistNodeAllowMerge(center->prev, center, fill))
+        _quicklistZiplistMerge(quicklist, center, center->prev);
+    if (_quicklistNodeAllowMerge(center, center->next, fill))
+        _quicklistZiplistMerge(quicklist, center, center->next);
+}
+
+/* Split 'node' into two parts, parameterized by 'offset' and 'after'.
+ *
+ * The 'after' argument controls which quicklistNode gets returned.
+ * If 'after'==1, returned node has elements after 'offset'.
+ *                input node keeps elements up to 'offset', including 'offset'.
+ * If 'after'==0, returned node has elements up to 'offset', excluding
+ *                'offset'.
+ *                input node keeps elements after 'offset', including
+ *                'offset'.
+ *
+ * The input node keeps all elements not taken by the returned node.
+ * The input node must be uncompressed.
+ *
+ * Returns newly created node or NULL if split not possible. */
+static quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
+                                          int after) {
+    size_t zl_sz = node->sz;
+    quicklistNode *new_node = quicklistCreateNode();
+    int orig_start, orig_extent, new_start, new_extent;
+
+    if (offset < 0) offset += node->count;
+
+    new_node->zl = zmalloc(zl_sz);
+
+    /* Copy original ziplist so we can split it */
+    memcpy(new_node->zl, node->zl, zl_sz);
+
+    /* -1 here means "continue deleting until the list ends" */
+    orig_start = after ? offset + 1 : 0;
+    orig_extent = after ? -1 : offset;
+    new_start = after ? 0 : offset;
+    new_extent = after ? offset + 1 : -1;
+
+    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
+    node->count = ziplistLen(node->zl);
+    quicklistNodeUpdateSz(node);
+
+    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
+    new_node->count = ziplistLen(new_node->zl);
+    quicklistNodeUpdateSz(new_node);
+
+    return new_node;
+}
+
+/* Insert a new entry before or after existing entry 'entry'.
+ *
+ * If after==1, the new value is inserted after 'entry', otherwise
+ * the new value is inserted before 'entry'. */
+static void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
+                             void *value, const size_t sz, int after) {
+    int full = 0, at_tail = 0, at_head = 0, full_next = 0, full_prev = 0;
+    int fill = quicklist->fill;
+    quicklistNode *node = entry->node;
+    quicklistNode *new_node = NULL;
+
+    if (!node) {
+        /* we have no reference node, so let's create only node in the list */
+        new_node = quicklistCreateNode();
+        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        __quicklistInsertNode(quicklist, NULL, new_node, after);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        quicklist->count++;
+        return;
+    }
+
+    /* Populate accounting flags for easier boolean checks later */
+    if (!_quicklistNodeAllowInsert(node, fill, sz))
+        full = 1;
+
+    if (after && (entry->offset == node->count - 1 || entry->offset == -1)) {
+        at_tail = 1;
+        if (!_quicklistNodeAllowInsert(node->next, fill, sz))
+            full_next = 1;
+    }
+
+    if (!after && (entry->offset == 0 || entry->offset == -node->count)) {
+        at_head = 1;
+        if (!_quicklistNodeAllowInsert(node->prev, fill, sz))
+            full_prev = 1;
+    }
+
+    /* Now determine where and how to insert the new element */
+    if (!full && after) {
+        unsigned char *next;
+
+        quicklistDecompressNodeForUse(node);
+        next = ziplistNext(node->zl, entry->zi);
+        if (next == NULL) {
+            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
+        } else {
+            node->zl = ziplistInsert(node->zl, next, value, sz);
+        }
+        node->count++;
+        quicklistNodeUpdateSz(node);
+        quicklistRecompressOnly(quicklist, node);
+    } else if (!full && !after) {
+        quicklistDecompressNodeForUse(node);
+        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->count++;
+        quicklistNodeUpdateSz(node);
+        quicklistRecompressOnly(quicklist, node);
+    } else if (full && at_tail && node->next && !full_next && after) {
+        /* If we are: at tail, next has free space, and inserting after:
+         *   - insert entry at head of next node. */
+        new_node = node->next;
+        quicklistDecompressNodeForUse(new_node);
+        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        quicklistRecompressOnly(quicklist, new_node);
+    } else if (full && at_head && node->prev && !full_prev && !after) {
+        /* If we are: at head, previous has free space, and inserting before:
+         *   - insert entry at tail of previous node. */
+        new_node = node->prev;
+        quicklistDecompressNodeForUse(new_node);
+        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        quicklistRecompressOnly(quicklist, new_node);
+    } else if (full && ((at_tail && node->next && full_next && after) ||
+                        (at_head && node->prev && full_prev && !after))) {
+        /* If we are: full, and our prev/next is full, then:
+         *   - create new node and attach to quicklist */
+        new_node = quicklistCreateNode();
+        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        __quicklistInsertNode(quicklist, node, new_node, after);
+    } else if (full) {
+        /* else, node is full we need to split it.
+         * covers both after and !after cases */
+        quicklistDecompressNodeForUse(node);
+        new_node = _quicklistSplitNode(node, entry->offset, after);
+        new_node->zl = ziplistPush(new_node->zl, value, sz,
+                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        __quicklistInsertNode(quicklist, node, new_node, after);
+        quicklistCompress(quicklist, new_node);
+        _quicklistMergeNodes(quicklist, node);
+    }
+
+    quicklist->count++;
+}
+
+void quicklistInsertBefore(quicklist *quicklist, quicklistEntry *entry,
+                           void *value, const size_t sz) {
+    _quicklistInsert(quicklist, entry, value, sz, 0);
+}
+
+void quicklistInsertAfter(quicklist *quicklist, quicklistEntry *entry,
+                          void *value, const size_t sz) {
+    _quicklistInsert(quicklist, entry, value, sz, 1);
+}
+
+/* Delete a range of elements from the quicklist.
+ *
+ * elements may span across multiple quicklistNodes, so we
+ * have to be careful about tracking where we start and end.
+ *
+ * Returns 1 if entries were deleted, 0 if nothing was deleted. */
+int quicklistDelRange(quicklist *quicklist, const long start,
+                      const long count) {
+    unsigned long extent;
+    quicklistEntry entry;
+    quicklistNode *node;
+
+    if (count <= 0)
+        return 0;
+
+    extent = count; /* range is inclusive of start position */
+
+    if (start >= 0 && extent > (quicklist->count - start)) {
+        /* if requesting delete more elements than exist, limit to list size. */
+        extent = quicklist->count - start;
+    } else if (start < 0 && extent > (unsigned long)(-start)) {
+        /* else, if at negative offset, limit max size to rest of list. */
+        extent = -start; /* c.f. LREM -29 29; just delete until end. */
+    }
+
+    if (!quicklistIndex(quicklist, start, &entry))
+        return 0;
+
+    node = entry.node;
+
+    /* iterate over next nodes until everything is deleted. */
+    while (extent) {
+        quicklistNode *next = node->next;
+        unsigned long del;
+        int delete_entire_node = 0;
+
+        if (entry.offset < 0) entry.offset += node->count;
+
+        if (entry.offset == 0 && extent >= node->count) {
+            /* If we are deleting more than the count of this node, we
+             * can just delete the entire node without ziplist math. */
+            delete_entire_node = 1;
+            del = node->count;
+        } else if (extent + entry.offset >= node->count) {
+            /* If deleting more nodes after this one, calculate delete based
+             * on size of current node. */
+            del = node->count - entry.offset;
+        } else {
+            /* else, we are deleting less than the extent of this node, so
+             * use extent directly. */
+            del = extent;
+        }
+
+        if (delete_entire_node) {
+            __quicklistDelNode(quicklist, node);
+        } else {
+            quicklistDecompressNodeForUse(node);
+            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            quicklistNodeUpdateSz(node);
+            node->count -= del;
+            quicklist->count -= del;
+            quicklistDeleteIfEmpty(quicklist, node);
+            if (node)
+                quicklistRecompressOnly(quicklist, node);
+        }
+
+        extent -= del;
+
+        node = next;
+
+        entry.offset = 0;
+    }
+    return 1;
+}
+
+/* Passthrough to ziplistCompare() */
+int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
+    return ziplistCompare(p1, p2, p2_len);
+}
+
+/* Returns a quicklist iterator 'iter'. After the initialization every
+ * call to quicklistNext() will return the next element of the quicklist. */
+quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction) {
+    quicklistIter *iter;
+
+    iter = zmalloc(sizeof(*iter));
+
+    if (direction == AL_START_HEAD) {
+        iter->current = quicklist->head;
+        iter->offset = 0;
+    } else if (direction == AL_START_TAIL) {
+        iter->current = quicklist->tail;
+        iter->offset = -1;
+    }
+
+    iter->direction = direction;
+    iter->quicklist = quicklist;
+
+    iter->zi = NULL;
+
+    return iter;
+}
+
+/* Initialize an iterator at a specific offset 'idx' and make the iterator
+ * return nodes in 'direction' direction.
+ * NULL is returned if 'idx' is out of range. */
+quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist,
+                                         const int direction,
+                                         const long long idx) {
+    quicklistEntry entry;
+    quicklistIter *base;
+    long offset;
+
+    if (!quicklistIndex(quicklist, idx, &entry))
+        return NULL;
+
+    base = quicklistGetIterator(quicklist, direction);
+    base->zi = NULL;
+    base->current = entry.node;
+
+    /* Iterators moving towards the tail use positive offsets and iterators
+     * moving towards the head negative ones, so that deleting the current
+     * entry never changes the offset of the next one. */
+    offset = entry.offset;
+    if (direction == AL_START_HEAD && offset < 0)
+        offset += entry.node->count;
+    else if (direction == AL_START_TAIL && offset >= 0)
+        offset -= entry.node->count;
+    base->offset = offset;
+    return base;
+}
+
+/* Release iterator.
+ * If we still have a valid current node, then re-encode current node. */
+void quicklistReleaseIterator(quicklistIter *iter) {
+    if (iter->current)
+        quicklistCompress(iter->quicklist, iter->current);
+
+    zfree(iter);
+}
+
+/* Get next element in iterator.
+ *
+ * Note: You must NOT insert into the list while iterating over it.
+ * You *may* delete from the list while iterating using the
+ * quicklistDelEntry() function.
+ * If you insert into the quicklist while iterating, you should
+ * re-create the iterator after your addition.
+ *
+ * iter = quicklistGetIterator(quicklist,<direction>);
+ * quicklistEntry entry;
+ * while (quicklistNext(iter, &entry)) {
+ *     if (entry.value)
+ *          [[ use entry.value with entry.sz ]]
+ *     else
+ *          [[ use entry.longval ]]
+ * }
+ *
+ * Populates 'entry' with values for this iteration.
+ * Returns 0 when iteration is complete or if iteration not possible.
+ * If return value is 0, the contents of 'entry' are not valid. */
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+    initEntry(entry);
+
+    if (!iter)
+        return 0;
+
+    entry->quicklist = iter->quicklist;
+    entry->node = iter->current;
+
+    if (!iter->current)
+        return 0;
+
+    if (!iter->zi) {
+        /* If !zi, use current index. */
+        quicklistDecompressNodeForUse(iter->current);
+        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+    } else {
+        /* else, use existing iterator offset and get prev/next as necessary. */
+        if (iter->direction == AL_START_HEAD) {
+            iter->zi = ziplistNext(iter->current->zl, iter->zi);
+            iter->offset++;
+        } else {
+            iter->zi = ziplistPrev(iter->current->zl, iter->zi);
+            iter->offset--;
+        }
+    }
+
+    entry->zi = iter->zi;
+    entry->offset = iter->offset;
+
+    if (iter->zi) {
+        /* Populate value from existing ziplist position */
+        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        return 1;
+    } else {
+        /* We ran out of ziplist entries.
+         * Pick next node, update offset, then re-run retrieval. */
+        quicklistCompress(iter->quicklist, iter->current);
+        if (iter->direction == AL_START_HEAD) {
+            /* Forward traversal */
+            iter->current = iter->current->next;
+            iter->offset = 0;
+        } else {
+            /* Reverse traversal */
+            iter->current = iter->current->prev;
+            iter->offset = -1;
+        }
+        iter->zi = NULL;
+        return quicklistNext(iter, entry);
+    }
+}
+
+/* Populate 'entry' with the element at the specified zero-based index
+ * where 0 is the head, 1 is the element next to head
+ * and so on. Negative integers are used in order to count
+ * from the tail, -1 is the last element, -2 the penultimate
+ * and so on. If the index is out of range 0 is returned.
+ *
+ * The nodes are scanned using their element counts, starting from the
+ * end of the list nearest to the requested element.
+ *
+ * Returns 1 if element found
+ * Returns 0 if element not found */
+int quicklistIndex(const quicklist *quicklist, const long long idx,
+                   quicklistEntry *entry) {
+    quicklistNode *n;
+    unsigned long long accum = 0;
+    unsigned long long index;
+    int forward = idx < 0 ? 0 : 1; /* < 0 -> reverse, 0+ -> forward */
+
+    initEntry(entry);
+    entry->quicklist = quicklist;
+
+    index = forward ? (unsigned long long)idx : (unsigned long long)(-idx) - 1;
+    if (index >= quicklist->count)
+        return 0;
+
+    /* Seek from the nearest end of the list. */
+    if (index > quicklist->count / 2) {
+        forward = !forward;
+        index = quicklist->count - 1 - index;
+    }
+    n = forward ? quicklist->head : quicklist->tail;
+
+    while (n) {
+        if ((accum + n->count) > index) {
+            break;
+        } else {
+            accum += n->count;
+            n = forward ? n->next : n->prev;
+        }
+    }
+
+    if (!n)
+        return 0;
+
+    entry->node = n;
+    if (forward) {
+        /* forward = normal head-to-tail offset. */
+        entry->offset = index - accum;
+    } else {
+        /* reverse = need negative offset for tail-to-head, so undo
+         * the result of the original if (index < 0) above. */
+        entry->offset = (-index) - 1 + accum;
+    }
+
+    quicklistDecompressNodeForUse(entry->node);
+    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
+    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    /* The caller will use our result, so we don't re-compress here.
+     * The caller can recompress or delete the node as needed, see
+     * quicklistRecompressEntry(). */
+    return 1;
+}
+
+/* Compress again the node of an entry returned by quicklistIndex() once the
+ * caller is done with it, if it was decompressed in order to access it.
+ * The entry value is no longer valid after this call. */
+void quicklistRecompressEntry(quicklistEntry *entry) {
+    if (entry->node)
+        quicklistRecompressOnly(quicklist, entry->node);
+    entry->value = NULL;
+    entry->zi = NULL;
+}
+
+/* pop from quicklist and return result in 'data' ptr.  Value of 'data'
+ * is the return value of 'saver' function pointer if the data is NOT a number.
+ *
+ * If the quicklist element is a long long, then the return value is returned in
+ * 'sval'.
+ *
+ * Return value of 0 means no elements available.
+ * Return value of 1 means check 'data' and 'sval' for values.
+ * If 'data' is set, use 'data' and 'sz'.  Otherwise, use 'sval'. */
+int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
+                       unsigned int *sz, long long *sval,
+                       void *(*saver)(unsigned char *data, unsigned int sz)) {
+    unsigned char *p;
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    int pos = (where == QUICKLIST_HEAD) ? 0 : -1;
+    quicklistNode *node;
+
+    if (quicklist->count == 0)
+        return 0;
+
+    if (data)
+        *data = NULL;
+    if (sz)
+        *sz = 0;
+    if (sval)
+        *sval = -123456789;
+
+    if (where == QUICKLIST_HEAD && quicklist->head) {
+        node = quicklist->head;
+    } else if (where == QUICKLIST_TAIL && quicklist->tail) {
+        node = quicklist->tail;
+    } else {
+        return 0;
+    }
+
+    p = ziplistIndex(node->zl, pos);
+    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+        if (vstr) {
+            if (data)
+                *data = saver(vstr, vlen);
+            if (sz)
+                *sz = vlen;
+        } else {
+            if (data)
+                *data = NULL;
+            if (sval)
+                *sval = vlong;
+        }
+        quicklistDelIndex(quicklist, node, &p);
+        return 1;
+    }
+    return 0;
+}
+
+/* Return a malloc'd copy of data passed in */
+static void *_quicklistSaver(unsigned char *data, unsigned int sz) {
+    unsigned char *vstr;
+    if (data) {
+        vstr = zmalloc(sz);
+        memcpy(vstr, data, sz);
+        return vstr;
+    }
+    return NULL;
+}
+
+/* Default pop function
+ *
+ * Returns malloc'd value from quicklist */
+int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
+                 unsigned int *sz, long long *slong) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    if (quicklist->count == 0)
+        return 0;
+    int ret = quicklistPopCustom(quicklist, where, &vstr, &vlen, &vlong,
+                                 _quicklistSaver);
+    if (data)
+        *data = vstr;
+    if (slong)
+        *slong = vlong;
+    if (sz)
+        *sz = vlen;
+    return ret;
+}
+
+#ifdef QUICKLIST_TEST_MAIN
+#include <sys/time.h>
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Check that the cached counts of the quicklist and of every node agree
+ * with the content of the ziplists, and that no node within the compress
+ * depth is compressed. Returns the number of errors. */
+static int checkCounts(quicklist *ql) {
+    quicklistNode *node;
+    unsigned long count = 0;
+    unsigned int len = 0;
+    int errors = 0;
+
+    for (node = ql->head; node; node = node->next) {
+        if (quicklistNodeIsCompressed(node)) {
+            if (len < ql->compress || len >= ql->len - ql->compress) {
+                printf("ERROR: node %u within depth %u is compressed\n",
+                    len, (unsigned int)ql->compress);
+                errors++;
+            }
+            count += node->count;
+            len++;
+            continue;
+        }
+        if (node->count != ziplistLen(node->zl)) {
+            printf("ERROR: node count %u, ziplist length %u\n",
+                node->count, ziplistLen(node->zl));
+            errors++;
+        }
+        if (node->count == 0) {
+            printf("ERROR: empty node in the list\n");
+            errors++;
+        }
+        count += node->count;
+        len++;
+    }
+    if (count != ql->count || len != ql->len) {
+        printf("ERROR: count %lu/%lu, len %u/%u\n",count,ql->count,len,ql->len);
+        errors++;
+    }
+    return errors;
+}
+
+static long long entryValue(quicklistEntry *entry) {
+    char buf[32];
+
+    if (entry->value == NULL) return entry->longval;
+    memcpy(buf,entry->value,entry->sz);
+    buf[entry->sz] = '\0';
+    return strtoll(buf,NULL,10);
+}
+
+/* Count the compressed nodes and the total bytes they save. */
+static unsigned int compressedNodes(quicklist *ql, size_t *saved) {
+    quicklistNode *node;
+    unsigned int compressed = 0;
+    void *data;
+
+    *saved = 0;
+    for (node = ql->head; node; node = node->next) {
+        if (quicklistNodeIsCompressed(node)) {
+            compressed++;
+            *saved += node->sz - quicklistGetLzf(node,&data);
+        }
+    }
+    return compressed;
+}
+
+int main(int argc, char **argv) {
+    int fills[] = {-2, 1, 4, 32, 128};
+    int depths[] = {0, 1, 2, 4};
+    int f, d, errors = 0;
+    long long start;
+
+    (void)argc; (void)argv;
+    for (d = 0; d < (int)(sizeof(depths)/sizeof(depths[0])); d++)
+    for (f = 0; f < (int)(sizeof(fills)/sizeof(fills[0])); f++) {
+        quicklist *ql = quicklistNew(fills[f],depths[d]);
+        quicklistEntry entry;
+        quicklistIter *iter;
+        char buf[64];
+        long long i, len, expected;
+        size_t saved;
+
+        /* Push 0..999 at tail, -1..-1000 at head: [-1000, ..., 999].
+         * The values are padded so that the nodes are compressible. */
+        for (i = 0; i < 1000; i++) {
+            len = ll2string(buf,sizeof(buf),i);
+            memcpy(buf+len,"-aaaaaaaaaaaaaaaa",17);
+            quicklistPushTail(ql,buf,len+17);
+            len = ll2string(buf,sizeof(buf),-i-1);
+            memcpy(buf+len,"-aaaaaaaaaaaaaaaa",17);
+            quicklistPushHead(ql,buf,len+17);
+        }
+        errors += checkCounts(ql);
+        /* Nodes of a single entry are too small to be compressed. */
+        if (depths[d] && fills[f] != 1 &&
+            ql->len > (unsigned int)depths[d]*2 &&
+            compressedNodes(ql,&saved) == 0)
+        {
+            printf("ERROR: fill %d, depth %d, no node compressed\n",
+                fills[f],depths[d]);
+            errors++;
+        }
+
+        /* Index from both ends. */
+        for (i = 0; i < 2000; i++) {
+            if (!quicklistIndex(ql,i,&entry) || entryValue(&entry) != i-1000) {
+                printf("ERROR: fill %d, wrong element at %lld\n",fills[f],i);
+                errors++;
+            }
+            quicklistRecompressEntry(&entry);
+            if (!quicklistIndex(ql,-i-1,&entry) ||
+                entryValue(&entry) != 999-i) {
+                printf("ERROR: fill %d, wrong element at %lld\n",fills[f],-i-1);
+                errors++;
+            }
+            quicklistRecompressEntry(&entry);
+        }
+        errors += checkCounts(ql);
+
+        /* Insert after every element, then delete the originals. */
+        iter = quicklistGetIterator(ql,AL_START_HEAD);
+        i = 0;
+        while (quicklistNext(iter,&entry)) {
+            if (i++ % 2 == 0) {
+                quicklistInsertAfter(ql,&entry,(unsigned char*)"x",1);
+                quicklistReleaseIterator(iter);
+                iter = quicklistGetIteratorAtIdx(ql,AL_START_HEAD,i);
+            }
+        }
+        quicklistReleaseIterator(iter);
+        errors += checkCounts(ql);
+        iter = quicklistGetIterator(ql,AL_START_TAIL);
+        while (quicklistNext(iter,&entry))
+            if (entry.value && entry.sz == 1 && entry.value[0] == 'x')
+                quicklistDelEntry(iter,&entry);
+        quicklistReleaseIterator(iter);
+        errors += checkCounts(ql);
+
+        /* Trim to the positive elements and check the order. */
+        quicklistDelRange(ql,0,1000);
+        quicklistDelRange(ql,-100,100);
+        errors += checkCounts(ql);
+        iter = quicklistGetIterator(ql,AL_START_HEAD);
+        expected = 0;
+        while (quicklistNext(iter,&entry)) {
+            if (entryValue(&entry) != expected++) {
+                printf("ERROR: fill %d, wrong order after trim\n",fills[f]);
+                errors++;
+                break;
+            }
+        }
+        quicklistReleaseIterator(iter);
+        if (ql->count != 900) {
+            printf("ERROR: fill %d, count %lu after trim\n",fills[f],ql->count);
+            errors++;
+        }
+
+        /* Replace some elements, then pop everything from both ends,
+         * checking the compression invariants while the list shrinks. */
+        for (i = 0; i < 900; i += 7) {
+            len = ll2string(buf,sizeof(buf),i);
+            quicklistReplaceAtIndex(ql,i,buf,len);
+        }
+        errors += checkCounts(ql);
+        for (i = 0; i < 450; i++) {
+            unsigned char *data;
+            unsigned int sz;
+            long long sval;
+            int where;
+
+            for (where = 0; where < 2; where++) {
+                quicklistPop(ql,where ? QUICKLIST_TAIL : QUICKLIST_HEAD,
+                    &data,&sz,&sval);
+                entry.value = data;
+                entry.sz = sz;
+                entry.longval = sval;
+                if (entryValue(&entry) != (where ? 899-i : i)) {
+                    printf("ERROR: fill %d, wrong popped element\n",fills[f]);
+                    errors++;
+                }
+                zfree(data);
+            }
+            if (i % 16 == 0) errors += checkCounts(ql);
+        }
+        if (ql->count != 0 || ql->len != 0) {
+            printf("ERROR: fill %d, list not empty after pops\n",fills[f]);
+            errors++;
+        }
+        quicklistRelease(ql);
+    }
+
+    /* Push/pop benchmark. */
+    {
+        quicklist *ql = quicklistNew(-2,1);
+        unsigned int compressed;
+        size_t saved;
+        unsigned char *data;
+        unsigned int sz;
+        long long sval;
+        int i;
+
+        start = usec();
+        for (i = 0; i < 1000000; i++)
+            quicklistPushTail(ql,"hello world",11);
+        start = usec()-start;
+        compressed = compressedNodes(ql,&saved);
+        printf("1000000 tail pushes: %lld usec, %u nodes, "
+               "%u compressed saving %zu bytes\n",
+            start,ql->len,compressed,saved);
+        start = usec();
+        for (i = 0; i < 1000000; i++) {
+            quicklistPop(ql,QUICKLIST_HEAD,&data,&sz,&sval);
+            zfree(data);
+        }
+        printf("1000000 head pops: %lld usec\n",usec()-start);
+        quicklistRelease(ql);
+    }
+
+    printf("%s\n", errors ? "ERRORS FOUND" : "ALL TESTS PASSED");
+    return errors ? 1 : 0;
+}
+#endif
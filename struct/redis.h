@@ -60,7 +60,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "quicklist.h" /* Lists of ziplists */
+#include "listpack.h" /* Compact list without cascading updates */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmaps of integers */
+#include "zbtree.h"  /* B+tree for large sorted sets */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -120,6 +124,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define REDIS_DEFAULT_MAXMEMORY 0
 #define REDIS_DEFAULT_MAXMEMORY_SAMPLES 3
+#define REDIS_DEFAULT_MAXMEMORY_EVICTION_TIME_LIMIT 0 /* Microseconds, 0 = off */
+#define REDIS_DEFAULT_MAXMEMORY_OVERSHOOT_TOLERANCE 0 /* % of maxmemory. */
+#define REDIS_DEFAULT_LAZYFREE_LAZY_EVICTION 0
+#define REDIS_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
+#define REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define REDIS_DEFAULT_KEYSPACE_INLINE_EXPIRES 0
 #define REDIS_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define REDIS_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define REDIS_DEFAULT_AOF_LOAD_TRUNCATED 1
@@ -133,7 +143,6 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_MIN_RESERVED_FDS 32
 #define REDIS_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 
-#define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
@@ -197,6 +206,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define REDIS_ENCODING_INTSET 6  /* Encoded as intset */
 #define REDIS_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define REDIS_ENCODING_QUICKLIST 8 /* Encoded as linked list of ziplists */
+#define REDIS_ENCODING_LISTPACK 9 /* Encoded as listpack */
+#define REDIS_ENCODING_LISTPACK_INDEXED 10 /* Listpack with a field index */
+#define REDIS_ENCODING_ROARING 11 /* Encoded as roaring bitmap */
+#define REDIS_ENCODING_BTREE 12  /* Encoded as B+tree */
+#define REDIS_ENCODING_SPARSE 13 /* String encoded as sparse bitmap */
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -307,6 +322,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^32 elements */
 #define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
 
+/* Sorted set pop directions, see genericZpopCommand() */
+#define ZSET_MIN 0
+#define ZSET_MAX 1
+
 /* Append only defines */
 #define AOF_FSYNC_NO 0
 #define AOF_FSYNC_ALWAYS 1
@@ -316,15 +335,28 @@ typedef long long mstime_t; /* millisecond time type. */
 /* Zip structure related defaults */
 #define REDIS_HASH_MAX_ZIPLIST_ENTRIES 512
 #define REDIS_HASH_MAX_ZIPLIST_VALUE 64
+#define REDIS_HASH_LISTPACK_INDEX_ENTRIES 128
 #define REDIS_LIST_MAX_ZIPLIST_ENTRIES 512
 #define REDIS_LIST_MAX_ZIPLIST_VALUE 64
+#define REDIS_LIST_MAX_ZIPLIST_SIZE -2
+#define REDIS_LIST_COMPRESS_DEPTH 0
 #define REDIS_SET_MAX_INTSET_ENTRIES 512
+#define REDIS_DEFAULT_SET_ROARING 1
 #define REDIS_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define REDIS_ZSET_MAX_ZIPLIST_VALUE 64
+#define REDIS_DEFAULT_ZSET_BTREE 0
+
+/* Adaptive encoding thresholds defaults, see adaptive.c */
+#define REDIS_DEFAULT_ENCODING_ADAPTIVE 0
+#define REDIS_DEFAULT_ENCODING_ADAPTIVE_MIN_ENTRIES 16
+#define REDIS_DEFAULT_ENCODING_ADAPTIVE_MAX_ENTRIES 4096
 
 /* HyperLogLog defines */
 #define REDIS_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
 
+/* Bitmaps defines, see bitops.c */
+#define REDIS_DEFAULT_BITMAP_SPARSE_THRESHOLD (1024*1024) /* 1mb */
+
 /* Sets operations codes */
 #define REDIS_OP_UNION 0
 #define REDIS_OP_DIFF 1
@@ -337,7 +369,29 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_MAXMEMORY_ALLKEYS_LRU 3
 #define REDIS_MAXMEMORY_ALLKEYS_RANDOM 4
 #define REDIS_MAXMEMORY_NO_EVICTION 5
+#define REDIS_MAXMEMORY_VOLATILE_LFU 6
+#define REDIS_MAXMEMORY_ALLKEYS_LFU 7
 #define REDIS_DEFAULT_MAXMEMORY_POLICY REDIS_MAXMEMORY_VOLATILE_LRU
+#define REDIS_MAXMEMORY_IS_LFU(_p) ((_p) == REDIS_MAXMEMORY_VOLATILE_LFU || \
+                                    (_p) == REDIS_MAXMEMORY_ALLKEYS_LFU)
+
+/* LFU (Least Frequently Used) eviction. When an LFU policy is selected the
+ * 24 bits of the object 'lru' field are split into two parts:
+ *
+ *          16 bits      8 bits
+ *     +----------------+--------+
+ *     + Last decr time | LOG_C  |
+ *     +----------------+--------+
+ *
+ * LOG_C is a logarithmic access counter that saturates at 255, while the
+ * upper 16 bits hold the last time (in minutes, reduced modulo 2^16) the
+ * counter was decremented, so that keys that were hot in the past but are
+ * no longer accessed slowly lose their frequency. */
+#define REDIS_LFU_INIT_VAL 5    /* New keys start with a non-zero counter so
+                                   that they are not evicted before they have
+                                   a chance to accumulate accesses. */
+#define REDIS_DEFAULT_LFU_LOG_FACTOR 10
+#define REDIS_DEFAULT_LFU_DECAY_TIME 1  /* Minutes per counter decrement. */
 
 /* Scripting */
 #define REDIS_LUA_TIME_LIMIT 5000 /* milliseconds */
@@ -413,6 +467,24 @@ typedef struct redisObject {
     void *ptr;
 } robj;
 
+/* Objects released by the lazy free thread (see lazyfree.c) may share
+ * sub-objects with the main thread, so reference counting must be atomic
+ * in order to free objects asynchronously. When atomic operations are not
+ * available REDIS_ATOMIC_REFCOUNT is not defined and lazy freeing falls back
+ * to synchronous freeing. */
+#if defined(__ATOMIC_RELAXED)
+#define REDIS_ATOMIC_REFCOUNT
+#define refcountIncr(_o) __atomic_add_fetch(&(_o)->refcount,1,__ATOMIC_RELAXED)
+#define refcountDecr(_o) __atomic_sub_fetch(&(_o)->refcount,1,__ATOMIC_ACQ_REL)
+#elif defined(HAVE_ATOMIC)
+#define REDIS_ATOMIC_REFCOUNT
+#define refcountIncr(_o) __sync_add_and_fetch(&(_o)->refcount,1)
+#define refcountDecr(_o) __sync_sub_and_fetch(&(_o)->refcount,1)
+#else
+#define refcountIncr(_o) (++(_o)->refcount)
+#define refcountDecr(_o) (--(_o)->refcount)
+#endif
+
 /* Macro used to initialize a Redis object allocated on the stack.
  * Note that this macro is taken near the structure definition to make sure
  * we'll update it when the structure is changed, to avoid bugs like
@@ -424,9 +496,31 @@ typedef struct redisObject {
     _var.ptr = _ptr; \
 } while(0);
 
+/* To improve the quality of the LRU approximation we take a set of keys
+ * that are good candidate for eviction across freeMemoryIfNeeded() calls.
+ *
+ * Entries inside the eviction pool are taken ordered by idle time, putting
+ * greater idle times to the right (ascending order). The pool is global,
+ * so every entry also remembers the DB its key belongs to. */
+#define REDIS_EVICTION_POOL_SIZE 16
+struct evictionPoolEntry {
+    unsigned long long idle;    /* Object idle time (inverted LFU/TTL). */
+    sds key;                    /* Key name. */
+    int dbid;                   /* DB the key belongs to. */
+};
+
+/* When keyspace-inline-expires is enabled the expire time of keys is not
+ * stored in db->expires, that stays empty, but in the metadata of the entry
+ * of the key in the main dictionary, saving a dictEntry and a hash lookup
+ * for every volatile key, at the cost of 8 bytes for non volatile keys.
+ * A value <= 0 means the key has no expire set. The mode can only be
+ * selected at startup. The metadata is accessed with memcpy() since it
+ * is just an array of bytes, see dbGetInlineExpire() in db.c. */
+
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
+    struct zskiplist *expires_index; /* Volatile keys ordered by expire time */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
@@ -534,7 +628,7 @@ struct sharedObjectsStruct {
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
     *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *rpop, *lpop,
-    *lpush, *emptyscan, *minstring, *maxstring,
+    *lpush, *zpopmin, *zpopmax, *emptyscan, *minstring, *maxstring,
     *select[REDIS_SHARED_SELECT_CMDS],
     *integers[REDIS_SHARED_INTEGERS],
     *mbulkhdr[REDIS_SHARED_BULKHDR_LEN], /* "*<value>\r\n" */
@@ -646,13 +740,14 @@ struct redisServer {
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
-                        *rpopCommand;
+                        *rpopCommand, *zpopminCommand, *zpopmaxCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    size_t stat_eviction_overshoot_peak; /* Max bytes found over maxmemory. */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     size_t stat_peak_memory;        /* Max used memory record */
@@ -787,6 +882,19 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    struct evictionPoolEntry *eviction_pool; /* Global eviction candidates. */
+    long long maxmemory_eviction_time_limit; /* Max usec per eviction call. */
+    int maxmemory_overshoot_tolerance; /* % over maxmemory still writable. */
+    int eviction_pending;           /* Background eviction in progress. */
+    mstime_t eviction_pending_since; /* Background eviction start time. */
+    long long eviction_timer_id;    /* Background eviction time event ID. */
+    int lfu_log_factor;             /* LFU logarithmic counter factor. */
+    int lfu_decay_time;             /* LFU counter decay period in minutes. */
+    /* Lazy free */
+    int lazyfree_lazy_eviction;     /* Free evicted values in background. */
+    int lazyfree_lazy_expire;       /* Free expired values in background. */
+    int lazyfree_lazy_server_del;   /* Free implicitly deleted values in bg. */
+    int keyspace_inline_expires;    /* Store expires in the main dict entry. */
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
@@ -800,12 +908,22 @@ struct redisServer {
     /* Zip structure config, see redis.conf for more information  */
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
+    size_t hash_listpack_index_entries;
     size_t list_max_ziplist_entries;
     size_t list_max_ziplist_value;
+    int list_max_ziplist_size;
+    int list_compress_depth;
     size_t set_max_intset_entries;
+    int set_roaring;                /* Use roaring bitmaps for big intsets. */
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    int zset_btree;                 /* Use a B+tree for big sorted sets. */
+    int encoding_adaptive;          /* Tune the *-entries limits online. */
+    size_t encoding_adaptive_min_entries; /* Lower bound of tuned limits. */
+    size_t encoding_adaptive_max_entries; /* Upper bound of tuned limits. */
     size_t hll_sparse_max_bytes;
+    size_t bitmap_sparse_threshold; /* Zero bytes SETBIT can add to a raw
+                                       bitmap before it becomes sparse. */
     time_t unixtime;        /* Unix time sampled every cron cycle. */
     long long mstime;       /* Like 'unixtime' but with milliseconds resolution. */
     /* Pubsub */
@@ -884,14 +1002,14 @@ typedef struct {
     unsigned char encoding;
     unsigned char direction; /* Iteration direction */
     unsigned char *zi;
-    listNode *ln;
+    quicklistIter *iter;
 } listTypeIterator;
 
 /* Structure for an entry while iterating over a list. */
 typedef struct {
     listTypeIterator *li;
-    unsigned char *zi;  /* Entry in ziplist */
-    listNode *ln;       /* Entry in linked list */
+    unsigned char *zi;      /* Entry in ziplist */
+    quicklistEntry entry;   /* Entry in quicklist */
 } listTypeEntry;
 
 /* Structure to hold set iteration abstraction. */
@@ -900,6 +1018,7 @@ typedef struct {
     int encoding;
     int ii; /* intset iterator */
     dictIterator *di;
+    roaringIterator ri; /* roaring bitmap iterator */
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -916,6 +1035,33 @@ typedef struct {
     dictEntry *de;
 } hashTypeIterator;
 
+/* Listpack encoded hashes with at least hash-listpack-index-entries fields
+ * use the REDIS_ENCODING_LISTPACK_INDEXED encoding: the object points to
+ * this structure, that holds the listpack and an open addressing table
+ * mapping the hash of every field to its offset inside the listpack, so
+ * that lookups don't need to scan and compare every field.
+ *
+ * The table has 'size' slots (a power of two), every slot is made of the
+ * offset of the field (0 means empty slot, since no entry can start inside
+ * the listpack header) and, stored after all the offsets, one byte taken
+ * from the field hash, checked before comparing the field itself. */
+typedef struct hashListpackIndex {
+    unsigned char *lp;  /* The listpack with the fields and values. */
+    uint32_t size;      /* Number of slots. */
+    uint32_t used;      /* Number of fields indexed. */
+    uint32_t offsets[]; /* 'size' offsets followed by 'size' hash bytes. */
+} hashListpackIndex;
+
+/* Strings used as bitmaps that are mostly made of zero bytes use the
+ * REDIS_ENCODING_SPARSE encoding: the object points to this structure, that
+ * holds the offsets of the bits set to one in a roaring bitmap, and the
+ * length of the string, since the bytes after the last bit set are part of
+ * the string as well. See bitops.c. */
+typedef struct sparseBitmap {
+    roaring *bits;      /* Offsets of the bits set. */
+    size_t len;         /* Length of the string in bytes. */
+} sparseBitmap;
+
 #define REDIS_HASH_KEY 1
 #define REDIS_HASH_VALUE 2
 
@@ -928,6 +1074,7 @@ extern struct sharedObjectsStruct shared;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType dbDictType;
+extern dictType keyptrDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
@@ -944,6 +1091,9 @@ void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+sds sparseBitmapToSds(sparseBitmap *sb);
+sds sparseBitmapRangeToSds(sparseBitmap *sb, size_t start, size_t end);
+void bitmapTypeConvert(robj *o, int enc);
 void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
@@ -960,6 +1110,7 @@ void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
+size_t zmalloc_size_sds(sds s);
 void addReplyBulk(redisClient *c, robj *obj);
 void addReplyBulkCString(redisClient *c, char *s);
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len);
@@ -981,6 +1132,7 @@ sds catClientInfoString(sds s, redisClient *client);
 sds getAllClientsInfoString(void);
 void rewriteClientCommandVector(redisClient *c, int argc, ...);
 void rewriteClientCommandArgument(redisClient *c, int i, robj *newval);
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv);
 unsigned long getClientOutputBufferMemoryUsage(redisClient *c);
 void freeClientsInAsyncFreeQueue(void);
 void asyncCloseClientOnOutputBufferLimitReached(redisClient *c);
@@ -1015,9 +1167,11 @@ int listTypeEqual(listTypeEntry *entry, robj *o);
 void listTypeDelete(listTypeEntry *entry);
 void listTypeConvert(robj *subject, int enc);
 void unblockClientWaitingData(redisClient *c);
-void handleClientsBlockedOnLists(void);
+void handleClientsBlockedOnKeys(void);
 void popGenericCommand(redisClient *c, int where);
-void signalListAsReady(redisDb *db, robj *key);
+void signalKeyAsReady(redisDb *db, robj *key);
+void blockForKeys(redisClient *c, robj **keys, int numkeys, time_t timeout, robj *target);
+int getTimeoutFromObjectOrReply(redisClient *c, robj *object, time_t *timeout);
 
 /* MULTI/EXEC/WATCH... */
 void unwatchAllKeys(redisClient *c);
@@ -1048,13 +1202,16 @@ robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
-robj *createListObject(void);
-robj *createZiplistObject(void);
+robj *createQuicklistObject(void);
+robj *createListpackObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createRoaringSetObject(void);
+robj *createSparseBitmapObject(size_t len);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
+robj *createZsetBtreeObject(void);
 int getLongFromObjectOrReply(redisClient *c, robj *o, long *target, const char *msg);
 int checkType(redisClient *c, robj *o, int type);
 int getLongLongFromObjectOrReply(redisClient *c, robj *o, long long *target, const char *msg);
@@ -1099,6 +1256,20 @@ void stopLoading(void);
 /* RDB persistence */
 #include "rdb.h"
 
+/* The object types defined in rdb.c, after the ones of version 6, are only
+ * known by this implementation. Other Redis implementations assign the
+ * versions from 7 onward to their own formats. So the version used here is
+ * far away from any of them, and they refuse the files and the DUMP
+ * payloads that may hold the new types instead of misreading them. For the
+ * same reason the versions between 6 and REDIS_RDB_VERSION are refused,
+ * while the older ones can still be loaded. */
+#undef REDIS_RDB_VERSION
+#define REDIS_RDB_VERSION 1000
+#define REDIS_RDB_COMPAT_VERSION 6
+#define rdbIsSupportedVersion(v) (((v) >= 1 && \
+                                   (v) <= REDIS_RDB_COMPAT_VERSION) || \
+                                  (v) == REDIS_RDB_VERSION)
+
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
@@ -1130,15 +1301,33 @@ void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
 unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score);
 int zslDelete(zskiplist *zsl, double score, robj *obj);
+void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update);
+void zslFreeNode(zskiplistNode *node);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
+zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+zskiplistNode *zslSkipNodes(zskiplist *zsl, zskiplistNode *ln, long offset, int reverse);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
+unsigned long zbtCountInRange(zbtree *zbt, zrangespec *range, unsigned long *start);
+unsigned long zbtCountInLexRange(zbtree *zbt, zlexrangespec *range, unsigned long *start);
+int zbtFindObject(zbtree *zbt, robj *ele, double *score);
+sds zbtNewMember(robj *ele);
 unsigned int zsetLength(robj *zobj);
+int zsetTest(int argc, char **argv);
 void zsetConvert(robj *zobj, int encoding);
+void genericZpopCommand(redisClient *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
 
 /* Core functions */
 int freeMemoryIfNeeded(void);
+struct evictionPoolEntry *evictionPoolAlloc(void);
+size_t getMaxmemoryUsedMemory(void);
+size_t getEvictionOvershoot(void);
+long long getEvictionLag(void);
+unsigned long LFUGetTimeInMinutes(void);
+unsigned char LFULogIncr(unsigned char counter);
+unsigned long LFUDecrAndReturn(robj *o);
+void updateLFU(robj *o);
 int processCommand(redisClient *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
@@ -1193,13 +1382,42 @@ unsigned long hashTypeLength(robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst);
 robj *hashTypeCurrentObject(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(redisClient *c, robj *key);
+unsigned char *hashTypeListpack(robj *o);
+void hashTypeTryIndex(robj *o);
+void hashTypeFreeIndexed(robj *o);
+int hashTest(int argc, char **argv);
+
+/* adaptive.c -- Adaptive compact encoding thresholds */
+#define REDIS_ADAPTIVE_HASH 0
+#define REDIS_ADAPTIVE_LIST 1
+#define REDIS_ADAPTIVE_SET 2
+#define REDIS_ADAPTIVE_ZSET 3
+#define REDIS_ADAPTIVE_TYPES 4
+
+/* State of a command sampled by the adaptive encoding logic, filled by
+ * adaptiveEncodingSampleBegin() before the command is executed. */
+typedef struct adaptiveSample {
+    int type;           /* REDIS_ADAPTIVE_* type of the first key. */
+    int compact;        /* True if the value uses the compact encoding. */
+    size_t len;         /* Number of elements of the value. */
+    size_t bytes;       /* Bytes used by the compact representation. */
+} adaptiveSample;
+
+void adaptiveEncodingInit(void);
+void adaptiveEncodingSetEnabled(int enabled);
+void adaptiveEncodingSetThreshold(int type, size_t value);
+size_t adaptiveEncodingConfiguredThreshold(int type);
+int adaptiveEncodingSampleBegin(redisClient *c, adaptiveSample *s);
+void adaptiveEncodingSampleEnd(adaptiveSample *s, long long duration);
+void adaptiveEncodingCron(void);
+sds genAdaptiveEncodingInfoString(sds info);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(redisClient *c, int notify);
@@ -1227,6 +1445,11 @@ void propagateExpire(redisDb *db, robj *key);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(redisDb *db, robj *key, long long when);
+long long getExpireFromEntry(redisDb *db, dictEntry *de);
+int dbDeleteExpire(redisDb *db, sds key);
+void expireIndexEmpty(redisDb *db);
+struct zskiplist *expireIndexDetach(redisDb *db);
+unsigned long expireIndexDueCount(redisDb *db, long long now);
 robj *lookupKey(redisDb *db, robj *key);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
@@ -1238,6 +1461,7 @@ void setKey(redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
+int dbSyncDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 long long emptyDb(void(callback)(void*));
 int selectDb(redisClient *c, int id);
@@ -1247,6 +1471,16 @@ unsigned int GetKeysInSlot(unsigned int hashslot, robj **keys, unsigned int coun
 void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(redisClient *c, robj *o, unsigned long *cursor);
 
+/* lazyfree.c -- Background release of objects and databases */
+int dbAsyncDelete(redisDb *db, robj *key);
+long long emptyDbAsync(redisDb *db);
+void freeObjAsync(robj *o);
+size_t lazyfreeGetFreeEffort(robj *obj);
+size_t lazyfreeEstimateObjectSize(robj *o);
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t size);
+void lazyfreeFreeDictFromBioThread(dict *d, size_t size);
+unsigned long long lazyfreeGetPendingObjectsCount(void);
+
 /* API to get key arguments from commands */
 #define REDIS_GETKEYS_ALL 0
 #define REDIS_GETKEYS_PRELOAD 1
@@ -1255,6 +1489,7 @@ void getKeysFreeResult(int *result);
 int *noPreloadGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags);
 int *renameGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags);
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags);
+int *intercardGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys, int flags);
 
 /* Sentinel */
 void initSentinelConfig(void);
@@ -1282,6 +1517,7 @@ void setexCommand(redisClient *c);
 void psetexCommand(redisClient *c);
 void getCommand(redisClient *c);
 void delCommand(redisClient *c);
+void unlinkCommand(redisClient *c);
 void existsCommand(redisClient *c);
 void setbitCommand(redisClient *c);
 void getbitCommand(redisClient *c);
@@ -1326,6 +1562,7 @@ void scardCommand(redisClient *c);
 void spopCommand(redisClient *c);
 void srandmemberCommand(redisClient *c);
 void sinterCommand(redisClient *c);
+void sinterCardCommand(redisClient *c);
 void sinterstoreCommand(redisClient *c);
 void sunionCommand(redisClient *c);
 void sunionstoreCommand(redisClient *c);
@@ -1389,6 +1626,11 @@ void hlenCommand(redisClient *c);
 void zremrangebyrankCommand(redisClient *c);
 void zunionstoreCommand(redisClient *c);
 void zinterstoreCommand(redisClient *c);
+void zinterCardCommand(redisClient *c);
+void zpopminCommand(redisClient *c);
+void zpopmaxCommand(redisClient *c);
+void bzpopminCommand(redisClient *c);
+void bzpopmaxCommand(redisClient *c);
 void zscanCommand(redisClient *c);
 void hkeysCommand(redisClient *c);
 void hvalsCommand(redisClient *c);
@@ -1418,6 +1660,7 @@ void timeCommand(redisClient *c);
 void bitopCommand(redisClient *c);
 void bitcountCommand(redisClient *c);
 void bitposCommand(redisClient *c);
+void bitfieldCommand(redisClient *c);
 void replconfCommand(redisClient *c);
 void pfselftestCommand(redisClient *c);
 void pfaddCommand(redisClient *c);
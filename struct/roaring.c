@@ -0,0 +1,1510 @@
+/* Roaring bitmaps: compressed sets of 64 bit integers.
+ *
+ * The value space is split into chunks of 65536 integers: the high 48 bits
+ * of a value select the chunk, the low 16 bits the position inside it.
+ * Every non empty chunk is stored into a "container" and the containers are
+ * kept in an array ordered by chunk (the container "key"), so that a value
+ * is located with a binary search on the keys followed by a lookup inside a
+ * single container.
+ *
+ * A container uses one of three representations, selected according to the
+ * density of the chunk:
+ *
+ * ARRAY: a sorted array of 16 bit integers, used for sparse chunks holding
+ *        up to ROARING_ARRAY_MAX values (2 bytes per value).
+ * BITMAP: a plain bitmap of 65536 bits (8k bytes), used for dense chunks.
+ * RUN: an array of runs of consecutive values, every run is a start value
+ *      and a length (4 bytes per run), used when the values are clustered.
+ *
+ * Run containers are created by roaringOptimize() and when the result of a
+ * set operation is computed, since runs are expensive to detect on every
+ * insertion. Values can however be added and removed from run containers,
+ * that are converted to other representations if they stop being the most
+ * compact one.
+ *
+ * In order for the ordering of the containers to follow the ordering of
+ * signed integers, values are stored with the sign bit flipped ("biased").
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include "redisassert.h"
+
+#define ROARING_ARRAY 0
+#define ROARING_BITMAP 1
+#define ROARING_RUN 2
+
+#define ROARING_ARRAY_MAX 4096      /* Max values of an array container. */
+#define ROARING_BITMAP_WORDS 1024   /* 65536 bits. */
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS*sizeof(uint64_t))
+
+/* A run covers the values from 'start' to 'start+len' included. */
+typedef struct roaringRun {
+    uint16_t start;
+    uint16_t len;
+} roaringRun;
+
+struct roaringContainer {
+    uint64_t key;       /* High 48 bits of the biased values. */
+    uint32_t card;      /* Number of values, from 1 to 65536. */
+    uint32_t n;         /* Number of runs (run containers only). */
+    uint32_t alloc;     /* Allocated array elements or runs. */
+    uint8_t type;       /* ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN. */
+    void *data;
+};
+
+#if defined(__GNUC__)
+#define roaringPopcount(w) __builtin_popcountll(w)
+#define roaringLowestBit(w) __builtin_ctzll(w)
+#else
+static int roaringPopcount(uint64_t w) {
+    int count = 0;
+    while (w) { w &= w-1; count++; }
+    return count;
+}
+static int roaringLowestBit(uint64_t w) {
+    int j = 0;
+    while (!(w & 1)) { w >>= 1; j++; }
+    return j;
+}
+#endif
+
+static uint64_t roaringBias(int64_t v) {
+    return ((uint64_t)v) ^ (1ULL<<63);
+}
+
+static int64_t roaringUnbias(uint64_t u) {
+    return (int64_t)(u ^ (1ULL<<63));
+}
+
+/* -----------------------------------------------------------------------------
+ * Containers
+ * -------------------------------------------------------------------------- */
+
+/* Return the index of the first element of the array not smaller than 'v',
+ * setting '*found' to 1 if it is equal to 'v'. */
+static uint32_t arrayLowerBound(uint16_t *a, uint32_t n, uint16_t v, int *found) {
+    uint32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (a[mid] < v) lo = mid+1; else hi = mid;
+    }
+    if (found) *found = (lo < n && a[lo] == v);
+    return lo;
+}
+
+/* Return the index of the last run starting at or before 'v', or -1 if all
+ * the runs start after 'v'. */
+static long runLast(roaringRun *runs, uint32_t n, uint16_t v) {
+    long lo = 0, hi = (long)n-1, res = -1;
+
+    while (lo <= hi) {
+        long mid = lo+(hi-lo)/2;
+        if (runs[mid].start <= v) {
+            res = mid;
+            lo = mid+1;
+        } else {
+            hi = mid-1;
+        }
+    }
+    return res;
+}
+
+/* Set or clear the bits from 'lo' to 'hi' included. */
+static void bitmapSetRange(uint64_t *w, uint32_t lo, uint32_t hi, int set) {
+    uint32_t fw = lo >> 6, lw = hi >> 6, j;
+    uint64_t fm = ~0ULL << (lo & 63), lm = ~0ULL >> (63 - (hi & 63));
+
+    if (fw == lw) fm &= lm;
+    if (set) w[fw] |= fm; else w[fw] &= ~fm;
+    if (fw == lw) return;
+    for (j = fw+1; j < lw; j++) w[j] = set ? ~0ULL : 0;
+    if (set) w[lw] |= lm; else w[lw] &= ~lm;
+}
+
+static uint32_t bitmapCardinality(uint64_t *w) {
+    uint32_t j, card = 0;
+
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++) card += roaringPopcount(w[j]);
+    return card;
+}
+
+static size_t containerBytes(roaringContainer *c) {
+    if (c->type == ROARING_BITMAP) return ROARING_BITMAP_BYTES;
+    if (c->type == ROARING_RUN) return c->alloc*sizeof(roaringRun);
+    return c->alloc*sizeof(uint16_t);
+}
+
+static int containerContains(roaringContainer *c, uint16_t v) {
+    if (c->type == ROARING_ARRAY) {
+        int found;
+        arrayLowerBound(c->data,c->card,v,&found);
+        return found;
+    } else if (c->type == ROARING_BITMAP) {
+        return (((uint64_t*)c->data)[v >> 6] >> (v & 63)) & 1;
+    } else {
+        roaringRun *runs = c->data;
+        long j = runLast(runs,c->n,v);
+        return j >= 0 && v <= (uint32_t)runs[j].start+runs[j].len;
+    }
+}
+
+/* Write the bitmap representation of the container into 'w'. */
+static void containerFillWords(roaringContainer *c, uint64_t *w) {
+    uint32_t j;
+
+    if (c->type == ROARING_BITMAP) {
+        memcpy(w,c->data,ROARING_BITMAP_BYTES);
+        return;
+    }
+    memset(w,0,ROARING_BITMAP_BYTES);
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        for (j = 0; j < c->card; j++) w[a[j] >> 6] |= 1ULL << (a[j] & 63);
+    } else {
+        roaringRun *runs = c->data;
+        for (j = 0; j < c->n; j++)
+            bitmapSetRange(w,runs[j].start,
+                           (uint32_t)runs[j].start+runs[j].len,1);
+    }
+}
+
+/* Like containerFillWords() but avoids the copy for bitmap containers:
+ * the returned pointer is either the container data or 'buf'. */
+static uint64_t *containerWords(roaringContainer *c, uint64_t *buf) {
+    if (c->type == ROARING_BITMAP) return c->data;
+    containerFillWords(c,buf);
+    return buf;
+}
+
+/* Write the values of the container, in ascending order, into 'a'. */
+static void containerFillArray(roaringContainer *c, uint16_t *a) {
+    uint32_t j, k = 0;
+
+    if (c->type == ROARING_ARRAY) {
+        memcpy(a,c->data,c->card*sizeof(uint16_t));
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data;
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            uint64_t word = w[j];
+            while (word) {
+                a[k++] = j*64 + roaringLowestBit(word);
+                word &= word-1;
+            }
+        }
+    } else {
+        roaringRun *runs = c->data;
+        for (j = 0; j < c->n; j++) {
+            uint32_t v, end = (uint32_t)runs[j].start+runs[j].len;
+            for (v = runs[j].start; v <= end; v++) a[k++] = v;
+        }
+    }
+}
+
+/* Return the number of runs needed to represent the container. */
+static uint32_t containerRunCount(roaringContainer *c) {
+    uint32_t j, runs = 0;
+
+    if (c->type == ROARING_RUN) {
+        return c->n;
+    } else if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        for (j = 0; j < c->card; j++)
+            if (j == 0 || a[j] != a[j-1]+1) runs++;
+    } else {
+        uint64_t *w = c->data, carry = 0;
+        /* A run starts at every set bit whose previous bit is clear. */
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            runs += roaringPopcount(w[j] & ~((w[j] << 1) | carry));
+            carry = w[j] >> 63;
+        }
+    }
+    return runs;
+}
+
+static void containerToBitmap(roaringContainer *c) {
+    uint64_t *w = zmalloc(ROARING_BITMAP_BYTES);
+
+    containerFillWords(c,w);
+    zfree(c->data);
+    c->data = w;
+    c->type = ROARING_BITMAP;
+    c->n = c->alloc = 0;
+}
+
+static void containerToArray(roaringContainer *c) {
+    uint16_t *a = zmalloc(c->card*sizeof(uint16_t));
+
+    containerFillArray(c,a);
+    zfree(c->data);
+    c->data = a;
+    c->type = ROARING_ARRAY;
+    c->alloc = c->card;
+    c->n = 0;
+}
+
+static void containerToRun(roaringContainer *c, uint32_t nruns) {
+    roaringRun *runs = zmalloc(nruns*sizeof(roaringRun));
+    uint16_t *a = zmalloc(c->card*sizeof(uint16_t));
+    uint32_t j, k = 0;
+
+    containerFillArray(c,a);
+    for (j = 0; j < c->card; j++) {
+        if (j == 0 || a[j] != a[j-1]+1) {
+            runs[k].start = a[j];
+            runs[k].len = 0;
+            k++;
+        } else {
+            runs[k-1].len++;
+        }
+    }
+    zfree(a);
+    zfree(c->data);
+    c->data = runs;
+    c->type = ROARING_RUN;
+    c->n = c->alloc = nruns;
+}
+
+/* Convert the container to the most compact representation. */
+static void containerOptimize(roaringContainer *c) {
+    uint32_t nruns = containerRunCount(c);
+    size_t runbytes = nruns*sizeof(roaringRun);
+    size_t arraybytes = (c->card <= ROARING_ARRAY_MAX) ?
+                        c->card*sizeof(uint16_t) : (size_t)-1;
+
+    if (runbytes < arraybytes && runbytes < ROARING_BITMAP_BYTES) {
+        if (c->type != ROARING_RUN || c->alloc != c->n)
+            containerToRun(c,nruns);
+    } else if (arraybytes <= ROARING_BITMAP_BYTES) {
+        if (c->type != ROARING_ARRAY || c->alloc != c->card)
+            containerToArray(c);
+    } else if (c->type != ROARING_BITMAP) {
+        containerToBitmap(c);
+    }
+}
+
+/* After a run container was modified, convert it if runs are no longer the
+ * most compact representation. */
+static void runCheckSize(roaringContainer *c) {
+    size_t runbytes = c->n*sizeof(roaringRun);
+
+    if (runbytes > ROARING_BITMAP_BYTES ||
+        (c->card <= ROARING_ARRAY_MAX && runbytes > c->card*sizeof(uint16_t)))
+    {
+        containerOptimize(c);
+    }
+}
+
+/* Make room for one more run at position 'pos'. */
+static void runInsertAt(roaringContainer *c, uint32_t pos, uint16_t start, uint16_t len) {
+    roaringRun *runs;
+
+    if (c->n == c->alloc) {
+        c->alloc = c->alloc ? c->alloc*2 : 4;
+        c->data = zrealloc(c->data,c->alloc*sizeof(roaringRun));
+    }
+    runs = c->data;
+    memmove(runs+pos+1,runs+pos,(c->n-pos)*sizeof(roaringRun));
+    runs[pos].start = start;
+    runs[pos].len = len;
+    c->n++;
+}
+
+static void runDeleteAt(roaringContainer *c, uint32_t pos) {
+    roaringRun *runs = c->data;
+
+    memmove(runs+pos,runs+pos+1,(c->n-pos-1)*sizeof(roaringRun));
+    c->n--;
+}
+
+/* Add 'v' to the container. Return 1 if the value was added, 0 if it was
+ * already there. */
+static int containerAdd(roaringContainer *c, uint16_t v) {
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        int found;
+        uint32_t pos = arrayLowerBound(a,c->card,v,&found);
+
+        if (found) return 0;
+        if (c->card == ROARING_ARRAY_MAX) {
+            containerToBitmap(c);
+            return containerAdd(c,v);
+        }
+        if (c->card == c->alloc) {
+            c->alloc = c->alloc ? c->alloc*2 : 4;
+            if (c->alloc > ROARING_ARRAY_MAX) c->alloc = ROARING_ARRAY_MAX;
+            a = c->data = zrealloc(c->data,c->alloc*sizeof(uint16_t));
+        }
+        memmove(a+pos+1,a+pos,(c->card-pos)*sizeof(uint16_t));
+        a[pos] = v;
+        c->card++;
+        return 1;
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data, bit = 1ULL << (v & 63);
+
+        if (w[v >> 6] & bit) return 0;
+        w[v >> 6] |= bit;
+        c->card++;
+        return 1;
+    } else {
+        roaringRun *runs = c->data;
+        long j = runLast(runs,c->n,v);
+        int prev, next;
+
+        if (j >= 0 && v <= (uint32_t)runs[j].start+runs[j].len) return 0;
+        prev = j >= 0 && (uint32_t)runs[j].start+runs[j].len+1 == v;
+        next = j+1 < (long)c->n && runs[j+1].start == (uint32_t)v+1;
+        if (prev && next) {
+            runs[j].len += runs[j+1].len + 2;
+            runDeleteAt(c,j+1);
+        } else if (prev) {
+            runs[j].len++;
+        } else if (next) {
+            runs[j+1].start--;
+            runs[j+1].len++;
+        } else {
+            runInsertAt(c,j+1,v,0);
+        }
+        c->card++;
+        runCheckSize(c);
+        return 1;
+    }
+}
+
+/* Remove 'v' from the container. Return 1 if the value was removed, 0 if it
+ * was not there. */
+static int containerRemove(roaringContainer *c, uint16_t v) {
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        int found;
+        uint32_t pos = arrayLowerBound(a,c->card,v,&found);
+
+        if (!found) return 0;
+        memmove(a+pos,a+pos+1,(c->card-pos-1)*sizeof(uint16_t));
+        c->card--;
+        if (c->card && c->card < c->alloc/4) {
+            c->alloc /= 2;
+            c->data = zrealloc(c->data,c->alloc*sizeof(uint16_t));
+        }
+        return 1;
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data, bit = 1ULL << (v & 63);
+
+        if (!(w[v >> 6] & bit)) return 0;
+        w[v >> 6] &= ~bit;
+        c->card--;
+        /* Convert back to an array only when the container is well below
+         * the array limit, so that adding and removing the same value does
+         * not convert the container back and forth. */
+        if (c->card && c->card <= ROARING_ARRAY_MAX/2) containerToArray(c);
+        return 1;
+    } else {
+        roaringRun *runs = c->data;
+        long j = runLast(runs,c->n,v);
+        uint32_t start, end;
+
+        if (j < 0) return 0;
+        start = runs[j].start;
+        end = start+runs[j].len;
+        if (v > end) return 0;
+        if (start == end) {
+            runDeleteAt(c,j);
+        } else if (v == start) {
+            runs[j].start++;
+            runs[j].len--;
+        } else if (v == end) {
+            runs[j].len--;
+        } else {
+            runs[j].len = v-start-1;
+            runInsertAt(c,j+1,v+1,end-v-1);
+        }
+        c->card--;
+        if (c->card) runCheckSize(c);
+        return 1;
+    }
+}
+
+/* Return the value with the specified rank (0 based) in the container. */
+static uint16_t containerSelect(roaringContainer *c, uint32_t rank) {
+    uint32_t j;
+
+    if (c->type == ROARING_ARRAY) {
+        return ((uint16_t*)c->data)[rank];
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data;
+
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            uint32_t count = roaringPopcount(w[j]);
+            uint64_t word = w[j];
+
+            if (rank >= count) {
+                rank -= count;
+                continue;
+            }
+            while (rank--) word &= word-1;
+            return j*64 + roaringLowestBit(word);
+        }
+    } else {
+        roaringRun *runs = c->data;
+
+        for (j = 0; j < c->n; j++) {
+            if (rank <= runs[j].len) return runs[j].start+rank;
+            rank -= runs[j].len+1;
+        }
+    }
+    assert(NULL); /* Rank out of range. */
+    return 0;
+}
+
+/* Return the number of values of the container not greater than 'v'. */
+static uint32_t containerRank(roaringContainer *c, uint16_t v) {
+    uint32_t j, rank = 0;
+
+    if (c->type == ROARING_ARRAY) {
+        int found;
+
+        rank = arrayLowerBound(c->data,c->card,v,&found);
+        return rank+found;
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data;
+
+        for (j = 0; j < (uint32_t)(v >> 6); j++) rank += roaringPopcount(w[j]);
+        return rank + roaringPopcount(w[v >> 6] & (~0ULL >> (63-(v & 63))));
+    } else {
+        roaringRun *runs = c->data;
+
+        for (j = 0; j < c->n && runs[j].start <= v; j++) {
+            uint32_t end = (uint32_t)runs[j].start+runs[j].len;
+            rank += ((end < v) ? end : v) - runs[j].start + 1;
+        }
+        return rank;
+    }
+}
+
+/* Return the smallest value not smaller than 'v' that is not in the
+ * container, or 65536 if all of them are. */
+static uint32_t containerNextMissing(roaringContainer *c, uint16_t v) {
+    uint32_t next = v;
+
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        uint32_t j = arrayLowerBound(a,c->card,v,NULL);
+
+        while (j < c->card && a[j] == next) {
+            j++;
+            next++;
+        }
+        return next;
+    } else if (c->type == ROARING_BITMAP) {
+        uint64_t *w = c->data;
+        uint32_t j = v >> 6;
+        uint64_t word = ~w[j] & (~0ULL << (v & 63));
+
+        while (!word) {
+            if (++j == ROARING_BITMAP_WORDS) return 65536;
+            word = ~w[j];
+        }
+        return j*64 + roaringLowestBit(word);
+    } else {
+        roaringRun *runs = c->data;
+        long j = runLast(runs,c->n,v);
+
+        /* Runs are never adjacent: the value after a run is missing. */
+        if (j >= 0 && v <= (uint32_t)runs[j].start+runs[j].len)
+            next = (uint32_t)runs[j].start+runs[j].len+1;
+        return next;
+    }
+}
+
+static void containerDup(roaringContainer *dst, roaringContainer *src) {
+    size_t bytes = containerBytes(src);
+
+    *dst = *src;
+    dst->data = zmalloc(bytes);
+    memcpy(dst->data,src->data,bytes);
+}
+
+/* Set 'out' to a container with the specified key and bitmap, converting it
+ * to an array if the number of values is small enough. The 'w' bitmap is
+ * owned by the container after the call, or freed if it is empty. */
+static void containerFromWords(roaringContainer *out, uint64_t key, uint64_t *w) {
+    out->key = key;
+    out->type = ROARING_BITMAP;
+    out->data = w;
+    out->n = out->alloc = 0;
+    out->card = bitmapCardinality(w);
+    if (out->card == 0) {
+        zfree(w);
+        out->data = NULL;
+    } else if (out->card <= ROARING_ARRAY_MAX) {
+        containerToArray(out);
+    }
+}
+
+static void containerAnd(roaringContainer *a, roaringContainer *b, roaringContainer *out) {
+    uint64_t bufa[ROARING_BITMAP_WORDS], bufb[ROARING_BITMAP_WORDS];
+
+    out->key = a->key;
+    out->n = 0;
+    if (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY) {
+        roaringContainer *s, *o;
+        uint16_t *sa, *res;
+        uint32_t j, k = 0;
+
+        /* Probe the values of the smallest array into the other
+         * container. */
+        if (a->type == ROARING_ARRAY &&
+            (b->type != ROARING_ARRAY || a->card <= b->card))
+        {
+            s = a; o = b;
+        } else {
+            s = b; o = a;
+        }
+        sa = s->data;
+        res = zmalloc(s->card*sizeof(uint16_t));
+        if (o->type == ROARING_ARRAY) {
+            uint16_t *oa = o->data;
+            uint32_t i = 0;
+
+            for (j = 0; j < s->card && i < o->card; j++) {
+                while (i < o->card && oa[i] < sa[j]) i++;
+                if (i < o->card && oa[i] == sa[j]) res[k++] = sa[j];
+            }
+        } else {
+            for (j = 0; j < s->card; j++)
+                if (containerContains(o,sa[j])) res[k++] = sa[j];
+        }
+        out->type = ROARING_ARRAY;
+        out->data = res;
+        out->card = out->alloc = k;
+        if (k == 0) {
+            zfree(res);
+            out->data = NULL;
+        }
+    } else {
+        uint64_t *wa = containerWords(a,bufa), *wb = containerWords(b,bufb);
+        uint64_t *w = zmalloc(ROARING_BITMAP_BYTES);
+        uint32_t j;
+
+        for (j = 0; j < ROARING_BITMAP_WORDS; j++) w[j] = wa[j] & wb[j];
+        containerFromWords(out,a->key,w);
+    }
+}
+
+static void containerOr(roaringContainer *a, roaringContainer *b, roaringContainer *out) {
+    uint64_t buf[ROARING_BITMAP_WORDS];
+
+    out->key = a->key;
+    out->n = 0;
+    if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY &&
+        a->card+b->card <= ROARING_ARRAY_MAX)
+    {
+        uint16_t *aa = a->data, *ba = b->data;
+        uint16_t *res = zmalloc((a->card+b->card)*sizeof(uint16_t));
+        uint32_t i = 0, j = 0, k = 0;
+
+        while (i < a->card && j < b->card) {
+            if (aa[i] < ba[j]) res[k++] = aa[i++];
+            else if (aa[i] > ba[j]) res[k++] = ba[j++];
+            else { res[k++] = aa[i++]; j++; }
+        }
+        while (i < a->card) res[k++] = aa[i++];
+        while (j < b->card) res[k++] = ba[j++];
+        out->type = ROARING_ARRAY;
+        out->data = res;
+        out->card = k;
+        out->alloc = a->card+b->card;
+    } else {
+        uint64_t *w = zmalloc(ROARING_BITMAP_BYTES), *wb;
+        uint32_t j;
+
+        containerFillWords(a,w);
+        if (b->type == ROARING_ARRAY) {
+            uint16_t *ba = b->data;
+            for (j = 0; j < b->card; j++) w[ba[j] >> 6] |= 1ULL << (ba[j] & 63);
+        } else {
+            wb = containerWords(b,buf);
+            for (j = 0; j < ROARING_BITMAP_WORDS; j++) w[j] |= wb[j];
+        }
+        containerFromWords(out,a->key,w);
+    }
+}
+
+static void containerAndNot(roaringContainer *a, roaringContainer *b, roaringContainer *out) {
+    uint64_t buf[ROARING_BITMAP_WORDS];
+
+    out->key = a->key;
+    out->n = 0;
+    if (a->type == ROARING_ARRAY) {
+        uint16_t *aa = a->data, *res = zmalloc(a->card*sizeof(uint16_t));
+        uint32_t j, k = 0;
+
+        for (j = 0; j < a->card; j++)
+            if (!containerContains(b,aa[j])) res[k++] = aa[j];
+        out->type = ROARING_ARRAY;
+        out->data = res;
+        out->card = out->alloc = k;
+        if (k == 0) {
+            zfree(res);
+            out->data = NULL;
+        }
+    } else {
+        uint64_t *w = zmalloc(ROARING_BITMAP_BYTES), *wb;
+        uint32_t j;
+
+        containerFillWords(a,w);
+        if (b->type == ROARING_ARRAY) {
+            uint16_t *ba = b->data;
+            for (j = 0; j < b->card; j++)
+                w[ba[j] >> 6] &= ~(1ULL << (ba[j] & 63));
+        } else {
+            wb = containerWords(b,buf);
+            for (j = 0; j < ROARING_BITMAP_WORDS; j++) w[j] &= ~wb[j];
+        }
+        containerFromWords(out,a->key,w);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Bitmaps
+ * -------------------------------------------------------------------------- */
+
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+
+    r->card = 0;
+    r->len = r->alloc = 0;
+    r->c = NULL;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) zfree(r->c[j].data);
+    zfree(r->c);
+    zfree(r);
+}
+
+roaring *roaringDup(roaring *r) {
+    roaring *d = roaringNew();
+    uint32_t j;
+
+    d->card = r->card;
+    d->len = d->alloc = r->len;
+    d->c = zmalloc(sizeof(roaringContainer)*(r->len ? r->len : 1));
+    for (j = 0; j < r->len; j++) containerDup(d->c+j,r->c+j);
+    return d;
+}
+
+/* Return the index of the container with the specified key, or -1 if there
+ * is no such container, setting '*pos' to the index where it should be
+ * inserted. */
+static long roaringFind(roaring *r, uint64_t key, uint32_t *pos) {
+    uint32_t lo = 0, hi = r->len;
+
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (r->c[mid].key < key) lo = mid+1; else hi = mid;
+    }
+    if (pos) *pos = lo;
+    return (lo < r->len && r->c[lo].key == key) ? (long)lo : -1;
+}
+
+/* Insert 'c' at position 'pos' of the containers array. */
+static void roaringInsertAt(roaring *r, uint32_t pos, roaringContainer *c) {
+    if (r->len == r->alloc) {
+        r->alloc = r->alloc ? r->alloc*2 : 1;
+        r->c = zrealloc(r->c,sizeof(roaringContainer)*r->alloc);
+    }
+    memmove(r->c+pos+1,r->c+pos,sizeof(roaringContainer)*(r->len-pos));
+    r->c[pos] = *c;
+    r->len++;
+    r->card += c->card;
+}
+
+/* Append the result of a set operation, discarding empty containers. */
+static void roaringAppend(roaring *r, roaringContainer *c) {
+    if (c->card == 0) return;
+    containerOptimize(c);
+    roaringInsertAt(r,r->len,c);
+}
+
+/* Add 'value' to the bitmap. Return 1 if it was added, 0 if it was already
+ * there. */
+int roaringAdd(roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    uint32_t pos;
+    long j = roaringFind(r,u >> 16,&pos);
+
+    if (j == -1) {
+        roaringContainer c;
+
+        c.key = u >> 16;
+        c.type = ROARING_ARRAY;
+        c.card = 1;
+        c.n = 0;
+        c.alloc = 4;
+        c.data = zmalloc(c.alloc*sizeof(uint16_t));
+        ((uint16_t*)c.data)[0] = u & 0xffff;
+        roaringInsertAt(r,pos,&c);
+        return 1;
+    }
+    if (!containerAdd(r->c+j,u & 0xffff)) return 0;
+    r->card++;
+    return 1;
+}
+
+/* Remove 'value' from the bitmap. Return 1 if it was removed, 0 if it was
+ * not there. */
+int roaringRemove(roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    long j = roaringFind(r,u >> 16,NULL);
+
+    if (j == -1 || !containerRemove(r->c+j,u & 0xffff)) return 0;
+    r->card--;
+    if (r->c[j].card == 0) {
+        zfree(r->c[j].data);
+        memmove(r->c+j,r->c+j+1,sizeof(roaringContainer)*(r->len-j-1));
+        r->len--;
+        if (r->len && r->len < r->alloc/4) {
+            r->alloc /= 2;
+            r->c = zrealloc(r->c,sizeof(roaringContainer)*r->alloc);
+        }
+    }
+    return 1;
+}
+
+int roaringContains(roaring *r, int64_t value) {
+    uint64_t u = roaringBias(value);
+    long j = roaringFind(r,u >> 16,NULL);
+
+    return j != -1 && containerContains(r->c+j,u & 0xffff);
+}
+
+uint64_t roaringCardinality(roaring *r) {
+    return r->card;
+}
+
+uint32_t roaringContainers(roaring *r) {
+    return r->len;
+}
+
+/* Return the number of bytes used by the bitmap. */
+size_t roaringBytes(roaring *r) {
+    size_t bytes = sizeof(*r) + sizeof(roaringContainer)*r->alloc;
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) bytes += containerBytes(r->c+j);
+    return bytes;
+}
+
+/* Return a random value of a non empty bitmap. */
+int64_t roaringRandom(roaring *r) {
+    uint64_t rank = (((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^
+                     (uint64_t)rand()) % r->card;
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) {
+        if (rank < r->c[j].card) {
+            uint16_t low = containerSelect(r->c+j,rank);
+            return roaringUnbias((r->c[j].key << 16) | low);
+        }
+        rank -= r->c[j].card;
+    }
+    assert(NULL); /* Cardinality out of sync. */
+    return 0;
+}
+
+/* Convert every container to its most compact representation. */
+void roaringOptimize(roaring *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->len; j++) containerOptimize(r->c+j);
+}
+
+/* Return the number of values from 'min' to 'max' included. */
+uint64_t roaringCountRange(roaring *r, int64_t min, int64_t max) {
+    uint64_t umin, umax, count = 0;
+    uint32_t j;
+
+    if (min > max) return 0;
+    umin = roaringBias(min);
+    umax = roaringBias(max);
+    roaringFind(r,umin >> 16,&j);
+    for (; j < r->len && r->c[j].key <= (umax >> 16); j++) {
+        roaringContainer *c = r->c+j;
+        uint32_t lo = (c->key == (umin >> 16)) ? (umin & 0xffff) : 0;
+        uint32_t hi = (c->key == (umax >> 16)) ? (umax & 0xffff) : 0xffff;
+
+        if (lo == 0 && hi == 0xffff)
+            count += c->card;
+        else
+            count += containerRank(c,hi) - (lo ? containerRank(c,lo-1) : 0);
+    }
+    return count;
+}
+
+/* Return the smallest value not smaller than 'min' that is not in the
+ * bitmap, or INT64_MAX if all the values from 'min' on are there. */
+int64_t roaringNextMissing(roaring *r, int64_t min) {
+    uint64_t u = roaringBias(min);
+    uint32_t j;
+
+    roaringFind(r,u >> 16,&j);
+    while (j < r->len && r->c[j].key == (u >> 16)) {
+        roaringContainer *c = r->c+j;
+        uint32_t next = containerNextMissing(c,u & 0xffff);
+
+        if (next < 65536) return roaringUnbias((c->key << 16) | next);
+        /* The container is full from 'u' on: continue with the next one,
+         * that may hold the following values. */
+        if (c->key == (UINT64_MAX >> 16)) return INT64_MAX;
+        u = (c->key+1) << 16;
+        j++;
+    }
+    return roaringUnbias(u);
+}
+
+/* Write into the 1024 words of 'w' the values of the 'idx'-th container,
+ * and return the first value it can hold: bit 'j' of word 'i' is set if
+ * the value returned plus i*64+j is in the bitmap. Together with
+ * roaringContainers() this allows to visit large bitmaps a chunk of 65536
+ * values at a time. */
+int64_t roaringContainerWords(roaring *r, uint32_t idx, uint64_t *w) {
+    containerFillWords(r->c+idx,w);
+    return roaringUnbias(r->c[idx].key << 16);
+}
+
+/* The opposite of roaringContainerWords(): add the values of a chunk given
+ * as 1024 words. 'base' must be a multiple of 65536 greater than all the
+ * values already in the bitmap. */
+void roaringAppendWords(roaring *r, int64_t base, uint64_t *w) {
+    uint64_t u = roaringBias(base);
+    uint64_t *copy;
+    roaringContainer c;
+
+    assert((u & 0xffff) == 0);
+    assert(r->len == 0 || r->c[r->len-1].key < (u >> 16));
+    copy = zmalloc(ROARING_BITMAP_BYTES);
+    memcpy(copy,w,ROARING_BITMAP_BYTES);
+    containerFromWords(&c,u >> 16,copy);
+    roaringAppend(r,&c);
+}
+
+/* Return a new bitmap with the values both in 'a' and 'b'. */
+roaring *roaringAnd(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+
+    while (i < a->len && j < b->len) {
+        if (a->c[i].key < b->c[j].key) {
+            i++;
+        } else if (a->c[i].key > b->c[j].key) {
+            j++;
+        } else {
+            roaringContainer c;
+
+            containerAnd(a->c+i,b->c+j,&c);
+            roaringAppend(r,&c);
+            i++; j++;
+        }
+    }
+    return r;
+}
+
+/* Return a new bitmap with the values either in 'a' or in 'b'. */
+roaring *roaringOr(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+    roaringContainer c;
+
+    while (i < a->len || j < b->len) {
+        if (j == b->len || (i < a->len && a->c[i].key < b->c[j].key)) {
+            containerDup(&c,a->c+i++);
+        } else if (i == a->len || a->c[i].key > b->c[j].key) {
+            containerDup(&c,b->c+j++);
+        } else {
+            containerOr(a->c+i,b->c+j,&c);
+            i++; j++;
+        }
+        roaringAppend(r,&c);
+    }
+    return r;
+}
+
+/* Return a new bitmap with the values of 'a' that are not in 'b'. */
+roaring *roaringAndNot(roaring *a, roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i, pos = 0;
+
+    for (i = 0; i < a->len; i++) {
+        roaringContainer c;
+        long j = roaringFind(b,a->c[i].key,&pos);
+
+        if (j == -1)
+            containerDup(&c,a->c+i);
+        else
+            containerAndNot(a->c+i,b->c+j,&c);
+        roaringAppend(r,&c);
+    }
+    return r;
+}
+
+/* -----------------------------------------------------------------------------
+ * Iteration
+ * -------------------------------------------------------------------------- */
+
+void roaringInitIterator(roaring *r, roaringIterator *it) {
+    it->r = r;
+    it->ci = it->pos = it->off = 0;
+}
+
+/* Store the next value into '*value' and return 1, or return 0 when there
+ * are no more values. */
+int roaringNext(roaringIterator *it, int64_t *value) {
+    roaring *r = it->r;
+
+    while (it->ci < r->len) {
+        roaringContainer *c = r->c+it->ci;
+        uint32_t low;
+
+        if (c->type == ROARING_ARRAY) {
+            if (it->pos < c->card) {
+                low = ((uint16_t*)c->data)[it->pos++];
+                *value = roaringUnbias((c->key << 16) | low);
+                return 1;
+            }
+        } else if (c->type == ROARING_BITMAP) {
+            uint64_t *w = c->data;
+
+            while (it->pos < 65536) {
+                uint64_t word = w[it->pos >> 6] & (~0ULL << (it->pos & 63));
+
+                if (word) {
+                    low = (it->pos & ~63) + roaringLowestBit(word);
+                    it->pos = low+1;
+                    *value = roaringUnbias((c->key << 16) | low);
+                    return 1;
+                }
+                it->pos = (it->pos & ~63) + 64;
+            }
+        } else {
+            roaringRun *runs = c->data;
+
+            if (it->pos < c->n) {
+                low = runs[it->pos].start + it->off;
+                if (it->off == runs[it->pos].len) {
+                    it->pos++;
+                    it->off = 0;
+                } else {
+                    it->off++;
+                }
+                *value = roaringUnbias((c->key << 16) | low);
+                return 1;
+            }
+        }
+        it->ci++;
+        it->pos = it->off = 0;
+    }
+    return 0;
+}
+
+/* Position the iterator at the first value not smaller than the biased
+ * value 'u'. */
+static void roaringSeek(roaringIterator *it, uint64_t u) {
+    roaring *r = it->r;
+    uint16_t low = u & 0xffff;
+    uint32_t pos;
+    roaringContainer *c;
+
+    it->pos = it->off = 0;
+    roaringFind(r,u >> 16,&pos);
+    it->ci = pos;
+    if (pos == r->len || r->c[pos].key != (u >> 16)) return;
+
+    c = r->c+pos;
+    if (c->type == ROARING_ARRAY) {
+        it->pos = arrayLowerBound(c->data,c->card,low,NULL);
+    } else if (c->type == ROARING_BITMAP) {
+        it->pos = low;
+    } else {
+        roaringRun *runs = c->data;
+        long j = runLast(runs,c->n,low);
+
+        if (j >= 0 && low <= (uint32_t)runs[j].start+runs[j].len) {
+            it->pos = j;
+            it->off = low-runs[j].start;
+        } else {
+            it->pos = j+1;
+        }
+    }
+}
+
+/* Store into '*value' the smallest value not smaller than 'min' and
+ * return 1, or return 0 if there is no such value. */
+int roaringNextValue(roaring *r, int64_t min, int64_t *value) {
+    roaringIterator it;
+
+    roaringInitIterator(r,&it);
+    roaringSeek(&it,roaringBias(min));
+    return roaringNext(&it,value);
+}
+
+/* Call 'fn' for up to 'count' values starting from 'cursor', and return
+ * the cursor to use for the next call, or 0 when all the values were
+ * visited. Like dictScan() the cursor starts at 0: since it encodes the
+ * next value to visit, values that are in the bitmap for the whole scan are
+ * always returned exactly once, even if the bitmap is modified between
+ * calls. */
+uint64_t roaringScan(roaring *r, uint64_t cursor, unsigned long count, roaringScanFunction *fn, void *privdata) {
+    roaringIterator it;
+    int64_t v;
+
+    roaringInitIterator(r,&it);
+    if (cursor) roaringSeek(&it,cursor-1);
+    while (roaringNext(&it,&v)) {
+        if (count-- == 0) {
+            uint64_t u = roaringBias(v);
+
+            /* The largest possible value can't be encoded as a cursor,
+             * but it is also the last one: return it now. */
+            if (u != UINT64_MAX) return u+1;
+            fn(privdata,v);
+            break;
+        }
+        fn(privdata,v);
+    }
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Serialization
+ * -------------------------------------------------------------------------- */
+
+/* The serialized format is the number of containers as a 32 bit integer,
+ * followed by every container as:
+ *
+ * <key:8> <type:1> <card:4> <runs:4> <payload>
+ *
+ * Where the payload is 'card' 16 bit values for arrays, the 1024 words of
+ * 64 bits for bitmaps and 'runs' pairs of 16 bit start and length values
+ * for run containers. All the integers are little endian. */
+
+static unsigned char *roaringWrite(unsigned char *p, void *src, size_t len) {
+    memcpy(p,src,len);
+#if (BYTE_ORDER == BIG_ENDIAN)
+    if (len == 2) memrev16(p);
+    else if (len == 4) memrev32(p);
+    else if (len == 8) memrev64(p);
+#endif
+    return p+len;
+}
+
+static unsigned char *roaringRead(unsigned char *p, void *dst, size_t len) {
+    memcpy(dst,p,len);
+#if (BYTE_ORDER == BIG_ENDIAN)
+    if (len == 2) memrev16(dst);
+    else if (len == 4) memrev32(dst);
+    else if (len == 8) memrev64(dst);
+#endif
+    return p+len;
+}
+
+/* Return a newly allocated buffer with the serialized bitmap, storing its
+ * length into '*len'. */
+unsigned char *roaringSerialize(roaring *r, size_t *len) {
+    size_t size = 4;
+    unsigned char *buf, *p;
+    uint32_t i, j;
+
+    for (i = 0; i < r->len; i++) {
+        roaringContainer *c = r->c+i;
+
+        size += 8+1+4+4;
+        if (c->type == ROARING_ARRAY) size += c->card*2;
+        else if (c->type == ROARING_BITMAP) size += ROARING_BITMAP_BYTES;
+        else size += c->n*4;
+    }
+    p = buf = zmalloc(size);
+    p = roaringWrite(p,&r->len,4);
+    for (i = 0; i < r->len; i++) {
+        roaringContainer *c = r->c+i;
+
+        p = roaringWrite(p,&c->key,8);
+        *p++ = c->type;
+        p = roaringWrite(p,&c->card,4);
+        p = roaringWrite(p,&c->n,4);
+        if (c->type == ROARING_ARRAY) {
+            uint16_t *a = c->data;
+            for (j = 0; j < c->card; j++) p = roaringWrite(p,a+j,2);
+        } else if (c->type == ROARING_BITMAP) {
+            uint64_t *w = c->data;
+            for (j = 0; j < ROARING_BITMAP_WORDS; j++) p = roaringWrite(p,w+j,8);
+        } else {
+            roaringRun *runs = c->data;
+            for (j = 0; j < c->n; j++) {
+                p = roaringWrite(p,&runs[j].start,2);
+                p = roaringWrite(p,&runs[j].len,2);
+            }
+        }
+    }
+    *len = size;
+    return buf;
+}
+
+/* Create a bitmap from its serialized form. The input is fully validated:
+ * NULL is returned if it is truncated or not a valid bitmap. */
+roaring *roaringDeserialize(unsigned char *buf, size_t len) {
+    unsigned char *p = buf, *end = buf+len;
+    roaring *r = roaringNew();
+    uint32_t count, i, j;
+
+    if (len < 4) goto err;
+    p = roaringRead(p,&count,4);
+    for (i = 0; i < count; i++) {
+        roaringContainer c;
+        uint64_t card = 0;
+        size_t payload;
+
+        if (end-p < 17) goto err;
+        p = roaringRead(p,&c.key,8);
+        c.type = *p++;
+        p = roaringRead(p,&c.card,4);
+        p = roaringRead(p,&c.n,4);
+        if (c.key >> 48 || c.card == 0 || c.card > 65536) goto err;
+        if (r->len && c.key <= r->c[r->len-1].key) goto err;
+
+        if (c.type == ROARING_ARRAY) {
+            if (c.card > ROARING_ARRAY_MAX || c.n != 0) goto err;
+            payload = (size_t)c.card*2;
+        } else if (c.type == ROARING_BITMAP) {
+            if (c.n != 0) goto err;
+            payload = ROARING_BITMAP_BYTES;
+        } else if (c.type == ROARING_RUN) {
+            if (c.n == 0 || c.n > 32768) goto err;
+            payload = (size_t)c.n*4;
+        } else {
+            goto err;
+        }
+        if ((size_t)(end-p) < payload) goto err;
+
+        c.alloc = (c.type == ROARING_ARRAY) ? c.card : c.n;
+        c.data = zmalloc(payload);
+        if (c.type == ROARING_ARRAY) {
+            uint16_t *a = c.data;
+            for (j = 0; j < c.card; j++) p = roaringRead(p,a+j,2);
+            for (j = 1; j < c.card; j++) if (a[j] <= a[j-1]) break;
+            card = (j < c.card) ? 0 : c.card;
+        } else if (c.type == ROARING_BITMAP) {
+            uint64_t *w = c.data;
+            for (j = 0; j < ROARING_BITMAP_WORDS; j++) p = roaringRead(p,w+j,8);
+            card = bitmapCardinality(w);
+        } else {
+            roaringRun *runs = c.data;
+            uint32_t next = 0;
+
+            for (j = 0; j < c.n; j++) {
+                p = roaringRead(p,&runs[j].start,2);
+                p = roaringRead(p,&runs[j].len,2);
+                /* Runs must be ordered, not overlapping nor adjacent. */
+                if (runs[j].start < next ||
+                    (uint32_t)runs[j].start+runs[j].len > 65535) break;
+                next = (uint32_t)runs[j].start+runs[j].len+2;
+                card += runs[j].len+1;
+            }
+            if (j < c.n) card = 0;
+        }
+        if (card != c.card) {
+            zfree(c.data);
+            goto err;
+        }
+        roaringInsertAt(r,r->len,&c);
+    }
+    if (p != end) goto err;
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+#ifdef ROARING_TEST_MAIN
+#include <sys/time.h>
+#include <time.h>
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static int cmpInt64(const void *a, const void *b) {
+    int64_t x = *(int64_t*)a, y = *(int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Check the bitmap against a sorted array of unique values. */
+static void checkAgainst(roaring *r, int64_t *vals, size_t n) {
+    roaringIterator it;
+    int64_t v;
+    size_t j = 0;
+
+    assert(roaringCardinality(r) == n);
+    roaringInitIterator(r,&it);
+    while (roaringNext(&it,&v)) {
+        assert(j < n && v == vals[j]);
+        j++;
+    }
+    assert(j == n);
+}
+
+static void scanCollect(void *privdata, int64_t value) {
+    int64_t **p = privdata;
+    *(*p)++ = value;
+}
+
+static int64_t randomValue(int mode) {
+    switch(mode) {
+    case 0: return rand() % 200000;                     /* Dense. */
+    case 1: return (int64_t)rand() * 4096 - (1LL<<40);  /* Sparse. */
+    case 2: return (rand() % 64) * 1000 + rand() % 100; /* Clustered. */
+    default: return (int64_t)(((uint64_t)rand() << 33) ^ rand()); /* Wide. */
+    }
+}
+
+static size_t uniqueSorted(int64_t *v, size_t n) {
+    size_t j, k = 0;
+
+    qsort(v,n,sizeof(int64_t),cmpInt64);
+    for (j = 0; j < n; j++) if (k == 0 || v[j] != v[k-1]) v[k++] = v[j];
+    return k;
+}
+
+int main(void) {
+    size_t n = 200000, j;
+    int mode;
+
+    srand(time(NULL));
+    printf("Add, remove, contains, iteration: ");
+    for (mode = 0; mode < 4; mode++) {
+        roaring *r = roaringNew();
+        /* Every wide value lives in its own container: keep it small. */
+        size_t m = (mode == 3) ? n/20 : n, k;
+        int64_t *vals = zmalloc(sizeof(int64_t)*m);
+
+        for (j = 0; j < m; j++) {
+            vals[j] = randomValue(mode);
+            roaringAdd(r,vals[j]);
+            assert(roaringContains(r,vals[j]));
+        }
+        if (mode == 2) roaringOptimize(r);
+        k = uniqueSorted(vals,m);
+        checkAgainst(r,vals,k);
+
+        /* Remove every third value. */
+        for (j = 0; j < k; j++) {
+            if (j % 3 == 0) {
+                assert(roaringRemove(r,vals[j]) == 1);
+                assert(roaringRemove(r,vals[j]) == 0);
+                assert(!roaringContains(r,vals[j]));
+            }
+        }
+        for (j = 0; j < k; j++)
+            assert(roaringContains(r,vals[j]) == (j % 3 != 0));
+        for (j = 0; j < 1000; j++) {
+            int64_t v = roaringRandom(r);
+            assert(roaringContains(r,v));
+        }
+        roaringFree(r);
+        zfree(vals);
+    }
+    printf("OK\n");
+
+    printf("Run containers: ");
+    {
+        roaring *r = roaringNew();
+        int64_t *vals = zmalloc(sizeof(int64_t)*n);
+        size_t k = 0;
+
+        for (j = 0; j < 100000; j++) roaringAdd(r,j);
+        roaringOptimize(r);
+        assert(roaringBytes(r) < 200);
+        for (j = 0; j < 100000; j += 7) roaringRemove(r,j);
+        for (j = 0; j < 100000; j += 14) roaringAdd(r,j);
+        for (j = 0; j < 100000; j++)
+            if (j % 7 != 0 || j % 14 == 0) vals[k++] = j;
+        checkAgainst(r,vals,k);
+        roaringFree(r);
+        zfree(vals);
+    }
+    printf("OK\n");
+
+    printf("Ranges and chunks: ");
+    for (mode = 0; mode < 3; mode++) {
+        roaring *r = roaringNew(), *d = roaringNew();
+        int64_t *vals = zmalloc(sizeof(int64_t)*n), v;
+        uint64_t w[ROARING_BITMAP_WORDS];
+        size_t k, i, lo, hi;
+        uint32_t c;
+
+        for (j = 0; j < n/4; j++) {
+            vals[j] = randomValue(mode);
+            roaringAdd(r,vals[j]);
+        }
+        /* A long sequence of consecutive values, to test runs. */
+        for (j = 0; j < 70000; j++) {
+            vals[n/4+j] = 300000+j;
+            roaringAdd(r,300000+j);
+        }
+        roaringOptimize(r);
+        k = uniqueSorted(vals,n/4+70000);
+        for (j = 0; j < 2000; j++) {
+            int64_t min = randomValue(mode), max = min + rand() % 100000;
+
+            if (j % 10 == 0) min = 300000 + rand() % 70000;
+            for (lo = 0; lo < k && vals[lo] < min; lo++);
+            for (hi = lo; hi < k && vals[hi] <= max; hi++);
+            assert(roaringCountRange(r,min,max) == hi-lo);
+            assert(roaringNextValue(r,min,&v) == (lo < k));
+            if (lo < k) assert(v == vals[lo]);
+            v = min;
+            for (i = lo; i < k && vals[i] == v; i++) v++;
+            assert(roaringNextMissing(r,min) == v);
+        }
+        for (c = 0; c < roaringContainers(r); c++) {
+            int64_t base = roaringContainerWords(r,c,w);
+            roaringAppendWords(d,base,w);
+        }
+        checkAgainst(d,vals,k);
+        roaringFree(r);
+        roaringFree(d);
+        zfree(vals);
+    }
+    printf("OK\n");
+
+    printf("Set operations and serialization: ");
+    for (mode = 0; mode < 4; mode++) {
+        roaring *a = roaringNew(), *b = roaringNew(), *res[3], *d;
+        int64_t *va = zmalloc(sizeof(int64_t)*n), *vb = zmalloc(sizeof(int64_t)*n);
+        int64_t *exp = zmalloc(sizeof(int64_t)*n*2), *scanned, *sp;
+        size_t m = (mode == 3) ? n/20 : n, la, lb, i, e, len;
+        unsigned char *buf;
+        uint64_t cursor = 0;
+
+        for (j = 0; j < m/2; j++) {
+            va[j] = randomValue(mode);
+            vb[j] = (j % 2) ? va[j] : randomValue(mode);
+            roaringAdd(a,va[j]);
+            roaringAdd(b,vb[j]);
+        }
+        if (mode == 2) roaringOptimize(b);
+        la = uniqueSorted(va,m/2);
+        lb = uniqueSorted(vb,m/2);
+        res[0] = roaringAnd(a,b);
+        res[1] = roaringOr(a,b);
+        res[2] = roaringAndNot(a,b);
+
+        for (i = j = e = 0; i < la && j < lb; ) {
+            if (va[i] < vb[j]) i++;
+            else if (va[i] > vb[j]) j++;
+            else { exp[e++] = va[i]; i++; j++; }
+        }
+        checkAgainst(res[0],exp,e);
+        memcpy(exp,va,la*sizeof(int64_t));
+        memcpy(exp+la,vb,lb*sizeof(int64_t));
+        e = uniqueSorted(exp,la+lb);
+        checkAgainst(res[1],exp,e);
+        for (i = j = e = 0; i < la; i++) {
+            while (j < lb && vb[j] < va[i]) j++;
+            if (j == lb || vb[j] != va[i]) exp[e++] = va[i];
+        }
+        checkAgainst(res[2],exp,e);
+
+        buf = roaringSerialize(res[1],&len);
+        d = roaringDeserialize(buf,len);
+        assert(d != NULL);
+        memcpy(exp,va,la*sizeof(int64_t));
+        memcpy(exp+la,vb,lb*sizeof(int64_t));
+        e = uniqueSorted(exp,la+lb);
+        checkAgainst(d,exp,e);
+        for (i = 0; i < len; i += len/64+1)
+            assert(roaringDeserialize(buf,i) == NULL);
+        zfree(buf);
+
+        sp = scanned = zmalloc(sizeof(int64_t)*(e+1));
+        do {
+            cursor = roaringScan(d,cursor,100,scanCollect,&sp);
+        } while (cursor);
+        assert((size_t)(sp-scanned) == e);
+        for (i = 0; i < e; i++) assert(scanned[i] == exp[i]);
+
+        roaringFree(d);
+        zfree(scanned);
+        for (i = 0; i < 3; i++) roaringFree(res[i]);
+        roaringFree(a); roaringFree(b);
+        zfree(va); zfree(vb); zfree(exp);
+    }
+    printf("OK\n");
+
+    printf("Benchmark:\n");
+    {
+        size_t sizes[] = {100000, 1000000, 10000000};
+        int s;
+
+        for (s = 0; s < 3; s++) {
+            roaring *a = roaringNew(), *b = roaringNew(), *r;
+            long long start;
+
+            for (j = 0; j < sizes[s]; j++) {
+                roaringAdd(a,rand() % (sizes[s]*4));
+                roaringAdd(b,rand() % (sizes[s]*4));
+            }
+            start = usec();
+            r = roaringAnd(a,b);
+            printf("  %8zu ids: %.2f bytes per id, "
+                   "intersection of %llu and %llu in %lld usec\n",
+                   sizes[s], (double)roaringBytes(a)/roaringCardinality(a),
+                   (unsigned long long)roaringCardinality(a),
+                   (unsigned long long)roaringCardinality(b),
+                   usec()-start);
+            roaringFree(a); roaringFree(b); roaringFree(r);
+        }
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,82 @@
+/* roaring.h - Compressed bitmap of 64 bit integers
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct roaringContainer roaringContainer;
+
+typedef struct roaring {
+    uint64_t card;              /* Number of integers in the bitmap. */
+    uint32_t len;               /* Number of containers. */
+    uint32_t alloc;             /* Allocated containers. */
+    roaringContainer *c;        /* Containers, ordered by key. */
+} roaring;
+
+/* Iterator over the integers of a bitmap, in ascending order. The bitmap
+ * must not be modified while it is iterated. */
+typedef struct roaringIterator {
+    roaring *r;
+    uint32_t ci;                /* Current container. */
+    uint32_t pos;               /* Position inside the container. */
+    uint32_t off;               /* Offset inside the current run. */
+} roaringIterator;
+
+typedef void (roaringScanFunction)(void *privdata, int64_t value);
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(roaring *r);
+int roaringAdd(roaring *r, int64_t value);
+int roaringRemove(roaring *r, int64_t value);
+int roaringContains(roaring *r, int64_t value);
+uint64_t roaringCardinality(roaring *r);
+int64_t roaringRandom(roaring *r);
+uint32_t roaringContainers(roaring *r);
+size_t roaringBytes(roaring *r);
+void roaringOptimize(roaring *r);
+uint64_t roaringCountRange(roaring *r, int64_t min, int64_t max);
+int roaringNextValue(roaring *r, int64_t min, int64_t *value);
+int64_t roaringNextMissing(roaring *r, int64_t min);
+int64_t roaringContainerWords(roaring *r, uint32_t idx, uint64_t *w);
+void roaringAppendWords(roaring *r, int64_t base, uint64_t *w);
+roaring *roaringAnd(roaring *a, roaring *b);
+roaring *roaringOr(roaring *a, roaring *b);
+roaring *roaringAndNot(roaring *a, roaring *b);
+void roaringInitIterator(roaring *r, roaringIterator *it);
+int roaringNext(roaringIterator *it, int64_t *value);
+uint64_t roaringScan(roaring *r, uint64_t cursor, unsigned long count, roaringScanFunction *fn, void *privdata);
+unsigned char *roaringSerialize(roaring *r, size_t *len);
+roaring *roaringDeserialize(unsigned char *buf, size_t len);
+
+#endif
@@ -35,12 +35,13 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != REDIS_ENCODING_ZIPLIST) return;
+    if (o->encoding != REDIS_ENCODING_LISTPACK &&
+        o->encoding != REDIS_ENCODING_LISTPACK_INDEXED) return;
 
     for (i = start; i <= end; i++) {
         if (argv[i]->encoding == REDIS_ENCODING_RAW &&
@@ -60,9 +61,169 @@ void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/*-----------------------------------------------------------------------------
+ * Listpack field index
+ *----------------------------------------------------------------------------*/
+
+/* Listpack encoded hashes are scanned comparing every field, so lookups
+ * become expensive when hash-max-ziplist-entries is raised in order to save
+ * memory. Hashes with at least hash-listpack-index-entries fields are indexed
+ * with a linear probing table of field offsets (see hashListpackIndex in
+ * redis.h), kept at most half full. The index is not persisted: it is
+ * rebuilt when the hash is loaded, hashing every field once. */
+
+#define HLI_MIN_SIZE 16
+#define hliTags(idx) ((unsigned char*)((idx)->offsets+(idx)->size))
+#define hliTag(h) ((unsigned char)((h)>>24))
+
+/* Return the hash of the listpack element 'p', integer encoded elements are
+ * hashed as their string representation, like the fields we look up. */
+static unsigned int hliHashElement(unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LP_INTBUF_SIZE];
+
+    lpGetValue(p, &vstr, &vlen, &vll);
+    if (vstr == NULL) {
+        vlen = ll2string(buf, sizeof(buf), vll);
+        vstr = (unsigned char*)buf;
+    }
+    return dictGenHashFunction(vstr, vlen);
+}
+
+/* Store the field at offset 'off' with hash 'h' in the first free slot. */
+static void hliAdd(hashListpackIndex *idx, uint32_t off, unsigned int h) {
+    unsigned long mask = idx->size-1, j = h & mask;
+
+    while (idx->offsets[j]) j = (j+1) & mask;
+    idx->offsets[j] = off;
+    hliTags(idx)[j] = hliTag(h);
+    idx->used++;
+}
+
+/* Create an index of the fields of the listpack 'lp', sized for 'fields'
+ * fields. */
+static hashListpackIndex *hliCreate(unsigned char *lp, unsigned long fields) {
+    hashListpackIndex *idx;
+    unsigned long size = HLI_MIN_SIZE;
+    unsigned char *fptr;
+
+    while (size < fields*2) size <<= 1;
+    idx = zcalloc(sizeof(*idx)+size*(sizeof(uint32_t)+1));
+    idx->lp = lp;
+    idx->size = size;
+    idx->used = 0;
+
+    fptr = lpFirst(lp);
+    while (fptr != NULL) {
+        hliAdd(idx, fptr-lp, hliHashElement(fptr));
+        fptr = lpNext(lp, lpNext(lp, fptr));
+    }
+    return idx;
+}
+
+/* Return the slot of the field 's' of length 'slen' and hash 'h', or -1 if
+ * the field is not in the hash. */
+static long hliFind(hashListpackIndex *idx, unsigned char *s,
+                    unsigned int slen, unsigned int h)
+{
+    unsigned long mask = idx->size-1, j = h & mask;
+    unsigned char tag = hliTag(h), *tags = hliTags(idx);
+
+    while (idx->offsets[j]) {
+        if (tags[j] == tag && lpCompare(idx->lp+idx->offsets[j], s, slen))
+            return j;
+        j = (j+1) & mask;
+    }
+    return -1;
+}
+
+/* Remove the slot 'j'. The following slots of the same cluster are moved
+ * back when possible, so that lookups can stop at the first empty slot
+ * without using tombstones. Must be called before the field is removed from
+ * the listpack, since the hash of the moved fields is computed again. */
+static void hliDelete(hashListpackIndex *idx, unsigned long j) {
+    unsigned long mask = idx->size-1, k = j, home;
+    unsigned char *tags = hliTags(idx);
+
+    idx->offsets[j] = 0;
+    while (1) {
+        k = (k+1) & mask;
+        if (idx->offsets[k] == 0) break;
+        home = hliHashElement(idx->lp+idx->offsets[k]) & mask;
+        /* Move the entry back if its home slot is not between the hole
+         * and its current position. */
+        if (((k-home) & mask) >= ((k-j) & mask)) {
+            idx->offsets[j] = idx->offsets[k];
+            tags[j] = tags[k];
+            idx->offsets[k] = 0;
+            j = k;
+        }
+    }
+    idx->used--;
+}
+
+/* Adjust by 'delta' the offsets of the fields stored after the offset
+ * 'from', after the listpack was modified at that offset. */
+static void hliShift(hashListpackIndex *idx, uint32_t from, long delta) {
+    unsigned long j;
+
+    if (delta == 0) return;
+    for (j = 0; j < idx->size; j++) {
+        if (idx->offsets[j] > from) idx->offsets[j] += delta;
+    }
+}
+
+/* Return the listpack of a listpack encoded hash, indexed or not. */
+unsigned char *hashTypeListpack(robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+        return ((hashListpackIndex*)o->ptr)->lp;
+    redisAssert(o->encoding == REDIS_ENCODING_LISTPACK);
+    return o->ptr;
+}
+
+/* Index the listpack encoded hash 'o' if it reached the configured number of
+ * fields. Called when fields are added and when hashes are loaded. */
+void hashTypeTryIndex(robj *o) {
+    unsigned long fields;
+
+    if (o->encoding != REDIS_ENCODING_LISTPACK ||
+        server.hash_listpack_index_entries == 0) return;
+    fields = lpLength(o->ptr)/2;
+    if (fields < server.hash_listpack_index_entries) return;
+    o->ptr = hliCreate(o->ptr, fields);
+    o->encoding = REDIS_ENCODING_LISTPACK_INDEXED;
+}
+
+/* Drop the index of an indexed hash, leaving a plain listpack. */
+static void hashTypeDropIndex(robj *o) {
+    hashListpackIndex *idx = o->ptr;
+
+    o->ptr = idx->lp;
+    o->encoding = REDIS_ENCODING_LISTPACK;
+    zfree(idx);
+}
+
+/* Drop the index of 'o' if indexing was disabled, setting
+ * hash-listpack-index-entries to 0, after the hash was indexed. Called every
+ * time a field of an indexed hash is accessed. */
+static void hashTypeCheckIndex(robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED &&
+        server.hash_listpack_index_entries == 0) hashTypeDropIndex(o);
+}
+
+/* Free the listpack and the index of an indexed hash. */
+void hashTypeFreeIndexed(robj *o) {
+    hashListpackIndex *idx = o->ptr;
+
+    lpFree(idx->lp);
+    zfree(idx);
+}
+
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, robj *field,
+int hashTypeGetFromListpack(robj *o, robj *field,
                            unsigned char **vstr,
                            unsigned int *vlen,
                            long long *vll)
@@ -70,17 +231,24 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
     unsigned char *zl, *fptr = NULL, *vptr = NULL;
     int ret;
 
-    redisAssert(o->encoding == REDIS_ENCODING_ZIPLIST);
-
     field = getDecodedObject(field);
 
-    zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
-    if (fptr != NULL) {
-        fptr = ziplistFind(fptr, field->ptr, sdslen(field->ptr), 1);
+    hashTypeCheckIndex(o);
+    zl = hashTypeListpack(o);
+    if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+        hashListpackIndex *idx = o->ptr;
+        unsigned int h = dictGenHashFunction(field->ptr, sdslen(field->ptr));
+        long j = hliFind(idx, field->ptr, sdslen(field->ptr), h);
+
+        if (j != -1) {
+            vptr = lpNext(zl, zl+idx->offsets[j]);
+            redisAssert(vptr != NULL);
+        }
+    } else if ((fptr = lpFirst(zl)) != NULL) {
+        fptr = lpFind(zl, fptr, field->ptr, sdslen(field->ptr), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(zl, fptr);
             redisAssert(vptr != NULL);
         }
     }
@@ -88,7 +256,7 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
     decrRefCount(field);
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
+        ret = lpGetValue(vptr, vstr, vlen, vll);
         redisAssert(ret);
         return 0;
     }
@@ -118,12 +286,14 @@ int hashTypeGetFromHashTable(robj *o, robj *field, robj **value) {
 robj *hashTypeGetObject(robj *o, robj *field) {
     robj *value = NULL;
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK ||
+        o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+    {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) {
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) {
             if (vstr) {
                 value = createStringObject((char*)vstr, vlen);
             } else {
@@ -147,12 +317,14 @@ robj *hashTypeGetObject(robj *o, robj *field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, robj *field) {
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK ||
+        o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+    {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == REDIS_ENCODING_HT) {
         robj *aux;
 
@@ -170,40 +342,83 @@ int hashTypeExists(robj *o, robj *field) {
 int hashTypeSet(robj *o, robj *field, robj *value) {
     int update = 0;
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    hashTypeCheckIndex(o);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr, *vptr;
 
         field = getDecodedObject(field);
         value = getDecodedObject(value);
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, field->ptr, sdslen(field->ptr), 1);
+            fptr = lpFind(zl, fptr, field->ptr, sdslen(field->ptr), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(zl, fptr);
                 redisAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, value->ptr, sdslen(value->ptr));
+                /* Replace value */
+                zl = lpReplace(zl, &vptr, value->ptr, sdslen(value->ptr));
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, field->ptr, sdslen(field->ptr), ZIPLIST_TAIL);
-            zl = ziplistPush(zl, value->ptr, sdslen(value->ptr), ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            zl = lpAppend(zl, field->ptr, sdslen(field->ptr));
+            zl = lpAppend(zl, value->ptr, sdslen(value->ptr));
         }
         o->ptr = zl;
         decrRefCount(field);
         decrRefCount(value);
 
-        /* Check if the ziplist needs to be converted to a hash table */
+        /* Check if the listpack needs to be converted to a hash table */
+        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+            hashTypeConvert(o, REDIS_ENCODING_HT);
+        else if (!update)
+            hashTypeTryIndex(o);
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+        hashListpackIndex *idx = o->ptr;
+        unsigned char *zl = idx->lp, *vptr;
+        unsigned int h;
+        long j;
+
+        field = getDecodedObject(field);
+        value = getDecodedObject(value);
+
+        h = dictGenHashFunction(field->ptr, sdslen(field->ptr));
+        j = hliFind(idx, field->ptr, sdslen(field->ptr), h);
+        if (j != -1) {
+            size_t oldbytes = lpBytes(zl);
+            uint32_t voff;
+
+            /* Replace the value, then fix the offsets of the fields
+             * stored after it. */
+            vptr = lpNext(zl, zl+idx->offsets[j]);
+            voff = vptr-zl;
+            zl = lpReplace(zl, &vptr, value->ptr, sdslen(value->ptr));
+            hliShift(idx, voff, (long)lpBytes(zl)-(long)oldbytes);
+            idx->lp = zl;
+            update = 1;
+        } else {
+            /* The new field will be stored where the end byte is now. */
+            uint32_t foff = lpBytes(zl)-1;
+
+            zl = lpAppend(zl, field->ptr, sdslen(field->ptr));
+            zl = lpAppend(zl, value->ptr, sdslen(value->ptr));
+            idx->lp = zl;
+            if ((idx->used+1)*2 > idx->size) {
+                /* Table full: rebuild it twice as large. */
+                o->ptr = hliCreate(zl, idx->used+1);
+                zfree(idx);
+            } else {
+                hliAdd(idx, foff, h);
+            }
+        }
+        decrRefCount(field);
+        decrRefCount(value);
+
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
             hashTypeConvert(o, REDIS_ENCODING_HT);
     } else if (o->encoding == REDIS_ENCODING_HT) {
@@ -224,18 +439,19 @@ int hashTypeSet(robj *o, robj *field, robj *value) {
 int hashTypeDelete(robj *o, robj *field) {
     int deleted = 0;
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    hashTypeCheckIndex(o);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl, *fptr;
 
         field = getDecodedObject(field);
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        fptr = lpFirst(zl);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, field->ptr, sdslen(field->ptr), 1);
+            fptr = lpFind(zl, fptr, field->ptr, sdslen(field->ptr), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr);
-                zl = ziplistDelete(zl,&fptr);
+                zl = lpDelete(zl,fptr,&fptr);
+                zl = lpDelete(zl,fptr,&fptr);
                 o->ptr = zl;
                 deleted = 1;
             }
@@ -243,6 +459,37 @@ int hashTypeDelete(robj *o, robj *field) {
 
         decrRefCount(field);
 
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+        hashListpackIndex *idx = o->ptr;
+        unsigned char *zl = idx->lp, *fptr;
+        unsigned int h;
+        long j;
+
+        field = getDecodedObject(field);
+
+        h = dictGenHashFunction(field->ptr, sdslen(field->ptr));
+        j = hliFind(idx, field->ptr, sdslen(field->ptr), h);
+        if (j != -1) {
+            size_t oldbytes = lpBytes(zl);
+            uint32_t foff = idx->offsets[j];
+
+            hliDelete(idx, j);
+            fptr = zl+foff;
+            zl = lpDelete(zl,fptr,&fptr);
+            zl = lpDelete(zl,fptr,&fptr);
+            hliShift(idx, foff, (long)lpBytes(zl)-(long)oldbytes);
+            idx->lp = zl;
+            deleted = 1;
+
+            /* Drop the index once the hash is well below the threshold, so
+             * that a hash around the threshold is not indexed over and
+             * over again. */
+            if (idx->used < server.hash_listpack_index_entries/2)
+                hashTypeDropIndex(o);
+        }
+
+        decrRefCount(field);
+
     } else if (o->encoding == REDIS_ENCODING_HT) {
         if (dictDelete((dict*)o->ptr, field) == REDIS_OK) {
             deleted = 1;
@@ -262,8 +509,10 @@ int hashTypeDelete(robj *o, robj *field) {
 unsigned long hashTypeLength(robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+        length = ((hashListpackIndex*)o->ptr)->used;
     } else if (o->encoding == REDIS_ENCODING_HT) {
         length = dictSize((dict*)o->ptr);
     } else {
@@ -278,7 +527,11 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+    /* Indexed hashes are iterated like plain listpacks. */
+    if (hi->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+        hi->encoding = REDIS_ENCODING_LISTPACK;
+
+    if (hi->encoding == REDIS_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == REDIS_ENCODING_HT) {
@@ -301,27 +554,27 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return REDIS_OK when the next entry
  * could be found and REDIS_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (hi->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl;
         unsigned char *fptr, *vptr;
 
-        zl = hi->subject->ptr;
+        zl = hashTypeListpack(hi->subject);
         fptr = hi->fptr;
         vptr = hi->vptr;
 
         if (fptr == NULL) {
             /* Initialize cursor */
             redisAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(zl);
         } else {
             /* Advance cursor */
             redisAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(zl, vptr);
         }
         if (fptr == NULL) return REDIS_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(zl, fptr);
         redisAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -336,27 +589,27 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll)
 {
     int ret;
 
-    redisAssert(hi->encoding == REDIS_ENCODING_ZIPLIST);
+    redisAssert(hi->encoding == REDIS_ENCODING_LISTPACK);
 
     if (what & REDIS_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->fptr, vstr, vlen, vll);
         redisAssert(ret);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->vptr, vstr, vlen, vll);
         redisAssert(ret);
     }
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromHashTable`. */
+ * encoded as a hash table. Prototype is similar to `hashTypeGetFromHashTable`. */
 void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst) {
     redisAssert(hi->encoding == REDIS_ENCODING_HT);
 
@@ -373,12 +626,12 @@ void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst) {
 robj *hashTypeCurrentObject(hashTypeIterator *hi, int what) {
     robj *dst;
 
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (hi->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr) {
             dst = createStringObject((char*)vstr, vlen);
         } else {
@@ -410,10 +663,11 @@ robj *hashTypeLookupWriteOrCreate(redisClient *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    redisAssert(o->encoding == REDIS_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    redisAssert(o->encoding == REDIS_ENCODING_LISTPACK ||
+                o->encoding == REDIS_ENCODING_LISTPACK_INDEXED);
 
-    if (enc == REDIS_ENCODING_ZIPLIST) {
+    if (enc == REDIS_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == REDIS_ENCODING_HT) {
@@ -433,14 +687,17 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = tryObjectEncoding(value);
             ret = dictAdd(dict, field, value);
             if (ret != DICT_OK) {
-                redisLogHexDump(REDIS_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
+                redisLogHexDump(REDIS_WARNING,"listpack with dup elements dump",
+                    hashTypeListpack(o),lpBytes(hashTypeListpack(o)));
                 redisAssert(ret == DICT_OK);
             }
         }
 
         hashTypeReleaseIterator(hi);
-        zfree(o->ptr);
+        if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+            hashTypeFreeIndexed(o);
+        else
+            lpFree(o->ptr);
 
         o->encoding = REDIS_ENCODING_HT;
         o->ptr = dict;
@@ -451,8 +708,10 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == REDIS_ENCODING_LISTPACK ||
+        o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+    {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == REDIS_ENCODING_HT) {
         redisPanic("Not implemented");
     } else {
@@ -594,12 +853,14 @@ static void addHashFieldToReply(redisClient *c, robj *o, robj *field) {
         return;
     }
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK ||
+        o->encoding == REDIS_ENCODING_LISTPACK_INDEXED)
+    {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReply(c, shared.nullbulk);
         } else {
@@ -689,12 +950,12 @@ void hlenCommand(redisClient *c) {
 }
 
 static void addHashIteratorCursorToReply(redisClient *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (hi->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr) {
             addReplyBulkCBuffer(c, vstr, vlen);
         } else {
@@ -772,3 +1033,141 @@ void hscanCommand(redisClient *c) {
         checkType(c,o,REDIS_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Self test, run with ./redis-server --test-hash
+ *----------------------------------------------------------------------------*/
+
+/* Check the index of the hash 'o' against the listpack: every field must be
+ * found in its slot, and there are no other slots in use. */
+static void hashTestCheckIndex(robj *o) {
+    hashListpackIndex *idx = o->ptr;
+    unsigned char *fptr, *vstr;
+    unsigned int vlen;
+    long long vll;
+    unsigned long j, slots = 0, fields = 0;
+    char buf[LP_INTBUF_SIZE];
+
+    for (j = 0; j < idx->size; j++) if (idx->offsets[j]) slots++;
+    fptr = lpFirst(idx->lp);
+    while (fptr != NULL) {
+        lpGetValue(fptr, &vstr, &vlen, &vll);
+        if (vstr == NULL) {
+            vlen = ll2string(buf, sizeof(buf), vll);
+            vstr = (unsigned char*)buf;
+        }
+        j = hliFind(idx, vstr, vlen, dictGenHashFunction(vstr, vlen));
+        redisAssert(j != (unsigned long)-1 &&
+                    idx->lp+idx->offsets[j] == fptr);
+        fields++;
+        fptr = lpNext(idx->lp, lpNext(idx->lp, fptr));
+    }
+    redisAssert(fields == idx->used && slots == idx->used &&
+                idx->used*2 <= idx->size);
+}
+
+/* Insert, update and delete random fields of a listpack encoded hash, going
+ * up and down across the indexing thresholds, and check the hash against a
+ * reference after every operation. Fields are taken from a small set, so
+ * that the probing clusters of the index get long and hliDelete() has to
+ * move entries back. Some fields look like integers, so that they are
+ * stored integer encoded in the listpack. */
+static void hashTestIndexed(void) {
+    size_t thresholds[] = {1, 2, 8, 16, 100};
+    size_t saved_entries = server.hash_max_ziplist_entries;
+    size_t saved_index = server.hash_listpack_index_entries;
+    int distinct = 300, t, op, j;
+    sds *ref = zcalloc(sizeof(sds)*distinct);
+
+    server.hash_max_ziplist_entries = distinct;
+    for (t = 0; t < (int)(sizeof(thresholds)/sizeof(thresholds[0])); t++) {
+        robj *o = createHashObject();
+        unsigned long count = 0;
+
+        server.hash_listpack_index_entries = thresholds[t];
+        for (op = 0; op < 17500; op++) {
+            /* Alternate phases growing the hash with phases only deleting
+             * fields, that empty it. The last phase grows it. */
+            int grow = ((op/2500) % 2 == 0) && random()%4 != 0;
+            int f = random()%distinct;
+            robj *field = createObject(REDIS_STRING, (f % 3 == 0) ?
+                sdsfromlonglong(f*1000) : sdscatprintf(sdsempty(),"f:%d",f));
+
+            if (grow) {
+                sds val = sdsgrowzero(sdsempty(), random()%40);
+                robj *value;
+
+                memset(val, 'a'+random()%26, sdslen(val));
+                value = createObject(REDIS_STRING, sdsdup(val));
+                redisAssert(hashTypeSet(o, field, value) == (ref[f] != NULL));
+                decrRefCount(value);
+                if (ref[f] == NULL) count++;
+                sdsfree(ref[f]);
+                ref[f] = val;
+            } else {
+                redisAssert(hashTypeDelete(o, field) == (ref[f] != NULL));
+                if (ref[f] != NULL) count--;
+                sdsfree(ref[f]);
+                ref[f] = NULL;
+            }
+            decrRefCount(field);
+
+            /* Hashes are indexed at the threshold, and the index is only
+             * dropped well below it. */
+            redisAssert(hashTypeLength(o) == count);
+            if (count >= thresholds[t])
+                redisAssert(o->encoding == REDIS_ENCODING_LISTPACK_INDEXED);
+            if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+                redisAssert(count >= thresholds[t]/2);
+                if (op % 64 == 0) hashTestCheckIndex(o);
+            }
+        }
+
+        /* Every field is found with its value, the others are not. */
+        for (j = 0; j < distinct; j++) {
+            robj *field = createObject(REDIS_STRING, (j % 3 == 0) ?
+                sdsfromlonglong(j*1000) : sdscatprintf(sdsempty(),"f:%d",j));
+            robj *value = hashTypeGetObject(o, field);
+
+            if (ref[j] == NULL) {
+                redisAssert(value == NULL);
+            } else {
+                redisAssert(value != NULL &&
+                            sdslen(value->ptr) == sdslen(ref[j]) &&
+                            memcmp(value->ptr, ref[j], sdslen(ref[j])) == 0);
+                decrRefCount(value);
+            }
+            decrRefCount(field);
+        }
+
+        /* Disabling the index drops it on the next access. */
+        if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+            robj *field = createStringObject("missing", 7);
+
+            server.hash_listpack_index_entries = 0;
+            redisAssert(hashTypeExists(o, field) == 0);
+            redisAssert(o->encoding == REDIS_ENCODING_LISTPACK);
+            redisAssert(hashTypeLength(o) == count);
+            decrRefCount(field);
+        }
+
+        decrRefCount(o);
+        for (j = 0; j < distinct; j++) {
+            sdsfree(ref[j]);
+            ref[j] = NULL;
+        }
+    }
+    zfree(ref);
+    server.hash_max_ziplist_entries = saved_entries;
+    server.hash_listpack_index_entries = saved_index;
+}
+
+int hashTest(int argc, char **argv) {
+    REDIS_NOTUSED(argc);
+    REDIS_NOTUSED(argv);
+
+    printf("Indexed listpack hashes: ");
+    hashTestIndexed();
+    printf("OK\n");
+    return 0;
+}
@@ -33,14 +33,19 @@
  * List API
  *----------------------------------------------------------------------------*/
 
-/* Check the argument length to see if it requires us to convert the ziplist
- * to a real list. Only check raw-encoded objects because integer encoded
+/* Check the argument length to see if it requires us to convert the listpack
+ * to a quicklist. Only check raw-encoded objects because integer encoded
  * objects are never too long. */
 void listTypeTryConversion(robj *subject, robj *value) {
-    if (subject->encoding != REDIS_ENCODING_ZIPLIST) return;
+    if (subject->encoding != REDIS_ENCODING_LISTPACK) return;
     if (value->encoding == REDIS_ENCODING_RAW &&
         sdslen(value->ptr) > server.list_max_ziplist_value)
-            listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+            listTypeConvert(subject,REDIS_ENCODING_QUICKLIST);
+}
+
+/* Save a ziplist entry popped from a quicklist as a string object. */
+static void *listPopSaver(unsigned char *data, unsigned int sz) {
+    return createStringObject((char*)data,sz);
 }
 
 /* The function pushes an element to the specified list object 'subject',
@@ -49,24 +54,24 @@ void listTypeTryConversion(robj *subject, robj *value) {
  * There is no need for the caller to increment the refcount of 'value' as
  * the function takes care of it if needed. */
 void listTypePush(robj *subject, robj *value, int where) {
-    /* Check if we need to convert the ziplist */
+    /* Check if we need to convert the listpack */
     listTypeTryConversion(subject,value);
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
-        ziplistLen(subject->ptr) >= server.list_max_ziplist_entries)
-            listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+    if (subject->encoding == REDIS_ENCODING_LISTPACK &&
+        lpLength(subject->ptr) >= server.list_max_ziplist_entries)
+            listTypeConvert(subject,REDIS_ENCODING_QUICKLIST);
 
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
-        int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+    if (subject->encoding == REDIS_ENCODING_LISTPACK) {
         value = getDecodedObject(value);
-        subject->ptr = ziplistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
+        if (where == REDIS_HEAD)
+            subject->ptr = lpPrepend(subject->ptr,value->ptr,sdslen(value->ptr));
+        else
+            subject->ptr = lpAppend(subject->ptr,value->ptr,sdslen(value->ptr));
+        decrRefCount(value);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        value = getDecodedObject(value);
+        quicklistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
         decrRefCount(value);
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(subject->ptr,value);
-        } else {
-            listAddNodeTail(subject->ptr,value);
-        }
-        incrRefCount(value);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -74,34 +79,29 @@ void listTypePush(robj *subject, robj *value, int where) {
 
 robj *listTypePop(robj *subject, int where) {
     robj *value = NULL;
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (subject->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *p;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
         int pos = (where == REDIS_HEAD) ? 0 : -1;
-        p = ziplistIndex(subject->ptr,pos);
-        if (ziplistGet(p,&vstr,&vlen,&vlong)) {
+        p = lpSeek(subject->ptr,pos);
+        if (lpGetValue(p,&vstr,&vlen,&vlong)) {
             if (vstr) {
                 value = createStringObject((char*)vstr,vlen);
             } else {
                 value = createStringObjectFromLongLong(vlong);
             }
             /* We only need to delete an element when it exists */
-            subject->ptr = ziplistDelete(subject->ptr,&p);
+            subject->ptr = lpDelete(subject->ptr,p,NULL);
         }
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list *list = subject->ptr;
-        listNode *ln;
-        if (where == REDIS_HEAD) {
-            ln = listFirst(list);
-        } else {
-            ln = listLast(list);
-        }
-        if (ln != NULL) {
-            value = listNodeValue(ln);
-            incrRefCount(value);
-            listDelNode(list,ln);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        long long vlong;
+        int ql_where = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        if (quicklistPopCustom(subject->ptr,ql_where,(unsigned char **)&value,
+                               NULL,&vlong,listPopSaver)) {
+            if (!value)
+                value = createStringObjectFromLongLong(vlong);
         }
     } else {
         redisPanic("Unknown list encoding");
@@ -110,10 +110,10 @@ robj *listTypePop(robj *subject, int where) {
 }
 
 unsigned long listTypeLength(robj *subject) {
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
-        return ziplistLen(subject->ptr);
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
-        return listLength((list*)subject->ptr);
+    if (subject->encoding == REDIS_ENCODING_LISTPACK) {
+        return lpLength(subject->ptr);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistCount(subject->ptr);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -125,10 +125,16 @@ listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char
     li->subject = subject;
     li->encoding = subject->encoding;
     li->direction = direction;
-    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
-        li->zi = ziplistIndex(subject->ptr,index);
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        li->ln = listIndex(subject->ptr,index);
+    li->iter = NULL;
+    if (li->encoding == REDIS_ENCODING_LISTPACK) {
+        li->zi = lpSeek(subject->ptr,index);
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        /* REDIS_TAIL means iterating towards the tail, that is, starting
+         * from the head side. An out of range index leaves li->iter set
+         * to NULL, so that the iteration returns no element. */
+        int iter_direction =
+            direction == REDIS_TAIL ? AL_START_HEAD : AL_START_TAIL;
+        li->iter = quicklistGetIteratorAtIdx(subject->ptr,iter_direction,index);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -137,6 +143,7 @@ listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char
 
 /* Clean up the iterator. */
 void listTypeReleaseIterator(listTypeIterator *li) {
+    if (li->iter) quicklistReleaseIterator(li->iter);
     zfree(li);
 }
 
@@ -148,24 +155,17 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
     redisAssert(li->subject->encoding == li->encoding);
 
     entry->li = li;
-    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (li->encoding == REDIS_ENCODING_LISTPACK) {
         entry->zi = li->zi;
         if (entry->zi != NULL) {
             if (li->direction == REDIS_TAIL)
-                li->zi = ziplistNext(li->subject->ptr,li->zi);
-            else
-                li->zi = ziplistPrev(li->subject->ptr,li->zi);
-            return 1;
-        }
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        entry->ln = li->ln;
-        if (entry->ln != NULL) {
-            if (li->direction == REDIS_TAIL)
-                li->ln = li->ln->next;
+                li->zi = lpNext(li->subject->ptr,li->zi);
             else
-                li->ln = li->ln->prev;
+                li->zi = lpPrev(li->subject->ptr,li->zi);
             return 1;
         }
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistNext(li->iter,&entry->entry);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -176,53 +176,50 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
 robj *listTypeGet(listTypeEntry *entry) {
     listTypeIterator *li = entry->li;
     robj *value = NULL;
-    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (li->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
         redisAssert(entry->zi != NULL);
-        if (ziplistGet(entry->zi,&vstr,&vlen,&vlong)) {
+        if (lpGetValue(entry->zi,&vstr,&vlen,&vlong)) {
             if (vstr) {
                 value = createStringObject((char*)vstr,vlen);
             } else {
                 value = createStringObjectFromLongLong(vlong);
             }
         }
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        redisAssert(entry->ln != NULL);
-        value = listNodeValue(entry->ln);
-        incrRefCount(value);
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        if (entry->entry.value) {
+            value = createStringObject((char*)entry->entry.value,
+                                       entry->entry.sz);
+        } else {
+            value = createStringObjectFromLongLong(entry->entry.longval);
+        }
     } else {
         redisPanic("Unknown list encoding");
     }
     return value;
 }
 
+/* Insert 'value' before or after the current entry. The iterator must not
+ * be used again after the insertion. */
 void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
     robj *subject = entry->li->subject;
-    if (entry->li->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (entry->li->encoding == REDIS_ENCODING_LISTPACK) {
         value = getDecodedObject(value);
-        if (where == REDIS_TAIL) {
-            unsigned char *next = ziplistNext(subject->ptr,entry->zi);
-
-            /* When we insert after the current element, but the current element
-             * is the tail of the list, we need to do a push. */
-            if (next == NULL) {
-                subject->ptr = ziplistPush(subject->ptr,value->ptr,sdslen(value->ptr),REDIS_TAIL);
-            } else {
-                subject->ptr = ziplistInsert(subject->ptr,next,value->ptr,sdslen(value->ptr));
-            }
-        } else {
-            subject->ptr = ziplistInsert(subject->ptr,entry->zi,value->ptr,sdslen(value->ptr));
-        }
+        subject->ptr = lpInsert(subject->ptr,value->ptr,sdslen(value->ptr),
+            entry->zi,(where == REDIS_TAIL) ? LP_AFTER : LP_BEFORE,NULL);
         decrRefCount(value);
-    } else if (entry->li->encoding == REDIS_ENCODING_LINKEDLIST) {
+    } else if (entry->li->encoding == REDIS_ENCODING_QUICKLIST) {
+        value = getDecodedObject(value);
         if (where == REDIS_TAIL) {
-            listInsertNode(subject->ptr,entry->ln,value,AL_START_TAIL);
+            quicklistInsertAfter(subject->ptr,&entry->entry,
+                                 value->ptr,sdslen(value->ptr));
         } else {
-            listInsertNode(subject->ptr,entry->ln,value,AL_START_HEAD);
+            quicklistInsertBefore(subject->ptr,&entry->entry,
+                                  value->ptr,sdslen(value->ptr));
         }
-        incrRefCount(value);
+        decrRefCount(value);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -231,11 +228,12 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
 /* Compare the given object with the entry at the current position. */
 int listTypeEqual(listTypeEntry *entry, robj *o) {
     listTypeIterator *li = entry->li;
-    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (li->encoding == REDIS_ENCODING_LISTPACK) {
         redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
-        return ziplistCompare(entry->zi,o->ptr,sdslen(o->ptr));
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        return equalStringObjects(o,listNodeValue(entry->ln));
+        return lpCompare(entry->zi,o->ptr,sdslen(o->ptr));
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
+        return quicklistCompare(entry->entry.zi,o->ptr,sdslen(o->ptr));
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -244,45 +242,51 @@ int listTypeEqual(listTypeEntry *entry, robj *o) {
 /* Delete the element pointed to. */
 void listTypeDelete(listTypeEntry *entry) {
     listTypeIterator *li = entry->li;
-    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *p = entry->zi;
-        li->subject->ptr = ziplistDelete(li->subject->ptr,&p);
+    if (li->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p;
+        li->subject->ptr = lpDelete(li->subject->ptr,entry->zi,&p);
 
-        /* Update position of the iterator depending on the direction */
+        /* Update position of the iterator depending on the direction. A NULL
+         * 'p' means we deleted the last element. */
         if (li->direction == REDIS_TAIL)
             li->zi = p;
         else
-            li->zi = ziplistPrev(li->subject->ptr,p);
-    } else if (entry->li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *next;
-        if (li->direction == REDIS_TAIL)
-            next = entry->ln->next;
-        else
-            next = entry->ln->prev;
-        listDelNode(li->subject->ptr,entry->ln);
-        li->ln = next;
+            li->zi = p ? lpPrev(li->subject->ptr,p) :
+                         lpLast(li->subject->ptr);
+    } else if (entry->li->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDelEntry(li->iter,&entry->entry);
     } else {
         redisPanic("Unknown list encoding");
     }
 }
 
+/* Convert a listpack encoded list into a quicklist: the elements are
+ * pushed into ziplist nodes honoring the list-max-ziplist-size and
+ * list-compress-depth settings. */
 void listTypeConvert(robj *subject, int enc) {
-    listTypeIterator *li;
-    listTypeEntry entry;
     redisAssertWithInfo(NULL,subject,subject->type == REDIS_LIST);
+    redisAssertWithInfo(NULL,subject,subject->encoding == REDIS_ENCODING_LISTPACK);
 
-    if (enc == REDIS_ENCODING_LINKEDLIST) {
-        list *l = listCreate();
-        listSetFreeMethod(l,decrRefCountVoid);
-
-        /* listTypeGet returns a robj with incremented refcount */
-        li = listTypeInitIterator(subject,0,REDIS_TAIL);
-        while (listTypeNext(li,&entry)) listAddNodeTail(l,listTypeGet(&entry));
-        listTypeReleaseIterator(li);
+    if (enc == REDIS_ENCODING_QUICKLIST) {
+        unsigned char *lp = subject->ptr, *p = lpFirst(lp);
+        quicklist *ql = quicklistNew(server.list_max_ziplist_size,
+                                     server.list_compress_depth);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        char buf[LP_INTBUF_SIZE];
 
-        subject->encoding = REDIS_ENCODING_LINKEDLIST;
-        zfree(subject->ptr);
-        subject->ptr = l;
+        while (lpGetValue(p,&vstr,&vlen,&vlong)) {
+            if (!vstr) {
+                vlen = ll2string(buf,sizeof(buf),vlong);
+                vstr = (unsigned char*)buf;
+            }
+            quicklistPushTail(ql,vstr,vlen);
+            p = lpNext(lp,p);
+        }
+        lpFree(lp);
+        subject->ptr = ql;
+        subject->encoding = REDIS_ENCODING_QUICKLIST;
     } else {
         redisPanic("Unsupported list conversion");
     }
@@ -304,7 +308,7 @@ void pushGenericCommand(redisClient *c, int where) {
     for (j = 2; j < c->argc; j++) {
         c->argv[j] = tryObjectEncoding(c->argv[j]);
         if (!lobj) {
-            lobj = createZiplistObject();
+            lobj = createListpackObject();
             dbAdd(c->db,c->argv[1],lobj);
         }
         listTypePush(lobj,c->argv[j],where);
@@ -342,7 +346,7 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
          * convert the list inside the iterator. We don't want to loop over
          * the list twice (once to see if the value can be inserted and once
          * to do the actual insert), so we assume this value can be inserted
-         * and convert the ziplist to a regular list if necessary. */
+         * and convert the listpack to a quicklist if necessary. */
         listTypeTryConversion(subject,val);
 
         /* Seek refval from head to tail */
@@ -357,10 +361,10 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
         listTypeReleaseIterator(iter);
 
         if (inserted) {
-            /* Check if the length exceeds the ziplist length threshold. */
-            if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
-                ziplistLen(subject->ptr) > server.list_max_ziplist_entries)
-                    listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+            /* Check if the length exceeds the listpack length threshold. */
+            if (subject->encoding == REDIS_ENCODING_LISTPACK &&
+                lpLength(subject->ptr) > server.list_max_ziplist_entries)
+                    listTypeConvert(subject,REDIS_ENCODING_QUICKLIST);
             signalModifiedKey(c->db,c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"linsert",
                                 c->argv[1],c->db->id);
@@ -418,13 +422,13 @@ void lindexCommand(redisClient *c) {
     if ((getLongFromObjectOrReply(c, c->argv[2], &index, NULL) != REDIS_OK))
         return;
 
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *p;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
-        p = ziplistIndex(o->ptr,index);
-        if (ziplistGet(p,&vstr,&vlen,&vlong)) {
+        p = lpSeek(o->ptr,index);
+        if (lpGetValue(p,&vstr,&vlen,&vlong)) {
             if (vstr) {
                 value = createStringObject((char*)vstr,vlen);
             } else {
@@ -435,11 +439,15 @@ void lindexCommand(redisClient *c) {
         } else {
             addReply(c,shared.nullbulk);
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *ln = listIndex(o->ptr,index);
-        if (ln != NULL) {
-            value = listNodeValue(ln);
-            addReplyBulk(c,value);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistEntry entry;
+        if (quicklistIndex(o->ptr,index,&entry)) {
+            if (entry.value) {
+                addReplyBulkCBuffer(c,entry.value,entry.sz);
+            } else {
+                addReplyBulkLongLong(c,entry.longval);
+            }
+            quicklistRecompressEntry(&entry);
         } else {
             addReply(c,shared.nullbulk);
         }
@@ -458,29 +466,30 @@ void lsetCommand(redisClient *c) {
         return;
 
     listTypeTryConversion(o,value);
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *p, *zl = o->ptr;
-        p = ziplistIndex(zl,index);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p, *lp = o->ptr;
+        p = lpSeek(lp,index);
         if (p == NULL) {
             addReply(c,shared.outofrangeerr);
         } else {
-            o->ptr = ziplistDelete(o->ptr,&p);
             value = getDecodedObject(value);
-            o->ptr = ziplistInsert(o->ptr,p,value->ptr,sdslen(value->ptr));
+            o->ptr = lpReplace(lp,&p,value->ptr,sdslen(value->ptr));
             decrRefCount(value);
             addReply(c,shared.ok);
             signalModifiedKey(c->db,c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"lset",c->argv[1],c->db->id);
             server.dirty++;
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *ln = listIndex(o->ptr,index);
-        if (ln == NULL) {
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        int replaced;
+
+        value = getDecodedObject(value);
+        replaced = quicklistReplaceAtIndex(o->ptr,index,value->ptr,
+                                           sdslen(value->ptr));
+        decrRefCount(value);
+        if (!replaced) {
             addReply(c,shared.outofrangeerr);
         } else {
-            decrRefCount((robj*)listNodeValue(ln));
-            listNodeValue(ln) = value;
-            incrRefCount(value);
             addReply(c,shared.ok);
             signalModifiedKey(c->db,c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST,"lset",c->argv[1],c->db->id);
@@ -491,27 +500,102 @@ void lsetCommand(redisClient *c) {
     }
 }
 
-void popGenericCommand(redisClient *c, int where) {
-    robj *o = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk);
-    if (o == NULL || checkType(c,o,REDIS_LIST)) return;
+/* Reply with up to 'count' elements from the head or the tail of the list,
+ * in the order they are popped, and then remove them all with a single
+ * range deletion, instead of popping them one after the other. Returns the
+ * number of elements removed. */
+static long listPopRangeAndReply(redisClient *c, robj *o, int where, long count) {
+    long llen = listTypeLength(o), j;
 
-    robj *value = listTypePop(o,where);
-    if (value == NULL) {
-        addReply(c,shared.nullbulk);
+    if (count > llen) count = llen;
+    addReplyMultiBulkLen(c,count);
+    if (count == 0) return 0;
+
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr,(where == REDIS_HEAD) ? 0 : -1);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        for (j = 0; j < count; j++) {
+            lpGetValue(p,&vstr,&vlen,&vlong);
+            if (vstr) {
+                addReplyBulkCBuffer(c,vstr,vlen);
+            } else {
+                addReplyBulkLongLong(c,vlong);
+            }
+            p = (where == REDIS_HEAD) ? lpNext(o->ptr,p) : lpPrev(o->ptr,p);
+        }
+        o->ptr = lpDeleteRange(o->ptr,(where == REDIS_HEAD) ? 0 : -count,
+                               count);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter *iter = quicklistGetIterator(o->ptr,
+            (where == REDIS_HEAD) ? AL_START_HEAD : AL_START_TAIL);
+        quicklistEntry entry;
+
+        for (j = 0; j < count; j++) {
+            quicklistNext(iter,&entry);
+            if (entry.value) {
+                addReplyBulkCBuffer(c,entry.value,entry.sz);
+            } else {
+                addReplyBulkLongLong(c,entry.longval);
+            }
+        }
+        quicklistReleaseIterator(iter);
+        quicklistDelRange(o->ptr,(where == REDIS_HEAD) ? 0 : -count,count);
     } else {
-        char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+        redisPanic("Unknown list encoding");
+    }
+    return count;
+}
+
+/* LPOP/RPOP key [count] */
+void popGenericCommand(redisClient *c, int where) {
+    long count = -1;
+    char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+    robj *o;
+
+    if (c->argc > 3) {
+        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+            c->cmd->name);
+        return;
+    } else if (c->argc == 3) {
+        if (getLongFromObjectOrReply(c,c->argv[2],&count,NULL) != REDIS_OK)
+            return;
+        if (count < 0) {
+            addReply(c,shared.outofrangeerr);
+            return;
+        }
+    }
+
+    o = lookupKeyWriteOrReply(c,c->argv[1],
+        (count == -1) ? shared.nullbulk : shared.nullmultibulk);
+    if (o == NULL || checkType(c,o,REDIS_LIST)) return;
 
+    if (count == -1) {
+        robj *value = listTypePop(o,where);
+        if (value == NULL) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
         addReplyBulk(c,value);
         decrRefCount(value);
-        notifyKeyspaceEvent(REDIS_NOTIFY_LIST,event,c->argv[1],c->db->id);
-        if (listTypeLength(o) == 0) {
-            notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",
-                                c->argv[1],c->db->id);
-            dbDelete(c->db,c->argv[1]);
-        }
-        signalModifiedKey(c->db,c->argv[1]);
-        server.dirty++;
+        count = 1;
+    } else {
+        /* The command is replicated verbatim: popping from one end of the
+         * list is deterministic. */
+        count = listPopRangeAndReply(c,o,where,count);
+        if (count == 0) return;
+    }
+
+    notifyKeyspaceEvent(REDIS_NOTIFY_LIST,event,c->argv[1],c->db->id);
+    if (listTypeLength(o) == 0) {
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",
+                            c->argv[1],c->db->id);
+        dbDelete(c->db,c->argv[1]);
     }
+    signalModifiedKey(c->db,c->argv[1]);
+    server.dirty += count;
 }
 
 void lpopCommand(redisClient *c) {
@@ -549,43 +633,45 @@ void lrangeCommand(redisClient *c) {
 
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c,rangelen);
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *p = ziplistIndex(o->ptr,start);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr,start);
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
 
         while(rangelen--) {
-            ziplistGet(p,&vstr,&vlen,&vlong);
+            lpGetValue(p,&vstr,&vlen,&vlong);
             if (vstr) {
                 addReplyBulkCBuffer(c,vstr,vlen);
             } else {
                 addReplyBulkLongLong(c,vlong);
             }
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *ln;
-
-        /* If we are nearest to the end of the list, reach the element
-         * starting from tail and going backward, as it is faster. */
-        if (start > llen/2) start -= llen;
-        ln = listIndex(o->ptr,start);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        /* quicklistGetIteratorAtIdx() seeks the start node walking from
+         * the nearest end of the list, skipping whole nodes at a time. */
+        quicklistIter *iter = quicklistGetIteratorAtIdx(o->ptr,
+                                                        AL_START_HEAD,start);
+        quicklistEntry entry;
 
         while(rangelen--) {
-            addReplyBulk(c,ln->value);
-            ln = ln->next;
+            quicklistNext(iter,&entry);
+            if (entry.value) {
+                addReplyBulkCBuffer(c,entry.value,entry.sz);
+            } else {
+                addReplyBulkLongLong(c,entry.longval);
+            }
         }
+        quicklistReleaseIterator(iter);
     } else {
-        redisPanic("List encoding is not LINKEDLIST nor ZIPLIST!");
+        redisPanic("List encoding is not QUICKLIST nor LISTPACK!");
     }
 }
 
 void ltrimCommand(redisClient *c) {
     robj *o;
-    long start, end, llen, j, ltrim, rtrim;
-    list *list;
-    listNode *ln;
+    long start, end, llen, ltrim, rtrim;
 
     if ((getLongFromObjectOrReply(c, c->argv[2], &start, NULL) != REDIS_OK) ||
         (getLongFromObjectOrReply(c, c->argv[3], &end, NULL) != REDIS_OK)) return;
@@ -612,19 +698,12 @@ void ltrimCommand(redisClient *c) {
     }
 
     /* Remove list elements to perform the trim */
-    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-        o->ptr = ziplistDeleteRange(o->ptr,0,ltrim);
-        o->ptr = ziplistDeleteRange(o->ptr,-rtrim,rtrim);
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list = o->ptr;
-        for (j = 0; j < ltrim; j++) {
-            ln = listFirst(list);
-            listDelNode(list,ln);
-        }
-        for (j = 0; j < rtrim; j++) {
-            ln = listLast(list);
-            listDelNode(list,ln);
-        }
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        o->ptr = lpDeleteRange(o->ptr,0,ltrim);
+        o->ptr = lpDeleteRange(o->ptr,-rtrim,rtrim);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDelRange(o->ptr,0,ltrim);
+        quicklistDelRange(o->ptr,-rtrim,rtrim);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -652,9 +731,9 @@ void lremCommand(redisClient *c) {
     subject = lookupKeyWriteOrReply(c,c->argv[1],shared.czero);
     if (subject == NULL || checkType(c,subject,REDIS_LIST)) return;
 
-    /* Make sure obj is raw when we're dealing with a ziplist */
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        obj = getDecodedObject(obj);
+    /* Make sure obj is raw: both list encodings compare against packed
+     * entries. */
+    obj = getDecodedObject(obj);
 
     listTypeIterator *li;
     if (toremove < 0) {
@@ -675,8 +754,7 @@ void lremCommand(redisClient *c) {
     listTypeReleaseIterator(li);
 
     /* Clean up raw encoded object */
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        decrRefCount(obj);
+    decrRefCount(obj);
 
     if (listTypeLength(subject) == 0) dbDelete(c->db,c->argv[1]);
     addReplyLongLong(c,removed);
@@ -702,7 +780,7 @@ void lremCommand(redisClient *c) {
 void rpoplpushHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj *value) {
     /* Create the list if the key does not exist */
     if (!dstobj) {
-        dstobj = createZiplistObject();
+        dstobj = createListpackObject();
         dbAdd(c->db,dstkey,dstobj);
     }
     signalModifiedKey(c->db,dstkey);
@@ -842,14 +920,15 @@ void unblockClientWaitingData(redisClient *c) {
     listAddNodeTail(server.unblocked_clients,c);
 }
 
-/* If the specified key has clients blocked waiting for list pushes, this
- * function will put the key reference into the server.ready_keys list.
+/* If the specified key has clients blocked waiting for list pushes or
+ * sorted set additions, this function will put the key reference into the
+ * server.ready_keys list.
  * Note that db->ready_keys is a hash table that allows us to avoid putting
  * the same key again and again in the list in case of multiple pushes
  * made by a script or in the context of MULTI/EXEC.
  *
- * The list will be finally processed by handleClientsBlockedOnLists() */
-void signalListAsReady(redisDb *db, robj *key) {
+ * The list will be finally processed by handleClientsBlockedOnKeys() */
+void signalKeyAsReady(redisDb *db, robj *key) {
     readyList *rl;
 
     /* No clients blocking for this key? No need to queue it. */
@@ -872,7 +951,7 @@ void signalListAsReady(redisDb *db, robj *key) {
     redisAssert(dictAdd(db->ready_keys,key,NULL) == DICT_OK);
 }
 
-/* This is a helper function for handleClientsBlockedOnLists(). It's work
+/* This is a helper function for handleClientsBlockedOnKeys(). It's work
  * is to serve a specific client (receiver) that is blocked on 'key'
  * in the context of the specified 'db', doing the following:
  *
@@ -941,6 +1020,30 @@ int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey, red
     return REDIS_OK;
 }
 
+/* Return true if the client is blocked by BZPOPMIN/BZPOPMAX, so that it
+ * must be served only by sorted sets, and not by lists. */
+static int clientBlockedOnSortedSet(redisClient *c) {
+    return c->lastcmd && (c->lastcmd->proc == bzpopminCommand ||
+                          c->lastcmd->proc == bzpopmaxCommand);
+}
+
+/* Helper function for handleClientsBlockedOnKeys(): serve a client blocked
+ * by BZPOPMIN/BZPOPMAX on 'key' popping a single element, and propagate the
+ * operation as a ZPOPMIN/ZPOPMAX into the AOF and replication channel. */
+static void serveClientBlockedOnSortedSet(redisClient *receiver, robj *key, redisDb *db) {
+    int where = (receiver->lastcmd->proc == bzpopminCommand) ?
+                ZSET_MIN : ZSET_MAX;
+    robj *argv[2];
+
+    genericZpopCommand(receiver,&key,1,where,1,NULL);
+
+    argv[0] = (where == ZSET_MIN) ? shared.zpopmin : shared.zpopmax;
+    argv[1] = key;
+    propagate((where == ZSET_MIN) ?
+        server.zpopminCommand : server.zpopmaxCommand,
+        db->id,argv,2,REDIS_PROPAGATE_AOF|REDIS_PROPAGATE_REPL);
+}
+
 /* This function should be called by Redis every time a single command,
  * a MULTI/EXEC block, or a Lua script, terminated its execution after
  * being called by a client.
@@ -951,13 +1054,13 @@ int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey, red
  * serve clients accordingly. Note that the function will iterate again and
  * again as a result of serving BRPOPLPUSH we can have new blocking clients
  * to serve because of the PUSH side of BRPOPLPUSH. */
-void handleClientsBlockedOnLists(void) {
+void handleClientsBlockedOnKeys(void) {
     while(listLength(server.ready_keys) != 0) {
         list *l;
 
         /* Point server.ready_keys to a fresh list and save the current one
          * locally. This way as we run the old list we are free to call
-         * signalListAsReady() that may push new elements in server.ready_keys
+         * signalKeyAsReady() that may push new elements in server.ready_keys
          * when handling clients blocked into BRPOPLPUSH. */
         l = server.ready_keys;
         server.ready_keys = listCreate();
@@ -967,7 +1070,7 @@ void handleClientsBlockedOnLists(void) {
             readyList *rl = ln->value;
 
             /* First of all remove this key from db->ready_keys so that
-             * we can safely call signalListAsReady() against this key. */
+             * we can safely call signalKeyAsReady() against this key. */
             dictDelete(rl->db->ready_keys,rl->key);
 
             /* If the key exists and it's a list, serve blocked clients
@@ -977,21 +1080,26 @@ void handleClientsBlockedOnLists(void) {
                 dictEntry *de;
 
                 /* We serve clients in the same order they blocked for
-                 * this key, from the first blocked to the last. */
+                 * this key, from the first blocked to the last. Clients
+                 * blocked by BZPOPMIN/BZPOPMAX on the same key are
+                 * skipped. */
                 de = dictFind(rl->db->blocking_keys,rl->key);
                 if (de) {
                     list *clients = dictGetVal(de);
-                    int numclients = listLength(clients);
+                    listNode *clientnode;
+                    listIter li;
 
-                    while(numclients--) {
-                        listNode *clientnode = listFirst(clients);
+                    listRewind(clients,&li);
+                    while((clientnode = listNext(&li)) != NULL) {
                         redisClient *receiver = clientnode->value;
                         robj *dstkey = receiver->bpop.target;
                         int where = (receiver->lastcmd &&
                                      receiver->lastcmd->proc == blpopCommand) ?
                                     REDIS_HEAD : REDIS_TAIL;
-                        robj *value = listTypePop(o,where);
+                        robj *value;
 
+                        if (clientBlockedOnSortedSet(receiver)) continue;
+                        value = listTypePop(o,where);
                         if (value) {
                             /* Protect receiver->bpop.target, that will be
                              * freed by the next unblockClientWaitingData()
@@ -1019,6 +1127,29 @@ void handleClientsBlockedOnLists(void) {
                 if (listTypeLength(o) == 0) dbDelete(rl->db,rl->key);
                 /* We don't call signalModifiedKey() as it was already called
                  * when an element was pushed on the list. */
+            } else if (o != NULL && o->type == REDIS_ZSET) {
+                dictEntry *de;
+
+                /* Same as above for clients blocked by BZPOPMIN/BZPOPMAX.
+                 * The sorted set is deleted by the pop of its last element,
+                 * so we stop as soon as it is empty. */
+                de = dictFind(rl->db->blocking_keys,rl->key);
+                if (de) {
+                    list *clients = dictGetVal(de);
+                    unsigned long zcard = zsetLength(o);
+                    listNode *clientnode;
+                    listIter li;
+
+                    listRewind(clients,&li);
+                    while(zcard && (clientnode = listNext(&li)) != NULL) {
+                        redisClient *receiver = clientnode->value;
+
+                        if (!clientBlockedOnSortedSet(receiver)) continue;
+                        unblockClientWaitingData(receiver);
+                        serveClientBlockedOnSortedSet(receiver,rl->key,rl->db);
+                        zcard--;
+                    }
+                }
             }
 
             /* Free this item. */
@@ -35,6 +35,52 @@
 
 void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *dstkey, int op);
 
+/* Roaring bitmaps use a container for every 65536 wide range of integers
+ * holding at least an element: when the elements are spread so much that
+ * most containers only hold a few of them, a hash table is used instead.
+ * Containers are kept in a sorted array, so their number is capped as well
+ * to bound the cost of creating a new one. */
+#define SET_ROARING_MIN_DENSITY 4
+#define SET_ROARING_MAX_CONTAINERS 16384
+
+/* SADD adds this many members or more to an intset with a single merge. */
+#define SADD_BULK_MIN_MEMBERS 16
+
+/* Return 1 if 'card' elements using 'containers' roaring containers are
+ * dense enough to be stored in a roaring bitmap, see SET_ROARING_MIN_DENSITY. */
+static int setTypeIsDense(uint64_t containers, uint64_t card) {
+    return containers <= server.set_max_intset_entries ||
+           (containers <= SET_ROARING_MAX_CONTAINERS &&
+            containers*SET_ROARING_MIN_DENSITY <= card);
+}
+
+/* Same as setTypeIsDense() for an existing roaring bitmap. */
+static int setTypeRoaringIsDense(roaring *r) {
+    return setTypeIsDense(roaringContainers(r),roaringCardinality(r));
+}
+
+/* Convert an intset that grew over the set-max-intset-entries limit into
+ * a roaring bitmap, or into a hash table if roaring bitmaps are disabled
+ * or the elements are too sparse. The containers are counted on the intset
+ * itself, where they are runs of elements sharing the same upper bits. */
+static void setTypeConvertBigIntset(robj *subject) {
+    intset *is = subject->ptr;
+    uint32_t len = intsetLen(is), j;
+    uint64_t containers = 0;
+    int64_t value, prev = 0;
+
+    if (server.set_roaring) {
+        for (j = 0; j < len; j++) {
+            intsetGet(is,j,&value);
+            if (j == 0 || (value >> 16) != (prev >> 16)) containers++;
+            prev = value;
+        }
+    }
+    setTypeConvert(subject,server.set_roaring &&
+                           setTypeIsDense(containers,len) ?
+                           REDIS_ENCODING_ROARING : REDIS_ENCODING_HT);
+}
+
 /* Factory method to return a set that *can* hold "value". When the object has
  * an integer-encodable value, an intset will be returned. Otherwise a regular
  * hash table. */
@@ -59,7 +105,7 @@ int setTypeAdd(robj *subject, robj *value) {
                 /* Convert to regular set when the intset contains
                  * too many entries. */
                 if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,REDIS_ENCODING_HT);
+                    setTypeConvertBigIntset(subject);
                 return 1;
             }
         } else {
@@ -72,6 +118,20 @@ int setTypeAdd(robj *subject, robj *value) {
             incrRefCount(value);
             return 1;
         }
+    } else if (subject->encoding == REDIS_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value,&llval) == REDIS_OK) {
+            if (roaringAdd(subject->ptr,llval)) {
+                if (!setTypeRoaringIsDense(subject->ptr))
+                    setTypeConvert(subject,REDIS_ENCODING_HT);
+                return 1;
+            }
+        } else {
+            /* Like intsets, roaring bitmaps only hold integers. */
+            setTypeConvert(subject,REDIS_ENCODING_HT);
+            redisAssertWithInfo(NULL,value,dictAdd(subject->ptr,value,NULL) == DICT_OK);
+            incrRefCount(value);
+            return 1;
+        }
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -91,6 +151,9 @@ int setTypeRemove(robj *setobj, robj *value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == REDIS_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value,&llval) == REDIS_OK)
+            return roaringRemove(setobj->ptr,llval);
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -105,6 +168,10 @@ int setTypeIsMember(robj *subject, robj *value) {
         if (isObjectRepresentableAsLongLong(value,&llval) == REDIS_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == REDIS_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value,&llval) == REDIS_OK) {
+            return roaringContains(subject->ptr,llval);
+        }
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -119,6 +186,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == REDIS_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == REDIS_ENCODING_ROARING) {
+        roaringInitIterator(subject->ptr,&si->ri);
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -137,7 +206,8 @@ void setTypeReleaseIterator(setTypeIterator *si) {
  * Since set elements can be internally be stored as redis objects or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (eobj) or (llobj) accordingly.
+ * (eobj) or (llobj) accordingly. Roaring bitmaps only hold integers as well,
+ * so for them REDIS_ENCODING_INTSET is returned and (llobj) populated.
  *
  * When there are no longer elements -1 is returned.
  * Returned objects ref count is not incremented, so this function is
@@ -150,6 +220,9 @@ int setTypeNext(setTypeIterator *si, robj **objele, int64_t *llele) {
     } else if (si->encoding == REDIS_ENCODING_INTSET) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
+    } else if (si->encoding == REDIS_ENCODING_ROARING) {
+        if (!roaringNext(&si->ri,llele)) return -1;
+        return REDIS_ENCODING_INTSET;
     }
     return si->encoding;
 }
@@ -188,7 +261,8 @@ robj *setTypeNextObject(setTypeIterator *si) {
  * The caller provides both pointers to be populated with the right
  * object. The return value of the function is the object->encoding
  * field of the object and is used by the caller to check if the
- * int64_t pointer or the redis object pointer was populated.
+ * int64_t pointer or the redis object pointer was populated. Sets encoded
+ * as roaring bitmaps return REDIS_ENCODING_INTSET like intsets.
  *
  * When an object is returned (the set was a real set) the ref count
  * of the object is not incremented so this function can be considered
@@ -199,6 +273,9 @@ int setTypeRandomElement(robj *setobj, robj **objele, int64_t *llele) {
         *objele = dictGetKey(de);
     } else if (setobj->encoding == REDIS_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
+    } else if (setobj->encoding == REDIS_ENCODING_ROARING) {
+        *llele = roaringRandom(setobj->ptr);
+        return REDIS_ENCODING_INTSET;
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -210,6 +287,8 @@ unsigned long setTypeSize(robj *subject) {
         return dictSize((dict*)subject->ptr);
     } else if (subject->encoding == REDIS_ENCODING_INTSET) {
         return intsetLen((intset*)subject->ptr);
+    } else if (subject->encoding == REDIS_ENCODING_ROARING) {
+        return roaringCardinality(subject->ptr);
     } else {
         redisPanic("Unknown set encoding");
     }
@@ -217,19 +296,21 @@ unsigned long setTypeSize(robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted into roaring bitmaps and hash tables, roaring
+ * bitmaps into intsets and hash tables. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
+    int64_t intele;
     redisAssertWithInfo(NULL,setobj,setobj->type == REDIS_SET &&
-                             setobj->encoding == REDIS_ENCODING_INTSET);
+                             (setobj->encoding == REDIS_ENCODING_INTSET ||
+                              setobj->encoding == REDIS_ENCODING_ROARING));
 
     if (enc == REDIS_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
         robj *element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
         si = setTypeInitIterator(setobj);
@@ -239,17 +320,70 @@ void setTypeConvert(robj *setobj, int enc) {
         }
         setTypeReleaseIterator(si);
 
+        if (setobj->encoding == REDIS_ENCODING_ROARING)
+            roaringFree(setobj->ptr);
+        else
+            zfree(setobj->ptr);
         setobj->encoding = REDIS_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == REDIS_ENCODING_ROARING &&
+               setobj->encoding == REDIS_ENCODING_INTSET)
+    {
+        roaring *r = roaringNew();
+
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si,NULL,&intele) != -1) roaringAdd(r,intele);
+        setTypeReleaseIterator(si);
+
+        zfree(setobj->ptr);
+        setobj->encoding = REDIS_ENCODING_ROARING;
+        setobj->ptr = r;
+    } else if (enc == REDIS_ENCODING_INTSET &&
+               setobj->encoding == REDIS_ENCODING_ROARING)
+    {
+        intset *is = intsetNew();
+
+        /* Elements are visited in ascending order, so every intsetAdd()
+         * appends at the tail. */
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si,NULL,&intele) != -1)
+            is = intsetAdd(is,intele,NULL);
+        setTypeReleaseIterator(si);
+
+        roaringFree(setobj->ptr);
+        setobj->encoding = REDIS_ENCODING_INTSET;
+        setobj->ptr = is;
     } else {
         redisPanic("Unsupported set conversion");
     }
 }
 
+/* Add the members c->argv[2..] to an intset with a single sort-merge,
+ * when all of them are integers. Returns the number of members added, or
+ * -1 if some member is not an integer and they must be added one by one. */
+static int saddIntsetBulk(redisClient *c, robj *set) {
+    int j, count = c->argc-2;
+    int64_t *values = zmalloc(sizeof(int64_t)*count);
+    long long llval;
+    uint32_t added;
+
+    for (j = 0; j < count; j++) {
+        if (isObjectRepresentableAsLongLong(c->argv[j+2],&llval) != REDIS_OK) {
+            zfree(values);
+            return -1;
+        }
+        values[j] = llval;
+    }
+    set->ptr = intsetAddMany(set->ptr,values,count,&added);
+    zfree(values);
+    if (intsetLen(set->ptr) > server.set_max_intset_entries)
+        setTypeConvertBigIntset(set);
+    return added;
+}
+
 void saddCommand(redisClient *c) {
     robj *set;
-    int j, added = 0;
+    int j, added = -1;
 
     set = lookupKeyWrite(c->db,c->argv[1]);
     if (set == NULL) {
@@ -262,9 +396,15 @@ void saddCommand(redisClient *c) {
         }
     }
 
-    for (j = 2; j < c->argc; j++) {
-        c->argv[j] = tryObjectEncoding(c->argv[j]);
-        if (setTypeAdd(set,c->argv[j])) added++;
+    if (set->encoding == REDIS_ENCODING_INTSET &&
+        c->argc-2 >= SADD_BULK_MIN_MEMBERS)
+        added = saddIntsetBulk(c,set);
+    if (added == -1) {
+        added = 0;
+        for (j = 2; j < c->argc; j++) {
+            c->argv[j] = tryObjectEncoding(c->argv[j]);
+            if (setTypeAdd(set,c->argv[j])) added++;
+        }
     }
     if (added) {
         signalModifiedKey(c->db,c->argv[1]);
@@ -377,18 +517,156 @@ void scardCommand(redisClient *c) {
     addReplyLongLong(c,setTypeSize(o));
 }
 
+/* handle the "SPOP key <count>" variant. The normal version of the
+ * command is handled by the spopCommand() function itself. */
+
+/* How many times bigger should be the set compared to the number of
+ * elements to pop, for us to extract the elements one by one? When the
+ * set is not big enough, the elements that survive are moved into a new
+ * set instead, and the old one is released with everything is left in it. */
+#define SPOP_MOVE_STRATEGY_MUL 5
+
+void spopWithCountCommand(redisClient *c) {
+    long l;
+    unsigned long count, size, j;
+    robj *set, *ele, **argv;
+    setTypeIterator *si;
+    int64_t llele;
+    int encoding;
+
+    if (getLongFromObjectOrReply(c,c->argv[2],&l,NULL) != REDIS_OK) return;
+    if (l < 0) {
+        addReply(c,shared.outofrangeerr);
+        return;
+    }
+    count = (unsigned long) l;
+
+    if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.emptymultibulk))
+        == NULL || checkType(c,set,REDIS_SET)) return;
+
+    if (count == 0) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+    size = setTypeSize(set);
+    notifyKeyspaceEvent(REDIS_NOTIFY_SET,"spop",c->argv[1],c->db->id);
+
+    /* CASE 1: the number of requested elements is greater than or equal to
+     * the number of elements inside the set: return the whole set and
+     * delete the key, replicating a plain DEL. */
+    if (count >= size) {
+        addReplyMultiBulkLen(c,size);
+        si = setTypeInitIterator(set);
+        while((ele = setTypeNextObject(si)) != NULL) {
+            addReplyBulk(c,ele);
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+        dbDelete(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",c->argv[1],c->db->id);
+        rewriteClientCommandVector(c,2,shared.del,c->argv[1]);
+        signalModifiedKey(c->db,c->argv[1]);
+        server.dirty += size;
+        return;
+    }
+
+    /* In every other case the popped elements are collected into a new
+     * command vector, so that the whole operation is replicated as a single
+     * SREM instead of one command per element. */
+    argv = zmalloc(sizeof(robj*)*(count+2));
+    argv[0] = createStringObject("SREM",4);
+    argv[1] = c->argv[1];
+    incrRefCount(argv[1]);
+    addReplyMultiBulkLen(c,count);
+
+    if (set->encoding == REDIS_ENCODING_INTSET) {
+        /* CASE 2: intsets are able to pop a random subset natively, with a
+         * single pass and a single reallocation. */
+        int64_t *popped = zmalloc(sizeof(int64_t)*count);
+
+        set->ptr = intsetPopRandom(set->ptr,count,popped);
+        for (j = 0; j < count; j++) {
+            argv[j+2] = createStringObjectFromLongLong(popped[j]);
+            addReplyBulk(c,argv[j+2]);
+        }
+        zfree(popped);
+    } else if (count*SPOP_MOVE_STRATEGY_MUL < size) {
+        /* CASE 3: we pop a small part of the set, just extract the
+         * elements one after the other. */
+        for (j = 0; j < count; j++) {
+            encoding = setTypeRandomElement(set,&ele,&llele);
+            if (encoding == REDIS_ENCODING_INTSET) {
+                ele = createStringObjectFromLongLong(llele);
+            } else {
+                incrRefCount(ele);
+            }
+            setTypeRemove(set,ele);
+            argv[j+2] = ele;
+            addReplyBulk(c,ele);
+        }
+    } else {
+        /* CASE 4: most of the set is going to be popped. Extracting random
+         * elements from an hash table that gets emptier and emptier is slow,
+         * so we move the elements that will remain into a new set, and
+         * reply with everything that is left in the old one, that is then
+         * released as a whole. */
+        unsigned long remaining = size-count;
+        robj *newset = NULL;
+
+        while (remaining--) {
+            encoding = setTypeRandomElement(set,&ele,&llele);
+            if (encoding == REDIS_ENCODING_INTSET) {
+                ele = createStringObjectFromLongLong(llele);
+            } else {
+                incrRefCount(ele);
+            }
+            if (newset == NULL) newset = setTypeCreate(ele);
+            setTypeAdd(newset,ele);
+            setTypeRemove(set,ele);
+            decrRefCount(ele);
+        }
+
+        j = 2;
+        si = setTypeInitIterator(set);
+        while((ele = setTypeNextObject(si)) != NULL) {
+            argv[j++] = ele;
+            addReplyBulk(c,ele);
+        }
+        setTypeReleaseIterator(si);
+        redisAssert(j == count+2);
+
+        /* Transfer the new set to the key: the old set is freed. */
+        dbOverwrite(c->db,c->argv[1],newset);
+    }
+
+    replaceClientCommandVector(c,count+2,argv);
+    signalModifiedKey(c->db,c->argv[1]);
+    server.dirty += count;
+}
+
 void spopCommand(redisClient *c) {
     robj *set, *ele, *aux;
     int64_t llele;
     int encoding;
 
+    if (c->argc == 3) {
+        spopWithCountCommand(c);
+        return;
+    } else if (c->argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
     if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
     encoding = setTypeRandomElement(set,&ele,&llele);
     if (encoding == REDIS_ENCODING_INTSET) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
+        if (set->encoding == REDIS_ENCODING_ROARING)
+            roaringRemove(set->ptr,llele);
+        else
+            set->ptr = intsetRemove(set->ptr,llele,NULL);
     } else {
         incrRefCount(ele);
         setTypeRemove(set,ele);
@@ -592,7 +870,132 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return  (o2 ? setTypeSize(o2) : 0) - (o1 ? setTypeSize(o1) : 0);
 }
 
-void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum, robj *dstkey) {
+#define REDIS_OP_UNION 0
+#define REDIS_OP_DIFF 1
+#define REDIS_OP_INTER 2
+
+/* Return 1 if all the existing sets in 'sets' are intset or roaring bitmap
+ * encoded, so that setTypeIntegerOperation() can be used. NULL entries (non
+ * existing keys) are ignored. */
+static int setTypeAllIntegers(robj **sets, unsigned long setnum) {
+    unsigned long j;
+
+    for (j = 0; j < setnum; j++)
+        if (sets[j] && sets[j]->encoding != REDIS_ENCODING_INTSET &&
+                       sets[j]->encoding != REDIS_ENCODING_ROARING) return 0;
+    return 1;
+}
+
+/* Perform the REDIS_OP_* operation 'op' between intset encoded sets,
+ * merging their sorted contents (see intsetIntersect() and friends) instead
+ * of looking up every element into the other sets. NULL entries are
+ * handled as empty sets. The result is returned as a new set object, that
+ * is converted like intsets growing over set-max-intset-entries if it is
+ * too big to be an intset. */
+static robj *setTypeIntsetOperation(robj **sets, unsigned long setnum, int op) {
+    intset *result = NULL, *is;
+    unsigned long j;
+    robj *o;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) {
+            if (op == REDIS_OP_DIFF && j == 0) break;
+            continue;
+        }
+        if (result == NULL) {
+            result = zmalloc(intsetBlobLen(sets[j]->ptr));
+            memcpy(result,sets[j]->ptr,intsetBlobLen(sets[j]->ptr));
+            continue;
+        }
+        if (op == REDIS_OP_INTER)
+            is = intsetIntersect(result,sets[j]->ptr);
+        else if (op == REDIS_OP_UNION)
+            is = intsetUnion(result,sets[j]->ptr);
+        else
+            is = intsetDifference(result,sets[j]->ptr);
+        zfree(result);
+        result = is;
+        /* Nothing to intersect or subtract from an empty set. */
+        if (op != REDIS_OP_UNION && intsetLen(result) == 0) break;
+    }
+    if (result == NULL) result = intsetNew();
+
+    o = createObject(REDIS_SET,result);
+    o->encoding = REDIS_ENCODING_INTSET;
+    if (intsetLen(result) > server.set_max_intset_entries)
+        setTypeConvertBigIntset(o);
+    return o;
+}
+
+/* Like setTypeIntsetOperation() but for a mix of intsets and roaring
+ * bitmaps: intsets are turned into temporary roaring bitmaps and the
+ * operation is performed container by container. */
+static robj *setTypeRoaringOperation(robj **sets, unsigned long setnum, int op) {
+    roaring *result = NULL, *r, *tmp;
+    unsigned long j;
+    setTypeIterator *si;
+    int64_t intele;
+    robj *o;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] == NULL) {
+            if (op == REDIS_OP_DIFF && j == 0) break;
+            continue;
+        }
+        tmp = NULL;
+        if (sets[j]->encoding == REDIS_ENCODING_ROARING) {
+            r = sets[j]->ptr;
+        } else {
+            r = tmp = roaringNew();
+            si = setTypeInitIterator(sets[j]);
+            while (setTypeNext(si,NULL,&intele) != -1) roaringAdd(tmp,intele);
+            setTypeReleaseIterator(si);
+        }
+        if (result == NULL) {
+            result = tmp ? tmp : roaringDup(r);
+            continue;
+        }
+        if (op == REDIS_OP_INTER)
+            r = roaringAnd(result,r);
+        else if (op == REDIS_OP_UNION)
+            r = roaringOr(result,r);
+        else
+            r = roaringAndNot(result,r);
+        roaringFree(result);
+        if (tmp) roaringFree(tmp);
+        result = r;
+        /* Nothing to intersect or subtract from an empty set. */
+        if (op != REDIS_OP_UNION && roaringCardinality(result) == 0) break;
+    }
+    if (result == NULL) result = roaringNew();
+
+    o = createObject(REDIS_SET,result);
+    o->encoding = REDIS_ENCODING_ROARING;
+    if (roaringCardinality(result) <= server.set_max_intset_entries)
+        setTypeConvert(o,REDIS_ENCODING_INTSET);
+    else if (!server.set_roaring || !setTypeRoaringIsDense(result))
+        setTypeConvert(o,REDIS_ENCODING_HT);
+    return o;
+}
+
+/* Perform the REDIS_OP_* operation 'op' between sets only holding integers
+ * (see setTypeAllIntegers()), using the roaring bitmaps operations when at
+ * least one of the sets is a roaring bitmap. */
+static robj *setTypeIntegerOperation(robj **sets, unsigned long setnum, int op) {
+    unsigned long j;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] && sets[j]->encoding == REDIS_ENCODING_ROARING)
+            return setTypeRoaringOperation(sets,setnum,op);
+    }
+    return setTypeIntsetOperation(sets,setnum,op);
+}
+
+/* When 'cardinality_only' is true only the number of elements of the
+ * intersection is computed and replied, stopping as soon as 'limit'
+ * elements are found (zero means no limit). */
+void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
+                          robj *dstkey, int cardinality_only, unsigned long limit) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
     robj *eleobj, *dstset = NULL;
@@ -613,6 +1016,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
                     server.dirty++;
                 }
                 addReply(c,shared.czero);
+            } else if (cardinality_only) {
+                addReply(c,shared.czero);
             } else {
                 addReply(c,shared.emptymultibulk);
             }
@@ -633,7 +1038,9 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    if (!dstkey) {
+    if (cardinality_only) {
+        /* Nothing to emit until the cardinality is known. */
+    } else if (!dstkey) {
         replylen = addDeferredMultiBulkLength(c);
     } else {
         /* If we have a target key where to store the resulting set
@@ -641,67 +1048,101 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
         dstset = createIntsetObject();
     }
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si,&eleobj,&intobj)) != -1) {
-        for (j = 1; j < setnum; j++) {
-            if (sets[j] == sets[0]) continue;
-            if (encoding == REDIS_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                if (sets[j]->encoding == REDIS_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                } else if (sets[j]->encoding == REDIS_ENCODING_HT) {
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    if (!setTypeIsMember(sets[j],eleobj)) {
+    if (!cardinality_only && setTypeAllIntegers(sets,setnum)) {
+        /* All the sets only hold integers: intersect their sorted
+         * contents. A single set is replied as it is, without a copy. */
+        robj *result;
+
+        if (setnum == 1 && !dstkey) {
+            result = sets[0];
+            incrRefCount(result);
+        } else {
+            result = setTypeIntegerOperation(sets,setnum,REDIS_OP_INTER);
+        }
+
+        if (!dstkey) {
+            si = setTypeInitIterator(result);
+            while(setTypeNext(si,&eleobj,&intobj) != -1) {
+                addReplyBulkLongLong(c,intobj);
+                cardinality++;
+            }
+            setTypeReleaseIterator(si);
+            decrRefCount(result);
+        } else {
+            decrRefCount(dstset);
+            dstset = result;
+        }
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        si = setTypeInitIterator(sets[0]);
+        while((encoding = setTypeNext(si,&eleobj,&intobj)) != -1) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (encoding == REDIS_ENCODING_INTSET) {
+                    /* intset with intset is simple... and fast */
+                    if (sets[j]->encoding == REDIS_ENCODING_INTSET &&
+                        !intsetFind((intset*)sets[j]->ptr,intobj))
+                    {
+                        break;
+                    } else if (sets[j]->encoding == REDIS_ENCODING_ROARING &&
+                               !roaringContains(sets[j]->ptr,intobj))
+                    {
+                        break;
+                    /* in order to compare an integer with an object we
+                     * have to use the generic function, creating an object
+                     * for this */
+                    } else if (sets[j]->encoding == REDIS_ENCODING_HT) {
+                        eleobj = createStringObjectFromLongLong(intobj);
+                        if (!setTypeIsMember(sets[j],eleobj)) {
+                            decrRefCount(eleobj);
+                            break;
+                        }
                         decrRefCount(eleobj);
+                    }
+                } else if (encoding == REDIS_ENCODING_HT) {
+                    /* Optimization... if the source object is integer
+                     * encoded AND the target set is an intset, we can get
+                     * a much faster path. */
+                    if (eleobj->encoding == REDIS_ENCODING_INT &&
+                        sets[j]->encoding == REDIS_ENCODING_INTSET &&
+                        !intsetFind((intset*)sets[j]->ptr,(long)eleobj->ptr))
+                    {
+                        break;
+                    /* else... object to object check is easy as we use the
+                     * type agnostic API here. */
+                    } else if (!setTypeIsMember(sets[j],eleobj)) {
                         break;
                     }
-                    decrRefCount(eleobj);
-                }
-            } else if (encoding == REDIS_ENCODING_HT) {
-                /* Optimization... if the source object is integer
-                 * encoded AND the target set is an intset, we can get
-                 * a much faster path. */
-                if (eleobj->encoding == REDIS_ENCODING_INT &&
-                    sets[j]->encoding == REDIS_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,(long)eleobj->ptr))
-                {
-                    break;
-                /* else... object to object check is easy as we use the
-                 * type agnostic API here. */
-                } else if (!setTypeIsMember(sets[j],eleobj)) {
-                    break;
                 }
             }
-        }
 
-        /* Only take action when all sets contain the member */
-        if (j == setnum) {
-            if (!dstkey) {
-                if (encoding == REDIS_ENCODING_HT)
-                    addReplyBulk(c,eleobj);
-                else
-                    addReplyBulkLongLong(c,intobj);
-                cardinality++;
-            } else {
-                if (encoding == REDIS_ENCODING_INTSET) {
-                    eleobj = createStringObjectFromLongLong(intobj);
-                    setTypeAdd(dstset,eleobj);
-                    decrRefCount(eleobj);
+            /* Only take action when all sets contain the member */
+            if (j == setnum) {
+                if (cardinality_only) {
+                    cardinality++;
+                    /* We can stop as soon as the limit is reached. */
+                    if (limit && cardinality >= limit) break;
+                } else if (!dstkey) {
+                    if (encoding == REDIS_ENCODING_HT)
+                        addReplyBulk(c,eleobj);
+                    else
+                        addReplyBulkLongLong(c,intobj);
+                    cardinality++;
                 } else {
-                    setTypeAdd(dstset,eleobj);
+                    if (encoding == REDIS_ENCODING_INTSET) {
+                        eleobj = createStringObjectFromLongLong(intobj);
+                        setTypeAdd(dstset,eleobj);
+                        decrRefCount(eleobj);
+                    } else {
+                        setTypeAdd(dstset,eleobj);
+                    }
                 }
             }
         }
+        setTypeReleaseIterator(si);
     }
-    setTypeReleaseIterator(si);
 
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -721,6 +1162,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
         }
         signalModifiedKey(c->db,dstkey);
         server.dirty++;
+    } else if (cardinality_only) {
+        addReplyLongLong(c,cardinality);
     } else {
         setDeferredMultiBulkLength(c,replylen,cardinality);
     }
@@ -728,16 +1171,43 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
 }
 
 void sinterCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0,0);
 }
 
-void sinterstoreCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+/* SINTERCARD numkeys key [key ...] [LIMIT limit] */
+void sinterCardCommand(redisClient *c) {
+    long j, numkeys, limit = 0;
+
+    if (getLongFromObjectOrReply(c,c->argv[1],&numkeys,NULL) != REDIS_OK)
+        return;
+    if (numkeys < 1) {
+        addReplyError(c,"numkeys should be greater than 0");
+        return;
+    }
+    if (numkeys > c->argc-2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    for (j = 2+numkeys; j < c->argc; j++) {
+        if (!strcasecmp(c->argv[j]->ptr,"limit") && j+1 < c->argc) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&limit,NULL)
+                != REDIS_OK) return;
+            if (limit < 0) {
+                addReplyError(c,"LIMIT can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+    sinterGenericCommand(c,c->argv+2,numkeys,NULL,1,limit);
 }
 
-#define REDIS_OP_UNION 0
-#define REDIS_OP_DIFF 1
-#define REDIS_OP_INTER 2
+void sinterstoreCommand(redisClient *c) {
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0,0);
+}
 
 void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *dstkey, int op) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
@@ -798,8 +1268,13 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
      * is not NULL (that is, we are inside an SUNIONSTORE operation) then
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();
-
-    if (op == REDIS_OP_UNION) {
+    if (setTypeAllIntegers(sets,setnum)) {
+        /* When all the sets only hold integers the result is computed
+         * merging their sorted contents. */
+        decrRefCount(dstset);
+        dstset = setTypeIntegerOperation(sets,setnum,op);
+        cardinality = setTypeSize(dstset);
+    } else if (op == REDIS_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {
@@ -142,6 +142,19 @@ void psetexCommand(redisClient *c) {
     setGenericCommand(c,REDIS_SET_NO_FLAGS,c->argv[1],c->argv[3],c->argv[2],UNIT_MILLISECONDS,NULL,NULL);
 }
 
+/* Reply with the value of a string key. Sparse bitmaps are materialized only
+ * for the reply, so that the key keeps its compact encoding. */
+static void addReplyStringValue(redisClient *c, robj *o) {
+    if (o->encoding == REDIS_ENCODING_SPARSE) {
+        robj *decoded = getDecodedObject(o);
+
+        addReplyBulk(c,decoded);
+        decrRefCount(decoded);
+    } else {
+        addReplyBulk(c,o);
+    }
+}
+
 int getGenericCommand(redisClient *c) {
     robj *o;
 
@@ -152,7 +165,7 @@ int getGenericCommand(redisClient *c) {
         addReply(c,shared.wrongtypeerr);
         return REDIS_ERR;
     } else {
-        addReplyBulk(c,o);
+        addReplyStringValue(c,o);
         return REDIS_OK;
     }
 }
@@ -245,6 +258,9 @@ void getrangeCommand(redisClient *c) {
     if (o->encoding == REDIS_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        str = NULL;
+        strlen = ((sparseBitmap*)o->ptr)->len;
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -261,6 +277,12 @@ void getrangeCommand(redisClient *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        /* Sparse bitmap: materialize just the requested range. */
+        sds range = sparseBitmapRangeToSds(o->ptr,start,end);
+
+        addReplyBulkCBuffer(c,range,sdslen(range));
+        sdsfree(range);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
@@ -278,7 +300,7 @@ void mgetCommand(redisClient *c) {
             if (o->type != REDIS_STRING) {
                 addReply(c,shared.nullbulk);
             } else {
-                addReplyBulk(c,o);
+                addReplyStringValue(c,o);
             }
         }
     }
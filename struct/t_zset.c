@@ -675,6 +675,28 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     return NULL;
 }
 
+/* Return the node 'offset' positions after 'ln', or before it if 'reverse'
+ * is true, or NULL if there is no such node. Instead of following 'offset'
+ * links, the rank of 'ln' is used to jump to the target with the spans, so
+ * that a LIMIT offset costs O(log N) whatever its value. A negative offset
+ * skips all the nodes, as the offset loop this replaces did. */
+zskiplistNode *zslSkipNodes(zskiplist *zsl, zskiplistNode *ln, long offset, int reverse) {
+    unsigned long rank;
+
+    if (offset == 0) return ln;
+    if (offset < 0) return NULL;
+
+    rank = zslGetRank(zsl,ln->score,ln->obj);
+    if (reverse) {
+        if ((unsigned long)offset >= rank) return NULL;
+        rank -= offset;
+    } else {
+        if ((unsigned long)offset > zsl->length - rank) return NULL;
+        rank += offset;
+    }
+    return zslGetElementByRank(zsl,rank);
+}
+
 /* Populate the rangespec according to the objects min and max. */
 static int zslParseRange(robj *min, robj *max, zrangespec *spec) {
     char *eptr;
@@ -878,7 +900,7 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -889,7 +911,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     redisAssert(sptr != NULL);
-    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    redisAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -902,16 +924,16 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as a Redis string object.
+/* Return a listpack element as a Redis string object.
  * This simple abstraction can be used to simplifies some code at the
  * cost of some performance. */
-robj *ziplistGetObject(unsigned char *sptr) {
+robj *lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     redisAssert(sptr != NULL);
-    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    redisAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return createStringObject((char*)vstr,vlen);
@@ -928,7 +950,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    redisAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -942,7 +964,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -951,9 +973,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     redisAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         redisAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -970,9 +992,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     redisAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         redisAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -994,13 +1016,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     redisAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -1012,14 +1034,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -1031,7 +1053,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -1040,14 +1062,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -1060,9 +1082,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            redisAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            redisAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -1071,14 +1093,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 static int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    robj *value = ziplistGetObject(p);
+    robj *value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     decrRefCount(value);
     return res;
 }
 
 static int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    robj *value = ziplistGetObject(p);
+    robj *value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     decrRefCount(value);
     return res;
@@ -1095,12 +1117,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
             (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     redisAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -1111,7 +1133,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -1125,9 +1147,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         redisAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -1136,7 +1158,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -1151,9 +1173,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            redisAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            redisAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -1162,14 +1184,14 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     ele = getDecodedObject(ele);
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssertWithInfo(NULL,ele,sptr != NULL);
 
-        if (ziplistCompare(eptr,ele->ptr,sdslen(ele->ptr))) {
+        if (lpCompare(eptr,ele->ptr,sdslen(ele->ptr))) {
             /* Matching element, pull out score. */
             if (score != NULL) *score = zzlGetScore(sptr);
             decrRefCount(ele);
@@ -1177,58 +1199,53 @@ unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     decrRefCount(ele);
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
 unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, double score) {
-    unsigned char *sptr;
+    unsigned char *newp;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     redisAssertWithInfo(NULL,ele,ele->encoding == REDIS_ENCODING_RAW);
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,ele->ptr,sdslen(ele->ptr),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,ele->ptr,sdslen(ele->ptr));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,ele->ptr,sdslen(ele->ptr));
-        eptr = zl+offset;
-
-        /* Insert score after the element. */
-        redisAssertWithInfo(NULL,ele,(sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        /* Insert the element before 'eptr', then the score after it:
+         * lpInsert() returns the new element address, so there is no need
+         * to keep an offset across the reallocation. */
+        zl = lpInsert(zl,ele->ptr,sdslen(ele->ptr),eptr,LP_BEFORE,&newp);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,newp,LP_AFTER,NULL);
     }
 
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     ele = getDecodedObject(ele);
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssertWithInfo(NULL,ele,sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1247,7 +1264,7 @@ unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1268,14 +1285,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1296,13 +1313,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1319,20 +1336,97 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
+/*-----------------------------------------------------------------------------
+ * B+tree encoding helpers
+ *----------------------------------------------------------------------------*/
+
+/* Predicates for zbtSeek(). Elements "before" the range are the ones below
+ * its minimum: the first element that is not before is the first one in
+ * range. Seeking with the LteMax predicates finds instead the first element
+ * past the range, so that the two ranks delimit the whole range. */
+static int zbtBeforeMin(void *privdata, double score, sds ele) {
+    DICT_NOTUSED(ele);
+    return !zslValueGteMin(score,privdata);
+}
+
+static int zbtNotAfterMax(void *privdata, double score, sds ele) {
+    DICT_NOTUSED(ele);
+    return zslValueLteMax(score,privdata);
+}
+
+static int zbtLexBeforeMin(void *privdata, double score, sds ele) {
+    robj o;
+
+    DICT_NOTUSED(score);
+    initStaticStringObject(o,ele);
+    return !zslLexValueGteMin(&o,privdata);
+}
+
+static int zbtLexNotAfterMax(void *privdata, double score, sds ele) {
+    robj o;
+
+    DICT_NOTUSED(score);
+    initStaticStringObject(o,ele);
+    return zslLexValueLteMax(&o,privdata);
+}
+
+/* Return the number of elements inside the score range, storing the
+ * zero-based rank of the first one in '*start'. */
+unsigned long zbtCountInRange(zbtree *zbt, zrangespec *range, unsigned long *start) {
+    zbtIter it;
+    unsigned long first, last;
+
+    first = zbtSeek(zbt,zbtBeforeMin,range,&it);
+    last = zbtSeek(zbt,zbtNotAfterMax,range,&it);
+    *start = first;
+    return (last > first) ? last-first : 0;
+}
+
+/* Same as zbtCountInRange() for a lexicographical range. */
+unsigned long zbtCountInLexRange(zbtree *zbt, zlexrangespec *range, unsigned long *start) {
+    zbtIter it;
+    unsigned long first, last;
+
+    first = zbtSeek(zbt,zbtLexBeforeMin,range,&it);
+    last = zbtSeek(zbt,zbtLexNotAfterMax,range,&it);
+    *start = first;
+    return (last > first) ? last-first : 0;
+}
+
+/* Lookup a member given as a string object, that may be integer encoded. */
+int zbtFindObject(zbtree *zbt, robj *ele, double *score) {
+    int found;
+
+    ele = getDecodedObject(ele);
+    found = zbtFind(zbt,ele->ptr,score);
+    decrRefCount(ele);
+    return found;
+}
+
+/* Return a new sds string with the member stored in the string object, to
+ * be handed to zbtInsert(). */
+sds zbtNewMember(robj *ele) {
+    if (ele->encoding == REDIS_ENCODING_INT)
+        return sdsfromlonglong((long)ele->ptr);
+    return sdsdup(ele->ptr);
+}
+
 /*-----------------------------------------------------------------------------
  * Common sorted set API
  *----------------------------------------------------------------------------*/
 
 unsigned int zsetLength(robj *zobj) {
     int length = -1;
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         length = ((zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        length = zbtLength((zbtree*)zobj->ptr);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1346,28 +1440,46 @@ void zsetConvert(robj *zobj, int encoding) {
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != REDIS_ENCODING_SKIPLIST)
+        if (encoding != REDIS_ENCODING_SKIPLIST &&
+            encoding != REDIS_ENCODING_BTREE)
             redisPanic("Unknown target encoding");
 
+        eptr = lpSeek(zl,0);
+        redisAssertWithInfo(NULL,zobj,eptr != NULL);
+        sptr = lpNext(zl,eptr);
+        redisAssertWithInfo(NULL,zobj,sptr != NULL);
+
+        if (encoding == REDIS_ENCODING_BTREE) {
+            zbtree *zbt = zbtCreate();
+
+            while (eptr != NULL) {
+                score = zzlGetScore(sptr);
+                redisAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
+                zbtInsert(zbt,score,(vstr == NULL) ? sdsfromlonglong(vlong) :
+                                                     sdsnewlen(vstr,vlen));
+                zzlNext(zl,&eptr,&sptr);
+            }
+
+            zfree(zobj->ptr);
+            zobj->ptr = zbt;
+            zobj->encoding = REDIS_ENCODING_BTREE;
+            return;
+        }
+
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
         zs->zsl = zslCreate();
 
-        eptr = ziplistIndex(zl,0);
-        redisAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        redisAssertWithInfo(NULL,zobj,sptr != NULL);
-
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            redisAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            redisAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = createStringObjectFromLongLong(vlong);
             else
@@ -1384,13 +1496,30 @@ void zsetConvert(robj *zobj, int encoding) {
         zobj->ptr = zs;
         zobj->encoding = REDIS_ENCODING_SKIPLIST;
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl;
+
+        if (encoding == REDIS_ENCODING_BTREE) {
+            zbtree *zbt = zbtCreate();
+
+            zs = zobj->ptr;
+            for (node = zs->zsl->header->level[0].forward; node;
+                 node = node->level[0].forward)
+                zbtInsert(zbt,node->score,zbtNewMember(node->obj));
+            dictRelease(zs->dict);
+            zslFree(zs->zsl);
+            zfree(zs);
+            zobj->ptr = zbt;
+            zobj->encoding = REDIS_ENCODING_BTREE;
+            return;
+        }
 
-        if (encoding != REDIS_ENCODING_ZIPLIST)
+        if (encoding != REDIS_ENCODING_LISTPACK)
             redisPanic("Unknown target encoding");
 
+        zl = lpNew();
+
         /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+         * the same time as creating the listpack. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
@@ -1409,7 +1538,40 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = REDIS_ENCODING_ZIPLIST;
+        zobj->encoding = REDIS_ENCODING_LISTPACK;
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        zbtIter it;
+        sds e;
+
+        if (encoding == REDIS_ENCODING_LISTPACK) {
+            unsigned char *zl = lpNew();
+            robj o;
+
+            for (zbtFirst(zbt,&it); zbtIterValid(&it); zbtNext(&it)) {
+                initStaticStringObject(o,zbtIterEle(&it));
+                zl = zzlInsertAt(zl,NULL,&o,zbtIterScore(&it));
+            }
+            zobj->ptr = zl;
+        } else if (encoding == REDIS_ENCODING_SKIPLIST) {
+            zs = zmalloc(sizeof(*zs));
+            zs->dict = dictCreate(&zsetDictType,NULL);
+            zs->zsl = zslCreate();
+
+            for (zbtFirst(zbt,&it); zbtIterValid(&it); zbtNext(&it)) {
+                e = zbtIterEle(&it);
+                ele = createStringObject(e,sdslen(e));
+                node = zslInsert(zs->zsl,zbtIterScore(&it),ele);
+                redisAssertWithInfo(NULL,zobj,dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+                incrRefCount(ele); /* Added to dictionary. */
+            }
+            zobj->ptr = zs;
+        } else {
+            redisPanic("Unknown target encoding");
+        }
+
+        zbtFree(zbt);
+        zobj->encoding = encoding;
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1419,6 +1581,82 @@ void zsetConvert(robj *zobj, int encoding) {
  * Sorted set commands
  *----------------------------------------------------------------------------*/
 
+/* Element of a ZADD batch loaded by zsetBulkLoad(). */
+typedef struct {
+    robj *ele;
+    double score;
+    dictEntry *de;
+} zsetbulkent;
+
+static int zsetBulkCompare(const void *a, const void *b) {
+    const zsetbulkent *ea = a, *eb = b;
+
+    if (ea->score != eb->score) return (ea->score < eb->score) ? -1 : 1;
+    return compareStringObjects(ea->ele,eb->ele);
+}
+
+/* Load the score/member pairs of a ZADD into the empty skiplist encoded
+ * sorted set 'zs'. The dictionary is sized in advance, and is used to drop
+ * the duplicated members: the last score wins, like when inserting the
+ * pairs one after the other. The pairs are then sorted, and the skiplist
+ * is built bottom-up appending every node at the tail of its levels, so
+ * there is no need to search for the insertion point.
+ * Returns the number of elements added. */
+static unsigned long zsetBulkLoad(zset *zs, robj **argv, double *scores, int elements) {
+    zsetbulkent *ents = zmalloc(sizeof(zsetbulkent)*elements);
+    zskiplist *zsl = zs->zsl;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], n = 0, j;
+    dictEntry *de;
+    robj *ele;
+    int i, level;
+
+    dictExpand(zs->dict,elements);
+    for (j = 0; j < (unsigned long)elements; j++) {
+        ele = argv[3+j*2] = tryObjectEncoding(argv[3+j*2]);
+        if ((de = dictFind(zs->dict,ele)) != NULL) {
+            ((zsetbulkent*)dictGetVal(de))->score = scores[j];
+            continue;
+        }
+        de = dictAddRaw(zs->dict,ele);
+        incrRefCount(ele); /* Added to dictionary. */
+        ents[n].ele = ele;
+        ents[n].score = scores[j];
+        ents[n].de = de;
+        dictGetVal(de) = &ents[n];
+        n++;
+    }
+    qsort(ents,n,sizeof(zsetbulkent),zsetBulkCompare);
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        update[i] = zsl->header;
+        rank[i] = 0;
+    }
+    for (j = 0; j < n; j++) {
+        level = zslRandomLevel();
+        if (level > zsl->level) zsl->level = level;
+        x = zslCreateNode(level,ents[j].score,ents[j].ele);
+        incrRefCount(ents[j].ele); /* Added to skiplist. */
+        for (i = 0; i < level; i++) {
+            x->level[i].forward = NULL;
+            update[i]->level[i].forward = x;
+            update[i]->level[i].span = j+1-rank[i];
+            update[i] = x;
+            rank[i] = j+1;
+        }
+        x->backward = j ? zsl->tail : NULL;
+        zsl->tail = x;
+        dictGetVal(ents[j].de) = &x->score;
+    }
+
+    /* The last node of every level spans the nodes following it. */
+    for (i = 0; i < zsl->level; i++)
+        update[i]->level[i].span = n-rank[i];
+    zsl->length = n;
+    zfree(ents);
+    return n;
+}
+
 /* This generic command implements both ZADD and ZINCRBY. */
 void zaddGenericCommand(redisClient *c, int incr) {
     static char *nanerr = "resulting score is not a number (NaN)";
@@ -1429,6 +1667,8 @@ void zaddGenericCommand(redisClient *c, int incr) {
     double score = 0, *scores = NULL, curscore = 0.0;
     int j, elements = (c->argc-2)/2;
     int added = 0, updated = 0;
+    int early = 0; /* Converted in advance because of the batch size. */
+    size_t maxelelen = 0;
 
     if (c->argc % 2) {
         addReply(c,shared.syntaxerr);
@@ -1442,33 +1682,66 @@ void zaddGenericCommand(redisClient *c, int incr) {
     for (j = 0; j < elements; j++) {
         if (getDoubleFromObjectOrReply(c,c->argv[2+j*2],&scores[j],NULL)
             != REDIS_OK) goto cleanup;
+        if (sdslen(c->argv[3+j*2]->ptr) > maxelelen)
+            maxelelen = sdslen(c->argv[3+j*2]->ptr);
     }
 
     /* Lookup the key and create the sorted set if does not exist. */
     zobj = lookupKeyWrite(c->db,key);
     if (zobj == NULL) {
+        early = (unsigned long)elements > server.zset_max_ziplist_entries;
         if (server.zset_max_ziplist_entries == 0 ||
-            server.zset_max_ziplist_value < sdslen(c->argv[3]->ptr))
+            server.zset_max_ziplist_value < sdslen(c->argv[3]->ptr) || early)
         {
-            zobj = createZsetObject();
+            zobj = server.zset_btree ? createZsetBtreeObject() :
+                                       createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
+
+        /* A new skiplist is built in bulk. */
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST && !incr) {
+            added = zsetBulkLoad(zobj->ptr,c->argv,scores,elements);
+            server.dirty += added;
+            goto reply;
+        }
     } else {
         if (zobj->type != REDIS_ZSET) {
             addReply(c,shared.wrongtypeerr);
             goto cleanup;
         }
+
+        /* Convert in advance when the batch alone exceeds the listpack
+         * limit, instead of converting in the middle of the insertions,
+         * and size the dictionary for the new members. */
+        if (zobj->encoding == REDIS_ENCODING_LISTPACK &&
+            (unsigned long)elements > server.zset_max_ziplist_entries)
+        {
+            zsetConvert(zobj,server.zset_btree ?
+                REDIS_ENCODING_BTREE : REDIS_ENCODING_SKIPLIST);
+            early = 1;
+        }
+        if (zobj->encoding == REDIS_ENCODING_SKIPLIST &&
+            (unsigned long)elements > server.zset_max_ziplist_entries)
+        {
+            zset *zs = zobj->ptr;
+            dictExpand(zs->dict,dictSize(zs->dict)+elements);
+        } else if (zobj->encoding == REDIS_ENCODING_BTREE &&
+                   (unsigned long)elements > server.zset_max_ziplist_entries)
+        {
+            zbtree *zbt = zobj->ptr;
+            dictExpand(zbt->dict,dictSize(zbt->dict)+elements);
+        }
     }
 
     for (j = 0; j < elements; j++) {
         score = scores[j];
 
-        if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
             unsigned char *eptr;
 
-            /* Prefer non-encoded element when dealing with ziplists. */
+            /* Prefer non-encoded element when dealing with listpacks. */
             ele = c->argv[3+j*2];
             if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
                 if (incr) {
@@ -1490,10 +1763,10 @@ void zaddGenericCommand(redisClient *c, int incr) {
                 /* Optimize: check if the element is too large or the list
                  * becomes too long *before* executing zzlInsert. */
                 zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-                if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
-                    zsetConvert(zobj,REDIS_ENCODING_SKIPLIST);
-                if (sdslen(ele->ptr) > server.zset_max_ziplist_value)
-                    zsetConvert(zobj,REDIS_ENCODING_SKIPLIST);
+                if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
+                    sdslen(ele->ptr) > server.zset_max_ziplist_value)
+                    zsetConvert(zobj,server.zset_btree ?
+                        REDIS_ENCODING_BTREE : REDIS_ENCODING_SKIPLIST);
                 server.dirty++;
                 added++;
             }
@@ -1537,10 +1810,44 @@ void zaddGenericCommand(redisClient *c, int incr) {
                 server.dirty++;
                 added++;
             }
+        } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+            zbtree *zbt = zobj->ptr;
+
+            ele = getDecodedObject(c->argv[3+j*2]);
+            if (zbtFind(zbt,ele->ptr,&curscore)) {
+                if (incr) {
+                    score += curscore;
+                    if (isnan(score)) {
+                        addReplyError(c,nanerr);
+                        decrRefCount(ele);
+                        goto cleanup;
+                    }
+                }
+
+                if (score != curscore) {
+                    zbtUpdateScore(zbt,ele->ptr,score);
+                    server.dirty++;
+                    updated++;
+                }
+            } else {
+                zbtInsert(zbt,score,sdsdup(ele->ptr));
+                server.dirty++;
+                added++;
+            }
+            decrRefCount(ele);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
     }
+
+reply:
+    /* The size of the batch counts the repeated members as well, so the
+     * early conversion may have been premature: go back to a listpack if
+     * the result is still within its limits. */
+    if (early &&
+        zsetLength(zobj) <= server.zset_max_ziplist_entries &&
+        maxelelen <= server.zset_max_ziplist_value)
+        zsetConvert(zobj,REDIS_ENCODING_LISTPACK);
     if (incr) /* ZINCRBY */
         addReplyDouble(c,score);
     else /* ZADD */
@@ -1571,7 +1878,7 @@ void zremCommand(redisClient *c) {
     if ((zobj = lookupKeyWriteOrReply(c,key,shared.czero)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         for (j = 2; j < c->argc; j++) {
@@ -1609,6 +1916,20 @@ void zremCommand(redisClient *c) {
                 }
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        robj *ele;
+
+        for (j = 2; j < c->argc; j++) {
+            ele = getDecodedObject(c->argv[j]);
+            deleted += zbtDelete(zbt,ele->ptr);
+            decrRefCount(ele);
+        }
+        if (htNeedsResize(zbt->dict)) dictResize(zbt->dict);
+        if (zbtLength(zbt) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1674,7 +1995,7 @@ void zremrangeGenericCommand(redisClient *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1708,6 +2029,28 @@ void zremrangeGenericCommand(redisClient *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        unsigned long first = 0, count = 0;
+
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            first = start;
+            count = end-start+1;
+            break;
+        case ZRANGE_SCORE:
+            count = zbtCountInRange(zbt,&range,&first);
+            break;
+        case ZRANGE_LEX:
+            count = zbtCountInLexRange(zbt,&lexrange,&first);
+            break;
+        }
+        deleted = count ? zbtDeleteRangeByRank(zbt,first,first+count-1) : 0;
+        if (htNeedsResize(zbt->dict)) dictResize(zbt->dict);
+        if (zbtLength(zbt) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1752,6 +2095,7 @@ typedef struct {
                 intset *is;
                 int ii;
             } is;
+            roaringIterator ri;
             struct {
                 dict *dict;
                 dictIterator *di;
@@ -1769,6 +2113,10 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            struct {
+                zbtree *zbt;
+                zbtIter it;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1807,6 +2155,8 @@ void zuiInitIterator(zsetopsrc *op) {
         if (op->encoding == REDIS_ENCODING_INTSET) {
             it->is.is = op->subject->ptr;
             it->is.ii = 0;
+        } else if (op->encoding == REDIS_ENCODING_ROARING) {
+            roaringInitIterator(op->subject->ptr,&it->ri);
         } else if (op->encoding == REDIS_ENCODING_HT) {
             it->ht.dict = op->subject->ptr;
             it->ht.di = dictGetIterator(op->subject->ptr);
@@ -1816,16 +2166,19 @@ void zuiInitIterator(zsetopsrc *op) {
         }
     } else if (op->type == REDIS_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 redisAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            it->bt.zbt = op->subject->ptr;
+            zbtFirst(it->bt.zbt,&it->bt.it);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -1840,7 +2193,8 @@ void zuiClearIterator(zsetopsrc *op) {
 
     if (op->type == REDIS_SET) {
         iterset *it = &op->iter.set;
-        if (op->encoding == REDIS_ENCODING_INTSET) {
+        if (op->encoding == REDIS_ENCODING_INTSET ||
+            op->encoding == REDIS_ENCODING_ROARING) {
             REDIS_NOTUSED(it); /* skip */
         } else if (op->encoding == REDIS_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
@@ -1849,9 +2203,10 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == REDIS_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_LISTPACK) {
             REDIS_NOTUSED(it); /* skip */
-        } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
+        } else if (op->encoding == REDIS_ENCODING_SKIPLIST ||
+                   op->encoding == REDIS_ENCODING_BTREE) {
             REDIS_NOTUSED(it); /* skip */
         } else {
             redisPanic("Unknown sorted set encoding");
@@ -1868,6 +2223,8 @@ int zuiLength(zsetopsrc *op) {
     if (op->type == REDIS_SET) {
         if (op->encoding == REDIS_ENCODING_INTSET) {
             return intsetLen(op->subject->ptr);
+        } else if (op->encoding == REDIS_ENCODING_ROARING) {
+            return roaringCardinality(op->subject->ptr);
         } else if (op->encoding == REDIS_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
@@ -1875,11 +2232,13 @@ int zuiLength(zsetopsrc *op) {
             redisPanic("Unknown set encoding");
         }
     } else if (op->type == REDIS_ZSET) {
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
             return zs->zsl->length;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            return zbtLength((zbtree*)op->subject->ptr);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -1912,6 +2271,13 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->is.ii++;
+        } else if (op->encoding == REDIS_ENCODING_ROARING) {
+            int64_t ell;
+
+            if (!roaringNext(&it->ri,&ell))
+                return 0;
+            val->ell = ell;
+            val->score = 1.0;
         } else if (op->encoding == REDIS_ENCODING_HT) {
             if (it->ht.de == NULL)
                 return 0;
@@ -1925,11 +2291,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == REDIS_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            redisAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            redisAssert(lpGetValue(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -1942,6 +2308,18 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            sds ele;
+
+            if (!zbtIterValid(&it->bt.it))
+                return 0;
+            ele = zbtIterEle(&it->bt.it);
+            val->estr = (unsigned char*)ele;
+            val->elen = sdslen(ele);
+            val->score = zbtIterScore(&it->bt.it);
+
+            /* Move to next element. */
+            zbtNext(&it->bt.it);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2024,6 +2402,15 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == REDIS_ENCODING_ROARING) {
+            if (zuiLongLongFromValue(val) &&
+                roaringContains(op->subject->ptr,val->ell))
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else if (op->encoding == REDIS_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             zuiObjectFromValue(val);
@@ -2039,7 +2426,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == REDIS_ZSET) {
         zuiObjectFromValue(val);
 
-        if (op->encoding == REDIS_ENCODING_ZIPLIST) {
+        if (op->encoding == REDIS_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2055,6 +2442,8 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            return zbtFindObject(op->subject->ptr,val->ele,score);
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2089,6 +2478,188 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
+/* Element of a compact source collected by zuiMergeCompact(). */
+typedef struct {
+    unsigned char *estr;    /* Member, NULL if it is stored in 'buf'. */
+    unsigned int elen;
+    double score;           /* Weighted score. */
+    unsigned char buf[REDIS_LONGSTR_SIZE];
+} zsetmergeent;
+
+/* Entries are moved around by qsort(), so 'buf' can't be referenced. */
+#define zuiMergeMember(e) ((e)->estr ? (e)->estr : (e)->buf)
+
+static int zuiMergeCompareMembers(zsetmergeent *a, zsetmergeent *b) {
+    unsigned int minlen = (a->elen < b->elen) ? a->elen : b->elen;
+    int cmp = memcmp(zuiMergeMember(a),zuiMergeMember(b),minlen);
+
+    if (cmp == 0) return (a->elen > b->elen) - (a->elen < b->elen);
+    return cmp;
+}
+
+static int zuiMergeCompareByMember(const void *a, const void *b) {
+    return zuiMergeCompareMembers((zsetmergeent*)a,(zsetmergeent*)b);
+}
+
+/* Sorted set order: by score, then by member. */
+static int zuiMergeCompareByScore(const void *a, const void *b) {
+    const zsetmergeent *ea = a, *eb = b;
+
+    if (ea->score != eb->score) return (ea->score < eb->score) ? -1 : 1;
+    return zuiMergeCompareMembers((zsetmergeent*)a,(zsetmergeent*)b);
+}
+
+/* Return true if all the inputs are small encoded sets, for which
+ * zuiMergeCompact() is used instead of the dictionary based algorithm. */
+int zuiIsCompact(zsetopsrc *src, long setnum) {
+    long i;
+
+    for (i = 0; i < setnum; i++) {
+        if (src[i].subject == NULL) continue;
+        if (src[i].type == REDIS_ZSET &&
+            src[i].encoding == REDIS_ENCODING_LISTPACK) continue;
+        if (src[i].type == REDIS_SET &&
+            src[i].encoding == REDIS_ENCODING_INTSET) continue;
+        return 0;
+    }
+    return 1;
+}
+
+/* Min-heap of sources ordered by their current member. Ties are broken by
+ * the source index, so that the scores of a member are aggregated in the
+ * order of the sources, exactly like the dictionary based algorithm does. */
+static int zuiMergeHeapLess(zsetmergeent **ents, unsigned long *pos, long a, long b) {
+    int cmp = zuiMergeCompareMembers(&ents[a][pos[a]],&ents[b][pos[b]]);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void zuiMergeHeapDown(long *heap, long len, long j, zsetmergeent **ents, unsigned long *pos) {
+    long child, tmp;
+
+    while ((child = j*2+1) < len) {
+        if (child+1 < len && zuiMergeHeapLess(ents,pos,heap[child+1],heap[child]))
+            child++;
+        if (!zuiMergeHeapLess(ents,pos,heap[child],heap[j])) break;
+        tmp = heap[j]; heap[j] = heap[child]; heap[child] = tmp;
+        j = child;
+    }
+}
+
+/* Compute the union or the intersection of compact sources, that are
+ * already sorted by cardinality, returning a new sorted set object.
+ *
+ * The elements of every source are copied into an array sorted by member,
+ * and the arrays are merged with a heap: the union emits every member, the
+ * intersection only the ones found in all the sources, stopping as soon as
+ * the smallest source is exhausted. The result, sized in advance, is then
+ * sorted by score and written to a listpack in a single pass, converting it
+ * if it exceeds the listpack limits.
+ *
+ * The length of the longest member of the result is stored in '*maxelelenp',
+ * so that the caller sees the same value the encoding was chosen with. */
+robj *zuiMergeCompact(zsetopsrc *src, long setnum, int op, int aggregate,
+                      unsigned int *maxelelenp)
+{
+    zsetmergeent **ents, *res, *e;
+    unsigned long *len, *pos, total = 0, reslen = 0, j;
+    unsigned int maxelelen = 0;
+    long *heap, heaplen = 0, i, matches, top;
+    int exhausted = 0;
+    zsetopval zval;
+    unsigned char *zl;
+    char scorebuf[128];
+    int scorelen;
+    robj *dstobj;
+
+    ents = zcalloc(sizeof(zsetmergeent*)*setnum);
+    len = zcalloc(sizeof(unsigned long)*setnum);
+    pos = zcalloc(sizeof(unsigned long)*setnum);
+    heap = zmalloc(sizeof(long)*setnum);
+
+    /* Collect the elements of every source, sorted by member. */
+    memset(&zval,0,sizeof(zval));
+    for (i = 0; i < setnum; i++) {
+        len[i] = zuiLength(&src[i]);
+        if (len[i] == 0) continue;
+        total += len[i];
+        ents[i] = zmalloc(sizeof(zsetmergeent)*len[i]);
+        j = 0;
+        zuiInitIterator(&src[i]);
+        while (zuiNext(&src[i],&zval)) {
+            e = &ents[i][j++];
+            if (zval.estr != NULL) {
+                e->estr = zval.estr;
+                e->elen = zval.elen;
+            } else {
+                e->elen = ll2string((char*)e->buf,sizeof(e->buf),zval.ell);
+                e->estr = NULL;
+            }
+            e->score = src[i].weight * zval.score;
+            if (isnan(e->score)) e->score = 0;
+        }
+        zuiClearIterator(&src[i]);
+        qsort(ents[i],len[i],sizeof(zsetmergeent),zuiMergeCompareByMember);
+        heap[heaplen++] = i;
+    }
+
+    /* The intersection is empty if any input is empty, otherwise it is not
+     * larger than the smallest input, that is the first one. */
+    if (op == REDIS_OP_INTER && heaplen < setnum) heaplen = 0;
+    res = zmalloc(sizeof(zsetmergeent)*((op == REDIS_OP_UNION) ? total : len[0]));
+
+    for (i = heaplen/2-1; i >= 0; i--)
+        zuiMergeHeapDown(heap,heaplen,i,ents,pos);
+    while (heaplen && !exhausted) {
+        zsetmergeent cur;
+
+        matches = 0;
+        cur = ents[heap[0]][pos[heap[0]]];
+        do {
+            top = heap[0];
+            if (matches++)
+                zunionInterAggregate(&cur.score,ents[top][pos[top]].score,aggregate);
+            if (++pos[top] == len[top]) {
+                /* No member can be common to all the inputs from now on. */
+                heap[0] = heap[--heaplen];
+                if (op == REDIS_OP_INTER) exhausted = 1;
+            }
+            zuiMergeHeapDown(heap,heaplen,0,ents,pos);
+        } while (heaplen &&
+                 zuiMergeCompareMembers(&ents[heap[0]][pos[heap[0]]],&cur) == 0);
+
+        /* String members still point to the source objects, that are not
+         * modified before the result is built. */
+        if (op == REDIS_OP_UNION || matches == setnum) {
+            res[reslen++] = cur;
+            if (cur.elen > maxelelen) maxelelen = cur.elen;
+        }
+    }
+
+    /* Build the result in sorted set order. */
+    qsort(res,reslen,sizeof(zsetmergeent),zuiMergeCompareByScore);
+    zl = lpNew();
+    for (j = 0; j < reslen; j++) {
+        scorelen = d2string(scorebuf,sizeof(scorebuf),res[j].score);
+        zl = lpAppend(zl,zuiMergeMember(&res[j]),res[j].elen);
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
+    }
+    dstobj = createObject(REDIS_ZSET,zl);
+    dstobj->encoding = REDIS_ENCODING_LISTPACK;
+    if (reslen > server.zset_max_ziplist_entries ||
+        maxelelen > server.zset_max_ziplist_value)
+        zsetConvert(dstobj,server.zset_btree ?
+            REDIS_ENCODING_BTREE : REDIS_ENCODING_SKIPLIST);
+    *maxelelenp = maxelelen;
+
+    for (i = 0; i < setnum; i++) zfree(ents[i]);
+    zfree(ents);
+    zfree(len);
+    zfree(pos);
+    zfree(heap);
+    zfree(res);
+    return dstobj;
+}
+
 void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
@@ -2181,11 +2752,14 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
-    memset(&zval, 0, sizeof(zval));
+    if (zuiIsCompact(src,setnum)) {
+        /* Small inputs are merged without the temporary dictionary. */
+        dstobj = zuiMergeCompact(src,setnum,op,aggregate,&maxelelen);
+    } else if (op == REDIS_OP_INTER) {
+        dstobj = createZsetObject();
+        dstzset = dstobj->ptr;
+        memset(&zval, 0, sizeof(zval));
 
-    if (op == REDIS_OP_INTER) {
         /* Skip everything if the smallest input is empty. */
         if (zuiLength(&src[0]) > 0) {
             /* Precondition: as src[0] is non-empty and the inputs are ordered
@@ -2232,6 +2806,10 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
         dictEntry *de;
         double score;
 
+        dstobj = createZsetObject();
+        dstzset = dstobj->ptr;
+        memset(&zval, 0, sizeof(zval));
+
         if (setnum) {
             /* Our union is at least as large as the largest set.
              * Resize the dictionary ASAP to avoid useless rehashing. */
@@ -2255,7 +2833,7 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
                 if (de == NULL) {
                     tmp = zuiObjectFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                     if (tmp->encoding == REDIS_ENCODING_RAW) {
                         if (sdslen(tmp->ptr) > maxelelen)
@@ -2307,11 +2885,15 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
         touched = 1;
         server.dirty++;
     }
-    if (dstzset->zsl->length) {
-        /* Convert to ziplist when in limits. */
-        if (dstzset->zsl->length <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(dstobj,REDIS_ENCODING_ZIPLIST);
+    if (zsetLength(dstobj)) {
+        /* Convert to listpack when in limits. */
+        if (dstobj->encoding == REDIS_ENCODING_SKIPLIST) {
+            if (zsetLength(dstobj) <= server.zset_max_ziplist_entries &&
+                maxelelen <= server.zset_max_ziplist_value)
+                    zsetConvert(dstobj,REDIS_ENCODING_LISTPACK);
+            else if (server.zset_btree)
+                    zsetConvert(dstobj,REDIS_ENCODING_BTREE);
+        }
 
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
@@ -2337,6 +2919,88 @@ void zinterstoreCommand(redisClient *c) {
     zunionInterGenericCommand(c,c->argv[1], REDIS_OP_INTER);
 }
 
+/* ZINTERCARD numkeys key [key ...] [LIMIT limit]
+ *
+ * Return the number of elements of the intersection of the specified sorted
+ * sets (or sets), without creating the result: the smallest input is
+ * iterated and every element is looked up into the other inputs with
+ * zuiFind(), stopping as soon as 'limit' elements are found if a non zero
+ * limit is given. */
+void zinterCardCommand(redisClient *c) {
+    long j, setnum, limit = 0, cardinality = 0;
+    zsetopsrc *src;
+    zsetopval zval;
+    double value;
+    int i;
+
+    if (getLongFromObjectOrReply(c,c->argv[1],&setnum,NULL) != REDIS_OK)
+        return;
+    if (setnum < 1) {
+        addReplyError(c,"at least 1 input key is needed for ZINTERCARD");
+        return;
+    }
+    if (setnum > c->argc-2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    for (j = 2+setnum; j < c->argc; j++) {
+        if (!strcasecmp(c->argv[j]->ptr,"limit") && j+1 < c->argc) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&limit,NULL)
+                != REDIS_OK) return;
+            if (limit < 0) {
+                addReplyError(c,"LIMIT can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    src = zcalloc(sizeof(zsetopsrc) * setnum);
+    for (i = 0; i < setnum; i++) {
+        robj *obj = lookupKeyRead(c->db,c->argv[2+i]);
+
+        if (obj != NULL) {
+            if (obj->type != REDIS_ZSET && obj->type != REDIS_SET) {
+                zfree(src);
+                addReply(c,shared.wrongtypeerr);
+                return;
+            }
+            src[i].subject = obj;
+            src[i].type = obj->type;
+            src[i].encoding = obj->encoding;
+        } else {
+            src[i].subject = NULL;
+        }
+    }
+
+    /* Sort the inputs from the smallest to the largest: a missing key sorts
+     * first as an empty input, and the intersection is empty as well. */
+    qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
+    memset(&zval, 0, sizeof(zval));
+
+    if (zuiLength(&src[0]) > 0) {
+        zuiInitIterator(&src[0]);
+        while (zuiNext(&src[0],&zval)) {
+            for (i = 1; i < setnum; i++) {
+                if (src[i].subject == src[0].subject) continue;
+                if (!zuiFind(&src[i],&zval,&value)) break;
+            }
+            if (i == setnum) {
+                cardinality++;
+                if (limit && cardinality >= limit) break;
+            }
+        }
+        /* Release the last value when the iteration was not completed. */
+        if (zval.flags & OPVAL_DIRTY_ROBJ) decrRefCount(zval.ele);
+        zuiClearIterator(&src[0]);
+    }
+    zfree(src);
+    addReplyLongLong(c,cardinality);
+}
+
 void zrangeGenericCommand(redisClient *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -2377,7 +3041,7 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2385,16 +3049,16 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             redisAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            redisAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 addReplyBulkLongLong(c,vlong);
             else
@@ -2434,6 +3098,19 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
                 addReplyDouble(c,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtIter it;
+        sds ele;
+
+        zbtSeekRank(zobj->ptr,reverse ? llen-1-start : start,&it);
+        while(rangelen--) {
+            redisAssertWithInfo(c,zobj,zbtIterValid(&it));
+            ele = zbtIterEle(&it);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores)
+                addReplyDouble(c,zbtIterScore(&it));
+            if (reverse) zbtPrev(&it); else zbtNext(&it);
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2497,7 +3174,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2520,7 +3197,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
 
         /* Get score pointer for the first element. */
         redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2547,8 +3224,8 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue() should always succeed */
+            redisAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -2591,15 +3268,9 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump to the element using the ranks without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        ln = zslSkipNodes(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -2623,6 +3294,41 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        zbtIter it;
+        unsigned long first, count;
+        sds ele;
+
+        /* The range is delimited by two rank lookups, so both the offset
+         * and the limit are applied without visiting the elements. */
+        count = zbtCountInRange(zbt,&range,&first);
+        if (offset < 0 || (unsigned long)offset >= count) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+        zbtSeekRank(zbt,reverse ? first+count-1-offset : first+offset,&it);
+        count -= offset;
+        if (limit >= 0 && (unsigned long)limit < count) count = limit;
+
+        replylen = addDeferredMultiBulkLength(c);
+        while (count--) {
+            redisAssertWithInfo(c,zobj,zbtIterValid(&it));
+            ele = zbtIterEle(&it);
+            rangelen++;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+
+            if (withscores) {
+                addReplyDouble(c,zbtIterScore(&it));
+            }
+
+            /* Move to next element */
+            if (reverse) {
+                zbtPrev(&it);
+            } else {
+                zbtNext(&it);
+            }
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2658,7 +3364,7 @@ void zcountCommand(redisClient *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, REDIS_ZSET)) return;
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2673,7 +3379,7 @@ void zcountCommand(redisClient *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         redisAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2712,6 +3418,10 @@ void zcountCommand(redisClient *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        unsigned long first;
+
+        count = zbtCountInRange(zobj->ptr, &range, &first);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2739,7 +3449,7 @@ void zlexcountCommand(redisClient *c) {
         return;
     }
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2754,7 +3464,7 @@ void zlexcountCommand(redisClient *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2790,6 +3500,10 @@ void zlexcountCommand(redisClient *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        unsigned long first;
+
+        count = zbtCountInLexRange(zobj->ptr, &range, &first);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -2849,7 +3563,7 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2872,7 +3586,7 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
 
         /* Get score pointer for the first element. */
         redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2897,9 +3611,9 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue() should always
              * succeed. */
-            redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            redisAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
@@ -2939,15 +3653,9 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
          * length in the output buffer, and will "fix" it later */
         replylen = addDeferredMultiBulkLength(c);
 
-        /* If there is an offset, just traverse the number of elements without
+        /* If there is an offset, jump to the element using the ranks without
          * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
-        }
+        ln = zslSkipNodes(zsl,ln,offset,reverse);
 
         while (ln && limit--) {
             /* Abort when the node is no longer in range. */
@@ -2967,6 +3675,36 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        zbtIter it;
+        unsigned long first, count;
+        sds ele;
+
+        count = zbtCountInLexRange(zbt,&range,&first);
+        if (offset < 0 || (unsigned long)offset >= count) {
+            addReply(c, shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
+        }
+        zbtSeekRank(zbt,reverse ? first+count-1-offset : first+offset,&it);
+        count -= offset;
+        if (limit >= 0 && (unsigned long)limit < count) count = limit;
+
+        replylen = addDeferredMultiBulkLength(c);
+        while (count--) {
+            redisAssertWithInfo(c,zobj,zbtIterValid(&it));
+            ele = zbtIterEle(&it);
+            rangelen++;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+
+            /* Move to next element */
+            if (reverse) {
+                zbtPrev(&it);
+            } else {
+                zbtNext(&it);
+            }
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3001,7 +3739,7 @@ void zscoreCommand(redisClient *c) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.nullbulk)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
 
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr,c->argv[2],&score) != NULL)
             addReplyDouble(c,score);
         else
@@ -3018,6 +3756,11 @@ void zscoreCommand(redisClient *c) {
         } else {
             addReply(c,shared.nullbulk);
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        if (zbtFindObject(zobj->ptr,c->argv[2],&score))
+            addReplyDouble(c,score);
+        else
+            addReply(c,shared.nullbulk);
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3035,18 +3778,18 @@ void zrankGenericCommand(redisClient *c, int reverse) {
     llen = zsetLength(zobj);
 
     redisAssertWithInfo(c,ele,ele->encoding == REDIS_ENCODING_RAW);
-    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         redisAssertWithInfo(c,zobj,sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,ele->ptr,sdslen(ele->ptr)))
+            if (lpCompare(eptr,ele->ptr,sdslen(ele->ptr)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -3079,6 +3822,16 @@ void zrankGenericCommand(redisClient *c, int reverse) {
         } else {
             addReply(c,shared.nullbulk);
         }
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        rank = zbtGetRank(zobj->ptr,ele->ptr);
+        if (rank) {
+            if (reverse)
+                addReplyLongLong(c,llen-rank);
+            else
+                addReplyLongLong(c,rank-1);
+        } else {
+            addReply(c,shared.nullbulk);
+        }
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3101,3 +3854,397 @@ void zscanCommand(redisClient *c) {
         checkType(c,o,REDIS_ZSET)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/* This command implements the generic zpop operation, used by ZPOPMIN,
+ * ZPOPMAX, BZPOPMIN and BZPOPMAX. The first key of 'keyv' holding a sorted
+ * set is popped, from the lowest scores if 'where' is ZSET_MIN, otherwise
+ * from the highest. When 'emitkey' is true the key name is emitted before
+ * the elements, as the blocking variants do. 'countarg' is the optional
+ * count argument, or NULL to pop a single element.
+ *
+ * The elements are sent to the client first, and then removed from the
+ * sorted set with a single range deletion. */
+void genericZpopCommand(redisClient *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg) {
+    int idx;
+    robj *key = NULL;
+    robj *zobj = NULL;
+    long count = 1, llen, j;
+
+    if (countarg) {
+        if (getLongFromObjectOrReply(c,countarg,&count,NULL) != REDIS_OK)
+            return;
+        if (count < 0) {
+            addReply(c,shared.outofrangeerr);
+            return;
+        }
+    }
+
+    /* Use the first key holding a sorted set, checking the type of the
+     * keys we skip. */
+    for (idx = 0; idx < keyc; idx++) {
+        key = keyv[idx];
+        zobj = lookupKeyWrite(c->db,key);
+        if (zobj == NULL) continue;
+        if (checkType(c,zobj,REDIS_ZSET)) return;
+        break;
+    }
+
+    if (zobj == NULL || count == 0) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+
+    llen = zsetLength(zobj);
+    if (count > llen) count = llen;
+    addReplyMultiBulkLen(c,count*2+(emitkey != 0));
+    if (emitkey) addReplyBulk(c,key);
+
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *zl = zobj->ptr;
+        unsigned char *eptr, *sptr;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        eptr = lpSeek(zl,(where == ZSET_MIN) ? 0 : -2);
+        redisAssertWithInfo(c,zobj,eptr != NULL);
+        sptr = lpNext(zl,eptr);
+
+        for (j = 0; j < count; j++) {
+            redisAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
+            redisAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
+            if (vstr == NULL)
+                addReplyBulkLongLong(c,vlong);
+            else
+                addReplyBulkCBuffer(c,vstr,vlen);
+            addReplyDouble(c,zzlGetScore(sptr));
+
+            if (where == ZSET_MIN)
+                zzlNext(zl,&eptr,&sptr);
+            else
+                zzlPrev(zl,&eptr,&sptr);
+        }
+
+        if (where == ZSET_MIN)
+            zobj->ptr = zzlDeleteRangeByRank(zl,1,count,NULL);
+        else
+            zobj->ptr = zzlDeleteRangeByRank(zl,llen-count+1,llen,NULL);
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+        zskiplist *zsl = zs->zsl;
+        zskiplistNode *ln;
+
+        ln = (where == ZSET_MIN) ? zsl->header->level[0].forward : zsl->tail;
+        for (j = 0; j < count; j++) {
+            redisAssertWithInfo(c,zobj,ln != NULL);
+            addReplyBulk(c,ln->obj);
+            addReplyDouble(c,ln->score);
+            ln = (where == ZSET_MIN) ? ln->level[0].forward : ln->backward;
+        }
+
+        if (where == ZSET_MIN)
+            zslDeleteRangeByRank(zsl,1,count,zs->dict);
+        else
+            zslDeleteRangeByRank(zsl,llen-count+1,llen,zs->dict);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = zobj->ptr;
+        zbtIter it;
+        sds ele;
+
+        if (where == ZSET_MIN)
+            zbtFirst(zbt,&it);
+        else
+            zbtLast(zbt,&it);
+        for (j = 0; j < count; j++) {
+            redisAssertWithInfo(c,zobj,zbtIterValid(&it));
+            ele = zbtIterEle(&it);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            addReplyDouble(c,zbtIterScore(&it));
+            if (where == ZSET_MIN) zbtNext(&it); else zbtPrev(&it);
+        }
+
+        if (where == ZSET_MIN)
+            zbtDeleteRangeByRank(zbt,0,count-1);
+        else
+            zbtDeleteRangeByRank(zbt,llen-count,llen-1);
+        if (htNeedsResize(zbt->dict)) dictResize(zbt->dict);
+    } else {
+        redisPanic("Unknown sorted set encoding");
+    }
+
+    notifyKeyspaceEvent(REDIS_NOTIFY_ZSET,
+        (where == ZSET_MIN) ? "zpopmin" : "zpopmax",key,c->db->id);
+    if (zsetLength(zobj) == 0) {
+        dbDelete(c->db,key);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",key,c->db->id);
+    }
+    signalModifiedKey(c->db,key);
+    server.dirty += count;
+}
+
+/* ZPOPMIN key [<count>] */
+void zpopminCommand(redisClient *c) {
+    if (c->argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    genericZpopCommand(c,&c->argv[1],1,ZSET_MIN,0,
+        (c->argc == 3) ? c->argv[2] : NULL);
+}
+
+/* ZPOPMAX key [<count>] */
+void zpopmaxCommand(redisClient *c) {
+    if (c->argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    genericZpopCommand(c,&c->argv[1],1,ZSET_MAX,0,
+        (c->argc == 3) ? c->argv[2] : NULL);
+}
+
+/* BZPOPMIN / BZPOPMAX actual implementation. */
+void blockingGenericZpopCommand(redisClient *c, int where) {
+    robj *o;
+    time_t timeout;
+    int j;
+
+    if (getTimeoutFromObjectOrReply(c,c->argv[c->argc-1],&timeout) != REDIS_OK)
+        return;
+
+    for (j = 1; j < c->argc-1; j++) {
+        o = lookupKeyWrite(c->db,c->argv[j]);
+        if (o != NULL) {
+            if (o->type != REDIS_ZSET) {
+                addReply(c,shared.wrongtypeerr);
+                return;
+            } else if (zsetLength(o) != 0) {
+                /* Non empty sorted set, this is like a normal Z[MIN|MAX]POP. */
+                genericZpopCommand(c,&c->argv[j],1,where,1,NULL);
+
+                /* Replicate it as a ZPOP[MIN|MAX] instead of BZPOP[MIN|MAX]. */
+                rewriteClientCommandVector(c,2,
+                    (where == ZSET_MAX) ? shared.zpopmax : shared.zpopmin,
+                    c->argv[j]);
+                return;
+            }
+        }
+    }
+
+    /* If we are inside a MULTI/EXEC and the sorted set is empty the only
+     * thing we can do is treating it as a timeout (even with timeout 0). */
+    if (c->flags & REDIS_MULTI) {
+        addReply(c,shared.nullmultibulk);
+        return;
+    }
+
+    /* If the keys do not exist we must block */
+    blockForKeys(c,c->argv + 1,c->argc - 2,timeout,NULL);
+}
+
+/* BZPOPMIN key [key ...] timeout */
+void bzpopminCommand(redisClient *c) {
+    blockingGenericZpopCommand(c,ZSET_MIN);
+}
+
+/* BZPOPMAX key [key ...] timeout */
+void bzpopmaxCommand(redisClient *c) {
+    blockingGenericZpopCommand(c,ZSET_MAX);
+}
+
+/*-----------------------------------------------------------------------------
+ * Self test, run with ./redis-server --test-zset
+ *----------------------------------------------------------------------------*/
+
+/* Check that zsetBulkLoad() builds the same skiplist as inserting the pairs
+ * one after the other, like ZADD does for small batches. The batches use
+ * few distinct members and scores, so that the duplicated members and the
+ * ordering by member are exercised as well. */
+static void zsetTestBulkLoad(void) {
+    int round, level, j;
+
+    for (round = 0; round < 100; round++) {
+        int elements = 1+random()%2000, distinct = 1+random()%1000;
+        robj **argv = zmalloc(sizeof(robj*)*(2+elements*2));
+        double *scores = zmalloc(sizeof(double)*elements);
+        robj *bulkobj = createZsetObject(), *refobj = createZsetObject();
+        zset *bulk = bulkobj->ptr, *ref = refobj->ptr;
+        zskiplistNode *x, *y, *prev = NULL;
+        unsigned long rank, n;
+        dictEntry *de;
+        robj *ele;
+
+        for (j = 0; j < elements; j++) {
+            argv[2+j*2] = NULL;
+            argv[3+j*2] = createObject(REDIS_STRING,
+                sdscatprintf(sdsempty(),"m:%ld",random()%distinct));
+            scores[j] = random()%100;
+        }
+
+        /* Reference: the pairs inserted one by one, the last score wins. */
+        for (j = 0; j < elements; j++) {
+            ele = argv[3+j*2];
+            if ((de = dictFind(ref->dict,ele)) != NULL) {
+                ele = dictGetKey(de);
+                redisAssert(zslDelete(ref->zsl,*(double*)dictGetVal(de),ele));
+                x = zslInsert(ref->zsl,scores[j],ele);
+                incrRefCount(ele); /* Re-inserted in skiplist. */
+                dictGetVal(de) = &x->score;
+            } else {
+                x = zslInsert(ref->zsl,scores[j],ele);
+                incrRefCount(ele); /* Inserted in skiplist. */
+                redisAssert(dictAdd(ref->dict,ele,&x->score) == DICT_OK);
+                incrRefCount(ele); /* Added to dictionary. */
+            }
+        }
+
+        n = zsetBulkLoad(bulk,argv,scores,elements);
+        redisAssert(n == ref->zsl->length && n == bulk->zsl->length);
+        redisAssert(dictSize(bulk->dict) == n);
+
+        /* Same elements in the same order, with consistent backward
+         * pointers, spans and dictionary. */
+        x = bulk->zsl->header->level[0].forward;
+        y = ref->zsl->header->level[0].forward;
+        for (rank = 1; rank <= n; rank++) {
+            redisAssert(x != NULL && y != NULL);
+            redisAssert(x->score == y->score && equalStringObjects(x->obj,y->obj));
+            redisAssert(x->backward == prev);
+            redisAssert(zslGetElementByRank(bulk->zsl,rank) == x);
+            redisAssert(zslGetRank(bulk->zsl,x->score,x->obj) == rank);
+            redisAssert(dictFetchValue(bulk->dict,x->obj) == &x->score);
+            prev = x;
+            x = x->level[0].forward;
+            y = y->level[0].forward;
+        }
+        redisAssert(x == NULL && y == NULL && bulk->zsl->tail == prev);
+
+        /* The span of the last node of every level reaches the end of the
+         * list, as zslInsert() expects when a taller node is added later. */
+        for (level = 0; level < bulk->zsl->level; level++) {
+            unsigned long next;
+
+            x = bulk->zsl->header;
+            rank = 0;
+            while (x != NULL) {
+                y = x->level[level].forward;
+                next = y ? zslGetRank(bulk->zsl,y->score,y->obj) : n;
+                redisAssert(x->level[level].span == next-rank);
+                x = y;
+                rank = next;
+            }
+        }
+
+        for (j = 0; j < elements; j++) decrRefCount(argv[3+j*2]);
+        zfree(argv);
+        zfree(scores);
+        decrRefCount(bulkobj);
+        decrRefCount(refobj);
+    }
+}
+
+static sds zsetTestMember(long id) {
+    return sdscatprintf(sdsempty(),"m:%ld",id);
+}
+
+/* Insert 'n' members with random scores into a skiplist encoded sorted set,
+ * the way ZADD does, and into a B+tree, then compare memory usage, ZRANK
+ * lookups, ZRANGE seeks by rank and ZRANGEBYSCORE-like scans. */
+static void zsetTestBenchmark(long n) {
+    long lookups = n < 1000000 ? n : 1000000, scans = 100000, j, k;
+    size_t mem;
+    long long start;
+    double sum = 0;
+    zrangespec range;
+    robj *zobj, *ele;
+    zset *zs;
+    zskiplistNode *x;
+    dictEntry *de;
+    zbtree *zbt;
+    zbtIter it;
+
+    range.max = n;
+    range.minex = range.maxex = 0;
+
+    printf("%ld members:\n", n);
+    mem = zmalloc_used_memory();
+    start = ustime();
+    zobj = createZsetObject();
+    zs = zobj->ptr;
+    for (j = 0; j < n; j++) {
+        ele = createObject(REDIS_STRING,zsetTestMember(j));
+        x = zslInsert(zs->zsl,random()%n,ele);
+        redisAssert(dictAdd(zs->dict,ele,&x->score) == DICT_OK);
+        incrRefCount(ele); /* Added to dictionary. */
+    }
+    printf("  skiplist: insert %lld ms, %.1f bytes per member\n",
+        (ustime()-start)/1000, (double)(zmalloc_used_memory()-mem)/n);
+    start = ustime();
+    for (j = 0; j < lookups; j++) {
+        ele = createObject(REDIS_STRING,zsetTestMember(random()%n));
+        de = dictFind(zs->dict,ele);
+        sum += zslGetRank(zs->zsl,*(double*)dictGetVal(de),dictGetKey(de));
+        decrRefCount(ele);
+    }
+    printf("  skiplist: %ld ranks in %lld ms\n", lookups,
+        (ustime()-start)/1000);
+    start = ustime();
+    for (j = 0; j < lookups; j++)
+        sum += zslGetElementByRank(zs->zsl,1+random()%n)->score;
+    printf("  skiplist: %ld seeks by rank in %lld ms\n", lookups,
+        (ustime()-start)/1000);
+    start = ustime();
+    for (j = 0; j < scans; j++) {
+        range.min = random()%n;
+        x = zslFirstInRange(zs->zsl,&range);
+        for (k = 0; k < 100 && x; k++, x = x->level[0].forward)
+            sum += x->score;
+    }
+    printf("  skiplist: %ld scans of 100 in %lld ms\n", scans,
+        (ustime()-start)/1000);
+    decrRefCount(zobj);
+
+    mem = zmalloc_used_memory();
+    start = ustime();
+    zbt = zbtCreate();
+    for (j = 0; j < n; j++) zbtInsert(zbt,random()%n,zsetTestMember(j));
+    printf("  b+tree:   insert %lld ms, %.1f bytes per member\n",
+        (ustime()-start)/1000, (double)(zmalloc_used_memory()-mem)/n);
+    start = ustime();
+    for (j = 0; j < lookups; j++) {
+        sds member = zsetTestMember(random()%n);
+        sum += zbtGetRank(zbt,member);
+        sdsfree(member);
+    }
+    printf("  b+tree:   %ld ranks in %lld ms\n", lookups,
+        (ustime()-start)/1000);
+    start = ustime();
+    for (j = 0; j < lookups; j++) {
+        zbtSeekRank(zbt,random()%n,&it);
+        sum += zbtIterScore(&it);
+    }
+    printf("  b+tree:   %ld seeks by rank in %lld ms\n", lookups,
+        (ustime()-start)/1000);
+    start = ustime();
+    for (j = 0; j < scans; j++) {
+        range.min = random()%n;
+        zbtSeek(zbt,zbtBeforeMin,&range,&it);
+        for (k = 0; k < 100 && zbtIterValid(&it); k++, zbtNext(&it))
+            sum += zbtIterScore(&it);
+    }
+    printf("  b+tree:   %ld scans of 100 in %lld ms\n", scans,
+        (ustime()-start)/1000);
+    zbtFree(zbt);
+    if (sum == 0) printf("\n"); /* Don't let the loops be optimized away. */
+}
+
+/* Run the tests, then the benchmark with 1M members, or with the number of
+ * members given as argument: ./redis-server --test-zset 100000000 */
+int zsetTest(int argc, char **argv) {
+    printf("ZADD bulk load: ");
+    zsetTestBulkLoad();
+    printf("OK\n");
+
+    zsetTestBenchmark(argc > 2 ? atol(argv[2]) : 1000000);
+    return 0;
+}
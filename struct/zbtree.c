@@ -0,0 +1,945 @@
+/* B+tree of (score, member) pairs, used by large sorted sets.
+ *
+ * Elements are ordered by score, and by member (binary comparison) when
+ * scores are the same, exactly like in the skiplist. Leaves pack up to
+ * ZBT_LEAF_MAX pairs into two parallel arrays of scores and member strings,
+ * and are linked in both directions, so that a range is scanned moving
+ * along contiguous memory instead of chasing a pointer for every element.
+ *
+ * Inner nodes hold up to ZBT_INNER_MAX children, the separator keys between
+ * them, and the number of elements inside every child subtree. Thanks to
+ * the counts the rank of an element, and the element with a given rank,
+ * are found descending a single path from the root, in O(log(N)).
+ *
+ * Separators satisfy the following invariant:
+ *
+ *   every element of child i < separator i <= every element of child i+1
+ *
+ * A separator owns a copy of its member string, so that it remains valid
+ * when the element it was copied from is deleted.
+ *
+ * The member strings are shared with a dictionary mapping every member to
+ * its score, used for O(1) score lookups and in order to find an element
+ * in the tree given its member only. The tree owns the strings: the
+ * dictionary has no destructors.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zbtree.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+#define ZBT_LEAF_MAX 64             /* Max elements of a leaf. */
+#define ZBT_LEAF_MIN (ZBT_LEAF_MAX/4)
+#define ZBT_INNER_MAX 64            /* Max children of an inner node. */
+#define ZBT_INNER_MIN (ZBT_INNER_MAX/4)
+#define ZBT_MAX_HEIGHT 32           /* Way more than 2^64 elements. */
+
+typedef struct zbtNode {
+    int leaf;                       /* True for leaves. */
+    int num;                        /* Elements of a leaf, or children. */
+} zbtNode;
+
+typedef struct zbtLeaf {
+    zbtNode n;
+    struct zbtLeaf *prev, *next;
+    double score[ZBT_LEAF_MAX];
+    sds ele[ZBT_LEAF_MAX];
+} zbtLeaf;
+
+typedef struct zbtInner {
+    zbtNode n;
+    double score[ZBT_INNER_MAX-1];      /* Separators. */
+    sds ele[ZBT_INNER_MAX-1];
+    unsigned long count[ZBT_INNER_MAX]; /* Elements inside every child. */
+    zbtNode *child[ZBT_INNER_MAX];
+} zbtInner;
+
+/* Path from the root to a leaf: the inner nodes traversed, and the index
+ * of the child taken at every level. */
+typedef struct zbtPath {
+    zbtInner *node[ZBT_MAX_HEIGHT];
+    int idx[ZBT_MAX_HEIGHT];
+    int depth;
+} zbtPath;
+
+/* Member -> score dictionary. Keys are the member strings owned by the
+ * tree, the score is stored inside the entry itself. */
+static unsigned int zbtDictHash(const void *key) {
+    return dictGenHashFunction(key,sdslen((sds)key));
+}
+
+static int zbtDictKeyCompare(void *privdata, const void *key1, const void *key2) {
+    size_t l1 = sdslen((sds)key1), l2 = sdslen((sds)key2);
+
+    DICT_NOTUSED(privdata);
+    return l1 == l2 && memcmp(key1,key2,l1) == 0;
+}
+
+static dictType zbtDictType = {
+    zbtDictHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    zbtDictKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* entry metadata bytes */
+};
+
+static int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 != s2) return (s1 < s2) ? -1 : 1;
+    return sdscmp(e1,e2);
+}
+
+/* ------------------------- Nodes ---------------------------------------- */
+
+static zbtLeaf *zbtCreateLeaf(zbtree *zbt) {
+    zbtLeaf *l = zmalloc(sizeof(*l));
+
+    l->n.leaf = 1;
+    l->n.num = 0;
+    l->prev = l->next = NULL;
+    zbt->leaves++;
+    return l;
+}
+
+static zbtInner *zbtCreateInner(zbtree *zbt) {
+    zbtInner *in = zmalloc(sizeof(*in));
+
+    in->n.leaf = 0;
+    in->n.num = 0;
+    zbt->inners++;
+    return in;
+}
+
+static void zbtFreeNode(zbtNode *n) {
+    int j;
+
+    if (n->leaf) {
+        zbtLeaf *l = (zbtLeaf*)n;
+        for (j = 0; j < n->num; j++) sdsfree(l->ele[j]);
+    } else {
+        zbtInner *in = (zbtInner*)n;
+        for (j = 0; j < n->num; j++) zbtFreeNode(in->child[j]);
+        for (j = 0; j < n->num-1; j++) sdsfree(in->ele[j]);
+    }
+    zfree(n);
+}
+
+/* Number of elements inside the subtree rooted at 'n'. */
+static unsigned long zbtNodeSize(zbtNode *n) {
+    unsigned long size = 0;
+    int j;
+
+    if (n->leaf) return n->num;
+    for (j = 0; j < n->num; j++) size += ((zbtInner*)n)->count[j];
+    return size;
+}
+
+/* Insert 'child' at position i+1 of the inner node, preceded by the
+ * separator (sepscore,sepele), that is owned by the node from now on. */
+static void zbtInnerInsert(zbtInner *in, int i, zbtNode *child, double sepscore, sds sepele) {
+    int num = in->n.num;
+
+    memmove(in->child+i+2,in->child+i+1,sizeof(zbtNode*)*(num-i-1));
+    memmove(in->count+i+2,in->count+i+1,sizeof(unsigned long)*(num-i-1));
+    memmove(in->score+i+1,in->score+i,sizeof(double)*(num-i-1));
+    memmove(in->ele+i+1,in->ele+i,sizeof(sds)*(num-i-1));
+    in->child[i+1] = child;
+    in->score[i] = sepscore;
+    in->ele[i] = sepele;
+    in->n.num++;
+}
+
+/* Remove the child at position j+1 of the inner node together with the
+ * separator j. The separator string is not freed. */
+static void zbtInnerRemove(zbtInner *in, int j) {
+    int num = in->n.num;
+
+    memmove(in->score+j,in->score+j+1,sizeof(double)*(num-j-2));
+    memmove(in->ele+j,in->ele+j+1,sizeof(sds)*(num-j-2));
+    memmove(in->child+j+1,in->child+j+2,sizeof(zbtNode*)*(num-j-2));
+    memmove(in->count+j+1,in->count+j+2,sizeof(unsigned long)*(num-j-2));
+    in->n.num--;
+}
+
+/* ------------------------- Descent -------------------------------------- */
+
+/* Descend from the root to the leaf where the element (score,ele) is, or
+ * should be inserted, filling 'path'. The position of the first element
+ * of the leaf that is not smaller than (score,ele) is stored in '*pos', and
+ * if 'rank' is not NULL the number of elements preceding it in '*rank'. */
+static zbtLeaf *zbtDescend(zbtree *zbt, double score, sds ele, zbtPath *path, int *pos, unsigned long *rank) {
+    zbtNode *n = zbt->root;
+    zbtLeaf *l;
+    unsigned long r = 0;
+    int lo, hi, mid, j;
+
+    path->depth = 0;
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+
+        /* Follow the child after the last separator <= (score,ele). */
+        lo = 0;
+        hi = n->num-1;
+        while (lo < hi) {
+            mid = (lo+hi)/2;
+            if (zbtCompare(in->score[mid],in->ele[mid],score,ele) <= 0)
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        for (j = 0; j < lo; j++) r += in->count[j];
+        path->node[path->depth] = in;
+        path->idx[path->depth] = lo;
+        path->depth++;
+        n = in->child[lo];
+    }
+
+    l = (zbtLeaf*)n;
+    lo = 0;
+    hi = n->num;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (zbtCompare(l->score[mid],l->ele[mid],score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    if (rank) *rank = r+lo;
+    return l;
+}
+
+/* Descend to the element with the specified zero-based rank, that must
+ * exist, filling 'path'. */
+static zbtLeaf *zbtDescendRank(zbtree *zbt, unsigned long rank, zbtPath *path, int *pos) {
+    zbtNode *n = zbt->root;
+    int i;
+
+    path->depth = 0;
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+
+        for (i = 0; rank >= in->count[i]; i++) rank -= in->count[i];
+        path->node[path->depth] = in;
+        path->idx[path->depth] = i;
+        path->depth++;
+        n = in->child[i];
+    }
+    *pos = (int)rank;
+    return (zbtLeaf*)n;
+}
+
+/* ------------------------- Insertion ------------------------------------ */
+
+/* Move the upper half of a full leaf into a new leaf, that is returned. */
+static zbtLeaf *zbtSplitLeaf(zbtree *zbt, zbtLeaf *l) {
+    zbtLeaf *r = zbtCreateLeaf(zbt);
+    int half = l->n.num/2;
+
+    r->n.num = l->n.num-half;
+    memcpy(r->score,l->score+half,sizeof(double)*r->n.num);
+    memcpy(r->ele,l->ele+half,sizeof(sds)*r->n.num);
+    l->n.num = half;
+
+    r->prev = l;
+    r->next = l->next;
+    if (l->next) l->next->prev = r; else zbt->tail = r;
+    l->next = r;
+    return r;
+}
+
+/* The node 'left', child of path->node[d] (or the root if d is -1), was
+ * split into 'left' and 'right': link 'right' into the parent, splitting
+ * the parents that are full as well, up to the root if needed. */
+static void zbtInsertChild(zbtree *zbt, zbtPath *path, int d, zbtNode *left, zbtNode *right, double sepscore, sds sepele) {
+    while (d >= 0) {
+        zbtInner *in = path->node[d], *sib;
+        int i = path->idx[d], half = ZBT_INNER_MAX/2;
+        double upscore;
+        sds upele;
+
+        if (in->n.num < ZBT_INNER_MAX) {
+            zbtInnerInsert(in,i,right,sepscore,sepele);
+            in->count[i] = zbtNodeSize(left);
+            in->count[i+1] = zbtNodeSize(right);
+            return;
+        }
+
+        /* The parent is full: split it, moving the middle separator one
+         * level up, and insert the new child into the proper half. */
+        sib = zbtCreateInner(zbt);
+        upscore = in->score[half-1];
+        upele = in->ele[half-1];
+        sib->n.num = in->n.num-half;
+        memcpy(sib->child,in->child+half,sizeof(zbtNode*)*sib->n.num);
+        memcpy(sib->count,in->count+half,sizeof(unsigned long)*sib->n.num);
+        memcpy(sib->score,in->score+half,sizeof(double)*(sib->n.num-1));
+        memcpy(sib->ele,in->ele+half,sizeof(sds)*(sib->n.num-1));
+        in->n.num = half;
+
+        if (i < half) {
+            zbtInnerInsert(in,i,right,sepscore,sepele);
+            in->count[i] = zbtNodeSize(left);
+            in->count[i+1] = zbtNodeSize(right);
+        } else {
+            i -= half;
+            zbtInnerInsert(sib,i,right,sepscore,sepele);
+            sib->count[i] = zbtNodeSize(left);
+            sib->count[i+1] = zbtNodeSize(right);
+        }
+        left = (zbtNode*)in;
+        right = (zbtNode*)sib;
+        sepscore = upscore;
+        sepele = upele;
+        d--;
+    }
+
+    /* The root was split: the tree grows by one level. */
+    {
+        zbtInner *root = zbtCreateInner(zbt);
+
+        root->n.num = 2;
+        root->child[0] = left;
+        root->child[1] = right;
+        root->count[0] = zbtNodeSize(left);
+        root->count[1] = zbtNodeSize(right);
+        root->score[0] = sepscore;
+        root->ele[0] = sepele;
+        zbt->root = (zbtNode*)root;
+        zbt->height++;
+    }
+}
+
+static void zbtLeafInsert(zbtLeaf *l, int pos, double score, sds ele) {
+    memmove(l->score+pos+1,l->score+pos,sizeof(double)*(l->n.num-pos));
+    memmove(l->ele+pos+1,l->ele+pos,sizeof(sds)*(l->n.num-pos));
+    l->score[pos] = score;
+    l->ele[pos] = ele;
+    l->n.num++;
+}
+
+/* Insert the element at position 'pos' of the leaf reached by 'path'. */
+static void zbtInsertAt(zbtree *zbt, zbtPath *path, zbtLeaf *l, int pos, double score, sds ele) {
+    int d;
+
+    for (d = 0; d < path->depth; d++)
+        path->node[d]->count[path->idx[d]]++;
+    zbt->length++;
+
+    if (l->n.num < ZBT_LEAF_MAX) {
+        zbtLeafInsert(l,pos,score,ele);
+    } else {
+        zbtLeaf *r = zbtSplitLeaf(zbt,l);
+
+        if (pos > l->n.num)
+            zbtLeafInsert(r,pos-l->n.num,score,ele);
+        else
+            zbtLeafInsert(l,pos,score,ele);
+        zbtInsertChild(zbt,path,path->depth-1,(zbtNode*)l,(zbtNode*)r,
+                       r->score[0],sdsdup(r->ele[0]));
+    }
+}
+
+/* ------------------------- Deletion ------------------------------------- */
+
+/* Rebalance the leaves j and j+1 of the inner node 'p', one of them being
+ * under the minimum fill: merge them if they fit a single leaf, otherwise
+ * move elements from one to the other so that both are half full. */
+static void zbtBalanceLeaves(zbtree *zbt, zbtInner *p, int j) {
+    zbtLeaf *l = (zbtLeaf*)p->child[j], *r = (zbtLeaf*)p->child[j+1];
+    int total = l->n.num+r->n.num, k;
+
+    if (total <= ZBT_LEAF_MAX) {
+        memcpy(l->score+l->n.num,r->score,sizeof(double)*r->n.num);
+        memcpy(l->ele+l->n.num,r->ele,sizeof(sds)*r->n.num);
+        l->n.num = total;
+        l->next = r->next;
+        if (r->next) r->next->prev = l; else zbt->tail = l;
+        zfree(r);
+        zbt->leaves--;
+        sdsfree(p->ele[j]);
+        zbtInnerRemove(p,j);
+        p->count[j] = total;
+        return;
+    }
+
+    if (l->n.num < total/2) {
+        k = total/2-l->n.num;
+        memcpy(l->score+l->n.num,r->score,sizeof(double)*k);
+        memcpy(l->ele+l->n.num,r->ele,sizeof(sds)*k);
+        memmove(r->score,r->score+k,sizeof(double)*(r->n.num-k));
+        memmove(r->ele,r->ele+k,sizeof(sds)*(r->n.num-k));
+        l->n.num += k;
+        r->n.num -= k;
+    } else {
+        k = l->n.num-total/2;
+        memmove(r->score+k,r->score,sizeof(double)*r->n.num);
+        memmove(r->ele+k,r->ele,sizeof(sds)*r->n.num);
+        memcpy(r->score,l->score+l->n.num-k,sizeof(double)*k);
+        memcpy(r->ele,l->ele+l->n.num-k,sizeof(sds)*k);
+        l->n.num -= k;
+        r->n.num += k;
+    }
+    sdsfree(p->ele[j]);
+    p->score[j] = r->score[0];
+    p->ele[j] = sdsdup(r->ele[0]);
+    p->count[j] = l->n.num;
+    p->count[j+1] = r->n.num;
+}
+
+/* Same as zbtBalanceLeaves() for two inner nodes. The separator of the
+ * parent moves down between the children of the two nodes, and a new one
+ * moves up when the children are just redistributed. */
+static void zbtBalanceInners(zbtree *zbt, zbtInner *p, int j) {
+    zbtInner *l = (zbtInner*)p->child[j], *r = (zbtInner*)p->child[j+1];
+    zbtNode *child[ZBT_INNER_MAX*2];
+    unsigned long count[ZBT_INNER_MAX*2];
+    double score[ZBT_INNER_MAX*2];
+    sds ele[ZBT_INNER_MAX*2];
+    int ln = l->n.num, rn = r->n.num, total = ln+rn, nl;
+
+    memcpy(child,l->child,sizeof(zbtNode*)*ln);
+    memcpy(child+ln,r->child,sizeof(zbtNode*)*rn);
+    memcpy(count,l->count,sizeof(unsigned long)*ln);
+    memcpy(count+ln,r->count,sizeof(unsigned long)*rn);
+    memcpy(score,l->score,sizeof(double)*(ln-1));
+    memcpy(ele,l->ele,sizeof(sds)*(ln-1));
+    score[ln-1] = p->score[j];
+    ele[ln-1] = p->ele[j];
+    memcpy(score+ln,r->score,sizeof(double)*(rn-1));
+    memcpy(ele+ln,r->ele,sizeof(sds)*(rn-1));
+
+    nl = (total <= ZBT_INNER_MAX) ? total : total/2;
+    memcpy(l->child,child,sizeof(zbtNode*)*nl);
+    memcpy(l->count,count,sizeof(unsigned long)*nl);
+    memcpy(l->score,score,sizeof(double)*(nl-1));
+    memcpy(l->ele,ele,sizeof(sds)*(nl-1));
+    l->n.num = nl;
+
+    if (nl == total) {
+        zfree(r);
+        zbt->inners--;
+        zbtInnerRemove(p,j);
+        p->count[j] = zbtNodeSize((zbtNode*)l);
+        return;
+    }
+
+    r->n.num = total-nl;
+    memcpy(r->child,child+nl,sizeof(zbtNode*)*r->n.num);
+    memcpy(r->count,count+nl,sizeof(unsigned long)*r->n.num);
+    memcpy(r->score,score+nl,sizeof(double)*(r->n.num-1));
+    memcpy(r->ele,ele+nl,sizeof(sds)*(r->n.num-1));
+    p->score[j] = score[nl-1];
+    p->ele[j] = ele[nl-1];
+    p->count[j] = zbtNodeSize((zbtNode*)l);
+    p->count[j+1] = zbtNodeSize((zbtNode*)r);
+}
+
+/* Restore the minimum fill of the nodes along 'path' after a deletion,
+ * starting from the leaf, and shrink the tree while the root is an inner
+ * node with a single child. */
+static void zbtRebalance(zbtree *zbt, zbtPath *path) {
+    int d;
+
+    for (d = path->depth-1; d >= 0; d--) {
+        zbtInner *p = path->node[d];
+        int i = path->idx[d];
+        zbtNode *child = p->child[i];
+
+        if (child->num >= (child->leaf ? ZBT_LEAF_MIN : ZBT_INNER_MIN))
+            break;
+        if (i > 0) i--;
+        if (child->leaf)
+            zbtBalanceLeaves(zbt,p,i);
+        else
+            zbtBalanceInners(zbt,p,i);
+    }
+
+    while (!zbt->root->leaf && zbt->root->num == 1) {
+        zbtInner *old = (zbtInner*)zbt->root;
+
+        zbt->root = old->child[0];
+        zfree(old);
+        zbt->inners--;
+        zbt->height--;
+    }
+}
+
+/* Remove 'k' elements starting at position 'pos' of the leaf reached by
+ * 'path'. The member strings must be released by the caller. */
+static void zbtLeafRemove(zbtree *zbt, zbtPath *path, zbtLeaf *l, int pos, int k) {
+    int d;
+
+    memmove(l->score+pos,l->score+pos+k,sizeof(double)*(l->n.num-pos-k));
+    memmove(l->ele+pos,l->ele+pos+k,sizeof(sds)*(l->n.num-pos-k));
+    l->n.num -= k;
+    for (d = 0; d < path->depth; d++)
+        path->node[d]->count[path->idx[d]] -= k;
+    zbt->length -= k;
+    zbtRebalance(zbt,path);
+}
+
+/* ------------------------- API ------------------------------------------ */
+
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbtLeaf *l;
+
+    zbt->leaves = zbt->inners = 0;
+    l = zbtCreateLeaf(zbt);
+    zbt->root = (zbtNode*)l;
+    zbt->head = zbt->tail = l;
+    zbt->dict = dictCreate(&zbtDictType,NULL);
+    zbt->length = 0;
+    zbt->height = 1;
+    return zbt;
+}
+
+void zbtFree(zbtree *zbt) {
+    dictRelease(zbt->dict);
+    zbtFreeNode(zbt->root);
+    zfree(zbt);
+}
+
+/* Lookup the score of 'ele'. Returns 0 if the member is not in the tree. */
+int zbtFind(zbtree *zbt, sds ele, double *score) {
+    dictEntry *de = dictFind(zbt->dict,ele);
+
+    if (de == NULL) return 0;
+    if (score) *score = dictGetDoubleVal(de);
+    return 1;
+}
+
+/* Insert a new element. The member must not be already in the tree, and
+ * the string is owned by the tree from now on. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    dictEntry *de = dictAddRaw(zbt->dict,ele);
+    zbtPath path;
+    zbtLeaf *l;
+    int pos;
+
+    assert(de != NULL);
+    dictSetDoubleVal(de,score);
+    l = zbtDescend(zbt,score,ele,&path,&pos,NULL);
+    zbtInsertAt(zbt,&path,l,pos,score,ele);
+}
+
+/* Delete the element with member 'ele'. Returns 0 if it was not found. */
+int zbtDelete(zbtree *zbt, sds ele) {
+    dictEntry *de = dictFind(zbt->dict,ele);
+    zbtPath path;
+    zbtLeaf *l;
+    sds stored;
+    int pos;
+
+    if (de == NULL) return 0;
+    stored = dictGetKey(de);
+    l = zbtDescend(zbt,dictGetDoubleVal(de),stored,&path,&pos,NULL);
+    assert(pos < l->n.num && l->ele[pos] == stored);
+    dictDelete(zbt->dict,stored);
+    zbtLeafRemove(zbt,&path,l,pos,1);
+    sdsfree(stored);
+    return 1;
+}
+
+/* Change the score of the element with member 'ele'. The element is just
+ * updated in place when the new score does not move it away from its
+ * neighbours inside the leaf. Returns 0 if the member was not found. */
+int zbtUpdateScore(zbtree *zbt, sds ele, double score) {
+    dictEntry *de = dictFind(zbt->dict,ele);
+    zbtPath path;
+    zbtLeaf *l;
+    sds stored;
+    int pos;
+
+    if (de == NULL) return 0;
+    if (dictGetDoubleVal(de) == score) return 1;
+    stored = dictGetKey(de);
+    l = zbtDescend(zbt,dictGetDoubleVal(de),stored,&path,&pos,NULL);
+    assert(pos < l->n.num && l->ele[pos] == stored);
+    dictSetDoubleVal(de,score);
+
+    if (pos > 0 && pos < l->n.num-1 &&
+        zbtCompare(l->score[pos-1],l->ele[pos-1],score,stored) < 0 &&
+        zbtCompare(score,stored,l->score[pos+1],l->ele[pos+1]) < 0)
+    {
+        l->score[pos] = score;
+        return 1;
+    }
+    zbtLeafRemove(zbt,&path,l,pos,1);
+    l = zbtDescend(zbt,score,stored,&path,&pos,NULL);
+    zbtInsertAt(zbt,&path,l,pos,score,stored);
+    return 1;
+}
+
+/* Return the 1-based rank of the element with member 'ele', or 0 if the
+ * member is not in the tree. */
+unsigned long zbtGetRank(zbtree *zbt, sds ele) {
+    dictEntry *de = dictFind(zbt->dict,ele);
+    unsigned long rank;
+    zbtPath path;
+    int pos;
+
+    if (de == NULL) return 0;
+    zbtDescend(zbt,dictGetDoubleVal(de),dictGetKey(de),&path,&pos,&rank);
+    return rank+1;
+}
+
+/* Position the iterator at the element with the zero-based rank 'rank'.
+ * Returns 0, with an invalid iterator, if the rank is out of range. */
+int zbtSeekRank(zbtree *zbt, unsigned long rank, zbtIter *it) {
+    zbtPath path;
+
+    if (rank >= zbt->length) {
+        it->leaf = NULL;
+        return 0;
+    }
+    it->leaf = zbtDescendRank(zbt,rank,&path,&it->pos);
+    return 1;
+}
+
+/* Position the iterator at the first element for which before() is false,
+ * returning its zero-based rank. When before() is true for all the
+ * elements the iterator is invalid and the length of the tree returned. */
+unsigned long zbtSeek(zbtree *zbt, zbtBeforeProc *before, void *privdata, zbtIter *it) {
+    zbtNode *n = zbt->root;
+    zbtLeaf *l;
+    unsigned long rank = 0;
+    int lo, hi, mid, j;
+
+    while (!n->leaf) {
+        zbtInner *in = (zbtInner*)n;
+
+        /* Every element of a child is before its separator: skip all the
+         * children with a separator matching the predicate. */
+        lo = 0;
+        hi = n->num-1;
+        while (lo < hi) {
+            mid = (lo+hi)/2;
+            if (before(privdata,in->score[mid],in->ele[mid]))
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        for (j = 0; j < lo; j++) rank += in->count[j];
+        n = in->child[lo];
+    }
+
+    l = (zbtLeaf*)n;
+    lo = 0;
+    hi = n->num;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (before(privdata,l->score[mid],l->ele[mid]))
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    rank += lo;
+
+    /* The first element after the range may be the head of the next
+     * leaf. Leaves other than the root are never empty. */
+    if (lo == n->num) {
+        it->leaf = l->next;
+        it->pos = 0;
+    } else {
+        it->leaf = l;
+        it->pos = lo;
+    }
+    return rank;
+}
+
+/* Delete the elements with zero-based rank between 'start' and 'end',
+ * inclusive. Elements are removed a leaf at a time. Returns the number of
+ * elements deleted. */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end) {
+    unsigned long todo, deleted = 0;
+
+    if (zbt->length == 0) return 0;
+    if (end >= zbt->length) end = zbt->length-1;
+    if (start > end) return 0;
+
+    todo = end-start+1;
+    while (todo) {
+        zbtPath path;
+        zbtLeaf *l;
+        int pos, k, j;
+
+        l = zbtDescendRank(zbt,start,&path,&pos);
+        k = l->n.num-pos;
+        if ((unsigned long)k > todo) k = (int)todo;
+        for (j = pos; j < pos+k; j++) {
+            dictDelete(zbt->dict,l->ele[j]);
+            sdsfree(l->ele[j]);
+        }
+        zbtLeafRemove(zbt,&path,l,pos,k);
+        todo -= k;
+        deleted += k;
+    }
+    return deleted;
+}
+
+void zbtFirst(zbtree *zbt, zbtIter *it) {
+    it->leaf = zbt->length ? zbt->head : NULL;
+    it->pos = 0;
+}
+
+void zbtLast(zbtree *zbt, zbtIter *it) {
+    it->leaf = zbt->length ? zbt->tail : NULL;
+    it->pos = it->leaf ? it->leaf->n.num-1 : 0;
+}
+
+void zbtNext(zbtIter *it) {
+    if (++it->pos == it->leaf->n.num) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+}
+
+void zbtPrev(zbtIter *it) {
+    if (it->pos-- == 0) {
+        it->leaf = it->leaf->prev;
+        if (it->leaf) it->pos = it->leaf->n.num-1;
+    }
+}
+
+double zbtIterScore(zbtIter *it) {
+    return it->leaf->score[it->pos];
+}
+
+sds zbtIterEle(zbtIter *it) {
+    return it->leaf->ele[it->pos];
+}
+
+/* Memory used by the nodes of the tree. The member strings and the
+ * dictionary are not accounted. */
+size_t zbtBytes(zbtree *zbt) {
+    return sizeof(*zbt)+zbt->leaves*sizeof(zbtLeaf)+
+           zbt->inners*sizeof(zbtInner);
+}
+
+#ifdef ZBTREE_TEST_MAIN
+/* Check the structural invariants of the subtree rooted at 'n': ordering
+ * against the bounds set by the separators, counts, and fill. Returns the
+ * number of elements of the subtree. */
+static unsigned long zbtVerifyNode(zbtNode *n, int isroot, int height,
+                                   double *minscore, sds minele,
+                                   double *maxscore, sds maxele) {
+    unsigned long size = 0;
+    int j;
+
+    if (n->leaf) {
+        zbtLeaf *l = (zbtLeaf*)n;
+
+        assert(height == 1);
+        assert(isroot || n->num >= ZBT_LEAF_MIN);
+        for (j = 0; j < n->num; j++) {
+            if (j) assert(zbtCompare(l->score[j-1],l->ele[j-1],
+                                     l->score[j],l->ele[j]) < 0);
+            if (minscore) assert(zbtCompare(*minscore,minele,
+                                            l->score[j],l->ele[j]) <= 0);
+            if (maxscore) assert(zbtCompare(l->score[j],l->ele[j],
+                                            *maxscore,maxele) < 0);
+        }
+        return n->num;
+    } else {
+        zbtInner *in = (zbtInner*)n;
+
+        assert(n->num >= (isroot ? 2 : ZBT_INNER_MIN));
+        for (j = 0; j < n->num; j++) {
+            unsigned long s;
+            s = zbtVerifyNode(in->child[j],0,height-1,
+                    j ? &in->score[j-1] : minscore,
+                    j ? in->ele[j-1] : minele,
+                    (j < n->num-1) ? &in->score[j] : maxscore,
+                    (j < n->num-1) ? in->ele[j] : maxele);
+            assert(s == in->count[j]);
+            size += s;
+        }
+        return size;
+    }
+}
+
+static void zbtVerify(zbtree *zbt) {
+    zbtIter it;
+    unsigned long n = 0;
+    zbtLeaf *prev = NULL;
+
+    assert(zbtVerifyNode(zbt->root,1,zbt->height,NULL,NULL,NULL,NULL) ==
+           zbt->length);
+    assert(dictSize(zbt->dict) == zbt->length);
+    zbtFirst(zbt,&it);
+    while (zbtIterValid(&it)) {
+        double score;
+        assert(zbtFind(zbt,zbtIterEle(&it),&score));
+        assert(score == zbtIterScore(&it));
+        if (it.leaf != prev) {
+            assert(it.leaf->prev == prev);
+            prev = it.leaf;
+        }
+        n++;
+        zbtNext(&it);
+    }
+    assert(n == zbt->length);
+    assert(zbt->length == 0 || prev == zbt->tail);
+}
+
+/* Reference model: scores indexed by member id, -1 if absent. Scores are
+ * small integers so that many elements share the same score and the
+ * ordering by member is exercised as well. */
+static sds memberName(long id) {
+    return sdscatprintf(sdsempty(),"m:%ld",id);
+}
+
+typedef struct refElement {
+    double score;
+    sds ele;
+} refElement;
+
+static int refCompare(const void *a, const void *b) {
+    const refElement *x = a, *y = b;
+    return zbtCompare(x->score,x->ele,y->score,y->ele);
+}
+
+static int scoreBefore(void *privdata, double score, sds ele) {
+    ((void) ele);
+    return score < *(double*)privdata;
+}
+
+static void zbtCheckAgainst(zbtree *zbt, double *model, long ids) {
+    refElement *ref = zmalloc(sizeof(refElement)*ids);
+    long n = 0, j;
+    zbtIter it;
+
+    for (j = 0; j < ids; j++) {
+        if (model[j] < 0) continue;
+        ref[n].score = model[j];
+        ref[n].ele = memberName(j);
+        n++;
+    }
+    qsort(ref,n,sizeof(refElement),refCompare);
+    assert((unsigned long)n == zbtLength(zbt));
+    zbtVerify(zbt);
+
+    zbtFirst(zbt,&it);
+    for (j = 0; j < n; j++) {
+        assert(zbtIterValid(&it));
+        assert(zbtIterScore(&it) == ref[j].score);
+        assert(sdscmp(zbtIterEle(&it),ref[j].ele) == 0);
+        zbtNext(&it);
+    }
+    assert(!zbtIterValid(&it));
+    zbtLast(zbt,&it);
+    for (j = n-1; j >= 0; j--) {
+        assert(sdscmp(zbtIterEle(&it),ref[j].ele) == 0);
+        zbtPrev(&it);
+    }
+    assert(!zbtIterValid(&it));
+
+    for (j = 0; j < n; j += 7) {
+        double score = ref[j].score;
+        long first = j;
+
+        assert(zbtGetRank(zbt,ref[j].ele) == (unsigned long)j+1);
+        assert(zbtSeekRank(zbt,j,&it));
+        assert(sdscmp(zbtIterEle(&it),ref[j].ele) == 0);
+        while (first > 0 && ref[first-1].score == score) first--;
+        assert(zbtSeek(zbt,scoreBefore,&score,&it) == (unsigned long)first);
+        assert(sdscmp(zbtIterEle(&it),ref[first].ele) == 0);
+    }
+    for (j = 0; j < n; j++) sdsfree(ref[j].ele);
+    zfree(ref);
+}
+
+/* The benchmark against the skiplist is run by ./redis-server --test-zset,
+ * so that it uses the real skiplist of t_zset.c, see zsetTest(). */
+int main(void) {
+    long ids = 20000, j, round;
+    double *model = zmalloc(sizeof(double)*ids);
+    zbtree *zbt = zbtCreate();
+
+    for (j = 0; j < ids; j++) model[j] = -1;
+    srandom(1234);
+    for (round = 0; round < 40; round++) {
+        long ops = random() % 5000;
+        int kind = round % 4;
+
+        for (j = 0; j < ops; j++) {
+            long id = random() % ids;
+            double score = random() % 100;
+            sds ele = memberName(id);
+
+            if (kind == 3 || (kind != 2 && model[id] < 0)) {
+                if (model[id] < 0) {
+                    zbtInsert(zbt,score,ele);
+                    model[id] = score;
+                    continue;
+                }
+                assert(zbtUpdateScore(zbt,ele,score));
+                model[id] = score;
+            } else if (kind == 2 || kind == 1) {
+                assert(zbtDelete(zbt,ele) == (model[id] >= 0));
+                model[id] = -1;
+            }
+            sdsfree(ele);
+        }
+        if (round % 10 == 9 && zbtLength(zbt)) {
+            /* Delete a range by rank, then rebuild the model from the
+             * elements that survived. */
+            unsigned long len = zbtLength(zbt);
+            unsigned long start = random() % len;
+            unsigned long end = start + random() % (len-start);
+            zbtIter it;
+
+            assert(zbtDeleteRangeByRank(zbt,start,end) == end-start+1);
+            for (j = 0; j < ids; j++) model[j] = -1;
+            zbtFirst(zbt,&it);
+            while (zbtIterValid(&it)) {
+                model[atol(zbtIterEle(&it)+2)] = zbtIterScore(&it);
+                zbtNext(&it);
+            }
+        }
+        zbtCheckAgainst(zbt,model,ids);
+    }
+    j = zbtLength(zbt);
+    assert(zbtDeleteRangeByRank(zbt,0,j) == (unsigned long)j);
+    assert(zbtLength(zbt) == 0 && zbt->height == 1 && zbt->leaves == 1);
+    zbtFree(zbt);
+    zfree(model);
+    printf("OK\n");
+    return 0;
+}
+#endif
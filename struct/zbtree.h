@@ -0,0 +1,82 @@
+/* zbtree.h - B+tree of (score, member) pairs for large sorted sets
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "sds.h"
+#include "dict.h"
+
+struct zbtNode;
+struct zbtLeaf;
+
+typedef struct zbtree {
+    struct zbtNode *root;
+    struct zbtLeaf *head, *tail;    /* Leaves are linked in both directions. */
+    dict *dict;                     /* Member -> score. */
+    unsigned long length;           /* Number of elements. */
+    unsigned long leaves;           /* Number of leaf nodes. */
+    unsigned long inners;           /* Number of inner nodes. */
+    int height;                     /* 1 when the root is a leaf. */
+} zbtree;
+
+/* Position of an element inside the tree. The iterator is invalidated by
+ * any modification of the tree. */
+typedef struct zbtIter {
+    struct zbtLeaf *leaf;           /* NULL when out of the elements. */
+    int pos;
+} zbtIter;
+
+/* Predicate used by zbtSeek(): it must be true for a (possibly empty)
+ * prefix of the elements in order, and false for all the rest. */
+typedef int (zbtBeforeProc)(void *privdata, double score, sds ele);
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+int zbtFind(zbtree *zbt, sds ele, double *score);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, sds ele);
+int zbtUpdateScore(zbtree *zbt, sds ele, double score);
+unsigned long zbtGetRank(zbtree *zbt, sds ele);
+int zbtSeekRank(zbtree *zbt, unsigned long rank, zbtIter *it);
+unsigned long zbtSeek(zbtree *zbt, zbtBeforeProc *before, void *privdata, zbtIter *it);
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end);
+void zbtFirst(zbtree *zbt, zbtIter *it);
+void zbtLast(zbtree *zbt, zbtIter *it);
+void zbtNext(zbtIter *it);
+void zbtPrev(zbtIter *it);
+double zbtIterScore(zbtIter *it);
+sds zbtIterEle(zbtIter *it);
+size_t zbtBytes(zbtree *zbt);
+
+#define zbtLength(zbt) ((zbt)->length)
+#define zbtIterValid(it) ((it)->leaf != NULL)
+
+#endif
@@ -1518,6 +1518,31 @@ size_t ziplistBlobLen(unsigned char *zl) {
     return intrev32ifbe(ZIPLIST_BYTES(zl));
 }
 
+/* Check that the 'size' bytes at 'zl' are a well formed ziplist header:
+ * zlbytes must match the size of the blob, zltail must point inside it,
+ * and the blob must end with ZIP_END. Moreover the header must agree with
+ * the blob about the ziplist being empty or not. The entries themselves
+ * are not checked. Used when loading ziplists from untrusted sources.
+ * Returns 1 if the header is valid, otherwise 0. */
+int ziplistValidateHeader(unsigned char *zl, size_t size) {
+    size_t tail;
+    int empty;
+
+    if (size < ZIPLIST_HEADER_SIZE+1) return 0;
+    if (intrev32ifbe(ZIPLIST_BYTES(zl)) != size) return 0;
+    if (zl[size-1] != ZIP_END) return 0;
+
+    tail = intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl));
+    empty = zl[ZIPLIST_HEADER_SIZE] == ZIP_END;
+    if (empty) {
+        if (tail != ZIPLIST_HEADER_SIZE || ZIPLIST_LENGTH(zl) != 0) return 0;
+    } else {
+        if (tail < ZIPLIST_HEADER_SIZE || tail >= size-1 ||
+            ZIPLIST_LENGTH(zl) == 0) return 0;
+    }
+    return 1;
+}
+
 
 //打印ziplist 的信息
 void ziplistRepr(unsigned char *zl) {
@@ -34,18 +34,35 @@
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
-/* This helper function used by GETBIT / SETBIT parses the bit offset argument
- * making sure an error is returned if it is negative or if it overflows
- * Redis 512 MB limit for the string value. */
-static int getBitOffsetFromArgument(redisClient *c, robj *o, size_t *offset) {
+/* This helper function used by GETBIT / SETBIT / BITFIELD parses the bit
+ * offset argument making sure an error is returned if it is negative or if
+ * the last of the 'bits' bits addressed overflows Redis 512 MB limit for the
+ * string value.
+ *
+ * If 'hash' is true the offset may also be given as "#<n>", meaning the
+ * n-th field of 'bits' bits, that is, bit offset n*bits. */
+static int getBitOffsetFromArgument(redisClient *c, robj *o, size_t *offset,
+                                    int hash, int bits)
+{
     long long loffset;
     char *err = "bit offset is not an integer or out of range";
+    char *p = o->ptr;
 
-    if (getLongLongFromObjectOrReply(c,o,&loffset,err) != REDIS_OK)
+    if (hash && o->encoding == REDIS_ENCODING_RAW && p[0] == '#') {
+        if (string2ll(p+1,sdslen(p)-1,&loffset) == 0 || loffset < 0 ||
+            loffset > (512LL*1024*1024*8)/bits)
+        {
+            addReplyError(c,err);
+            return REDIS_ERR;
+        }
+        loffset *= bits;
+    } else if (getLongLongFromObjectOrReply(c,o,&loffset,err) != REDIS_OK) {
         return REDIS_ERR;
+    }
 
     /* Limit offset to 512MB in bytes */
-    if ((loffset < 0) || ((unsigned long long)loffset >> 3) >= (512*1024*1024))
+    if ((loffset < 0) ||
+        ((unsigned long long)loffset+bits-1) >> 3 >= (512*1024*1024))
     {
         addReplyError(c,err);
         return REDIS_ERR;
@@ -55,10 +72,24 @@ static int getBitOffsetFromArgument(redisClient *c, robj *o, size_t *offset) {
     return REDIS_OK;
 }
 
+/* On x86 the popcount and the bitpos kernels can use the POPCNT and AVX2
+ * instructions. The kernels are compiled with the target attribute, so
+ * the rest of the server does not need to be compiled with -mavx2, and
+ * the right one is selected at runtime according to the CPU we are
+ * running on. Everywhere else only the portable implementation is used. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define BITOPS_HAVE_DISPATCH
+#include <immintrin.h>
+#endif
+
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+ * work with a input string length up to 512 MB.
+ *
+ * This is the portable implementation, used when the CPU has no
+ * hardware popcount. */
+static size_t redisPopcountPortable(void *s, long count) {
     size_t bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
@@ -100,6 +131,281 @@ size_t redisPopcount(void *s, long count) {
     return bits;
 }
 
+#ifdef BITOPS_HAVE_DISPATCH
+/* Popcount using the POPCNT instruction 64 bits at a time. Four
+ * independent accumulators are used so that consecutive POPCNT
+ * instructions don't wait for each other. */
+__attribute__((target("popcnt")))
+static size_t redisPopcountPopcnt(void *s, long count) {
+    unsigned char *p = s;
+    uint64_t aux, bits1 = 0, bits2 = 0, bits3 = 0, bits4 = 0;
+
+    /* Count bits 32 bytes at a time. Loads are done with memcpy() since
+     * the pointer may not be aligned: it compiles to plain moves. */
+    while(count >= 32) {
+        uint64_t w[4];
+
+        memcpy(w,p,sizeof(w));
+        bits1 += __builtin_popcountll(w[0]);
+        bits2 += __builtin_popcountll(w[1]);
+        bits3 += __builtin_popcountll(w[2]);
+        bits4 += __builtin_popcountll(w[3]);
+        p += 32;
+        count -= 32;
+    }
+    while(count >= 8) {
+        memcpy(&aux,p,sizeof(aux));
+        bits1 += __builtin_popcountll(aux);
+        p += 8;
+        count -= 8;
+    }
+    /* Count the remaining bytes. */
+    if (count) {
+        aux = 0;
+        memcpy(&aux,p,count);
+        bits1 += __builtin_popcountll(aux);
+    }
+    return bits1+bits2+bits3+bits4;
+}
+
+/* Number of bits set in every byte of 'v', returned as four 64 bit
+ * counters (one every 8 bytes), using the nibble lookup table trick. */
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v,low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup,lo),
+                                  _mm256_shuffle_epi8(lookup,hi));
+    return _mm256_sad_epu8(cnt,_mm256_setzero_si256());
+}
+
+/* Carry save adder: given a, b and c computes the bits of the sum in
+ * 'l' (low) and in 'h' (high). */
+#define BITOPS_CSA(h,l,a,b,c) do { \
+    __m256i _u = _mm256_xor_si256(a,b); \
+    h = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(_u,c)); \
+    l = _mm256_xor_si256(_u,c); \
+} while(0)
+
+/* Popcount using AVX2 and the Harley-Seal algorithm: 16 vectors (512
+ * bytes) are reduced with a tree of carry save adders to the "ones",
+ * "twos", "fours", "eights" and "sixteens" vectors, so that the
+ * expensive vector popcount is done only once every 512 bytes on the
+ * sixteens vector. Inputs too small to amortize the setup, and the
+ * remaining tail, are handled by the POPCNT kernel: every CPU with AVX2
+ * also has POPCNT. */
+__attribute__((target("avx2,popcnt")))
+static size_t redisPopcountAVX2(void *s, long count) {
+    unsigned char *p = s;
+    __m256i total, ones, twos, fours, eights, sixteens;
+    __m256i twosA, twosB, foursA, foursB, eightsA, eightsB;
+    uint64_t res[4];
+    size_t bits;
+    long j;
+
+    if (count < 1024) return redisPopcountPopcnt(s,count);
+
+    total = ones = twos = fours = eights = _mm256_setzero_si256();
+#define BITOPS_LOAD(i) _mm256_loadu_si256((const __m256i*)(p+(i)*32))
+    while(count >= 512) {
+        BITOPS_CSA(twosA,ones,ones,BITOPS_LOAD(0),BITOPS_LOAD(1));
+        BITOPS_CSA(twosB,ones,ones,BITOPS_LOAD(2),BITOPS_LOAD(3));
+        BITOPS_CSA(foursA,twos,twos,twosA,twosB);
+        BITOPS_CSA(twosA,ones,ones,BITOPS_LOAD(4),BITOPS_LOAD(5));
+        BITOPS_CSA(twosB,ones,ones,BITOPS_LOAD(6),BITOPS_LOAD(7));
+        BITOPS_CSA(foursB,twos,twos,twosA,twosB);
+        BITOPS_CSA(eightsA,fours,fours,foursA,foursB);
+        BITOPS_CSA(twosA,ones,ones,BITOPS_LOAD(8),BITOPS_LOAD(9));
+        BITOPS_CSA(twosB,ones,ones,BITOPS_LOAD(10),BITOPS_LOAD(11));
+        BITOPS_CSA(foursA,twos,twos,twosA,twosB);
+        BITOPS_CSA(twosA,ones,ones,BITOPS_LOAD(12),BITOPS_LOAD(13));
+        BITOPS_CSA(twosB,ones,ones,BITOPS_LOAD(14),BITOPS_LOAD(15));
+        BITOPS_CSA(foursB,twos,twos,twosA,twosB);
+        BITOPS_CSA(eightsB,fours,fours,foursA,foursB);
+        BITOPS_CSA(sixteens,eights,eights,eightsA,eightsB);
+        total = _mm256_add_epi64(total,popcount256(sixteens));
+        p += 512;
+        count -= 512;
+    }
+#undef BITOPS_LOAD
+
+    /* Combine the partial counters with their weights. */
+    total = _mm256_slli_epi64(total,4);
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(eights),3));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(fours),2));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcount256(twos),1));
+    total = _mm256_add_epi64(total,popcount256(ones));
+    _mm256_storeu_si256((__m256i*)res,total);
+    bits = 0;
+    for (j = 0; j < 4; j++) bits += res[j];
+    return bits + redisPopcountPopcnt(p,count);
+}
+
+/* Return the number of leading bytes of 'p' that are all equal to
+ * 'skipval' (0 or 0xff), in steps of 32 bytes. The caller continues the
+ * scan from there with the word based loop. */
+__attribute__((target("avx2")))
+static unsigned long redisBitposSkipAVX2(unsigned char *p,
+                                         unsigned long count, int skipval)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long skipped = 0;
+
+    while (count-skipped >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p+skipped));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p+skipped+32));
+        if (skipval) {
+            if (!_mm256_testc_si256(_mm256_and_si256(a,b),ones)) break;
+        } else {
+            if (!_mm256_testz_si256(_mm256_or_si256(a,b),ones)) break;
+        }
+        skipped += 64;
+    }
+    while (count-skipped >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p+skipped));
+        if (skipval) {
+            if (!_mm256_testc_si256(a,ones)) break;
+        } else {
+            if (!_mm256_testz_si256(a,ones)) break;
+        }
+        skipped += 32;
+    }
+    return skipped;
+}
+#endif
+
+/* Operations of BITOP, also used by the kernels below. */
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+/* Compute dst = dst <op> src over 'count' bytes, or dst = ~src for
+ * BITOP_NOT. This is the portable implementation, processing 32 bytes
+ * per iteration. Loads and stores use memcpy() since the pointers may
+ * not be aligned. */
+static void bitopKernelPortable(unsigned char *dst, unsigned char *src,
+                                unsigned long count, int op)
+{
+    unsigned long d[4], w[4];
+
+    while (count >= sizeof(d)) {
+        memcpy(w,src,sizeof(w));
+        if (op != BITOP_NOT) memcpy(d,dst,sizeof(d));
+        switch(op) {
+        case BITOP_AND:
+            d[0] &= w[0]; d[1] &= w[1]; d[2] &= w[2]; d[3] &= w[3];
+            break;
+        case BITOP_OR:
+            d[0] |= w[0]; d[1] |= w[1]; d[2] |= w[2]; d[3] |= w[3];
+            break;
+        case BITOP_XOR:
+            d[0] ^= w[0]; d[1] ^= w[1]; d[2] ^= w[2]; d[3] ^= w[3];
+            break;
+        case BITOP_NOT:
+            d[0] = ~w[0]; d[1] = ~w[1]; d[2] = ~w[2]; d[3] = ~w[3];
+            break;
+        }
+        memcpy(dst,d,sizeof(d));
+        dst += sizeof(d);
+        src += sizeof(d);
+        count -= sizeof(d);
+    }
+    while (count--) {
+        switch(op) {
+        case BITOP_AND: *dst &= *src; break;
+        case BITOP_OR:  *dst |= *src; break;
+        case BITOP_XOR: *dst ^= *src; break;
+        case BITOP_NOT: *dst = ~*src; break;
+        }
+        dst++;
+        src++;
+    }
+}
+
+#ifdef BITOPS_HAVE_DISPATCH
+/* Same as bitopKernelPortable() but using AVX2, 64 bytes per iteration. */
+__attribute__((target("avx2")))
+static void bitopKernelAVX2(unsigned char *dst, unsigned char *src,
+                            unsigned long count, int op)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    while (count >= 64) {
+        __m256i s0 = _mm256_loadu_si256((const __m256i*)src);
+        __m256i s1 = _mm256_loadu_si256((const __m256i*)(src+32));
+        __m256i d0, d1;
+
+        if (op == BITOP_NOT) {
+            d0 = _mm256_xor_si256(s0,ones);
+            d1 = _mm256_xor_si256(s1,ones);
+        } else {
+            d0 = _mm256_loadu_si256((const __m256i*)dst);
+            d1 = _mm256_loadu_si256((const __m256i*)(dst+32));
+            switch(op) {
+            case BITOP_AND:
+                d0 = _mm256_and_si256(d0,s0);
+                d1 = _mm256_and_si256(d1,s1);
+                break;
+            case BITOP_OR:
+                d0 = _mm256_or_si256(d0,s0);
+                d1 = _mm256_or_si256(d1,s1);
+                break;
+            case BITOP_XOR:
+                d0 = _mm256_xor_si256(d0,s0);
+                d1 = _mm256_xor_si256(d1,s1);
+                break;
+            }
+        }
+        _mm256_storeu_si256((__m256i*)dst,d0);
+        _mm256_storeu_si256((__m256i*)(dst+32),d1);
+        dst += 64;
+        src += 64;
+        count -= 64;
+    }
+    bitopKernelPortable(dst,src,count,op);
+}
+#endif
+
+/* BITOP computes the result in blocks of this size, see bitopCommand(). */
+#define BITOP_BLOCK_SIZE (16*1024)
+
+/* True once redisBitopsSelect() was called. */
+static int bitopsSelected = 0;
+/* The implementations in use, see redisBitopsSelect(). */
+static size_t (*redisPopcountImpl)(void *s, long count) = redisPopcountPortable;
+static void (*bitopKernel)(unsigned char *dst, unsigned char *src,
+                           unsigned long count, int op) = bitopKernelPortable;
+/* True when redisBitpos() can use the AVX2 skip loop. */
+static int redisBitposAVX2 = 0;
+
+/* Select the fastest implementations for the CPU we are running on. */
+static void redisBitopsSelect(void) {
+#ifdef BITOPS_HAVE_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        redisPopcountImpl = redisPopcountAVX2;
+        bitopKernel = bitopKernelAVX2;
+        redisBitposAVX2 = 1;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        redisPopcountImpl = redisPopcountPopcnt;
+    }
+#endif
+    bitopsSelected = 1;
+}
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. The implementation of this function is required to
+ * work with a input string length up to 512 MB. */
+size_t redisPopcount(void *s, long count) {
+    if (!bitopsSelected) redisBitopsSelect();
+    return redisPopcountImpl(s,count);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -133,6 +439,17 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
+#ifdef BITOPS_HAVE_DISPATCH
+    /* Skip large blocks of bits with AVX2 when available. */
+    if (!bitopsSelected) redisBitopsSelect();
+    if (redisBitposAVX2 && count >= 32) {
+        unsigned long skipped = redisBitposSkipAVX2(c,count,!bit);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
+#endif
+
     /* Skip bits with full word step. */
     skipval = bit ? 0 : ULONG_MAX;
     l = (unsigned long*) c;
@@ -187,15 +504,310 @@ long redisBitpos(void *s, unsigned long count, int bit) {
     return 0; /* Just to avoid warnings. */
 }
 
+/* This helper function used by BITFIELD parses the field type argument,
+ * "i<bits>" for signed integers of 1 to 64 bits, or "u<bits>" for unsigned
+ * integers of 1 to 63 bits (so that every value fits the integer reply). */
+static int getBitfieldTypeFromArgument(redisClient *c, robj *o, int *sign,
+                                       int *bits)
+{
+    char *p = o->ptr;
+    char *err = "Invalid bitfield type. Use something like i16 u8. "
+                "Note that u64 is not supported but i64 is.";
+    long long llbits;
+
+    if (o->encoding != REDIS_ENCODING_RAW) goto badtype;
+    if (p[0] == 'i' || p[0] == 'I') {
+        *sign = 1;
+    } else if (p[0] == 'u' || p[0] == 'U') {
+        *sign = 0;
+    } else {
+        goto badtype;
+    }
+    if (string2ll(p+1,sdslen(p)-1,&llbits) == 0 || llbits < 1 ||
+        llbits > (*sign ? 64 : 63)) goto badtype;
+    *bits = llbits;
+    return REDIS_OK;
+
+badtype:
+    addReplyError(c,err);
+    return REDIS_ERR;
+}
+
+/* Return the 'bits' bits long field starting at bit 'offset' of the 'len'
+ * bytes long buffer 'p', as an unsigned integer. Bits are numbered like
+ * GETBIT does, from the most significant bit of the first byte, and the
+ * bytes after the end of the buffer read as zero. The field is processed
+ * up to a byte at a time. */
+static uint64_t getUnsignedBitfield(unsigned char *p, size_t len,
+                                    size_t offset, int bits)
+{
+    uint64_t value = 0;
+
+    while (bits) {
+        size_t byte = offset >> 3;
+        int skip = offset & 7, n = 8-skip;
+        unsigned int byteval = (byte < len) ? p[byte] : 0;
+
+        if (n > bits) n = bits;
+        byteval = (byteval >> (8-skip-n)) & ((1<<n)-1);
+        value = (value << n) | byteval;
+        offset += n;
+        bits -= n;
+    }
+    return value;
+}
+
+/* Same as getUnsignedBitfield() for strings encoded as sparse bitmaps. */
+static uint64_t getUnsignedBitfieldSparse(sparseBitmap *sb, size_t offset,
+                                          int bits)
+{
+    uint64_t value = 0;
+    int j;
+
+    for (j = 0; j < bits; j++)
+        value = (value << 1) | roaringContains(sb->bits,offset+j);
+    return value;
+}
+
+/* Interpret the 'bits' bits long field 'value' as a two's complement
+ * signed integer, extending the sign bit to the bits above the field. */
+static int64_t signExtendBitfield(uint64_t value, int bits) {
+    if (bits < 64 && (value & ((uint64_t)1 << (bits-1))))
+        value |= ((uint64_t)-1) << bits;
+    return (int64_t)value;
+}
+
+/* Store the low 'bits' bits of 'value' in the field starting at bit
+ * 'offset' of 'p', that must be already large enough. */
+static void setBitfield(unsigned char *p, size_t offset, int bits,
+                        uint64_t value)
+{
+    while (bits) {
+        size_t byte = offset >> 3;
+        int skip = offset & 7, n = 8-skip, shift;
+        unsigned int mask;
+
+        if (n > bits) n = bits;
+        shift = 8-skip-n;
+        mask = ((1<<n)-1) << shift;
+        p[byte] = (p[byte] & ~mask) | (((value >> (bits-n)) << shift) & mask);
+        offset += n;
+        bits -= n;
+    }
+}
+
+/* Same as setBitfield() for strings encoded as sparse bitmaps. */
+static void setBitfieldSparse(sparseBitmap *sb, size_t offset, int bits,
+                              uint64_t value)
+{
+    int j;
+
+    for (j = 0; j < bits; j++) {
+        if ((value >> (bits-1-j)) & 1)
+            roaringAdd(sb->bits,offset+j);
+        else
+            roaringRemove(sb->bits,offset+j);
+    }
+}
+
+/* Overflow behaviors of BITFIELD SET and INCRBY. */
+#define BFOVERFLOW_WRAP 0
+#define BFOVERFLOW_SAT  1
+#define BFOVERFLOW_FAIL 2
+
+/* Add 'incr' to the value 'value' of a field of 'bits' bits, signed or
+ * unsigned according to 'sign', storing the result in '*res'. When the
+ * result does not fit the field it is wrapped around or saturated to the
+ * minimum or maximum value according to 'owtype'. With BFOVERFLOW_FAIL
+ * REDIS_ERR is returned instead, otherwise REDIS_OK.
+ *
+ * 'value' must be in the range of the field. Everything is computed with
+ * unsigned arithmetic so that no signed overflow can happen. */
+static int addBitfieldValue(int64_t value, int64_t incr, int sign, int bits,
+                            int owtype, int64_t *res)
+{
+    uint64_t max, wrapped;
+    int64_t min;
+    int overflow = 0;
+
+    if (sign) {
+        max = (bits == 64) ? INT64_MAX : ((uint64_t)1 << (bits-1))-1;
+        min = -(int64_t)max-1;
+    } else {
+        max = ((uint64_t)1 << bits)-1;
+        min = 0;
+    }
+
+    if (incr > 0 && (uint64_t)incr > max-(uint64_t)value)
+        overflow = 1;
+    else if (incr < 0 &&
+             (uint64_t)(-(incr+1))+1 > (uint64_t)value-(uint64_t)min)
+        overflow = -1;
+
+    if (!overflow) {
+        *res = value+incr;
+        return REDIS_OK;
+    }
+
+    switch(owtype) {
+    case BFOVERFLOW_WRAP:
+        wrapped = (uint64_t)value+(uint64_t)incr;
+        if (bits < 64) {
+            uint64_t mask = ((uint64_t)1 << bits)-1;
+
+            wrapped &= mask;
+            if (sign && (wrapped & ((uint64_t)1 << (bits-1))))
+                wrapped |= ~mask;
+        }
+        *res = (int64_t)wrapped;
+        return REDIS_OK;
+    case BFOVERFLOW_SAT:
+        *res = (overflow > 0) ? (int64_t)max : min;
+        return REDIS_OK;
+    default:
+        return REDIS_ERR;
+    }
+}
+
+/* Reverse the order of the bits of a byte: in strings the first bit is the
+ * most significant of the byte, in roaring bitmaps the least significant. */
+#define bitmapReverseByte(b) \
+    ((unsigned char)((((b) * 0x0202020202ULL) & 0x010884422010ULL) % 1023))
+
+/* Return a new sds string with the bytes of a sparse bitmap. */
+sds sparseBitmapToSds(sparseBitmap *sb) {
+    sds s = sdsnewlen(NULL,sb->len);
+    unsigned char *p = (unsigned char*) s;
+    uint64_t w[1024];
+    uint32_t j, containers = roaringContainers(sb->bits);
+
+    for (j = 0; j < containers; j++) {
+        size_t byte = roaringContainerWords(sb->bits,j,w) >> 3, i;
+
+        for (i = 0; i < sizeof(w) && byte+i < sb->len; i++) {
+            unsigned char v = (w[i >> 3] >> ((i & 7)*8)) & 0xff;
+            if (v) p[byte+i] = bitmapReverseByte(v);
+        }
+    }
+    return s;
+}
+
+/* Return a new sds string with the bytes from 'start' to 'end' included of
+ * a sparse bitmap. The range must be inside the string. */
+sds sparseBitmapRangeToSds(sparseBitmap *sb, size_t start, size_t end) {
+    sds s = sdsnewlen(NULL,end-start+1);
+    int64_t bit = (int64_t)start*8, last = (int64_t)end*8+7;
+
+    while (roaringNextValue(sb->bits,bit,&bit) && bit <= last) {
+        s[(bit >> 3)-start] |= 1 << (7-(bit & 7));
+        bit++;
+    }
+    return s;
+}
+
+/* Return a new roaring bitmap with the offsets of the bits set in the 'len'
+ * bytes at 'p'. Zero bytes are skipped 8 at a time. */
+static roaring *bitmapBytesToRoaring(unsigned char *p, size_t len) {
+    roaring *r = roaringNew();
+    uint64_t w[1024], aux;
+    size_t chunk, i, n;
+
+    for (chunk = 0; chunk < len; chunk += sizeof(w)) {
+        int nonzero = 0;
+
+        n = len-chunk;
+        if (n > sizeof(w)) n = sizeof(w);
+        memset(w,0,sizeof(w));
+        for (i = 0; i < n; i++) {
+            if ((i & 7) == 0 && i+8 <= n) {
+                memcpy(&aux,p+chunk+i,sizeof(aux));
+                if (aux == 0) {
+                    i += 7;
+                    continue;
+                }
+            }
+            if (p[chunk+i]) {
+                w[i >> 3] |= (uint64_t)bitmapReverseByte(p[chunk+i]) <<
+                             ((i & 7)*8);
+                nonzero = 1;
+            }
+        }
+        if (nonzero) roaringAppendWords(r,(int64_t)chunk*8,w);
+    }
+    return r;
+}
+
+/* Convert a string object used as a bitmap from the raw to the sparse
+ * encoding or the other way around. The value does not change, only its
+ * representation, so the object is converted in place. */
+void bitmapTypeConvert(robj *o, int enc) {
+    sparseBitmap *sb;
+
+    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
+    if (enc == REDIS_ENCODING_RAW) {
+        redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_SPARSE);
+        sb = o->ptr;
+        o->ptr = sparseBitmapToSds(sb);
+        o->encoding = REDIS_ENCODING_RAW;
+        roaringFree(sb->bits);
+        zfree(sb);
+    } else if (enc == REDIS_ENCODING_SPARSE) {
+        redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
+        sb = zmalloc(sizeof(*sb));
+        sb->len = sdslen(o->ptr);
+        sb->bits = bitmapBytesToRoaring(o->ptr,sb->len);
+        sdsfree(o->ptr);
+        o->ptr = sb;
+        o->encoding = REDIS_ENCODING_SPARSE;
+    } else {
+        redisPanic("Unknown bitmap encoding");
+    }
+}
+
+/* Lookup the string at the key of a command writing bits, creating it if
+ * it does not exist, and make sure it is large enough to address the bit
+ * 'maxbit'. On type mismatch an error is sent to the client and NULL is
+ * returned.
+ *
+ * When the string would have to grow by more than bitmap-sparse-threshold
+ * zero bytes it is switched to the sparse encoding instead, so the
+ * returned object is either raw or sparse. */
+static robj *lookupStringForBitCommand(redisClient *c, size_t maxbit) {
+    size_t len = (maxbit >> 3)+1;
+    size_t threshold = server.bitmap_sparse_threshold;
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+
+    if (o == NULL) {
+        if (threshold && len > threshold)
+            o = createSparseBitmapObject(0);
+        else
+            o = createObject(REDIS_STRING,sdsempty());
+        dbAdd(c->db,c->argv[1],o);
+    } else {
+        if (checkType(c,o,REDIS_STRING)) return NULL;
+        if (o->encoding != REDIS_ENCODING_SPARSE) {
+            o = dbUnshareStringValue(c->db,c->argv[1],o);
+            if (threshold && len > sdslen(o->ptr) &&
+                len-sdslen(o->ptr) > threshold)
+                bitmapTypeConvert(o,REDIS_ENCODING_SPARSE);
+        }
+    }
+
+    /* Grow the value to the right length if necessary */
+    if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sparseBitmap *sb = o->ptr;
+
+        if (sb->len < len) sb->len = len;
+    } else {
+        o->ptr = sdsgrowzero(o->ptr,len);
+    }
+    return o;
+}
+
 /* -----------------------------------------------------------------------------
- * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP, BITFIELD.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
-
 /* SETBIT key offset bitvalue */
 void setbitCommand(redisClient *c) {
     robj *o;
@@ -205,7 +817,7 @@ void setbitCommand(redisClient *c) {
     int byteval, bitval;
     long on;
 
-    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset) != REDIS_OK)
+    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,1) != REDIS_OK)
         return;
 
     if (getLongFromObjectOrReply(c,c->argv[3],&on,err) != REDIS_OK)
@@ -217,28 +829,28 @@ void setbitCommand(redisClient *c) {
         return;
     }
 
-    o = lookupKeyWrite(c->db,c->argv[1]);
-    if (o == NULL) {
-        o = createObject(REDIS_STRING,sdsempty());
-        dbAdd(c->db,c->argv[1],o);
-    } else {
-        if (checkType(c,o,REDIS_STRING)) return;
-        o = dbUnshareStringValue(c->db,c->argv[1],o);
-    }
+    if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
 
-    /* Grow sds value to the right length if necessary */
-    byte = bitoffset >> 3;
-    o->ptr = sdsgrowzero(o->ptr,byte+1);
+    if (o->encoding == REDIS_ENCODING_SPARSE) {
+        roaring *bits = ((sparseBitmap*)o->ptr)->bits;
 
-    /* Get current values */
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+        /* Update the bit, learning the original value from the result. */
+        if (on)
+            bitval = !roaringAdd(bits,bitoffset);
+        else
+            bitval = roaringRemove(bits,bitoffset);
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -253,7 +865,7 @@ void getbitCommand(redisClient *c) {
     size_t byte, bit;
     size_t bitval = 0;
 
-    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset) != REDIS_OK)
+    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,1) != REDIS_OK)
         return;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
@@ -261,7 +873,9 @@ void getbitCommand(redisClient *c) {
 
     byte = bitoffset >> 3;
     bit = 7 - (bitoffset & 0x7);
-    if (o->encoding != REDIS_ENCODING_RAW) {
+    if (o->encoding == REDIS_ENCODING_SPARSE) {
+        bitval = roaringContains(((sparseBitmap*)o->ptr)->bits,bitoffset);
+    } else if (o->encoding != REDIS_ENCODING_RAW) {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
     } else {
@@ -272,6 +886,48 @@ void getbitCommand(redisClient *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* Compute AND, OR or XOR of sources where at least one is a sparse bitmap,
+ * without materializing them. Sparse sources are passed as objects with a
+ * NULL 'src' entry, the others are converted to temporary bitmaps. A missing
+ * key is an empty bitmap, that is the same as an empty string. */
+static roaring *bitopSparse(unsigned long op, robj **objects,
+                            unsigned char **src, unsigned long *len,
+                            unsigned long numkeys)
+{
+    roaring *res = NULL, *cur, *tmp, *both;
+    unsigned long j;
+
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j] == NULL)
+            cur = roaringNew();
+        else if (src[j] == NULL)
+            cur = ((sparseBitmap*)objects[j]->ptr)->bits;
+        else
+            cur = bitmapBytesToRoaring(src[j],len[j]);
+
+        if (res == NULL) {
+            res = (src[j] == NULL && objects[j]) ? roaringDup(cur) : cur;
+            continue;
+        }
+        if (op == BITOP_AND) {
+            tmp = roaringAnd(res,cur);
+        } else if (op == BITOP_OR) {
+            tmp = roaringOr(res,cur);
+        } else {
+            both = roaringAnd(res,cur);
+            tmp = roaringOr(res,cur);
+            roaringFree(res);
+            res = tmp;
+            tmp = roaringAndNot(res,both);
+            roaringFree(both);
+        }
+        roaringFree(res);
+        res = tmp;
+        if (src[j] != NULL || objects[j] == NULL) roaringFree(cur);
+    }
+    return res;
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(redisClient *c) {
     char *opname = c->argv[1]->ptr;
@@ -283,6 +939,8 @@ void bitopCommand(redisClient *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    roaring *sparseres = NULL; /* Resulting bitmap, with sparse sources. */
+    int sparse = 0;            /* True if some source is a sparse bitmap. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -331,97 +989,58 @@ void bitopCommand(redisClient *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        if (o->encoding == REDIS_ENCODING_SPARSE && op != BITOP_NOT) {
+            /* Sparse bitmaps are combined natively, see bitopSparse().
+             * NOT of a sparse bitmap is dense, so it gets materialized. */
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((sparseBitmap*)o->ptr)->len;
+            sparse = 1;
+        } else {
+            objects[j] = getDecodedObject(o);
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
-    /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    /* Compute the bit operation, if at least one string is not empty.
+     *
+     * The result is computed in blocks small enough to stay in the CPU
+     * cache while all the sources are applied to it, one source at a time,
+     * using the fastest kernel available. Sources shorter than the result
+     * are handled without copies: with OR and XOR the missing bytes are
+     * zero so they leave the result unchanged, while with AND every byte
+     * after the shortest source is zero, and sdsnewlen() already returns
+     * a zeroed buffer. */
+    if (maxlen && sparse) {
+        sparseres = bitopSparse(op,objects,src,len,numkeys);
+    } else if (maxlen) {
+        unsigned long oplen, pos, blen, n, i;
+
+        if (!bitopsSelected) redisBitopsSelect();
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
-        unsigned char output, byte;
-        unsigned long i;
-
-        /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. */
-        j = 0;
-        if (minlen && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
+        oplen = (op == BITOP_AND) ? minlen : maxlen;
+        for (pos = 0; pos < oplen; pos += blen) {
+            blen = oplen-pos;
+            if (blen > BITOP_BLOCK_SIZE) blen = BITOP_BLOCK_SIZE;
+
+            /* The first source initializes the block. For NOT this is
+             * the only source, and it's always as long as the result. */
+            n = (len[0] > pos) ? len[0]-pos : 0;
+            if (n > blen) n = blen;
+            if (op == BITOP_NOT)
+                bitopKernel(res+pos,src[0]+pos,n,BITOP_NOT);
+            else if (n)
+                memcpy(res+pos,src[0]+pos,n);
 
-        /* j is set to the next byte to process by the previous loop. */
-        for (; j < maxlen; j++) {
-            output = (len[0] <= j) ? 0 : src[0][j];
-            if (op == BITOP_NOT) output = ~output;
             for (i = 1; i < numkeys; i++) {
-                byte = (len[i] <= j) ? 0 : src[i][j];
-                switch(op) {
-                case BITOP_AND: output &= byte; break;
-                case BITOP_OR:  output |= byte; break;
-                case BITOP_XOR: output ^= byte; break;
-                }
+                n = (len[i] > pos) ? len[i]-pos : 0;
+                if (n > blen) n = blen;
+                if (n) bitopKernel(res+pos,src[i]+pos,n,op);
             }
-            res[j] = output;
         }
     }
     for (j = 0; j < numkeys; j++) {
@@ -432,9 +1051,28 @@ void bitopCommand(redisClient *c) {
     zfree(len);
     zfree(objects);
 
-    /* Store the computed value into the target key */
+    /* Store the computed value into the target key. A result computed from
+     * sparse sources stays sparse only if it is large enough to deserve it. */
     if (maxlen) {
-        o = createObject(REDIS_STRING,res);
+        if (sparseres) {
+            sparseBitmap sb;
+
+            sb.bits = sparseres;
+            sb.len = maxlen;
+            if (server.bitmap_sparse_threshold &&
+                maxlen > server.bitmap_sparse_threshold)
+            {
+                o = createSparseBitmapObject(maxlen);
+                roaringFree(((sparseBitmap*)o->ptr)->bits);
+                roaringOptimize(sparseres);
+                ((sparseBitmap*)o->ptr)->bits = sparseres;
+            } else {
+                o = createObject(REDIS_STRING,sparseBitmapToSds(&sb));
+                roaringFree(sparseres);
+            }
+        } else {
+            o = createObject(REDIS_STRING,res);
+        }
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -452,16 +1090,22 @@ void bitcountCommand(redisClient *c) {
     long start, end, strlen;
     unsigned char *p;
     char llbuf[32];
+    sparseBitmap *sb = NULL;
 
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_STRING)) return;
 
     /* Set the 'p' pointer to the string, that can be just a stack allocated
-     * array if our string was integer encoded. */
+     * array if our string was integer encoded. Sparse bitmaps are handled
+     * without accessing the bytes. */
     if (o->encoding == REDIS_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sb = o->ptr;
+        p = NULL;
+        strlen = sb->len;
     } else {
         p = (unsigned char*) o->ptr;
         strlen = sdslen(o->ptr);
@@ -493,6 +1137,9 @@ void bitcountCommand(redisClient *c) {
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (sb) {
+        addReplyLongLong(c,roaringCountRange(sb->bits,(int64_t)start*8,
+                                                      (int64_t)end*8+7));
     } else {
         long bytes = end-start+1;
 
@@ -507,6 +1154,7 @@ void bitposCommand(redisClient *c) {
     unsigned char *p;
     char llbuf[32];
     int end_given = 0;
+    sparseBitmap *sb = NULL;
 
     /* Parse the bit argument to understand what we are looking for, set
      * or clear bits. */
@@ -527,10 +1175,15 @@ void bitposCommand(redisClient *c) {
     if (checkType(c,o,REDIS_STRING)) return;
 
     /* Set the 'p' pointer to the string, that can be just a stack allocated
-     * array if our string was integer encoded. */
+     * array if our string was integer encoded. Sparse bitmaps are handled
+     * without accessing the bytes. */
     if (o->encoding == REDIS_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sb = o->ptr;
+        p = NULL;
+        strlen = sb->len;
     } else {
         p = (unsigned char*) o->ptr;
         strlen = sdslen(o->ptr);
@@ -567,6 +1220,19 @@ void bitposCommand(redisClient *c) {
      * not contain a 0 nor a 1. */
     if (start > end) {
         addReplyLongLong(c, -1);
+    } else if (sb) {
+        int64_t first = (int64_t)start*8, last = (int64_t)end*8+7, pos;
+
+        if (bit) {
+            if (!roaringNextValue(sb->bits,first,&pos) || pos > last)
+                pos = -1;
+        } else {
+            /* Same semantics of the raw case below about the right of the
+             * range being zero padded if no end was given. */
+            pos = roaringNextMissing(sb->bits,first);
+            if (pos > last) pos = end_given ? -1 : last+1;
+        }
+        addReplyLongLong(c,pos);
     } else {
         long bytes = end-start+1;
         long pos = redisBitpos(p+start,bytes,bit);
@@ -586,3 +1252,431 @@ void bitposCommand(redisClient *c) {
         addReplyLongLong(c,pos);
     }
 }
+
+/* BITFIELD key [GET type offset] [SET type offset value]
+ *              [INCRBY type offset increment] [OVERFLOW WRAP|SAT|FAIL] ... */
+
+#define BITFIELDOP_GET 0
+#define BITFIELDOP_SET 1
+#define BITFIELDOP_INCRBY 2
+
+typedef struct bitfieldOp {
+    size_t offset;      /* Bit offset of the field. */
+    int64_t i64;        /* Value of SET, or increment of INCRBY. */
+    int opcode;         /* BITFIELDOP_* */
+    int owtype;         /* BFOVERFLOW_* in effect for this operation. */
+    int bits;           /* Width of the field. */
+    int sign;           /* True for signed fields. */
+} bitfieldOp;
+
+void bitfieldCommand(redisClient *c) {
+    robj *o;
+    bitfieldOp *ops = NULL;
+    int j, numops = 0, changes = 0, readonly = 1;
+    int owtype = BFOVERFLOW_WRAP;
+    size_t maxbit = 0;      /* Last bit written by any operation. */
+    unsigned char *p = NULL;
+    sparseBitmap *sb = NULL;
+    size_t len = 0;
+    char llbuf[32];
+
+    /* Parse all the operations first, so that a syntax error in any of
+     * them aborts the command without touching the key. */
+    for (j = 2; j < c->argc; j++) {
+        int remargs = c->argc-j-1;
+        char *subcmd = c->argv[j]->ptr;
+        int opcode, sign, bits;
+        long long i64 = 0;
+        size_t bitoffset;
+
+        if (!strcasecmp(subcmd,"get") && remargs >= 2) {
+            opcode = BITFIELDOP_GET;
+        } else if (!strcasecmp(subcmd,"set") && remargs >= 3) {
+            opcode = BITFIELDOP_SET;
+        } else if (!strcasecmp(subcmd,"incrby") && remargs >= 3) {
+            opcode = BITFIELDOP_INCRBY;
+        } else if (!strcasecmp(subcmd,"overflow") && remargs >= 1) {
+            char *owtypename = c->argv[j+1]->ptr;
+
+            j++;
+            if (!strcasecmp(owtypename,"wrap")) {
+                owtype = BFOVERFLOW_WRAP;
+            } else if (!strcasecmp(owtypename,"sat")) {
+                owtype = BFOVERFLOW_SAT;
+            } else if (!strcasecmp(owtypename,"fail")) {
+                owtype = BFOVERFLOW_FAIL;
+            } else {
+                addReplyError(c,"Invalid OVERFLOW type specified");
+                zfree(ops);
+                return;
+            }
+            continue;
+        } else {
+            addReply(c,shared.syntaxerr);
+            zfree(ops);
+            return;
+        }
+
+        if (getBitfieldTypeFromArgument(c,c->argv[j+1],&sign,&bits)
+            != REDIS_OK ||
+            getBitOffsetFromArgument(c,c->argv[j+2],&bitoffset,1,bits)
+            != REDIS_OK)
+        {
+            zfree(ops);
+            return;
+        }
+        if (opcode != BITFIELDOP_GET) {
+            if (getLongLongFromObjectOrReply(c,c->argv[j+3],&i64,NULL)
+                != REDIS_OK)
+            {
+                zfree(ops);
+                return;
+            }
+            readonly = 0;
+            if (bitoffset+bits-1 > maxbit) maxbit = bitoffset+bits-1;
+        }
+
+        ops = zrealloc(ops,sizeof(bitfieldOp)*(numops+1));
+        ops[numops].offset = bitoffset;
+        ops[numops].i64 = i64;
+        ops[numops].opcode = opcode;
+        ops[numops].owtype = owtype;
+        ops[numops].bits = bits;
+        ops[numops].sign = sign;
+        numops++;
+        j += (opcode == BITFIELDOP_GET) ? 2 : 3;
+    }
+
+    if (readonly) {
+        /* Only GET operations: a missing key reads as an empty string. */
+        o = lookupKeyRead(c->db,c->argv[1]);
+        if (o != NULL) {
+            if (checkType(c,o,REDIS_STRING)) {
+                zfree(ops);
+                return;
+            }
+            if (o->encoding == REDIS_ENCODING_INT) {
+                p = (unsigned char*) llbuf;
+                len = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+            } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+                sb = o->ptr;
+            } else {
+                p = o->ptr;
+                len = sdslen(o->ptr);
+            }
+        }
+    } else {
+        /* Grow the string once for all the writes. */
+        if ((o = lookupStringForBitCommand(c,maxbit)) == NULL) {
+            zfree(ops);
+            return;
+        }
+        if (o->encoding == REDIS_ENCODING_SPARSE) {
+            sb = o->ptr;
+        } else {
+            p = o->ptr;
+            len = sdslen(o->ptr);
+        }
+    }
+
+    addReplyMultiBulkLen(c,numops);
+    for (j = 0; j < numops; j++) {
+        bitfieldOp *op = ops+j;
+        uint64_t field;
+        int64_t oldval, newval;
+
+        if (sb)
+            field = getUnsignedBitfieldSparse(sb,op->offset,op->bits);
+        else
+            field = getUnsignedBitfield(p,len,op->offset,op->bits);
+        oldval = op->sign ? signExtendBitfield(field,op->bits) :
+                            (int64_t)field;
+        if (op->opcode == BITFIELDOP_GET) {
+            addReplyLongLong(c,oldval);
+            continue;
+        }
+
+        /* SET is computed as 0+value, so that out of range values are
+         * handled exactly like overflows of INCRBY. */
+        if (addBitfieldValue(op->opcode == BITFIELDOP_SET ? 0 : oldval,
+                             op->i64,op->sign,op->bits,op->owtype,
+                             &newval) == REDIS_ERR)
+        {
+            addReply(c,shared.nullbulk);
+            continue;
+        }
+        if (sb)
+            setBitfieldSparse(sb,op->offset,op->bits,(uint64_t)newval);
+        else
+            setBitfield(p,op->offset,op->bits,(uint64_t)newval);
+        addReplyLongLong(c,op->opcode == BITFIELDOP_SET ? oldval : newval);
+        changes++;
+    }
+
+    /* Only the writes that succeeded count: when all of them failed because
+     * of OVERFLOW FAIL there is nothing to propagate. */
+    if (changes) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
+        server.dirty += changes;
+    }
+    zfree(ops);
+}
+
+#ifdef BITOPS_TEST_MAIN
+#include <sys/time.h>
+
+static long long bitopsUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Run 'fn' over 'len' bytes enough times to take some time, and print
+ * the throughput in GB/s. */
+static void bitopsBenchPopcount(char *name, size_t (*fn)(void*,long),
+                                unsigned char *buf, long len, size_t expected)
+{
+    long iter = (256L*1024*1024)/len, j;
+    long long start;
+    size_t bits = 0;
+
+    if (iter < 2) iter = 2;
+    start = bitopsUstime();
+    for (j = 0; j < iter; j++) bits += fn(buf,len);
+    start = bitopsUstime()-start;
+    if (bits != expected*iter) {
+        printf("%s: wrong result for %ld bytes\n", name, len);
+        exit(1);
+    }
+    printf("  %-9s %8.2f GB/s\n", name,
+        (double)len*iter/(start ? start : 1)/1000);
+}
+
+/* Check a BITFIELD operation on the field of 'bits' bits at 'offset' of
+ * 'buf', starting from the field value 'value': the result of adding 'incr'
+ * with the overflow behavior 'owtype' must be 'expected', or an error when
+ * 'fail' is true. The field is then written back and read again, both in
+ * the raw and in the sparse representation, and the bits around it must
+ * not change. */
+static void bitopsTestBitfieldOp(unsigned char *buf, size_t len, size_t offset,
+                                 int sign, int bits, int owtype, int64_t value,
+                                 int64_t incr, int fail, int64_t expected)
+{
+    unsigned char saved[32];
+    sparseBitmap sb;
+    int64_t res;
+    size_t j;
+    sds s;
+
+    setBitfield(buf,offset,bits,(uint64_t)value);
+    if (addBitfieldValue(value,incr,sign,bits,owtype,&res) !=
+        (fail ? REDIS_ERR : REDIS_OK) || (!fail && res != expected))
+    {
+        printf("Bitfield %c%d at %zu: %lld + %lld with overflow %d: "
+               "got %lld\n", sign ? 'i' : 'u', bits, offset,
+               (long long)value, (long long)incr, owtype, (long long)res);
+        exit(1);
+    }
+    if (fail) return;
+
+    memcpy(saved,buf,len);
+    sb.bits = bitmapBytesToRoaring(buf,len);
+    sb.len = len;
+    setBitfield(buf,offset,bits,(uint64_t)res);
+    setBitfieldSparse(&sb,offset,bits,(uint64_t)res);
+    s = sparseBitmapToSds(&sb);
+    for (j = 0; j < len*8; j++) {
+        int bit = (buf[j>>3] >> (7-(j&7))) & 1;
+        int old = (saved[j>>3] >> (7-(j&7))) & 1;
+
+        if ((j < offset || j >= offset+bits) && bit != old) {
+            printf("Bitfield %c%d at %zu: bit %zu changed\n",
+                sign ? 'i' : 'u', bits, offset, j);
+            exit(1);
+        }
+    }
+    if (memcmp(s,buf,len) != 0 ||
+        getUnsignedBitfield(buf,len,offset,bits) !=
+        getUnsignedBitfieldSparse(&sb,offset,bits) ||
+        (sign ? signExtendBitfield(getUnsignedBitfield(buf,len,offset,bits),
+                                   bits) :
+                (int64_t)getUnsignedBitfield(buf,len,offset,bits)) != res)
+    {
+        printf("Bitfield %c%d at %zu: wrong value read back\n",
+            sign ? 'i' : 'u', bits, offset);
+        exit(1);
+    }
+    sdsfree(s);
+    roaringFree(sb.bits);
+}
+
+/* BITFIELD SET and INCRBY on the widths at the edges, 1, 63 and 64 bits
+ * (64 only signed, like the command), at aligned and unaligned offsets,
+ * for every overflow behavior. SET is checked as an increment from 0,
+ * which is how the command computes it. */
+static void bitopsTestBitfield(void) {
+    static int widths[] = {1, 63, 64};
+    static size_t offsets[] = {0, 1, 3, 7, 8, 9, 13, 61, 64, 127};
+    unsigned char buf[32];
+    int w, o, sign, ow, j;
+
+    for (w = 0; w < 3; w++) {
+        for (sign = 0; sign <= 1; sign++) {
+            int bits = widths[w], i64 = sign && bits == 64;
+            int64_t max, min;
+
+            if (!sign && bits == 64) continue;
+            max = sign ? (int64_t)(((uint64_t)1 << (bits-1))-1) :
+                         (int64_t)(((uint64_t)1 << bits)-1);
+            min = sign ? -max-1 : 0;
+
+            /* Value, increment, result with WRAP and with SAT, and whether
+             * it is an overflow, that is, an error with FAIL. */
+            struct {
+                int64_t value, incr, wrap, sat;
+                int overflow;
+            } cases[] = {
+                {min, 0, min, min, 0},
+                {0, max, max, max, 0},
+                {0, min, min, min, 0},
+                {max, 1, min, max, 1},
+                {min, -1, max, min, 1},
+                {max, max, max ? (sign ? -2 : max-1) : 0, max, max != 0},
+                {min, min, 0, min, sign},
+                {max, INT64_MIN, i64 ? -1 : max, i64 ? -1 : min, !i64},
+                {min, INT64_MAX, i64 ? -1 : max, i64 ? -1 : max, bits < 63}
+            };
+
+            for (o = 0; o < (int)(sizeof(offsets)/sizeof(offsets[0])); o++) {
+                for (j = 0; j < (int)sizeof(buf); j++) buf[j] = rand();
+                for (j = 0; j < (int)(sizeof(cases)/sizeof(cases[0])); j++) {
+                    for (ow = BFOVERFLOW_WRAP; ow <= BFOVERFLOW_FAIL; ow++) {
+                        bitopsTestBitfieldOp(buf,sizeof(buf),offsets[o],
+                            sign,bits,ow,cases[j].value,cases[j].incr,
+                            ow == BFOVERFLOW_FAIL && cases[j].overflow,
+                            ow == BFOVERFLOW_WRAP ? cases[j].wrap :
+                                                    cases[j].sat);
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    /* Benchmarked lengths, up to the maximum length of a string. */
+    static long sizes[] = {1024, 8192, 64L*1024, 1024L*1024, 8L*1024*1024,
+                           64L*1024*1024, 512L*1024*1024};
+    long maxlen = 512L*1024*1024, len, j;
+    size_t k;
+    unsigned char *buf;
+
+    if (argc > 1) maxlen = atol(argv[1]);
+    buf = zmalloc(maxlen+1);
+    srand(1234);
+    for (j = 0; j < maxlen+1; j++) buf[j] = rand();
+
+    /* Check all the kernels against the portable implementation on every
+     * length and alignment in a small range. */
+    redisBitopsSelect();
+    for (len = 0; len < 4096; len++) {
+        for (j = 0; j < 2; j++) {
+            size_t expected = redisPopcountPortable(buf+j,len);
+            if (redisPopcount(buf+j,len) != expected) {
+                printf("Popcount mismatch at length %ld\n", len);
+                exit(1);
+            }
+        }
+    }
+
+    /* Same for BITPOS, with and without the AVX2 skip loop, placing the
+     * first interesting bit everywhere in a buffer of 0 or 1 bits. */
+    for (len = 0; len < 1024 && len < maxlen; len++) {
+        int bit, avx2;
+
+        for (bit = 0; bit <= 1; bit++) {
+            memset(buf,bit ? 0 : 0xff,1024);
+            if (len) buf[len] ^= 1 << (len & 7);
+            for (avx2 = 0; avx2 <= redisBitposAVX2; avx2++) {
+                int saved = redisBitposAVX2;
+                long pos;
+
+                redisBitposAVX2 = avx2;
+                pos = redisBitpos(buf+(len&1),1024-1,bit);
+                redisBitposAVX2 = saved;
+                if (pos != (len ? (len-(len&1))*8+(7-(len&7)) :
+                                  (bit ? -1 : (1024-1)*8)))
+                {
+                    printf("Bitpos mismatch at offset %ld\n", len);
+                    exit(1);
+                }
+            }
+        }
+    }
+    for (j = 0; j < maxlen+1; j++) buf[j] = rand();
+
+    /* And for the BITOP kernels, against a byte by byte loop. */
+    for (len = 0; len < 512 && len*3 < maxlen; len++) {
+        unsigned char dst[512], ref[512];
+        int op;
+
+        for (op = BITOP_AND; op <= BITOP_NOT; op++) {
+            memcpy(dst,buf+len*2,len);
+            for (j = 0; j < len; j++) {
+                unsigned char a = buf[len*2+j], b = buf[1+j];
+                ref[j] = op == BITOP_AND ? a & b : op == BITOP_OR ? a | b :
+                         op == BITOP_XOR ? a ^ b : (unsigned char) ~b;
+            }
+            bitopKernel(dst,buf+1,len,op);
+            if (memcmp(dst,ref,len) != 0) {
+                printf("Bitop mismatch at length %ld\n", len);
+                exit(1);
+            }
+        }
+    }
+
+    bitopsTestBitfield();
+
+    for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++) {
+        size_t expected;
+
+        if ((len = sizes[k]) > maxlen) break;
+        expected = redisPopcountPortable(buf,len);
+
+        printf("BITCOUNT %ld bytes:\n", len);
+        bitopsBenchPopcount("portable",redisPopcountPortable,buf,len,expected);
+#ifdef BITOPS_HAVE_DISPATCH
+        if (__builtin_cpu_supports("popcnt"))
+            bitopsBenchPopcount("popcnt",redisPopcountPopcnt,buf,len,expected);
+        if (__builtin_cpu_supports("avx2"))
+            bitopsBenchPopcount("avx2",redisPopcountAVX2,buf,len,expected);
+#endif
+    }
+
+    /* BITPOS over a zeroed buffer with a single bit set at the end. */
+    for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++) {
+        long iter;
+        long long start;
+
+        if ((len = sizes[k]) > maxlen) break;
+        iter = (256L*1024*1024)/len;
+        if (iter < 2) iter = 2;
+        memset(buf,0,len);
+        buf[len-1] = 1;
+        start = bitopsUstime();
+        for (j = 0; j < iter; j++) {
+            if (redisBitpos(buf,len,1) != len*8-1) {
+                printf("Bitpos mismatch at length %ld\n", len);
+                exit(1);
+            }
+        }
+        start = bitopsUstime()-start;
+        printf("BITPOS %ld bytes: %.2f GB/s\n", len,
+            (double)len*iter/(start ? start : 1)/1000);
+    }
+    zfree(buf);
+    return 0;
+}
+#endif
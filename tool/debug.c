@@ -147,7 +147,7 @@ void computeDatasetDigest(unsigned char *final) {
 
             aux = htonl(o->type);
             mixDigest(digest,&aux,sizeof(aux));
-            expiretime = getExpire(db,keyobj);
+            expiretime = getExpireFromEntry(db,de);
 
             /* Save the key and associated value */
             if (o->type == REDIS_STRING) {
@@ -172,7 +172,7 @@ void computeDatasetDigest(unsigned char *final) {
             } else if (o->type == REDIS_ZSET) {
                 unsigned char eledigest[20];
 
-                if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+                if (o->encoding == REDIS_ENCODING_LISTPACK) {
                     unsigned char *zl = o->ptr;
                     unsigned char *eptr, *sptr;
                     unsigned char *vstr;
@@ -180,13 +180,13 @@ void computeDatasetDigest(unsigned char *final) {
                     long long vll;
                     double score;
 
-                    eptr = ziplistIndex(zl,0);
+                    eptr = lpFirst(zl);
                     redisAssert(eptr != NULL);
-                    sptr = ziplistNext(zl,eptr);
+                    sptr = lpNext(zl,eptr);
                     redisAssert(sptr != NULL);
 
                     while (eptr != NULL) {
-                        redisAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                        redisAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
                         score = zzlGetScore(sptr);
 
                         memset(eledigest,0,20);
@@ -218,6 +218,18 @@ void computeDatasetDigest(unsigned char *final) {
                         xorDigest(digest,eledigest,20);
                     }
                     dictReleaseIterator(di);
+                } else if (o->encoding == REDIS_ENCODING_BTREE) {
+                    zbtIter it;
+                    sds ele;
+
+                    for (zbtFirst(o->ptr,&it); zbtIterValid(&it); zbtNext(&it)) {
+                        ele = zbtIterEle(&it);
+                        snprintf(buf,sizeof(buf),"%.17g",zbtIterScore(&it));
+                        memset(eledigest,0,20);
+                        mixDigest(eledigest,ele,sdslen(ele));
+                        mixDigest(eledigest,buf,strlen(buf));
+                        xorDigest(digest,eledigest,20);
+                    }
                 } else {
                     redisPanic("Unknown sorted set encoding");
                 }
@@ -287,6 +299,7 @@ void debugCommand(redisClient *c) {
         dictEntry *de;
         robj *val;
         char *strenc;
+        char extra[256] = {0};
 
         if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
             addReply(c,shared.nokeyerr);
@@ -295,13 +308,41 @@ void debugCommand(redisClient *c) {
         val = dictGetVal(de);
         strenc = strEncoding(val->encoding);
 
+        if (val->encoding == REDIS_ENCODING_QUICKLIST) {
+            quicklist *ql = val->ptr;
+            quicklistNode *node;
+            unsigned long compressed = 0;
+            size_t used = 0, uncompressed = 0;
+
+            /* Report how much memory the LZF compression of the interior
+             * nodes is saving. */
+            for (node = ql->head; node; node = node->next) {
+                uncompressed += node->sz;
+                if (quicklistNodeIsCompressed(node)) {
+                    void *data;
+                    used += quicklistGetLzf(node,&data);
+                    compressed++;
+                } else {
+                    used += node->sz;
+                }
+            }
+            snprintf(extra,sizeof(extra),
+                " ql_nodes:%u ql_avg_node:%.2f ql_ziplist_max:%d"
+                " ql_compressed:%lu ql_uncompressed_size:%lu"
+                " ql_compressed_size:%lu ql_compression_ratio:%.2f",
+                ql->len, ql->len ? (double)ql->count/ql->len : 0,
+                (int)ql->fill, compressed, (unsigned long)uncompressed,
+                (unsigned long)used,
+                used ? (double)uncompressed/used : 1);
+        }
+
         addReplyStatusFormat(c,
             "Value at:%p refcount:%d "
             "encoding:%s serializedlength:%lld "
-            "lru:%d lru_seconds_idle:%lu",
+            "lru:%d lru_seconds_idle:%lu%s",
             (void*)val, val->refcount,
             strenc, (long long) rdbSavedObjectLen(val),
-            val->lru, estimateObjectIdleTime(val));
+            val->lru, estimateObjectIdleTime(val), extra);
     } else if (!strcasecmp(c->argv[1]->ptr,"sdslen") && c->argc == 3) {
         dictEntry *de;
         robj *val;
@@ -447,6 +488,8 @@ void redisLogObjectDebugInfo(robj *o) {
         redisLog(REDIS_WARNING,"Sorted set size: %d", (int) zsetLength(o));
         if (o->encoding == REDIS_ENCODING_SKIPLIST)
             redisLog(REDIS_WARNING,"Skiplist level: %d", (int) ((zset*)o->ptr)->zsl->level);
+        else if (o->encoding == REDIS_ENCODING_BTREE)
+            redisLog(REDIS_WARNING,"B+tree height: %d", ((zbtree*)o->ptr)->height);
     }
 }
 
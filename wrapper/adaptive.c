@@ -0,0 +1,371 @@
+/* Adaptive thresholds for the compact encodings.
+ *
+ * Small hashes, lists, sets and sorted sets are stored using compact
+ * encodings (listpacks and intsets) that use a lot less memory than the
+ * hash tables, quicklists and skiplists used for big values, at the cost of
+ * operations that are O(N) in the number of elements. The point where a
+ * value is converted is controlled by the *-max-ziplist-entries and
+ * set-max-intset-entries limits, that are static guesses and may be a poor
+ * fit for the workload of a given instance.
+ *
+ * When encoding-adaptive is enabled the server samples fast commands
+ * operating on aggregate values, measuring how long they take when the
+ * value uses the compact encoding and when it uses the full one. Once per
+ * second, for every type, the limit is moved towards the number of
+ * elements where the extra latency of the compact encoding is no longer
+ * paid back by the memory it saves:
+ *
+ *   limit = full_cost * memory_ratio / element_cost
+ *
+ * Where full_cost is the average time of a command on the full encoding,
+ * element_cost the extra time per element of a command on the compact
+ * encoding, and memory_ratio the ratio between the estimated bytes per
+ * element of the two encodings. The limits are always kept between
+ * encoding-adaptive-min-entries and encoding-adaptive-max-entries.
+ *
+ * Values are converted according to the new limits only when they are
+ * modified, exactly like it happens when the limits are changed with
+ * CONFIG SET.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+
+/* Only one eligible command every ADAPTIVE_SAMPLE_PERIOD is sampled. */
+#define ADAPTIVE_SAMPLE_PERIOD 16
+
+/* Minimum number of samples of a given kind required in order to trust
+ * the average computed from them. */
+#define ADAPTIVE_MIN_SAMPLES 32
+
+/* Samples are accumulated with an exponential decay: at every tuning cycle
+ * the accumulated values are multiplied by this factor, so that the
+ * estimations follow changes in the workload. */
+#define ADAPTIVE_DECAY 0.5
+
+typedef struct adaptiveStats {
+    /* Decayed sums of the samples. */
+    double compact_calls;       /* Commands against compact values. */
+    double compact_usec;        /* Time spent in such commands. */
+    double compact_elements;    /* Sum of the lengths of such values. */
+    double compact_bytes;       /* Sum of the sizes of such values. */
+    double full_calls;          /* Commands against fully encoded values. */
+    double full_usec;           /* Time spent in such commands. */
+    /* Estimations computed at the last tuning cycle, reported by INFO. */
+    double full_cost;           /* Microseconds per call, full encoding. */
+    double element_cost;        /* Extra microseconds per element, compact. */
+    double compact_entry_bytes; /* Bytes per element, compact encoding. */
+    double full_entry_bytes;    /* Bytes per element, full encoding. */
+} adaptiveStats;
+
+static adaptiveStats adaptive_stats[REDIS_ADAPTIVE_TYPES];
+static size_t adaptive_configured[REDIS_ADAPTIVE_TYPES];
+static unsigned long adaptive_eligible_calls;
+static char *adaptive_type_names[REDIS_ADAPTIVE_TYPES] = {
+    "hash", "list", "set", "zset"
+};
+
+/* Return a pointer to the server field holding the limit of the specified
+ * REDIS_ADAPTIVE_* type. */
+static size_t *adaptiveThresholdPtr(int type) {
+    switch(type) {
+    case REDIS_ADAPTIVE_HASH: return &server.hash_max_ziplist_entries;
+    case REDIS_ADAPTIVE_LIST: return &server.list_max_ziplist_entries;
+    case REDIS_ADAPTIVE_SET: return &server.set_max_intset_entries;
+    case REDIS_ADAPTIVE_ZSET: return &server.zset_max_ziplist_entries;
+    default: redisPanic("Unknown adaptive encoding type");
+    }
+    return NULL; /* Just to avoid warnings. */
+}
+
+/* Estimated memory used by every element of a fully encoded value, in
+ * addition to the payload itself. */
+static size_t adaptiveFullEntryOverhead(int type) {
+    size_t entry = sizeof(dictEntry) + sizeof(dictEntry*);
+    size_t string = sizeof(robj) + sizeof(struct sdshdr) + 1;
+
+    switch(type) {
+    case REDIS_ADAPTIVE_HASH: return entry + string*2;
+    case REDIS_ADAPTIVE_SET: return entry + string;
+    case REDIS_ADAPTIVE_ZSET:
+        /* The average skiplist node has 1.33 levels. */
+        return entry + string + sizeof(zskiplistNode) +
+               sizeof(struct zskiplistLevel)*4/3;
+    case REDIS_ADAPTIVE_LIST:
+        /* Quicklist nodes are ziplists as well: the only overhead is the
+         * node header, shared by all the elements in the node. */
+        return sizeof(quicklistNode)/8;
+    default: redisPanic("Unknown adaptive encoding type");
+    }
+    return 0; /* Just to avoid warnings. */
+}
+
+/* Called at server startup, after the configuration is loaded. */
+void adaptiveEncodingInit(void) {
+    int j;
+
+    memset(adaptive_stats,0,sizeof(adaptive_stats));
+    for (j = 0; j < REDIS_ADAPTIVE_TYPES; j++)
+        adaptive_configured[j] = *adaptiveThresholdPtr(j);
+}
+
+/* Enable or disable the adaptive limits. When the feature is turned off
+ * the limits set by the user are restored. */
+void adaptiveEncodingSetEnabled(int enabled) {
+    int j;
+
+    if (enabled == server.encoding_adaptive) return;
+    for (j = 0; j < REDIS_ADAPTIVE_TYPES; j++) {
+        if (enabled)
+            adaptive_configured[j] = *adaptiveThresholdPtr(j);
+        else
+            *adaptiveThresholdPtr(j) = adaptive_configured[j];
+    }
+    memset(adaptive_stats,0,sizeof(adaptive_stats));
+    server.encoding_adaptive = enabled;
+}
+
+/* Set the limit of the specified type, as requested by CONFIG SET. When the
+ * adaptive limits are enabled the value is used as a new starting point. */
+void adaptiveEncodingSetThreshold(int type, size_t value) {
+    *adaptiveThresholdPtr(type) = value;
+    adaptive_configured[type] = value;
+}
+
+/* Return the limit set by the user for the specified type, that may differ
+ * from the one currently in use when the adaptive limits are enabled. This
+ * is the value CONFIG REWRITE persists. */
+size_t adaptiveEncodingConfiguredThreshold(int type) {
+    return server.encoding_adaptive ? adaptive_configured[type] :
+                                      *adaptiveThresholdPtr(type);
+}
+
+/* Called by call() before executing a command. If the command should be
+ * sampled the function fills 's' with the state of the value stored at the
+ * first key of the command and returns 1, so that the caller will later
+ * call adaptiveEncodingSampleEnd() with the execution time. Otherwise 0 is
+ * returned.
+ *
+ * Only commands flagged as fast are considered: they are O(1) or O(log(N))
+ * with the full encodings, so the time they take against compact values
+ * shows how much the compact encoding costs. */
+int adaptiveEncodingSampleBegin(redisClient *c, adaptiveSample *s) {
+    struct redisCommand *cmd = c->cmd;
+    dictEntry *de;
+    robj *o;
+
+    if (!server.encoding_adaptive || server.loading) return 0;
+    if (!(cmd->flags & REDIS_CMD_FAST) ||
+        cmd->firstkey <= 0 || cmd->firstkey >= c->argc) return 0;
+    if (++adaptive_eligible_calls % ADAPTIVE_SAMPLE_PERIOD) return 0;
+
+    /* Access the dictionary directly: lookupKey() would update the LRU. */
+    de = dictFind(c->db->dict,c->argv[cmd->firstkey]->ptr);
+    if (de == NULL) return 0;
+    o = dictGetVal(de);
+
+    switch(o->type) {
+    case REDIS_HASH:
+        s->type = REDIS_ADAPTIVE_HASH;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            s->compact = 1;
+            s->len = lpLength(o->ptr)/2;
+            s->bytes = lpBytes(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            s->compact = 0;
+            s->len = dictSize((dict*)o->ptr);
+        } else {
+            /* Indexed listpacks are not O(N), sampling them would make
+             * big compact hashes look cheaper than they are to update. */
+            return 0;
+        }
+        break;
+    case REDIS_LIST:
+        s->type = REDIS_ADAPTIVE_LIST;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            s->compact = 1;
+            s->len = lpLength(o->ptr);
+            s->bytes = lpBytes(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+            s->compact = 0;
+            s->len = quicklistCount(o->ptr);
+        } else {
+            return 0;
+        }
+        break;
+    case REDIS_SET:
+        s->type = REDIS_ADAPTIVE_SET;
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            s->compact = 1;
+            s->len = intsetLen(o->ptr);
+            s->bytes = intsetBlobLen(o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_HT) {
+            s->compact = 0;
+            s->len = dictSize((dict*)o->ptr);
+        } else {
+            return 0;
+        }
+        break;
+    case REDIS_ZSET:
+        s->type = REDIS_ADAPTIVE_ZSET;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            s->compact = 1;
+            s->len = lpLength(o->ptr)/2;
+            s->bytes = lpBytes(o->ptr);
+        } else {
+            s->compact = 0;
+            s->len = zsetLength(o);
+        }
+        break;
+    default:
+        return 0;
+    }
+    return s->len != 0;
+}
+
+/* Account the execution time of a command sampled with
+ * adaptiveEncodingSampleBegin(). */
+void adaptiveEncodingSampleEnd(adaptiveSample *s, long long duration) {
+    adaptiveStats *st = adaptive_stats+s->type;
+
+    if (s->compact) {
+        st->compact_calls++;
+        st->compact_usec += duration;
+        st->compact_elements += s->len;
+        st->compact_bytes += s->bytes;
+    } else {
+        st->full_calls++;
+        st->full_usec += duration;
+    }
+}
+
+/* Update the estimations of the specified type and move its limit towards
+ * the best value according to them. A type without enough samples of one
+ * kind uses the averages of all the types: this way a limit that is too
+ * low (or too high) to ever see values of one encoding can still move. */
+static void adaptiveEncodingTune(int type, adaptiveStats *all) {
+    adaptiveStats *st = adaptive_stats+type;
+    size_t *limit = adaptiveThresholdPtr(type);
+    double ratio, target;
+
+    if (st->full_calls >= ADAPTIVE_MIN_SAMPLES)
+        st->full_cost = st->full_usec / st->full_calls;
+    else if (all->full_calls >= ADAPTIVE_MIN_SAMPLES)
+        st->full_cost = all->full_usec / all->full_calls;
+    else
+        return;
+
+    if (st->compact_calls >= ADAPTIVE_MIN_SAMPLES) {
+        st->element_cost = (st->compact_usec -
+                            st->compact_calls * st->full_cost) /
+                           st->compact_elements;
+        st->compact_entry_bytes = st->compact_bytes / st->compact_elements;
+    } else if (all->compact_calls >= ADAPTIVE_MIN_SAMPLES) {
+        st->element_cost = (all->compact_usec -
+                            all->compact_calls * all->full_cost) /
+                           all->compact_elements;
+    } else {
+        return;
+    }
+    /* The memory ratio needs at least a sample of the value's own type. */
+    if (st->compact_entry_bytes == 0) return;
+    st->full_entry_bytes = st->compact_entry_bytes +
+                           adaptiveFullEntryOverhead(type);
+    ratio = st->full_entry_bytes / st->compact_entry_bytes;
+
+    if (st->element_cost <= 0)
+        target = server.encoding_adaptive_max_entries;
+    else
+        target = st->full_cost * ratio / st->element_cost;
+    if (target > server.encoding_adaptive_max_entries)
+        target = server.encoding_adaptive_max_entries;
+    if (target < server.encoding_adaptive_min_entries)
+        target = server.encoding_adaptive_min_entries;
+
+    /* Move only half of the way at every cycle, so that a few noisy
+     * samples can't make the limit oscillate. */
+    *limit = (size_t)((*limit + target) / 2);
+}
+
+/* Called once per second by serverCron(). */
+void adaptiveEncodingCron(void) {
+    adaptiveStats all;
+    int j;
+
+    if (!server.encoding_adaptive) return;
+
+    /* Aggregate the samples of all the types. The full_cost field of the
+     * aggregate is the average, since the per element cost of a type
+     * needs to be computed from it. */
+    memset(&all,0,sizeof(all));
+    for (j = 0; j < REDIS_ADAPTIVE_TYPES; j++) {
+        all.compact_calls += adaptive_stats[j].compact_calls;
+        all.compact_usec += adaptive_stats[j].compact_usec;
+        all.compact_elements += adaptive_stats[j].compact_elements;
+        all.full_calls += adaptive_stats[j].full_calls;
+        all.full_usec += adaptive_stats[j].full_usec;
+    }
+    if (all.full_calls) all.full_cost = all.full_usec / all.full_calls;
+
+    for (j = 0; j < REDIS_ADAPTIVE_TYPES; j++) {
+        adaptiveStats *st = adaptive_stats+j;
+
+        adaptiveEncodingTune(j,&all);
+        st->compact_calls *= ADAPTIVE_DECAY;
+        st->compact_usec *= ADAPTIVE_DECAY;
+        st->compact_elements *= ADAPTIVE_DECAY;
+        st->compact_bytes *= ADAPTIVE_DECAY;
+        st->full_calls *= ADAPTIVE_DECAY;
+        st->full_usec *= ADAPTIVE_DECAY;
+    }
+}
+
+/* Append the "encoding" INFO section fields to 'info'. */
+sds genAdaptiveEncodingInfoString(sds info) {
+    int j;
+
+    info = sdscatprintf(info,"encoding_adaptive:%d\r\n",
+        server.encoding_adaptive);
+    for (j = 0; j < REDIS_ADAPTIVE_TYPES; j++) {
+        adaptiveStats *st = adaptive_stats+j;
+
+        info = sdscatprintf(info,
+            "encoding_%s:max_entries=%zu,configured_max_entries=%zu,"
+            "full_usec_per_call=%.3f,compact_usec_per_entry=%.4f,"
+            "compact_bytes_per_entry=%.1f,full_bytes_per_entry=%.1f\r\n",
+            adaptive_type_names[j],
+            *adaptiveThresholdPtr(j),
+            adaptiveEncodingConfiguredThreshold(j),
+            st->full_cost, st->element_cost,
+            st->compact_entry_bytes, st->full_entry_bytes);
+    }
+    return info;
+}
@@ -1,16 +1,20 @@
 /* Background I/O service for Redis.
  *
  * This file implements operations that we need to perform in the background.
- * Currently there is only a single operation, that is a background close(2)
- * system call. This is needed as when the process is the last owner of a
- * reference to a file closing it means unlinking it, and the deletion of the
- * file is slow, blocking the server.
+ * Currently there are three operations:
+ *
+ * 1) A background close(2) system call. This is needed as when the process is
+ *    the last owner of a reference to a file closing it means unlinking it,
+ *    and the deletion of the file is slow, blocking the server.
+ *
+ * 2) A background fsync(2) of the append only file.
+ *
+ * 3) The release of objects and whole databases, used by UNLINK and
+ *    FLUSHDB/FLUSHALL ASYNC, and optionally by eviction, expiration and
+ *    implicit deletions. See lazyfree.c for more information.
  *
  * In the future we'll either continue implementing new things we need or
- * we'll switch to libeio. However there are probably long term uses for this
- * file as we may want to put here Redis specific background tasks (for instance
- * it is not impossible that we'll need a non blocking FLUSHDB/FLUSHALL
- * implementation).
+ * we'll switch to libeio.
  *
  * DESIGN
  * ------
@@ -176,6 +180,15 @@ void *bioProcessBackgroundJobs(void *arg) {
             close((long)job->arg1);
         } else if (type == REDIS_BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
+        } else if (type == REDIS_BIO_LAZY_FREE) {
+            /* What we free changes depending on what arguments are set:
+             * arg1 -> free the object at pointer.
+             * arg2 -> free the database dictionary at pointer.
+             * arg3 is the estimated size of what is being freed. */
+            if (job->arg1)
+                lazyfreeFreeObjectFromBioThread(job->arg1,(size_t)job->arg3);
+            else if (job->arg2)
+                lazyfreeFreeDictFromBioThread(job->arg2,(size_t)job->arg3);
         } else {
             redisPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
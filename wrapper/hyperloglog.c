@@ -497,6 +497,256 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     }
 }
 
+/* Like hllDenseAdd() for a batch of 'n' updates, already computed by
+ * hllAddBatch(): every entry of 'regs' is the register index shifted left
+ * by 6 bits, ored with the length of the pattern.
+ *
+ * Returns 1 if at least one register was updated, otherwise 0. */
+static int hllDenseAddBatch(uint8_t *registers, uint32_t *regs, long n) {
+    uint8_t oldcount;
+    int updated = 0;
+    long j;
+
+    for (j = 0; j < n; j++) {
+        unsigned long index = regs[j] >> 6;
+        uint8_t count = regs[j] & 63;
+
+        HLL_DENSE_GET_REGISTER(oldcount,registers,index);
+        if (count > oldcount) {
+            HLL_DENSE_SET_REGISTER(registers,index,count);
+            updated = 1;
+        }
+    }
+    return updated;
+}
+
+/* ========================= Dense registers kernels ==========================
+ * PFCOUNT and PFMERGE work on an array of HLL_REGISTERS bytes, one register
+ * per byte, so the dense registers are unpacked 4 registers every 3 bytes,
+ * merged computing the max of every register, and summed to estimate the
+ * cardinality. On x86 this can use AVX2:
+ * as in bitops.c the kernels are compiled with the target attribute and the
+ * right one is selected at runtime according to the CPU. Everywhere else
+ * only the portable implementation is used.
+ *
+ * All the kernels need HLL_BITS to be 6. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HLL_HAVE_DISPATCH
+#include <immintrin.h>
+#endif
+
+/* Unpack 'count' dense registers, a multiple of 4, into the bytes at 'raw'. */
+static void hllDenseUnpackPortable(uint8_t *raw, uint8_t *registers,
+                                   int count)
+{
+    uint8_t *p = registers;
+    int j;
+
+    for (j = 0; j < count; j += 4) {
+        unsigned long v = p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16);
+
+        raw[j] = v & 63;
+        raw[j+1] = (v >> 6) & 63;
+        raw[j+2] = (v >> 12) & 63;
+        raw[j+3] = (v >> 18) & 63;
+        p += 3;
+    }
+}
+
+/* Like hllDenseUnpackPortable() but setting every byte of 'max' to the max
+ * between its value and the one of the register. */
+static void hllDenseMaxPortable(uint8_t *max, uint8_t *registers, int count) {
+    uint8_t *p = registers;
+    int j;
+
+    for (j = 0; j < count; j += 4) {
+        unsigned long v = p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16);
+        uint8_t r0 = v & 63, r1 = (v >> 6) & 63,
+                r2 = (v >> 12) & 63, r3 = (v >> 18) & 63;
+
+        if (r0 > max[j]) max[j] = r0;
+        if (r1 > max[j+1]) max[j+1] = r1;
+        if (r2 > max[j+2]) max[j+2] = r2;
+        if (r3 > max[j+3]) max[j+3] = r3;
+        p += 3;
+    }
+}
+
+#ifdef HLL_HAVE_DISPATCH
+/* Unpack the 32 registers stored in the 24 bytes at 'p'. Every 128 bit lane
+ * handles 12 bytes: they are spread one group of 3 bytes per 32 bit word,
+ * and the 4 registers of every word are moved to their own byte. Note that
+ * 28 bytes are read. */
+__attribute__((target("avx2")))
+static inline __m256i hllUnpack32AVX2(uint8_t *p) {
+    const __m256i spread = _mm256_setr_epi8(
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+    __m256i v, r0, r1, r2, r3;
+
+    v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((__m128i*)p)),
+            _mm_loadu_si128((__m128i*)(p+12)),1);
+    v = _mm256_shuffle_epi8(v,spread);
+    r0 = _mm256_and_si256(v,_mm256_set1_epi32(0x3f));
+    r1 = _mm256_and_si256(_mm256_slli_epi32(v,2),_mm256_set1_epi32(0x3f00));
+    r2 = _mm256_and_si256(_mm256_slli_epi32(v,4),_mm256_set1_epi32(0x3f0000));
+    r3 = _mm256_and_si256(_mm256_slli_epi32(v,6),
+                          _mm256_set1_epi32(0x3f000000));
+    return _mm256_or_si256(_mm256_or_si256(r0,r1),_mm256_or_si256(r2,r3));
+}
+
+/* AVX2 versions of the portable kernels: 32 registers per iteration. The
+ * last 32 registers are always handled by the portable code, so that the
+ * loads never read after the end of the registers. */
+__attribute__((target("avx2")))
+static void hllDenseUnpackAVX2(uint8_t *raw, uint8_t *registers, int count) {
+    int j;
+
+    for (j = 0; j+64 <= count; j += 32) {
+        _mm256_storeu_si256((__m256i*)(raw+j),
+                            hllUnpack32AVX2(registers+j/4*3));
+    }
+    hllDenseUnpackPortable(raw+j,registers+j/4*3,count-j);
+}
+
+__attribute__((target("avx2")))
+static void hllDenseMaxAVX2(uint8_t *max, uint8_t *registers, int count) {
+    int j;
+
+    for (j = 0; j+64 <= count; j += 32) {
+        __m256i m = _mm256_loadu_si256((__m256i*)(max+j));
+
+        m = _mm256_max_epu8(m,hllUnpack32AVX2(registers+j/4*3));
+        _mm256_storeu_si256((__m256i*)(max+j),m);
+    }
+    hllDenseMaxPortable(max+j,registers+j/4*3,count-j);
+}
+#endif
+
+/* Compute SUM(2^-reg) of an array of HLL_REGISTERS registers, one per byte.
+ * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
+ * As a side effect the integer pointed by 'ezp' is set to the number of zero
+ * registers.
+ *
+ * The sum uses 16 accumulators, the register at position j being added to
+ * the accumulator j%16, and the accumulators are added in order at the end.
+ * The AVX2 version follows exactly the same order, so both return the very
+ * same result. */
+static double hllRawSumPortable(uint8_t *registers, double *PE, int *ezp) {
+    double acc[16] = {0}, E = 0;
+    int j, k, ez = 0;
+
+    for (j = 0; j < HLL_REGISTERS; j += 16) {
+        for (k = 0; k < 16; k++) {
+            acc[k] += PE[registers[j+k]];
+            ez += (registers[j+k] == 0);
+        }
+    }
+    for (k = 0; k < 16; k++) E += acc[k];
+    *ezp = ez;
+    return E;
+}
+
+#ifdef HLL_HAVE_DISPATCH
+/* Return 2^-r for the four 64 bit integers 'r', building the exponent of the
+ * doubles directly. */
+__attribute__((target("avx2")))
+static inline __m256d hllPow2NegAVX2(__m256i r) {
+    r = _mm256_sub_epi64(_mm256_set1_epi64x(1023),r);
+    return _mm256_castsi256_pd(_mm256_slli_epi64(r,52));
+}
+
+/* AVX2 version of hllRawSumPortable(): the lane l of acc[a] is the
+ * accumulator 4*a+l of the portable code. */
+__attribute__((target("avx2")))
+static double hllRawSumAVX2(uint8_t *registers, double *PE, int *ezp) {
+    __m256d acc[4];
+    double sum[16], E = 0;
+    int j, k, ez = 0;
+
+    REDIS_NOTUSED(PE);
+    for (k = 0; k < 4; k++) acc[k] = _mm256_setzero_pd();
+    for (j = 0; j < HLL_REGISTERS; j += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)(registers+j));
+
+        ez += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_setzero_si128())));
+        for (k = 0; k < 4; k++) {
+            acc[k] = _mm256_add_pd(acc[k],
+                                   hllPow2NegAVX2(_mm256_cvtepu8_epi64(v)));
+            v = _mm_srli_si128(v,4);
+        }
+    }
+    for (k = 0; k < 4; k++) _mm256_storeu_pd(sum+k*4,acc[k]);
+    for (k = 0; k < 16; k++) E += sum[k];
+    *ezp = ez;
+    return E;
+}
+#endif
+
+/* True once hllSelectKernels() was called. */
+static int hllKernelsSelected = 0;
+/* The implementations in use, see hllSelectKernels(). */
+static void (*hllDenseUnpackImpl)(uint8_t *raw, uint8_t *registers,
+                                  int count) = hllDenseUnpackPortable;
+static void (*hllDenseMaxImpl)(uint8_t *max, uint8_t *registers,
+                               int count) = hllDenseMaxPortable;
+static double (*hllRawSumImpl)(uint8_t *registers, double *PE,
+                               int *ezp) = hllRawSumPortable;
+
+/* Select the fastest implementations for the CPU we are running on. */
+static void hllSelectKernels(void) {
+#ifdef HLL_HAVE_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hllDenseUnpackImpl = hllDenseUnpackAVX2;
+        hllDenseMaxImpl = hllDenseMaxAVX2;
+        hllRawSumImpl = hllRawSumAVX2;
+    }
+#endif
+    hllKernelsSelected = 1;
+}
+
+/* Unpack all the dense 'registers' into the HLL_REGISTERS bytes at 'raw'. */
+void hllDenseUnpack(uint8_t *raw, uint8_t *registers) {
+    if (!hllKernelsSelected) hllSelectKernels();
+    hllDenseUnpackImpl(raw,registers,HLL_REGISTERS);
+}
+
+/* Set every byte of the HLL_REGISTERS bytes at 'max' to the max between its
+ * value and the one of the corresponding dense register. */
+void hllDenseMax(uint8_t *max, uint8_t *registers) {
+    if (!hllKernelsSelected) hllSelectKernels();
+    hllDenseMaxImpl(max,registers,HLL_REGISTERS);
+}
+
+/* The opposite of hllDenseUnpack(): store the HLL_REGISTERS bytes at 'raw'
+ * as dense registers. */
+void hllDensePack(uint8_t *registers, uint8_t *raw) {
+    uint8_t *p = registers;
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS; j += 4) {
+        unsigned long v = raw[j] | (raw[j+1] << 6) | (raw[j+2] << 12) |
+                          ((unsigned long)raw[j+3] << 18);
+
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+        p[2] = (v >> 16) & 0xff;
+        p += 3;
+    }
+}
+
+/* Compute SUM(2^-reg) of an array of HLL_REGISTERS registers, one per byte,
+ * see hllRawSumPortable(). */
+double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
+    if (!hllKernelsSelected) hllSelectKernels();
+    return hllRawSumImpl(registers,PE,ezp);
+}
+
 /* Compute SUM(2^-reg) in the dense representation.
  * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
  * As a side effect the integer pointed by 'ezp' is set to the number
@@ -505,40 +755,14 @@ double hllDenseSum(uint8_t *registers, double *PE, int *ezp) {
     double E = 0;
     int j, ez = 0;
 
-    /* Redis default is to use 16384 registers 6 bits each. The code works
-     * with other values by modifying the defines, but for our target value
-     * we take a faster path with unrolled loops. */
-    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
-        uint8_t *r = registers;
-        unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
-                      r10, r11, r12, r13, r14, r15;
-        for (j = 0; j < 1024; j++) {
-            /* Handle 16 registers per iteration. */
-            r0 = r[0] & 63; if (r0 == 0) ez++;
-            r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-            r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-            r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-            r4 = r[3] & 63; if (r4 == 0) ez++;
-            r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-            r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-            r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-            r8 = r[6] & 63; if (r8 == 0) ez++;
-            r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-            r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-            r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-            r12 = r[9] & 63; if (r12 == 0) ez++;
-            r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-            r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-            r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-            /* Additional parens will allow the compiler to optimize the
-             * code more with a loss of precision that is not very relevant
-             * here (floating point math is not commutative!). */
-            E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-                 (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-                 (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-            r += 12;
-        }
+    /* Redis default is to use 6 bits registers: in this case we take a
+     * faster path unpacking all the registers at once. The code works with
+     * other values by modifying the defines. */
+    if (HLL_BITS == 6) {
+        uint8_t raw[HLL_REGISTERS];
+
+        hllDenseUnpack(raw,registers);
+        return hllRawSum(raw,PE,ezp);
     } else {
         for (j = 0; j < HLL_REGISTERS; j++) {
             unsigned long reg;
@@ -881,6 +1105,148 @@ promote: /* Promote to dense representation. */
     return dense_retval;
 }
 
+/* State used to write a sparse representation from scratch one run of
+ * registers with the same value at a time, see hllSparseAddBatch(). Adjacent
+ * runs with the same value are joined, so that the smallest sequence of
+ * opcodes is emitted. */
+typedef struct hllSparseWriter {
+    uint8_t *p;         /* Where the next opcode is written. */
+    int value;          /* Value of the pending run of registers. */
+    long len;           /* Length of the pending run, 0 if none. */
+} hllSparseWriter;
+
+/* Emit the opcodes of the pending run. */
+static void hllSparseWriterFlush(hllSparseWriter *w) {
+    long len = w->len, l;
+
+    while(len) {
+        if (w->value == 0 && len > HLL_SPARSE_ZERO_MAX_LEN) {
+            l = (len > HLL_SPARSE_XZERO_MAX_LEN) ?
+                HLL_SPARSE_XZERO_MAX_LEN : len;
+            HLL_SPARSE_XZERO_SET(w->p,l);
+            w->p += 2;
+        } else if (w->value == 0) {
+            l = len;
+            HLL_SPARSE_ZERO_SET(w->p,l);
+            w->p++;
+        } else {
+            l = (len > HLL_SPARSE_VAL_MAX_LEN) ? HLL_SPARSE_VAL_MAX_LEN : len;
+            HLL_SPARSE_VAL_SET(w->p,w->value,l);
+            w->p++;
+        }
+        len -= l;
+    }
+    w->len = 0;
+}
+
+/* Append 'len' registers set to 'value'. */
+static void hllSparseWriterAdd(hllSparseWriter *w, int value, long len) {
+    if (len == 0) return;
+    if (w->len && w->value != value) hllSparseWriterFlush(w);
+    w->value = value;
+    w->len += len;
+}
+
+/* Like hllSparseAdd() for a batch of 'n' updates sorted by register, with
+ * at most one update per register, see hllDenseAddBatch() for the format
+ * of 'regs'.
+ *
+ * Instead of modifying the representation in place once per element, with
+ * a scan and possibly a memmove each time, the new representation is
+ * written in a single pass over the old one, applying the updates while the
+ * runs covering them are copied.
+ *
+ * Returns 1 if at least one register was updated, 0 if not, and -1 if the
+ * representation is invalid. As hllSparseAdd() this may promote the HLL to
+ * the dense representation, also checking the final size of the new sparse
+ * representation once instead of at every element. */
+static int hllSparseAddBatch(robj *o, uint32_t *regs, long n) {
+    uint8_t *p = (uint8_t*)o->ptr + HLL_HDR_SIZE;
+    uint8_t *end = (uint8_t*)o->ptr + sdslen(o->ptr);
+    hllSparseWriter w;
+    size_t maxlen, newlen;
+    long j, idx = 0;
+    int updated = 0;
+    sds out;
+
+    /* Values not representable with the sparse representation need the
+     * dense one anyway. */
+    for (j = 0; j < n; j++) {
+        if ((int)(regs[j] & 63) > HLL_SPARSE_VAL_MAX_VALUE) goto promote;
+    }
+
+    /* Every update splits at most one opcode into three, growing the
+     * representation by at most 3 bytes (XZERO into XZERO-VAL-XZERO). */
+    maxlen = sdslen(o->ptr)+n*3;
+    out = sdsnewlen(NULL,maxlen);
+    memcpy(out,o->ptr,HLL_HDR_SIZE);
+    w.p = (uint8_t*)out + HLL_HDR_SIZE;
+    w.value = 0;
+    w.len = 0;
+
+    j = 0;
+    while(p < end) {
+        long runlen, first;
+        int regval;
+
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            runlen = HLL_SPARSE_ZERO_LEN(p);
+            regval = 0;
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            runlen = HLL_SPARSE_XZERO_LEN(p);
+            regval = 0;
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            p++;
+        }
+        if (idx+runlen > HLL_REGISTERS) break; /* Invalid format. */
+
+        /* Copy the run, splitting it at the registers to update. */
+        first = idx;
+        idx += runlen;
+        for (; j < n && (long)(regs[j] >> 6) < idx; j++) {
+            long index = regs[j] >> 6;
+            int count = regs[j] & 63;
+
+            if (count <= regval) continue;
+            hllSparseWriterAdd(&w,regval,index-first);
+            hllSparseWriterAdd(&w,count,1);
+            first = index+1;
+            updated = 1;
+        }
+        hllSparseWriterAdd(&w,regval,idx-first);
+    }
+    hllSparseWriterFlush(&w);
+
+    if (idx != HLL_REGISTERS || p != end) {
+        sdsfree(out);
+        return -1;
+    }
+    if (!updated) {
+        sdsfree(out);
+        return 0;
+    }
+
+    newlen = w.p - (uint8_t*)out;
+    redisAssert(newlen <= maxlen);
+    if (newlen > server.hll_sparse_max_bytes) {
+        sdsfree(out);
+        goto promote;
+    }
+    sdsIncrLen(out,-(int)(maxlen-newlen));
+    sdsfree(o->ptr);
+    o->ptr = sdsRemoveFreeSpace(out);
+    HLL_INVALIDATE_CACHE((struct hllhdr*)o->ptr);
+    return 1;
+
+promote: /* Promote to dense representation. */
+    if (hllSparseToDense(o) == REDIS_ERR) return -1; /* Corrupted HLL. */
+    return hllDenseAddBatch(((struct hllhdr*)o->ptr)->registers,regs,n);
+}
+
 /* Compute SUM(2^-reg) in the sparse representation.
  * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
  * As a side effect the integer pointed by 'ezp' is set to the number
@@ -923,36 +1289,6 @@ double hllSparseSum(uint8_t *sparse, int sparselen, double *PE, int *ezp, int *i
  * as helpers to compute the SUM(2^-reg) part of the computation, which is
  * representation-specific, while all the rest is common. */
 
-/* Implements the SUM operation for uint8_t data type which is only used
- * internally as speedup for PFCOUNT with multiple keys. */
-double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
-    double E = 0;
-    int j, ez = 0;
-    uint64_t *word = (uint64_t*) registers;
-    uint8_t *bytes;
-
-    for (j = 0; j < HLL_REGISTERS/8; j++) {
-        if (*word == 0) {
-            ez += 8;
-        } else {
-            bytes = (uint8_t*) word;
-            if (bytes[0]) E += PE[bytes[0]]; else ez++;
-            if (bytes[1]) E += PE[bytes[1]]; else ez++;
-            if (bytes[2]) E += PE[bytes[2]]; else ez++;
-            if (bytes[3]) E += PE[bytes[3]]; else ez++;
-            if (bytes[4]) E += PE[bytes[4]]; else ez++;
-            if (bytes[5]) E += PE[bytes[5]]; else ez++;
-            if (bytes[6]) E += PE[bytes[6]]; else ez++;
-            if (bytes[7]) E += PE[bytes[7]]; else ez++;
-        }
-        word++;
-    }
-    E += ez; /* 2^(-reg[j]) is 1 when m is 0, add it 'ez' times for every
-                zero register in the HLL. */
-    *ezp = ez;
-    return E;
-}
-
 /* Return the approximated cardinality of the set based on the harmonic
  * mean of the registers values. 'hdr' points to the start of the SDS
  * representing the String object holding the HLL representation.
@@ -1033,6 +1369,55 @@ int hllAdd(robj *o, unsigned char *ele, size_t elesize) {
     }
 }
 
+/* Compare two entries of the updates array used by hllAddBatch(). */
+static int hllCompareUpdates(const void *a, const void *b) {
+    uint32_t ua = *(const uint32_t*)a, ub = *(const uint32_t*)b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+/* Add the 'numele' string objects in 'ele' to the HLL, like calling hllAdd()
+ * for every one of them. All the elements are hashed first, and the
+ * updates are sorted by register, keeping only the greatest value for
+ * every register, so that they can be applied in a single pass.
+ *
+ * Returns 1 if the approximated cardinality changed, 0 if not, and -1 if
+ * the representation is invalid. */
+int hllAddBatch(robj *o, robj **ele, int numele) {
+    struct hllhdr *hdr = o->ptr;
+    uint32_t *regs;
+    long j, n = 0;
+    int retval;
+
+    if (hdr->encoding != HLL_DENSE && hdr->encoding != HLL_SPARSE)
+        return -1; /* Invalid representation. */
+
+    /* Every update is the register index shifted left by 6 bits, ored with
+     * the pattern length, that is at most 64-HLL_P+1, so that sorting the
+     * updates sorts them by register and then by value. */
+    regs = zmalloc(sizeof(uint32_t)*numele);
+    for (j = 0; j < numele; j++) {
+        long index;
+        int count = hllPatLen(ele[j]->ptr,sdslen(ele[j]->ptr),&index);
+
+        regs[j] = ((uint32_t)index << 6) | count;
+    }
+    qsort(regs,numele,sizeof(uint32_t),hllCompareUpdates);
+    for (j = 0; j < numele; j++) {
+        if (n && (regs[n-1] >> 6) == (regs[j] >> 6))
+            regs[n-1] = regs[j];
+        else
+            regs[n++] = regs[j];
+    }
+
+    if (hdr->encoding == HLL_DENSE)
+        retval = hllDenseAddBatch(hdr->registers,regs,n);
+    else
+        retval = hllSparseAddBatch(o,regs,n);
+    zfree(regs);
+    return retval;
+}
+
 /* Merge by computing MAX(registers[i],hll[i]) the HyperLogLog 'hll'
  * with an array of uint8_t HLL_REGISTERS registers pointed by 'max'.
  *
@@ -1045,7 +1430,9 @@ int hllMerge(uint8_t *max, robj *hll) {
     struct hllhdr *hdr = hll->ptr;
     int i;
 
-    if (hdr->encoding == HLL_DENSE) {
+    if (hdr->encoding == HLL_DENSE && HLL_BITS == 6) {
+        hllDenseMax(max,hdr->registers);
+    } else if (hdr->encoding == HLL_DENSE) {
         uint8_t val;
 
         for (i = 0; i < HLL_REGISTERS; i++) {
@@ -1128,6 +1515,26 @@ int isHLLObjectOrReply(redisClient *c, robj *o) {
     if (checkType(c,o,REDIS_STRING))
         return REDIS_ERR; /* Error already sent. */
 
+    /* A string used as a bitmap may be sparse encoded. Check the header
+     * reading just its bytes, so that an invalid value is rejected without
+     * expanding it, and convert it to raw only if it looks like an HLL, since
+     * the HLL code needs the bytes. */
+    if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sparseBitmap *sb = o->ptr;
+        sds header;
+        int valid;
+
+        if (sb->len < sizeof(*hdr)) goto invalid;
+        header = sparseBitmapRangeToSds(sb,0,sizeof(*hdr)-1);
+        hdr = (struct hllhdr*) header;
+        valid = memcmp(hdr->magic,"HYLL",4) == 0 &&
+                hdr->encoding <= HLL_MAX_ENCODING &&
+                (hdr->encoding != HLL_DENSE || sb->len == HLL_DENSE_SIZE);
+        sdsfree(header);
+        if (!valid) goto invalid;
+        bitmapTypeConvert(o,REDIS_ENCODING_RAW);
+    }
+
     if (stringObjectLen(o) < sizeof(*hdr)) goto invalid;
     hdr = o->ptr;
 
@@ -1168,18 +1575,29 @@ void pfaddCommand(redisClient *c) {
         if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
         o = dbUnshareStringValue(c->db,c->argv[1],o);
     }
-    /* Perform the low level ADD operation for every element. */
-    for (j = 2; j < c->argc; j++) {
-        int retval = hllAdd(o, (unsigned char*)c->argv[j]->ptr,
-                               sdslen(c->argv[j]->ptr));
-        switch(retval) {
-        case 1:
-            updated++;
-            break;
-        case -1:
+    /* Perform the low level ADD operation for every element. Multiple
+     * elements are added as a batch, see hllAddBatch(). */
+    if (c->argc > 3) {
+        int retval = hllAddBatch(o,c->argv+2,c->argc-2);
+
+        if (retval == -1) {
             addReplySds(c,sdsnew(invalid_hll_err));
             return;
         }
+        updated += retval;
+    } else {
+        for (j = 2; j < c->argc; j++) {
+            int retval = hllAdd(o, (unsigned char*)c->argv[j]->ptr,
+                                   sdslen(c->argv[j]->ptr));
+            switch(retval) {
+            case 1:
+                updated++;
+                break;
+            case -1:
+                addReplySds(c,sdsnew(invalid_hll_err));
+                return;
+            }
+        }
     }
     hdr = o->ptr;
     if (updated) {
@@ -1329,8 +1747,12 @@ void pfmergeCommand(redisClient *c) {
     /* Write the resulting HLL to the destination HLL registers and
      * invalidate the cached value. */
     hdr = o->ptr;
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
+    if (HLL_BITS == 6) {
+        hllDensePack(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
+        }
     }
     HLL_INVALIDATE_CACHE(hdr);
 
@@ -1352,8 +1774,9 @@ void pfselftestCommand(redisClient *c) {
     unsigned int j, i;
     sds bitcounters = sdsnewlen(NULL,HLL_DENSE_SIZE);
     struct hllhdr *hdr = (struct hllhdr*) bitcounters, *hdr2;
-    robj *o = NULL;
+    robj *o = NULL, *o2 = NULL, *batch[1000];
     uint8_t bytecounters[HLL_REGISTERS];
+    unsigned int batchlen;
 
     /* Test 1: access registers.
      * The test is conceived to test that the different counters of our data
@@ -1380,6 +1803,34 @@ void pfselftestCommand(redisClient *c) {
                 goto cleanup;
             }
         }
+
+        /* Check that the kernels used by PFCOUNT and PFMERGE agree. */
+        if (HLL_BITS == 6) {
+            uint8_t raw[HLL_REGISTERS], other[HLL_REGISTERS];
+
+            hllDenseUnpack(raw,hdr->registers);
+            if (memcmp(raw,bytecounters,HLL_REGISTERS) != 0) {
+                addReplyError(c,"TESTFAILED dense registers unpacking");
+                goto cleanup;
+            }
+            for (i = 0; i < HLL_REGISTERS; i++)
+                raw[i] = other[i] = rand() & HLL_REGISTER_MAX;
+            hllDenseMax(raw,hdr->registers);
+            for (i = 0; i < HLL_REGISTERS; i++) {
+                uint8_t expected = (other[i] > bytecounters[i]) ?
+                                   other[i] : bytecounters[i];
+                if (raw[i] != expected) {
+                    addReplyError(c,"TESTFAILED dense registers merge");
+                    goto cleanup;
+                }
+            }
+            hllDensePack(hdr->registers,bytecounters);
+            hllDenseUnpack(raw,hdr->registers);
+            if (memcmp(raw,bytecounters,HLL_REGISTERS) != 0) {
+                addReplyError(c,"TESTFAILED dense registers packing");
+                goto cleanup;
+            }
+        }
     }
 
     /* Test 2: approximation error.
@@ -1442,12 +1893,58 @@ void pfselftestCommand(redisClient *c) {
         }
     }
 
+    /* Test 3: batched additions.
+     * The same elements are added to an HLL one at a time, and in batches
+     * of random size to another one, going from the sparse to the dense
+     * representation: the registers must be the same after every batch,
+     * and so must be the reported cardinality change. The elements are
+     * drawn from a limited range so that some are repeated. */
+    decrRefCount(o);
+    o = createHLLObject();
+    o2 = createHLLObject();
+    for (j = 0; j < 20000; j += batchlen) {
+        uint8_t regs1[HLL_REGISTERS], regs2[HLL_REGISTERS];
+        int changed = 0, batchchanged;
+
+        batchlen = 1+rand()%((j < 2000) ? 50 : 1000);
+        for (i = 0; i < batchlen; i++) {
+            ele = rand()%40000;
+            batch[i] = createObject(REDIS_STRING,sdsfromlonglong(ele));
+            if (hllAdd(o,batch[i]->ptr,sdslen(batch[i]->ptr)) == 1)
+                changed = 1;
+        }
+        batchchanged = hllAddBatch(o2,batch,batchlen);
+        for (i = 0; i < batchlen; i++) decrRefCount(batch[i]);
+
+        memset(regs1,0,sizeof(regs1));
+        memset(regs2,0,sizeof(regs2));
+        if (hllMerge(regs1,o) == REDIS_ERR ||
+            hllMerge(regs2,o2) == REDIS_ERR ||
+            memcmp(regs1,regs2,HLL_REGISTERS) != 0)
+        {
+            addReplyErrorFormat(c,
+                "TESTFAILED batched/single add disagree after %u elements",
+                j+batchlen);
+            goto cleanup;
+        }
+        if (batchchanged != changed) {
+            addReplyError(c,"TESTFAILED batched add reported wrong change");
+            goto cleanup;
+        }
+    }
+    hdr2 = o2->ptr;
+    if (hdr2->encoding != HLL_DENSE) {
+        addReplyError(c,"TESTFAILED batched add did not promote to dense");
+        goto cleanup;
+    }
+
     /* Success! */
     addReply(c,shared.ok);
 
 cleanup:
     sdsfree(bitcounters);
     if (o) decrRefCount(o);
+    if (o2) decrRefCount(o2);
 }
 
 /* PFDEBUG <subcommand> <key> ... args ...
@@ -0,0 +1,334 @@
+/* Lazy freeing of objects and databases.
+ *
+ * Releasing a big aggregate value (a list, set, sorted set or hash with
+ * millions of elements) or a whole database requires to free every single
+ * allocation composing it, and may block the server for seconds. This file
+ * implements the ability to unlink such values from the key space in O(1)
+ * and release them in a background thread (see bio.c), using the
+ * REDIS_BIO_LAZY_FREE job type.
+ *
+ * Small values are still released synchronously, as handing them to the
+ * background thread would cost more than freeing them.
+ *
+ * The memory of values scheduled for release is accounted in zmalloc as
+ * "pending free" memory (see zmalloc_pending_free_add()), so that the
+ * maxmemory logic does not evict more keys while the background thread is
+ * catching up. Since the exact amount of memory used by a value is not
+ * known without visiting all its elements, a sampled estimate is used.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include "bio.h"
+
+/* Values requiring more than LAZYFREE_THRESHOLD allocations to be freed
+ * are released in the background thread. */
+#define LAZYFREE_THRESHOLD 64
+
+/* Number of elements sampled in order to estimate the memory used by a
+ * value, and number of keys sampled to estimate the size of a database. */
+#define LAZYFREE_SIZE_SAMPLES 5
+#define LAZYFREE_DB_SIZE_SAMPLES 16
+
+/* Return the amount of work needed in order to free an object.
+ * The return value is not always the actual number of allocations the
+ * object is composed of, but a number proportional to it.
+ *
+ * For strings the function always returns 1.
+ *
+ * For aggregated objects represented by hash tables or other data structures
+ * the function just returns the number of elements the object is composed of.
+ *
+ * Objects composed of single allocations are always reported as having a
+ * single item even if they are actually logical composed of multiple
+ * elements.
+ *
+ * When the server is built without atomic operations support the object
+ * reference counting is not thread safe, so we always report an effort of
+ * zero, and objects are always freed synchronously. */
+size_t lazyfreeGetFreeEffort(robj *obj) {
+#ifndef REDIS_ATOMIC_REFCOUNT
+    REDIS_NOTUSED(obj);
+    return 0;
+#else
+    if (obj->type == REDIS_LIST && obj->encoding == REDIS_ENCODING_QUICKLIST) {
+        return ((quicklist*)obj->ptr)->len;
+    } else if (obj->type == REDIS_SET && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+    } else if (obj->encoding == REDIS_ENCODING_ROARING) {
+        return roaringContainers(obj->ptr);
+    } else if (obj->encoding == REDIS_ENCODING_SPARSE) {
+        return roaringContainers(((sparseBitmap*)obj->ptr)->bits);
+    } else if (obj->type == REDIS_ZSET &&
+               obj->encoding == REDIS_ENCODING_SKIPLIST)
+    {
+        return ((zset*)obj->ptr)->zsl->length;
+    } else if (obj->type == REDIS_ZSET &&
+               obj->encoding == REDIS_ENCODING_BTREE)
+    {
+        return zbtLength((zbtree*)obj->ptr);
+    } else if (obj->type == REDIS_HASH && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+    } else {
+        return 1; /* Everything else is a single allocation. */
+    }
+#endif
+}
+
+/* Return the memory used by a string object stored as an element of an
+ * aggregate value or as a value. */
+static size_t lazyfreeStringObjectSize(robj *o) {
+    size_t size = sizeof(*o);
+
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        size += zmalloc_size_sds(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sparseBitmap *sb = o->ptr;
+
+        size += sizeof(*sb) + roaringBytes(sb->bits);
+    }
+    return size;
+}
+
+/* Return the memory used by the dictionary structure alone, that is, the
+ * tables and the entries, without the keys and values. */
+static size_t lazyfreeDictOverhead(dict *d) {
+    return sizeof(*d) +
+           (d->ht[0].size + d->ht[1].size) * sizeof(dictEntry*) +
+           dictSize(d) * sizeof(dictEntry);
+}
+
+/* Return an estimate of the memory used by the keys and values of a
+ * dictionary storing string objects, sampling the first entries. */
+static size_t lazyfreeDictElementsSize(dict *d, int has_values) {
+    dictIterator *di;
+    dictEntry *de;
+    size_t sampled = 0, samples = 0;
+
+    if (dictSize(d) == 0) return 0;
+    di = dictGetIterator(d);
+    while(samples < LAZYFREE_SIZE_SAMPLES && (de = dictNext(di)) != NULL) {
+        sampled += lazyfreeStringObjectSize(dictGetKey(de));
+        if (has_values) sampled += lazyfreeStringObjectSize(dictGetVal(de));
+        samples++;
+    }
+    dictReleaseIterator(di);
+    return sampled / samples * dictSize(d);
+}
+
+/* Return an estimate of the memory that will be released once the object
+ * is freed. The estimate is computed in constant time, sampling a few
+ * elements of aggregate values. */
+size_t lazyfreeEstimateObjectSize(robj *o) {
+    size_t size = sizeof(*o);
+
+    if (o->type == REDIS_STRING) {
+        size = lazyfreeStringObjectSize(o);
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        size += lpBytes(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK_INDEXED) {
+        hashListpackIndex *idx = o->ptr;
+
+        size += lpBytes(idx->lp) + sizeof(*idx) +
+                idx->size * (sizeof(uint32_t)+1);
+    } else if (o->encoding == REDIS_ENCODING_INTSET) {
+        size += intsetBlobLen(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_ROARING) {
+        size += roaringBytes(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklist *ql = o->ptr;
+        quicklistNode *node = ql->head;
+        size_t sampled = 0, samples = 0;
+
+        size += sizeof(*ql) + ql->len * sizeof(quicklistNode);
+        while(samples < LAZYFREE_SIZE_SAMPLES && node) {
+            sampled += node->sz;
+            samples++;
+            node = node->next;
+        }
+        if (samples) size += sampled / samples * ql->len;
+    } else if (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_HT) {
+        size += lazyfreeDictOverhead(o->ptr);
+        size += lazyfreeDictElementsSize(o->ptr,0);
+    } else if (o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT) {
+        size += lazyfreeDictOverhead(o->ptr);
+        size += lazyfreeDictElementsSize(o->ptr,1);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+
+        /* Skiplist nodes have on average 1/(1-P) levels. The member objects
+         * are shared between the skiplist and the dictionary. */
+        size += sizeof(*zs) + sizeof(*zs->zsl);
+        size += zs->zsl->length * (sizeof(zskiplistNode) +
+                (size_t)(sizeof(struct zskiplistLevel)/(1-ZSKIPLIST_P)));
+        size += lazyfreeDictOverhead(zs->dict);
+        size += lazyfreeDictElementsSize(zs->dict,0);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_BTREE) {
+        zbtree *zbt = o->ptr;
+        zbtIter it;
+        size_t sampled = 0, samples = 0;
+
+        /* Members are plain sds strings owned by the tree, referenced by
+         * the dictionary as well. */
+        size += zbtBytes(zbt) + lazyfreeDictOverhead(zbt->dict);
+        zbtFirst(zbt,&it);
+        while(samples < LAZYFREE_SIZE_SAMPLES && zbtIterValid(&it)) {
+            sampled += zmalloc_size_sds(zbtIterEle(&it));
+            samples++;
+            zbtNext(&it);
+        }
+        if (samples) size += sampled / samples * zbtLength(zbt);
+    }
+    return size;
+}
+
+/* Return an estimate of the memory used by a database dictionary, sampling
+ * a few random keys. */
+static size_t lazyfreeEstimateDbSize(dict *d) {
+    size_t sampled = 0;
+    int j, samples = 0;
+
+    for (j = 0; j < LAZYFREE_DB_SIZE_SAMPLES && dictSize(d); j++) {
+        dictEntry *de = dictGetRandomKey(d);
+        sds key = dictGetKey(de);
+
+        sampled += zmalloc_size_sds(key);
+        sampled += lazyfreeEstimateObjectSize(dictGetVal(de));
+        samples++;
+    }
+    return lazyfreeDictOverhead(d) +
+           (samples ? sampled / samples * dictSize(d) : 0);
+}
+
+/* Release an object, in the background thread if it is worth it. The
+ * object reference is transferred to this function in any case.
+ *
+ * Objects that are shared (refcount > 1) are just decremented, since they
+ * will not be released anyway. */
+void freeObjAsync(robj *o) {
+    size_t free_effort = lazyfreeGetFreeEffort(o);
+
+    if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
+        size_t size = lazyfreeEstimateObjectSize(o);
+
+        zmalloc_pending_free_add(size);
+        bioCreateBackgroundJob(REDIS_BIO_LAZY_FREE,o,NULL,(void*)size);
+    } else {
+        decrRefCount(o);
+    }
+}
+
+/* Delete a key, value, and associated expiration entry if any, from the DB.
+ * If there are enough allocations to free the value object may be put into
+ * a lazy free list instead of being freed synchronously. The lazy free list
+ * will be reclaimed in a different bio.c thread. */
+int dbAsyncDelete(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    /* Deleting an entry from the expires dict will not free the sds of
+     * the key, because it is shared with the main dictionary. */
+    if (db->expires_index->length > 0) dbDeleteExpire(db,key->ptr);
+
+    /* If the value is composed of a few allocations, to free in a lazy way
+     * is actually just slower... So under a certain limit we just free
+     * the object synchronously. */
+    de = dictFind(db->dict,key->ptr);
+    if (de) {
+        robj *val = dictGetVal(de);
+
+        /* Unlink the value from the key space, so that deleting the entry
+         * will only free the key (the value destructor ignores NULLs), and
+         * release the value by other means. */
+        dictSetVal(db->dict,de,NULL);
+        freeObjAsync(val);
+    }
+
+    /* Release the key-val pair, or just the key if we set the val
+     * field to NULL in order to lazy free it later. */
+    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Empty a Redis DB asynchronously. What the function does actually is to
+ * create a new empty set of hash tables and scheduling the old ones for
+ * lazy freeing. Return the number of keys removed. */
+long long emptyDbAsync(redisDb *db) {
+    dict *oldht1 = db->dict, *oldht2 = db->expires;
+    long long removed = dictSize(oldht1);
+    size_t size1, size2;
+
+    db->dict = dictCreate(&dbDictType,NULL);
+    db->expires = dictCreate(&keyptrDictType,NULL);
+
+    /* The expire index is a skiplist like the ones used by sorted sets:
+     * wrap it into an empty sorted set object so that it can be released
+     * by the lazy free thread as any other value. The index references the
+     * keys of the main dictionary, so they are detached first. */
+    if (db->expires_index->length) {
+        robj *idx = createZsetObject();
+        zset *zs = idx->ptr;
+
+        zslFree(zs->zsl);
+        zs->zsl = expireIndexDetach(db);
+        freeObjAsync(idx);
+    }
+
+    /* The expires dictionary shares the keys with the main one, so its
+     * size is just the table and the entries. */
+    size1 = lazyfreeEstimateDbSize(oldht1);
+    size2 = lazyfreeDictOverhead(oldht2);
+    zmalloc_pending_free_add(size1+size2);
+    bioCreateBackgroundJob(REDIS_BIO_LAZY_FREE,NULL,oldht1,(void*)size1);
+    bioCreateBackgroundJob(REDIS_BIO_LAZY_FREE,NULL,oldht2,(void*)size2);
+    return removed;
+}
+
+/* Release objects from the lazyfree thread. It's just decrRefCount()
+ * updating the count of memory pending to be released. */
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t size) {
+    decrRefCount(o);
+    zmalloc_pending_free_sub(size);
+}
+
+/* Release a database dictionary from the lazyfree thread. */
+void lazyfreeFreeDictFromBioThread(dict *d, size_t size) {
+    dictRelease(d);
+    zmalloc_pending_free_sub(size);
+}
+
+/* Return the number of objects and dictionaries waiting to be released
+ * by the background thread. */
+unsigned long long lazyfreeGetPendingObjectsCount(void) {
+    return bioPendingJobsOfType(REDIS_BIO_LAZY_FREE);
+}
@@ -36,8 +36,9 @@ void createDumpPayload(rio *payload, robj *o) {
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,&crc,8);
 }
 
-/* Verify that the RDB version of the dump payload matches the one of this Redis
- * instance and that the checksum is ok.
+/* Verify that the RDB version of the dump payload can be loaded by this Redis
+ * instance, that is, it is the current one or an older one produced before
+ * the upgrade of the node, and that the checksum is ok.
  * If the DUMP payload looks valid REDIS_OK is returned, otherwise REDIS_ERR
  * is returned. */
 int verifyDumpPayload(unsigned char *p, size_t len) {
@@ -51,7 +52,7 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
 
     /* Verify RDB version */
     rdbver = (footer[1] << 8) | footer[0];
-    if (rdbver != REDIS_RDB_VERSION) return REDIS_ERR;
+    if (!rdbIsSupportedVersion(rdbver)) return REDIS_ERR;
 
     /* Verify CRC64 */
     crc = crc64(0,p,len-8);
@@ -118,6 +119,13 @@ void restoreCommand(redisClient *c) {
         return;
     }
 
+    /* Empty keys can't exist, see rdbLoad(). */
+    if (obj->type == REDIS_LIST && listTypeLength(obj) == 0) {
+        decrRefCount(obj);
+        addReplyError(c,"Bad data format");
+        return;
+    }
+
     /* Create the key and set the TTL if any */
     dbAdd(c->db,c->argv[1],obj);
     if (ttl) setExpire(c->db,c->argv[1],mstime()+ttl);
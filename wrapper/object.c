@@ -43,8 +43,13 @@ robj *createObject(int type, void *ptr) {
     o->ptr = ptr;
     o->refcount = 1;
 
-    /* Set the LRU to the current lruclock (minutes resolution). */
-    o->lru = server.lruclock;
+    /* Set the LRU to the current lruclock (minutes resolution), or
+     * alternatively the LFU counter. */
+    if (REDIS_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+        o->lru = (LFUGetTimeInMinutes()<<8) | REDIS_LFU_INIT_VAL;
+    } else {
+        o->lru = server.lruclock;
+    }
     return o;
 }
 
@@ -116,18 +121,18 @@ robj *dupStringObject(robj *o) {
     return createStringObject(o->ptr,sdslen(o->ptr));
 }
 
-robj *createListObject(void) {
-    list *l = listCreate();
+robj *createQuicklistObject(void) {
+    quicklist *l = quicklistNew(server.list_max_ziplist_size,
+                                server.list_compress_depth);
     robj *o = createObject(REDIS_LIST,l);
-    listSetFreeMethod(l,decrRefCountVoid);
-    o->encoding = REDIS_ENCODING_LINKEDLIST;
+    o->encoding = REDIS_ENCODING_QUICKLIST;
     return o;
 }
 
-robj *createZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(REDIS_LIST,zl);
-    o->encoding = REDIS_ENCODING_ZIPLIST;
+robj *createListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(REDIS_LIST,lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
     return o;
 }
 
@@ -145,10 +150,28 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createRoaringSetObject(void) {
+    roaring *r = roaringNew();
+    robj *o = createObject(REDIS_SET,r);
+    o->encoding = REDIS_ENCODING_ROARING;
+    return o;
+}
+
+/* Create an empty string of 'len' zero bytes encoded as a sparse bitmap. */
+robj *createSparseBitmapObject(size_t len) {
+    sparseBitmap *sb = zmalloc(sizeof(*sb));
+    robj *o = createObject(REDIS_STRING,sb);
+
+    sb->bits = roaringNew();
+    sb->len = len;
+    o->encoding = REDIS_ENCODING_SPARSE;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(REDIS_HASH, zl);
-    o->encoding = REDIS_ENCODING_ZIPLIST;
+    unsigned char *lp = lpNew();
+    robj *o = createObject(REDIS_HASH, lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
     return o;
 }
 
@@ -163,26 +186,38 @@ robj *createZsetObject(void) {
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(REDIS_ZSET,zl);
-    o->encoding = REDIS_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(REDIS_ZSET,lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
+    return o;
+}
+
+robj *createZsetBtreeObject(void) {
+    zbtree *zbt = zbtCreate();
+    robj *o = createObject(REDIS_ZSET,zbt);
+    o->encoding = REDIS_ENCODING_BTREE;
     return o;
 }
 
 void freeStringObject(robj *o) {
     if (o->encoding == REDIS_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        sparseBitmap *sb = o->ptr;
+
+        roaringFree(sb->bits);
+        zfree(sb);
     }
 }
 
 void freeListObject(robj *o) {
     switch (o->encoding) {
-    case REDIS_ENCODING_LINKEDLIST:
-        listRelease((list*) o->ptr);
+    case REDIS_ENCODING_QUICKLIST:
+        quicklistRelease(o->ptr);
         break;
-    case REDIS_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case REDIS_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         redisPanic("Unknown list encoding type");
@@ -197,6 +232,9 @@ void freeSetObject(robj *o) {
     case REDIS_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case REDIS_ENCODING_ROARING:
+        roaringFree(o->ptr);
+        break;
     default:
         redisPanic("Unknown set encoding type");
     }
@@ -211,8 +249,11 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case REDIS_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case REDIS_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
+    case REDIS_ENCODING_BTREE:
+        zbtFree(o->ptr);
         break;
     default:
         redisPanic("Unknown sorted set encoding");
@@ -224,8 +265,11 @@ void freeHashObject(robj *o) {
     case REDIS_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case REDIS_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case REDIS_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
+    case REDIS_ENCODING_LISTPACK_INDEXED:
+        hashTypeFreeIndexed(o);
         break;
     default:
         redisPanic("Unknown hash encoding type");
@@ -234,12 +278,17 @@ void freeHashObject(robj *o) {
 }
 
 void incrRefCount(robj *o) {
-    o->refcount++;
+    refcountIncr(o);
 }
 
 void decrRefCount(robj *o) {
-    if (o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
-    if (o->refcount == 1) {
+    /* A single atomic decrement both releases our reference and tells us
+     * if it was the last one: reading the count before decrementing would
+     * race with a lazyfree thread releasing its own reference. */
+    int refcount = refcountDecr(o);
+
+    if (refcount < 0) redisPanic("decrRefCount against refcount <= 0");
+    if (refcount == 0) {
         switch(o->type) {
         case REDIS_STRING: freeStringObject(o); break;
         case REDIS_LIST: freeListObject(o); break;
@@ -249,8 +298,6 @@ void decrRefCount(robj *o) {
         default: redisPanic("Unknown object type"); break;
         }
         zfree(o);
-    } else {
-        o->refcount--;
     }
 }
 
@@ -374,6 +421,9 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == REDIS_STRING &&
+               o->encoding == REDIS_ENCODING_SPARSE) {
+        return createObject(REDIS_STRING,sparseBitmapToSds(o->ptr));
     } else {
         redisPanic("Unknown encoding type");
     }
@@ -448,6 +498,8 @@ size_t stringObjectLen(robj *o) {
     redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
     if (o->encoding == REDIS_ENCODING_RAW) {
         return sdslen(o->ptr);
+    } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+        return ((sparseBitmap*)o->ptr)->len;
     } else {
         char buf[32];
 
@@ -475,6 +527,12 @@ int getDoubleFromObject(robj *o, double *target) {
                 return REDIS_ERR;
         } else if (o->encoding == REDIS_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+            robj *decoded = getDecodedObject(o);
+            int retval = getDoubleFromObject(decoded,target);
+
+            decrRefCount(decoded);
+            return retval;
         } else {
             redisPanic("Unknown string encoding");
         }
@@ -513,6 +571,12 @@ int getLongDoubleFromObject(robj *o, long double *target) {
                 return REDIS_ERR;
         } else if (o->encoding == REDIS_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+            robj *decoded = getDecodedObject(o);
+            int retval = getLongDoubleFromObject(decoded,target);
+
+            decrRefCount(decoded);
+            return retval;
         } else {
             redisPanic("Unknown string encoding");
         }
@@ -551,6 +615,12 @@ int getLongLongFromObject(robj *o, long long *target) {
                 return REDIS_ERR;
         } else if (o->encoding == REDIS_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == REDIS_ENCODING_SPARSE) {
+            robj *decoded = getDecodedObject(o);
+            int retval = getLongLongFromObject(decoded,target);
+
+            decrRefCount(decoded);
+            return retval;
         } else {
             redisPanic("Unknown string encoding");
         }
@@ -596,8 +666,14 @@ char *strEncoding(int encoding) {
     case REDIS_ENCODING_HT: return "hashtable";
     case REDIS_ENCODING_LINKEDLIST: return "linkedlist";
     case REDIS_ENCODING_ZIPLIST: return "ziplist";
+    case REDIS_ENCODING_LISTPACK: return "listpack";
+    case REDIS_ENCODING_LISTPACK_INDEXED: return "listpack-indexed";
     case REDIS_ENCODING_INTSET: return "intset";
+    case REDIS_ENCODING_ROARING: return "roaring";
+    case REDIS_ENCODING_SPARSE: return "sparse";
     case REDIS_ENCODING_SKIPLIST: return "skiplist";
+    case REDIS_ENCODING_BTREE: return "btree";
+    case REDIS_ENCODING_QUICKLIST: return "quicklist";
     default: return "unknown";
     }
 }
@@ -630,7 +706,7 @@ robj *objectCommandLookupOrReply(redisClient *c, robj *key, robj *reply) {
 }
 
 /* Object command allows to inspect the internals of an Redis Object.
- * Usage: OBJECT <refcount|encoding|idletime> <key> */
+ * Usage: OBJECT <refcount|encoding|idletime|freq> <key> */
 void objectCommand(redisClient *c) {
     robj *o;
 
@@ -645,9 +721,24 @@ void objectCommand(redisClient *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"idletime") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
+        if (REDIS_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+            addReplyError(c,"An LFU maxmemory policy is selected, idle time not tracked. Please note that when switching between policies at runtime LRU and LFU data will take some time to adjust.");
+            return;
+        }
         addReplyLongLong(c,estimateObjectIdleTime(o));
+    } else if (!strcasecmp(c->argv[1]->ptr,"freq") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
+                == NULL) return;
+        if (!REDIS_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+            addReplyError(c,"An LFU maxmemory policy is not selected, access frequency not tracked. Please note that when switching between policies at runtime LRU and LFU data will take some time to adjust.");
+            return;
+        }
+        /* LFUDecrAndReturn should be called in case of the key has not
+         * been accessed for a long time, because we update the access
+         * time only when the key is read or overwritten. */
+        addReplyLongLong(c,LFUDecrAndReturn(o));
     } else {
-        addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime)");
+        addReplyError(c,"Syntax error. Try OBJECT (refcount|encoding|idletime|freq)");
     }
 }
 
@@ -119,8 +119,12 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
         if (o->type != REDIS_STRING) goto noobj;
 
         /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+         * increased. sortCommand decreases it again. Sparse bitmaps are
+         * returned as a new raw string, since SORT needs the bytes. */
+        if (o->encoding == REDIS_ENCODING_SPARSE)
+            o = getDecodedObject(o);
+        else
+            incrRefCount(o);
     }
     decrRefCount(keyobj);
     if (fieldobj) decrRefCount(fieldobj);
@@ -219,7 +223,7 @@ void sortCommand(redisClient *c) {
     if (sortval)
         incrRefCount(sortval);
     else
-        sortval = createListObject();
+        sortval = createQuicklistObject();
 
     /* The SORT command has an SQL-alike syntax, parse it */
     while(j < c->argc) {
@@ -488,7 +492,7 @@ void sortCommand(redisClient *c) {
             }
         }
     } else {
-        robj *sobj = createZiplistObject();
+        robj *sobj = createListpackObject();
 
         /* STORE option specified, set the sorting result as a List object */
         for (j = start; j <= end; j++) {
@@ -112,6 +112,33 @@ static size_t used_memory = 0;
 static int zmalloc_thread_safe = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Memory that was handed to a background thread in order to be released,
+ * but that is still allocated. It is always updated in a thread safe way
+ * since by definition it is shared with the threads doing the free. */
+static size_t pending_free_memory = 0;
+pthread_mutex_t pending_free_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__ATOMIC_RELAXED)
+#define update_pending_free_add(__n) __atomic_add_fetch(&pending_free_memory, (__n), __ATOMIC_RELAXED)
+#define update_pending_free_sub(__n) __atomic_sub_fetch(&pending_free_memory, (__n), __ATOMIC_RELAXED)
+#elif defined(HAVE_ATOMIC)
+#define update_pending_free_add(__n) __sync_add_and_fetch(&pending_free_memory, (__n))
+#define update_pending_free_sub(__n) __sync_sub_and_fetch(&pending_free_memory, (__n))
+#else
+#define update_pending_free_add(__n) do { \
+    pthread_mutex_lock(&pending_free_memory_mutex); \
+    pending_free_memory += (__n); \
+    pthread_mutex_unlock(&pending_free_memory_mutex); \
+} while(0)
+
+#define update_pending_free_sub(__n) do { \
+    pthread_mutex_lock(&pending_free_memory_mutex); \
+    pending_free_memory -= (__n); \
+    pthread_mutex_unlock(&pending_free_memory_mutex); \
+} while(0)
+
+#endif
+
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -237,6 +264,34 @@ size_t zmalloc_used_memory(void) {
     return um;
 }
 
+/* Account 'size' bytes as scheduled to be released by another thread.
+ * The memory is still counted by zmalloc_used_memory() until the thread
+ * actually frees it, so callers that want to know how much memory will
+ * be in use once pending frees are completed should subtract the value
+ * returned by zmalloc_pending_free_memory(). */
+void zmalloc_pending_free_add(size_t size) {
+    update_pending_free_add(size);
+}
+
+/* Called by the thread releasing the memory once 'size' bytes previously
+ * accounted with zmalloc_pending_free_add() were freed. */
+void zmalloc_pending_free_sub(size_t size) {
+    update_pending_free_sub(size);
+}
+
+size_t zmalloc_pending_free_memory(void) {
+    size_t pf;
+
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+    pf = update_pending_free_add(0);
+#else
+    pthread_mutex_lock(&pending_free_memory_mutex);
+    pf = pending_free_memory;
+    pthread_mutex_unlock(&pending_free_memory_mutex);
+#endif
+    return pf;
+}
+
 void zmalloc_enable_thread_safeness(void) {
     zmalloc_thread_safe = 1;
 }
@@ -71,6 +71,9 @@ void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
+void zmalloc_pending_free_add(size_t size);
+void zmalloc_pending_free_sub(size_t size);
+size_t zmalloc_pending_free_memory(void);
 void zmalloc_enable_thread_safeness(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 float zmalloc_get_fragmentation_ratio(size_t rss);